@@ -5,46 +5,18 @@ local ffi = require "ffi"
 local C = ffi.C
 
 local floor = math.floor
+local select, unpack = select, unpack
 
 ffi.cdef [[
 
 double av_time();
 void av_sleep(double seconds);
 
-typedef struct av_Audio {
-	unsigned int blocksize;
-	unsigned int frames;	
-	unsigned int indevice, outdevice;
-	unsigned int inchannels, outchannels;		
-	
-	double time;					// in seconds
-	double samplerate;				// in samples
-	double latency_seconds;			// in seconds
-	
-	// a big buffer for main-thread audio generation
-	float * buffer;
-	float * inbuffer;
-	
-	int blocks, blockread, blockwrite, blockstep;
-	int block_io_latency, dummy;
-	
-	// only access from audio thread:
-	float * input;
-	float * output;	
-	void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames);
-	
-} av_Audio;
-
-av_Audio * av_audio_get();
-
-// only use from main thread:
-void av_audio_start(); 
 ]]
 
 local lib = ffi.C
 
-local driver = lib.av_audio_get()
-assert(driver ~= nil, "problem acquiring audio driver")
+local driver = require "audio.driver"
 
 local buffer = require "audio.buffer"
 
@@ -53,8 +25,48 @@ local sched = scheduler.create()
 
 local audio = {
 	driver = driver,
-	outbuffer = buffer(driver.blocks * driver.blocksize, driver.outchannels, driver.buffer),
+	outbuffer = buffer(driver.blocks * driver.blocksize, driver.outbuses, driver.buffer),
+	inbuffer = buffer(driver.blocks * driver.blocksize, driver.inbuses, driver.inbuffer),
 }
+-- (so that their summaries are those the audio thread keeps, see buffer:summary)
+audio.outbuffer.ring = 0
+audio.inbuffer.ring = 1
+
+-- the offset of the first sample of block blk, and the (frame, channel) strides,
+-- such that frame i (counted from the start of the ring) of channel c is at
+-- offset + i*fs + c*cs, for any frame i within that block:
+local function block_layout(blk, blocksize, channels)
+	if driver.planar ~= 0 then
+		return blk * blocksize * (channels - 1), 1, blocksize
+	else
+		return 0, channels, 1
+	end
+end
+
+-- write the values returned by a generator into one frame of chans channels
+-- (as in buffer:write, channel c takes value (c % k) + 1 of the k values returned)
+local function write_frame(out, idx, cs, chans, ...)
+	local k = select("#", ...)
+	while k > 0 and select(k, ...) == nil do k = k - 1 end
+	if k == 0 then
+		for c = 0, chans-1 do out[idx + c*cs] = 0 end
+	else
+		for c = 0, chans-1 do out[idx + c*cs] = select((c % k) + 1, ...) or 0 end
+	end
+end
+
+-- as write_frame, but adding into the frame
+-- returns false if the generator returned nothing (i.e. it has finished)
+local function mix_frame(out, idx, cs, chans, ...)
+	local k = select("#", ...)
+	while k > 0 and select(k, ...) == nil do k = k - 1 end
+	if k == 0 then return false end
+	for c = 0, chans-1 do 
+		local j = idx + c*cs
+		out[j] = out[j] + (select((c % k) + 1, ...) or 0)
+	end
+	return true
+end
 
 --- Add a coroutine to the audio scheduler
 -- @param delay (Optional) delay in seconds before starting the coroutine
@@ -70,6 +82,7 @@ function audio.cancel(co) end
 audio.cancel = sched.cancel
 
 --- Suspend a coroutine for a period or until an event occurs
+-- Timed waits are sample-accurate: the audio block is split at the sample where the coroutine resumes, and any native voices it plays start at that sample.
 -- @param t A period (in seconds) or an event name (string) to wait for
 function audio.wait(t) end
 audio.wait = sched.wait
@@ -84,154 +97,391 @@ audio.now = sched.now
 function audio.event(name) end
 audio.event = sched.event
 
-function audio.run(generate)
+-- adapt a per-sample generator into the block contract (see audio.run):
+local function generator_adapter(generate)
+	return function(out, inp, frames, chans)
+		local _, fs, cs = block_layout(0, frames, chans)
+		if chans == 2 then
+			for i = 0, frames-1 do
+				local l, r = generate()
+				out[i*fs] = l or 0
+				out[i*fs+cs] = r or l or 0
+			end
+		else
+			for i = 0, frames-1 do
+				write_frame(out, i*fs, cs, chans, generate())
+			end
+		end
+	end
+end
+local generator_adapters = setmetatable({}, { __mode = "k" })
+
+--- Fill the audio output directly, without the scheduler
+-- Call this regularly (e.g. once per frame of the main loop) to produce as many blocks as are needed to keep up.
+-- By default, generate() is called once per sample frame, returning the values of each channel. 
+-- If block is true, generate(out, input, frames, channels, inchannels) is instead called once per block, and must fill out (a float pointer) with frames of channels samples; input holds frames of inchannels samples from the input buses. Both are interleaved (frame i of channel c at i*channels + c), or in planar mode (see audio.planar) hold one run of frames samples per channel (at c*frames + i).
+-- @param generate The function to call
+-- @param block (Optional) true to use the block contract
+function audio.run(generate, block)
 	if generate then
-		local blocksize = driver.blocksize
-		local w = driver.blockwrite
-		local r = driver.blockread
-		local s = driver.blocks
-		local t = (r + driver.block_io_latency) % driver.blocks
-		local done = 0 -- how many blocks produced on this update
-	
-		if w > t then
-			-- fill up & wrap around:
-			while w < s do
-				local out = driver.buffer + w * driver.blockstep
-				for i = 0, blocksize-1 do
-					local l, r = generate()
-					out[i*2] = l or 0
-					out[i*2+1] = r or l or 0
-				end
-				done = done + 1
-				driver.blockwrite = w
-				w = w + 1
+		local fill = generate
+		if not block then
+			fill = generator_adapters[generate]
+			if not fill then
+				fill = generator_adapter(generate)
+				generator_adapters[generate] = fill
 			end
-			w = 0
-			driver.blockwrite = w
 		end
-		while w < t do
+		local blocksize = driver.blocksize
+		local chans = driver.outbuses
+		local inchans = driver.inbuses
+		-- how many blocks are needed to restore the target latency:
+		local n = lib.av_audio_writable()
+		for b = 1, n do
+			local w = driver.blockwrite
 			local out = driver.buffer + w * driver.blockstep
-			for i = 0, blocksize-1 do
-				local l, r = generate()
-				out[i*2] = l or 0
-				out[i*2+1] = r or l or 0
-			end
-			done = done + 1
-			w = w + 1
-			driver.blockwrite = w
+			local inp = driver.inbuffer + w * blocksize * inchans
+			fill(out, inp, blocksize, chans, inchans)
+			-- hand it over to the audio thread:
+			lib.av_audio_commit()
 		end
-		--print(done)
 	end
 end
 
-
-
 local is_audio_runloop_running = false
 local voices = {}
 
-local function addvoice(func, dur)
+-- native (C++) buffer voices, indexed by handle
+-- this keeps the buffer alive until the audio thread has finished with it:
+local players = {}
+
+-- parameter indices of native voices:
+local VOICE_GAIN, VOICE_PAN, VOICE_RATE, VOICE_LOOP, VOICE_LOOPSTART, VOICE_LOOPEND, VOICE_POSITION, VOICE_QUALITY = 0, 1, 2, 3, 4, 5, 6, 7
+
+-- release buffers (and streams) of native voices that have stopped playing:
+local function reclaim_players()
+	local h = lib.av_audio_voice_done()
+	while h >= 0 do
+		local p = players[h]
+		if p and p.stream then lib.av_audio_stream_close(p.stream) end
+		players[h] = nil
+		h = lib.av_audio_voice_done()
+	end
+end
 
+-- recording handles by id, until their files are finished:
+local recordings = {}
+-- the recording in progress, if any:
+local recording_current
+
+-- note the final counts of recordings whose files are finished, freeing their slots:
+local function reclaim_recordings()
+	local id = lib.av_audio_record_done()
+	while id >= 0 do
+		local r = recordings[id]
+		if r then
+			r.final = { 
+				blocks = lib.av_audio_record_blocks(id), 
+				dropped = lib.av_audio_record_dropped(id, 0), 
+				changed = lib.av_audio_record_dropped(id, 1),
+			}
+			if recording_current == r then recording_current = nil end
+		end
+		recordings[id] = nil
+		id = lib.av_audio_record_done()
+	end
+end
+
+--- A handle to a buffer or stream playing in a native voice.
+-- Returned by audio.play(buffer) or audio.play(stream). Streams play forward only, with linear interpolation.
+-- @type player
+local player = {}
+player.__index = player
+
+--- Stop playing
+function player:stop()
+	lib.av_audio_voice_stop(self.handle)
+	return self
+end
+
+--- Set the gain
+-- @param gain the amplitude multiplier
+function player:gain(gain)
+	lib.av_audio_voice_param(self.handle, VOICE_GAIN, gain)
+	return self
+end
+
+--- Set the pan position
+-- @param pan from -1 (left) to 1 (right)
+function player:pan(pan)
+	lib.av_audio_voice_param(self.handle, VOICE_PAN, pan)
+	return self
+end
+
+--- Set the playback rate
+-- @param rate 1 is normal speed, 0.5 is an octave down, negative values play backwards
+function player:rate(rate)
+	lib.av_audio_voice_param(self.handle, VOICE_RATE, rate * self.ratio)
+	return self
+end
+
+--- Set the interpolation quality
+-- @param quality 0 for linear (the default), or 1, 2 or 3 for windowed-sinc interpolation with 8, 16 or 32 taps
+function player:quality(quality)
+	lib.av_audio_voice_param(self.handle, VOICE_QUALITY, quality)
+	return self
+end
+
+--- Loop a region of the buffer
+-- @param start first frame of the loop (default 0)
+-- @param finish frame after the end of the loop (default all of the buffer)
+function player:loop(start, finish)
+	if self.stream then
+		lib.av_audio_stream_loop(self.stream, 1, start or 0, finish or self.frames)
+		return self
+	end
+	lib.av_audio_voice_param(self.handle, VOICE_LOOPSTART, start or 0)
+	lib.av_audio_voice_param(self.handle, VOICE_LOOPEND, finish or self.frames)
+	lib.av_audio_voice_param(self.handle, VOICE_LOOP, 1)
+	return self
+end
+
+--- Stop looping (the voice ends when it reaches the end of the buffer)
+function player:unloop()
+	if self.stream then
+		lib.av_audio_stream_loop(self.stream, 0, 0, 0)
+		return self
+	end
+	lib.av_audio_voice_param(self.handle, VOICE_LOOP, 0)
+	return self
+end
+
+--- Move the playback position
+-- A stream continues from the new position once it has been read, discarding what it had read ahead.
+-- @param frame the position (in frames) to move to
+function player:seek(frame)
+	if self.stream then
+		lib.av_audio_stream_seek(self.stream, frame)
+		return self
+	end
+	lib.av_audio_voice_param(self.handle, VOICE_POSITION, frame)
+	return self
+end
+
+--- Count the blocks in which a stream ran out of data read from disk
+-- (each leaves a gap of silence; a longer readahead helps)
+-- @return the number of underruns, or 0 for a buffer
+function player:underruns()
+	return self.stream and lib.av_audio_stream_underruns(self.stream) or 0
+end
+
+local function addvoice(func, dur, block)
 	local voice = {
 		dur = dur or math.huge,
 	}
-	
-	function voice:blockfunc(blocksize, out)
-		for i = 0, blocksize-1 do
-			local l, r = func()
+	if block then
+		voice.block = func
+	else
+		voice.func = func
+		-- one frame of input values, for buses other than stereo:
+		voice.inframe = {}
+	end
+	voices[voice] = true
+end
+
+-- mix a per-sample voice straight into the ring, laid out as described by block_layout()
+-- the function is called once per frame with the input channels, and returns the output channels
+-- (the first two outputs are copied to other channels); returns false once it returns nothing:
+local function mix_samples(v, out, fs, cs, chans, inbuf, ifs, ics, inchans, from, to)
+	local func = v.func
+	if chans == 2 and inchans == 2 then
+		for i = from, to do
+			local l, r = func(inbuf[i*ifs], inbuf[i*ifs+ics])
 			if l == nil and r == nil then 
-				return nil
+				return false
 			end
-			out[i*2] = out[i*2] + (l or 0)
-			out[i*2+1] = out[i*2+1] + (r or l or 0)
+			out[i*fs] = out[i*fs] + (l or 0)
+			out[i*fs+cs] = out[i*fs+cs] + (r or l or 0)
 		end
-		self.dur = self.dur - blocksize
-		return self.dur > 0 or nil
-	end
-	
-	function voice:sablockfunc(out, outchannels, inbuf, inchannels, from, to)
+	else
+		local inframe = v.inframe
 		for i = from, to do
-			local l = inbuf[i*outchannels]
-			local r = inbuf[i*outchannels+1]
-			local l, r = func(l, r)
-			if l == nil and r == nil then 
-				return nil
+			for c = 0, inchans-1 do
+				inframe[c+1] = inbuf[i*ifs + c*ics]
+			end
+			if not mix_frame(out, i*fs, cs, chans, func(unpack(inframe, 1, inchans))) then
+				return false
 			end
-			out[i*outchannels] = out[i*outchannels] + (l or 0)
-			out[i*outchannels+1] = out[i*outchannels+1] + (r or l or 0)
 		end
-		self.dur = self.dur - (1 + to - from)
-		return self.dur > 0 or nil
 	end
-	
-	voices[voice] = true
+	return true
 end
 
-local function dsp(out, outchannels, inbuf, inchannels, from, to)
+-- scratch sub-blocks for block voices, in the layout of the block contract:
+local vout, vin, vsize = nil, nil, 0
+
+local function dsp(out, fs, cs, chans, inbuf, ifs, ics, inchans, from, to)
 	for i = from, to do
-		for c = 0, outchannels-1 do
-			out[i*outchannels+c] = 0
+		for c = 0, chans-1 do
+			out[i*fs+c*cs] = 0
 		end
-	end		
+	end
+	if next(voices) == nil then return end
+	
+	local frames = 1 + to - from
+	local bytes = ffi.sizeof("float") * frames * chans
+	-- an interleaved sub-block, or a whole planar block, is already laid out as the block contract 
+	-- asks, so block voices can use the ring itself; a planar sub-block of part of a block is not
+	-- (its channels are a whole block apart), so voices use scratch blocks instead:
+	local direct = driver.planar == 0 or frames == driver.blocksize
+	local sub, subin = out + from*fs, inbuf + from*ifs
+	local filled = false
 	for v in pairs(voices) do
-		voices[v] = v:sablockfunc(out, outchannels, inbuf, inchannels, from, to)
+		if v.block then
+			local keep
+			if direct and not filled then
+				-- the first fills the (zeroed) sub-block in place:
+				keep = v.block(sub, subin, frames, chans, inchans)
+				filled = true
+			else
+				local size = driver.blocksize * math.max(chans, inchans)
+				if size > vsize then
+					vout = ffi.new("float[?]", size)
+					vin = ffi.new("float[?]", size)
+					vsize = size
+				end
+				ffi.fill(vout, bytes)
+				if direct then
+					keep = v.block(vout, subin, frames, chans, inchans)
+					lib.av_audio_accumulate(sub, vout, frames * chans)
+				else
+					-- (every voice sees the same input)
+					for c = 0, inchans-1 do
+						ffi.copy(vin + c*frames, subin + c*ics, ffi.sizeof("float") * frames)
+					end
+					keep = v.block(vout, vin, frames, chans, inchans)
+					for c = 0, chans-1 do
+						lib.av_audio_accumulate(sub + c*cs, vout + c*frames, frames)
+					end
+				end
+			end
+			v.dur = v.dur - frames
+			if keep == false or v.dur <= 0 then voices[v] = nil end
+		end
+	end
+	-- then the per-sample voices, which mix into the ring:
+	for v in pairs(voices) do
+		if v.func then
+			local keep = mix_samples(v, out, fs, cs, chans, inbuf, ifs, ics, inchans, from, to)
+			v.dur = v.dur - frames
+			if not keep or v.dur <= 0 then voices[v] = nil end
+		end
 	end
 end
 
+-- the sample time of the next frame to generate:
 local s0 = 0
 
+-- a guard against coroutines that never wait for a later sample:
+local max_events_per_block = 4096
+-- blocks whose events were cut short by it (see audio.fill):
+local deferred = 0
+
+-- the rings may have been reallocated:
+local function refresh_rings()
+	audio.outbuffer.samples = driver.buffer
+	audio.outbuffer.frames = driver.blocks * driver.blocksize
+	audio.outbuffer.channels = driver.outbuses
+	audio.outbuffer.blocksize = driver.planar ~= 0 and driver.blocksize or nil
+	audio.inbuffer.samples = driver.inbuffer
+	audio.inbuffer.frames = driver.blocks * driver.blocksize
+	audio.inbuffer.channels = driver.inbuses
+	audio.inbuffer.blocksize = driver.planar ~= 0 and driver.blocksize or nil
+end
+
+-- after the stream has been reconfigured (from the given samplerate):
+local function reconfigured(samplerate)
+	refresh_rings()
+	-- sample time carries on, counted at the new samplerate:
+	s0 = floor(s0 * driver.samplerate / samplerate + 0.5)
+end
+
+-- returns the number of blocks whose remaining events were left for a later block:
 local function audio_schedloop()
-	local blocksize = driver.blocksize
-	local samplerate = driver.samplerate
-	local blocks = driver.blocks
-	local outchannels = driver.outchannels
-	local inchannels = driver.inchannels
+	local cut = 0
 	
-	local w = driver.blockwrite
-	local r = driver.blockread
-	local target_block = (r + driver.block_io_latency) % blocks
+	-- carry on any reconfiguration of the stream (see audio.reconfigure):
+	local rate = driver.samplerate
+	if lib.av_audio_reconfigure_poll() ~= 0 then reconfigured(rate) end
 	
-	local smax = blocks * blocksize
-	local isr = 1 / samplerate
+	local blocksize = driver.blocksize
+	local samplerate = driver.samplerate
+	local outbuses = driver.outbuses
+	local inbuses = driver.inbuses
 	
-	local t0 = s0 * isr	
+	-- release buffers of finished native voices, and finished recordings:
+	reclaim_players()
+	reclaim_recordings()
 	
-	--print((blocksize + target_block - w) % blocksize)
+	-- how many blocks are needed to restore the target latency:
+	local n = lib.av_audio_writable()
+	-- render with the audio thread's floating-point modes (restored below):
+	local fp = n > 0 and lib.av_audio_fp_begin()
 	
-	while w ~= target_block do
+	for b = 1, n do
 		-- outbuffer for this block:
-		local out = driver.buffer
-		local inbuf = driver.inbuffer
+		local blk = driver.blockwrite
+		local o, fs, cs = block_layout(blk, blocksize, outbuses)
+		local io, ifs, ics = block_layout(blk, blocksize, inbuses)
+		local out = driver.buffer + o
+		local inbuf = driver.inbuffer + io
+		-- ring frame of the block start:
+		local f0 = blk * blocksize
 		
-		-- time at end of this block:
+		-- sample time at end of this block:
 		local s1 = s0 + blocksize
-		local t1 = s1 * isr
 		
-		-- check for events & clock-divide?
+		-- split the block at each event due within it:
+		local s = s0
+		local events = 0
 		local te = sched.due()
-		if te and te < t1 then
-			local se = floor(s0 + (te - t0) * samplerate)
-			
-			-- dsp from s0 to se
-			dsp(out, outchannels, inbuf, inchannels, s0 % smax, se % smax)
-			
-			-- invoke event
+		while te do
+			local se = floor(te * samplerate + 0.5)
+			if se >= s1 then break end
+			if se > s then
+				-- dsp from s up to the event:
+				dsp(out, fs, cs, outbuses, inbuf, ifs, ics, inbuses, f0 + s - s0, f0 + se - s0 - 1)
+				s = se
+			end
+			events = events + 1
+			if events > max_events_per_block then
+				-- probably a runaway loop? leave the rest for the next block
+				cut = cut + 1
+				break
+			end
+			-- invoke the event, with any native voices it starts beginning at the same sample
+			-- (events that were already due start at the current sample):
+			lib.av_audio_voice_at(blk, s - s0)
 			sched.run_first()
-			
-			-- update clocks
-			t0 = te
-			s0 = se
+			lib.av_audio_voice_at(-1, 0)
+			te = sched.due()
 		end
 		
-		-- dsp from s0 to s1
-		dsp(out, outchannels, inbuf, inchannels, s0 % smax, (s1 - 1) % smax)
+		-- dsp to the end of the block:
+		if s < s1 then
+			dsp(out, fs, cs, outbuses, inbuf, ifs, ics, inbuses, f0 + s - s0, f0 + blocksize - 1)
+		end
 		
 		-- advance clocks:
-		t0 = t1
-		w = (w + 1) % blocks
-		driver.blockwrite = w
-		s0 = s1 --% smax
+		s0 = s1
+		
+		-- hand it over to the audio thread:
+		lib.av_audio_commit()
 	end
-	--print("done", r, w)
+	if fp then lib.av_audio_fp_end(fp) end
+	
+	deferred = deferred + cut
+	return cut
 end
 
 --[[
@@ -277,7 +527,10 @@ end
 
 local function start_audio_runloop()
 	local runloop = require "runloop"
-	runloop.insert(audio_schedloop)
+	-- the audio thread wakes the loop whenever the ring has drained to half the latency;
+	-- the period is only a backstop (and paces audio.reconfigure):
+	local id = runloop.insert(audio_schedloop, 0.02)
+	lib.av_audio_wake_runloop(id)
 	is_audio_runloop_running = true
 end
 
@@ -287,26 +540,388 @@ function audio.start()
 	end
 	print(string.format("Estimated audio latency: %.3f seconds", driver.block_io_latency * driver.blocksize / driver.samplerate))
 	
-	audio.outbuffer.samples = driver.buffer
+	refresh_rings()
 
 	if not is_audio_runloop_running then
 		start_audio_runloop()
 	end
 end
 
+--- Stop the audio device
+-- Native voices end (and release their buffers & streams) at once; audio.start() starts the device again.
+function audio.stop()
+	lib.av_audio_stop()
+	-- the audio thread no longer returns finished voices, so they are all returned now:
+	reclaim_players()
+end
+
+--- Change the audio devices, samplerate or blocksize without stopping the sound
+-- The new stream opens in the background while the current one plays on; once it is running, the current stream fades out over a few milliseconds and the new one fades in. (If the host API can't open a device twice, the current stream fades out first, and there is a gap while the new one opens.) The switch completes a little later, in the audio runloop; if only the devices change, the blocks already queued carry over. Native voices already playing keep their playback rates, so they change pitch with the samplerate.
+-- If no device stream is running (e.g. on the virtual device), this sets the options and restarts as audio.start() does.
+-- The options table may set input and output (device numbers, as listed by audio.start() or audio.rescan()), samplerate and blocksize; the rest stay as they are.
+-- @param options table of options
+-- @return true if the switch is under way (or done), false if it couldn't begin (because one is already under way, or the devices don't support the samplerate)
+function audio.reconfigure(options)
+	options = options or {}
+	local rate = driver.samplerate
+	local result = lib.av_audio_reconfigure(
+		options.input or driver.indevice,
+		options.output or driver.outdevice,
+		options.samplerate or rate,
+		options.blocksize or driver.blocksize
+	)
+	if result == 0 then
+		reconfigured(rate)
+		if not is_audio_runloop_running then
+			start_audio_runloop()
+		end
+	end
+	return result >= 0
+end
+
+--- List the audio devices again, e.g. after plugging one in
+-- The list is otherwise made once, at the first audio.start(), and reused by restarts & audio.reconfigure().
+-- @return the number of devices, or nil while a reconfiguration is under way
+function audio.rescan()
+	local count = lib.av_audio_devices_scan()
+	if count < 0 then return nil end
+	return count
+end
+
+--- Render audio to a sound file, as fast as possible
+-- Stops the audio device, and runs the scheduler, voices and audio-thread DSP block by block without waiting, so that a long piece renders in a fraction of its duration. Sample time carries on from the audio scheduler's time (zero for a script that renders as it loads), so the same script renders the same file each time: native voices still playing end first, and native ugens restart from their initial state. The device is restarted afterward if it was running, with the latency (and adaptive latency setting) it had before.
+-- The options table may set channels (default 2), samplerate (default the current samplerate), and input (a function returning a block of interleaved input samples, as a float pointer, or nil for silence).
+-- @param path The sound file to write
+-- @param duration The length to render, in seconds
+-- @param options (Optional) table of options
+-- @return the realtime factor, i.e. seconds of audio rendered per second of CPU time
+function audio.render(path, duration, options)
+	options = options or {}
+	local sndfile = require "audio.sndfile"
+	local channels = options.channels or 2
+	local samplerate, outchannels, inchannels = driver.samplerate, driver.outchannels, driver.inchannels
+	local adaptive, latency = driver.adaptive, driver.block_io_latency
+	driver.samplerate = options.samplerate or samplerate
+	
+	local running = lib.av_audio_offline_begin(channels, 0) ~= 0
+	refresh_rings()
+	-- the ring doesn't need to hide any jitter:
+	driver.adaptive = 0
+	driver.block_io_latency = 1
+	-- carry on from the scheduler's current time:
+	s0 = floor(sched.now() * driver.samplerate + 0.5)
+	
+	local blocksize = driver.blocksize
+	local file = sndfile.create(path, { channels = channels, samplerate = driver.samplerate })
+	local block = ffi.new("float[?]", blocksize * channels)
+	local out = ffi.cast("float *", block)
+	local blocks = math.ceil(duration * driver.samplerate / blocksize)
+	
+	local t0 = lib.av_time()
+	for b = 1, blocks do
+		audio_schedloop()
+		lib.av_audio_offline_process(out, options.input and options.input() or nil)
+		file:write(out, blocksize * channels)
+	end
+	local elapsed = lib.av_time() - t0
+	file:close()
+	reclaim_players()
+	
+	local rendered = blocks * blocksize / driver.samplerate
+	print(string.format("rendered %.3f seconds to %s in %.3f seconds (%.1fx realtime)", rendered, path, elapsed, rendered / elapsed))
+	
+	driver.samplerate = samplerate
+	if running then 
+		audio.start() 
+	else
+		lib.av_audio_offline_begin(outchannels, inchannels)
+		refresh_rings()
+	end
+	-- (after restarting, which resets the latency to driver.latency_seconds)
+	driver.adaptive, driver.block_io_latency = adaptive, latency
+	return rendered / elapsed
+end
+
+--- A handle to a recording in progress.
+-- Returned by audio.record().
+-- @type recording
+local recording = {}
+recording.__index = recording
+
+--- Stop recording
+-- The file is finished by the writer thread shortly afterward (see recording:busy).
+function recording:stop()
+	lib.av_audio_record_stop(self.id)
+	if recording_current == self then recording_current = nil end
+	return self
+end
+
+--- Whether the file is still being written
+function recording:busy()
+	reclaim_recordings()
+	return not self.final
+end
+
+--- The number of blocks recorded
+function recording:blocks()
+	if self.final then return self.final.blocks end
+	return lib.av_audio_record_blocks(self.id)
+end
+
+--- The number of blocks dropped
+-- Blocks are dropped if the writer falls behind, or if the number of buses changes (e.g. by audio.reconfigure) so that they no longer match the file.
+-- @return the number of blocks dropped in all
+-- @return the number of those dropped because the buses changed
+function recording:dropped()
+	local final = self.final
+	if final then return final.dropped + final.changed, final.changed end
+	local changed = lib.av_audio_record_dropped(self.id, 1)
+	return lib.av_audio_record_dropped(self.id, 0) + changed, changed
+end
+
+local record_formats = { wav = true, w64 = true, flac = true, aiff = true }
+local record_sources = { output = 1, input = 2, both = 3 }
+
+--- Record the audio buses to a sound file, in the background
+-- After each callback, the audio thread copies the block it played (the output buses) and/or received (the input buses) into a ring, which a writer thread saves to disk; neither the audio thread nor the main loop waits for the disk. If the writer falls behind, whole blocks are dropped and counted (see recording:dropped).
+-- The options table may set source ("output" (the default), "input", or "both", outputs first), format ("wav", "w64", "aiff" or "flac"; by default from the file extension), encoding ("pcm16", "pcm24" or "float"; by default "pcm24" for flac, else "float"), and buffer (seconds to hold in memory, default 2). One recording can be made at a time: starting another stops the last, whose file is finished in the background meanwhile.
+-- @param path The sound file to write
+-- @param options (Optional) table of options
+-- @return a recording handle, or nil if recording could not start
+function audio.record(path, options)
+	options = options or {}
+	local sndfile = require "audio.sndfile"
+	local sources = record_sources[options.source or "output"]
+	assert(sources, "audio.record: source should be output, input or both")
+	local format = options.format
+	if not format then
+		local ext = path:match("%.(%w+)$")
+		ext = ext and ext:lower()
+		format = record_formats[ext] and ext or "wav"
+	end
+	local channels = 0
+	if sources ~= 2 then channels = channels + driver.outbuses end
+	if sources ~= 1 then channels = channels + driver.inbuses end
+	
+	-- stop any previous recording (its writer finishes the file alongside this one):
+	if recording_current then recording_current:stop() end
+	reclaim_recordings()
+	
+	local file = sndfile.create(path, { 
+		channels = channels, 
+		samplerate = driver.samplerate, 
+		format = format, 
+		encoding = options.encoding or (format == "flac" and "pcm24" or "float"),
+	})
+	local sf = sndfile.lib
+	local id = lib.av_audio_record_start(file, 
+		ffi.cast("av_audio_record_write_fn", sf.sf_writef_float), 
+		ffi.cast("av_audio_record_close_fn", sf.sf_close), 
+		sources, math.ceil((options.buffer or 2) * driver.samplerate))
+	if id < 0 then
+		print("audio.record: unable to start recording")
+		return
+	end
+	-- the writer thread closes the file now:
+	ffi.gc(file, nil)
+	local r = setmetatable({ path = path, id = id }, recording)
+	recordings[id] = r
+	recording_current = r
+	return r
+end
+
+--- Analyze the spectrum of the input (or output) buses, in the background
+-- See audio.spectrum.open for the options.
+-- @param options (Optional) table of options
+-- @return spectrum
+function audio.spectrum(options)
+	return require("audio.spectrum").open(options)
+end
+
+--- Insert a convolution reverb (or any impulse response) on the output buses
+-- See audio.convolver.open for the options.
+-- @param response The impulse response, an audio_buffer (e.g. from audio.buffer.load)
+-- @param options (Optional) table of options
+-- @return convolver
+function audio.convolver(response, options)
+	return require("audio.convolver").open(response, options)
+end
+
+--- Set the number of channels generated and consumed by scripts
+-- These bus channels are independent of the device; see audio.route() to map them to device channels. Takes effect at the next audio.start().
+-- @param outs number of output buses (default 2)
+-- @param ins number of input buses (default 2)
+function audio.channels(outs, ins)
+	driver.outbuses = outs or driver.outbuses
+	driver.inbuses = ins or driver.inbuses
+end
+
+--- Route an output bus to a device output channel
+-- By default bus N goes to output N. Can be changed while audio is running.
+-- @param output the device output channel (from 0)
+-- @param bus the output bus (from 0)
+-- @param gain (Optional) default 1; use 0 to remove the route
+function audio.route(output, bus, gain)
+	lib.av_audio_route_set(0, output, bus, gain or 1)
+end
+
+--- Route a device input channel to an input bus
+-- By default input N goes to bus N. Can be changed while audio is running.
+-- @param bus the input bus (from 0)
+-- @param input the device input channel (from 0)
+-- @param gain (Optional) default 1; use 0 to remove the route
+function audio.routein(bus, input, gain)
+	lib.av_audio_route_set(1, bus, input, gain or 1)
+end
+
+--- Restore one-to-one routing
+-- @param input (Optional) if true, reset the input routing rather than the output routing
+function audio.unroute(input)
+	lib.av_audio_route_set(input and 1 or 0, -1, -1, 0)
+end
+
+--- Choose between interleaved and planar (non-interleaved) streams
+-- In planar mode each block of the rings holds one contiguous run of samples per channel, so that DSP can work across samples of a channel rather than striding across channels. Takes effect at the next audio.start().
+-- @param enable true for planar, false for interleaved (the default)
+function audio.planar(enable)
+	driver.planar = enable and 1 or 0
+end
+
+--- Use a virtual audio device rather than the sound card
+-- The virtual device calls back at the same rate as a real device, from a timer thread, but its output goes nowhere and its input is silent. It is used automatically when no audio devices are found. Takes effect at the next audio.start().
+-- @param enable true to use the virtual device, false to use the sound card (the default)
+-- @param jitter (Optional) delay each callback by a random amount up to this many seconds, to simulate a less regular device (default 0)
+function audio.virtualdevice(enable, jitter)
+	driver.virtualdevice = enable and 1 or 0
+	driver.jitter = jitter or 0
+end
+
 --- Set the audio input/output latency
--- The actual latency may be slightly higher, due to driver implementation and block size
+-- The actual latency may be slightly higher, due to driver implementation and block size. This also turns off adaptive latency.
 -- @param seconds The intended latency in seconds
 function audio.latency(seconds)
+	driver.adaptive = 0
 	driver.latency_seconds = seconds
-	driver.block_io_latency = 1 + math.floor(seconds * driver.samplerate / driver.blocksize)
+	driver.block_io_latency = lib.av_audio_latency_blocks(seconds)
+end
+
+--- Let the audio thread choose the latency
+-- The latency grows at once when the main thread fails to keep up, and shrinks again slowly once it has been comfortably ahead for a while; repeated underruns make it slower to shrink. Use audio.latency() to return to a fixed latency.
+-- @param minseconds The lowest latency allowed (default one block)
+-- @param maxseconds The highest latency allowed (default 0.5)
+function audio.adaptive(minseconds, maxseconds)
+	driver.latency_min = minseconds and lib.av_audio_latency_blocks(minseconds) or 1
+	driver.latency_max = lib.av_audio_latency_blocks(maxseconds or 0.5)
+	driver.adaptive = 1
+end
+
+--- Render the native voices (buffers & streams played by audio.play) on several cores
+-- The audio thread shares the voices out among itself and count-1 worker threads each block. The mix is identical whatever the count, so a piece renders the same either way. Use no more threads than there are cores; see benchmarks/voices.lua for the scaling on this machine. Voice functions (audio.play(func)) always run on the main thread.
+-- @param count The number of threads, 1 to 16 (default 1)
+-- @return the number of threads now in use
+function audio.voicethreads(count)
+	return lib.av_audio_voice_threads(count or 1)
+end
+
+-- the AV_AUDIO_RT_* flag of each realtime option:
+local realtime_flags = { priority = 1, lockmemory = 2, cpu = 4, flushdenormals = 8 }
+
+--- Configure the audio callback thread for real-time work
+-- The options table may set priority (a SCHED_FIFO priority from 1 to 99, or true for 80; false or 0 to leave the thread's scheduling alone), lockmemory (true to lock the process's pages into RAM, so the audio thread never waits on paging), cpu (the core to pin the callback thread to, or false for any) and flushdenormals (flush denormal floats to zero in the callback thread, and in the main thread while it renders audio, so that decaying filters don't spike the CPU; on by default). Takes effect at the next audio.start(); use audio.realtimestatus() to see what the system allowed. Raising the priority or locking memory usually needs privileges (e.g. rtprio & memlock limits on Linux).
+-- @param options table of options
+function audio.realtime(options)
+	options = options or {}
+	local priority = options.priority
+	if priority == true then priority = 80 end
+	driver.realtime = priority or 0
+	driver.lockmemory = options.lockmemory and 1 or 0
+	driver.affinity = options.cpu or -1
+	driver.flushdenormals = (options.flushdenormals == false) and 0 or 1
+end
+
+--- Report which real-time options took effect at the last audio.start()
+-- @return a table mapping each option asked for (priority, lockmemory, cpu, flushdenormals) to true if it took effect or false if it failed, or nil if the audio thread hasn't applied them yet
+function audio.realtimestatus()
+	if driver.rt_pending ~= 0 then return nil end
+	local applied, failed = driver.rt_applied, driver.rt_failed
+	local status = {}
+	for k, flag in pairs(realtime_flags) do
+		if bit.band(applied, flag) ~= 0 then
+			status[k] = true
+		elseif bit.band(failed, flag) ~= 0 then
+			status[k] = false
+		end
+	end
+	return status
+end
+
+--- Run Lua code in the audio-thread Lua state
+-- The code runs between blocks in the audio thread, so it is not delayed by the main/GL loop. 
+-- Define a global onframes(time, input, output, frames, inchannels, outchannels) there to add DSP that runs once per block.
+-- Functions are sent as bytecode, so they cannot capture upvalues.
+-- @param code A string of Lua code, or a function
+-- @return true if the message was queued, false if the message buffer is full
+function audio.send(code)
+	if type(code) == "function" then
+		code = string.dump(code)
+	end
+	assert(type(code) == "string", "audio.send requires a string or function")
+	return lib.av_audio_msg_send(code, #code) ~= 0
+end
+
+--- Report the state of the audio block ring
+-- @return fill The number of blocks queued for the audio thread at its last callback
+-- @return underruns The number of callbacks that found the ring empty (and played silence)
+-- @return overruns The number of blocks rejected because the ring was full
+-- @return latency The current latency, in seconds (which varies in adaptive mode)
+-- @return deferred The number of blocks with more events due than one block runs (probably a coroutine that never waits), whose remaining events were left for the next block
+function audio.fill()
+	return driver.fill, driver.underruns, driver.overruns, driver.block_io_latency * driver.blocksize / driver.samplerate, deferred
+end
+
+--- Get the audio callback telemetry
+-- The fields (updated by the audio thread at every callback) are callback_last & callback_max (seconds), load, load_avg & load_max (the callback's duration as a fraction of the block period), callbacks, input_overflows & output_underflows (as reported by the driver), fill_min & fill_max (blocks ready at a callback), and histogram (callbacks counted by load, in steps of 1/16 of the block period).
+-- @param reset If true, clear the statistics (at the next callback)
+-- @return the av_AudioStats structure
+function audio.stats(reset)
+	if reset then lib.av_audio_stats_reset() end
+	return lib.av_audio_stats()
+end
+
+--- Print a summary of the audio callback telemetry
+-- Includes a histogram of callback durations, to help find the source of glitches.
+-- @param reset If true, clear the statistics afterward
+function audio.report(reset)
+	local s = lib.av_audio_stats()
+	local period = driver.blocksize / driver.samplerate
+	local n = s.callbacks
+	print(string.format("audio: %d callbacks of %.2fms; callback last %.3fms max %.3fms", n, period*1000, s.callback_last*1000, s.callback_max*1000))
+	print(string.format("audio: load %.1f%% avg %.1f%% max %.1f%%", s.load*100, s.load_avg*100, s.load_max*100))
+	print(string.format("audio: device overflows %d underflows %d; ring fill %d..%d, underruns %d overruns %d", s.input_overflows, s.output_underflows, n > 0 and s.fill_min or 0, s.fill_max, driver.underruns, driver.overruns))
+	if n > 0 then
+		-- skip empty bins at the top:
+		local last = 0
+		for i = 0, 31 do if s.histogram[i] > 0 then last = i end end
+		for i = 0, last do
+			local count = s.histogram[i]
+			local bar = string.rep("#", math.ceil(40 * count / n))
+			local label = i < 31 and string.format("%3d-%3d%%", math.floor(i*100/16), math.floor((i+1)*100/16)) or string.format("   >%3d%%", math.floor(i*100/16))
+			print(string.format("audio: %s %8d %s", label, count, bar))
+		end
+	end
+	if reset then lib.av_audio_stats_reset() end
 end
 
---- Play a function or audio_buffer.
--- @param content The buffer or function to play
+--- Play a function, audio_buffer or audio.stream.
+-- Buffers and streams are played by native voices in the audio thread; the options table may set gain, pan (-1..1), rate, loop (boolean), loopstart and loopend (in frames), and quality (see player:quality; buffers only). A buffer recorded at a different samplerate (buf.samplerate) is played at its original pitch, as is a stream.
+-- A function is by default called once per sample frame, with the values of each input bus, and returns the values of each output bus; it ends when it returns nothing. If the options table sets block = true, the function is instead called once per (sub-)block as func(out, input, frames, channels, inchannels), and fills out with frames of channels samples (input holds frames of inchannels samples), laid out as for audio.run; it ends when it returns false.
+-- @param content The buffer, stream or function to play
 -- @param duration seconds to play
-function audio.play(content, duration)
+-- @param options (Optional) table of playback options for buffers and streams
+-- @return a player handle (for buffers and streams), or nil if no voices were available
+function audio.play(content, duration, options)
 	local buffer = require "audio.buffer"
+	local stream = require "audio.stream"
 	
 	if not is_audio_runloop_running then
 		start_audio_runloop()
@@ -316,26 +931,56 @@ function audio.play(content, duration)
 		error("cannot play a number")
 	elseif type(content) == "function" then
 		
-		addvoice(content, duration and driver.samplerate * duration)
+		addvoice(content, duration and driver.samplerate * duration, options and options.block)
 		
 	elseif buffer.isbuffer(content) then
 		
-		local count = 0	
+		reclaim_players()
+		
 		local buf = content
-		local chans = buf.channels
-		local frames = tonumber(buf.frames)
-		if duration then
-			frames = math.min(frames, driver.samplerate * duration)
+		local opt = options or {}
+		-- source frames per output frame at rate 1:
+		local ratio = (buf.samplerate or driver.samplerate) / driver.samplerate
+		local handle = lib.av_audio_voice_start(buf.samples, buffer.types[buf.type].id, buf.frames, buf.channels, 
+			opt.gain or 1, opt.pan or 0, (opt.rate or 1) * ratio, 
+			opt.loop and 1 or 0, opt.loopstart or 0, opt.loopend or buf.frames, 
+			duration and driver.samplerate * duration or 0)
+		if handle < 0 then
+			print("audio.play: no voices available")
+			return
+		end
+		if opt.quality then
+			lib.av_audio_voice_param(handle, VOICE_QUALITY, opt.quality)
 		end
+		local p = setmetatable({ handle = handle, buffer = buf, frames = buf.frames, ratio = ratio }, player)
+		players[handle] = p
+		return p
+	elseif stream.isstream(content) then
 		
-		addvoice(function()
-			if count < frames then
-				local l = buf.samples[count*chans]
-				local r = chans > 1 and buf.samples[count*chans+1] or l
-				count = count + 1
-				return l, r
-			end
-		end, frames)
+		reclaim_players()
+		
+		local opt = options or {}
+		local id
+		if opt.loop ~= nil then
+			id = content:start(opt.loop, opt.loopstart, opt.loopend)
+		else
+			id = content:start()
+		end
+		if not id then
+			print("audio.play: no streams available")
+			return
+		end
+		local ratio = content.samplerate / driver.samplerate
+		local handle = lib.av_audio_stream_play(id, opt.gain or 1, opt.pan or 0, (opt.rate or 1) * ratio, 
+			duration and driver.samplerate * duration or 0)
+		if handle < 0 then
+			lib.av_audio_stream_close(id)
+			print("audio.play: no voices available")
+			return
+		end
+		local p = setmetatable({ handle = handle, stream = id, frames = content.frames, ratio = ratio }, player)
+		players[handle] = p
+		return p
 	else
 		error("bad type for audio.play")
 	end
@@ -350,75 +995,43 @@ function audio.scope()
 	window.create()
 	
 	local buf = audio.outbuffer
-	local blocks = driver.blocks
-	local frames = buf.frames
-	local channels = buf.channels
+	-- the lowest, highest & RMS values per pixel column, via the ring's summary:
+	local columns, peaks
 	
 	draw = function()
 	
 		local w = window.width
-		local iw = 1/w
-		local playphase = audio.driver.blockwrite / blocks
-	
-		-- set the positions of the vertices:
-		gl.Begin(gl.TRIANGLE_STRIP)
-		for i = 0, w-1 do
-			-- phase (0..1) through sound:
-			local phase = i / w
-			-- convert to X coordinate (-1..1)
-			local x = phase*2-1
-		
-			-- get start point:
-			local first = math.floor(phase * buf.frames)
-			-- get number of samples per vertex:
-			local count = math.floor(frames * iw)
-		
-			-- get highest & lowest sample in this period:
-			local lo, hi = 1, -1
-			for j = first, first+count-1 do
-				lo = math.min(lo, buf.samples[j*channels])
-				hi = math.max(hi, buf.samples[j*channels])
-			end
-		
-			local g = (playphase - phase) % 1
-			g = 0.2 + 0.8*(1-g)*(1-g)
-		
-			gl.Color(0.2, g, 0.2)
-		
-			gl.Vertex(x, lo*0.5+0.5, 0)
-			gl.Vertex(x, hi*0.5+0.5, 0)
+		if w ~= columns then
+			columns = w
+			peaks = ffi.new("float[?]", w * 3)
 		end
-		gl.End()
-		
-		-- set the positions of the vertices:
-		gl.Begin(gl.TRIANGLE_STRIP)
-		for i = 0, w-1 do
-			-- phase (0..1) through sound:
-			local phase = i / w
-			-- convert to X coordinate (-1..1)
-			local x = phase*2-1
-		
-			-- get start point:
-			local first = math.floor(phase * buf.frames)
-			-- get number of samples per vertex:
-			local count = math.floor(frames * iw)
+		local playphase = driver.blockwrite / driver.blocks
 		
-			-- get highest & lowest sample in this period:
-			local lo, hi = 1, -1
-			for j = first, first+count-1 do
-				lo = math.min(lo, buf.samples[j*channels+1])
-				hi = math.max(hi, buf.samples[j*channels+1])
+		-- the first two channels, one above the other:
+		for c = 0, 1 do
+			local y = c == 0 and 0.5 or -0.5
+			buf:peaks(w, math.min(c, buf.channels - 1), 0, buf.frames, peaks)
+			
+			-- set the positions of the vertices:
+			gl.Begin(gl.TRIANGLE_STRIP)
+			for i = 0, w-1 do
+				-- phase (0..1) through sound:
+				local phase = i / w
+				-- convert to X coordinate (-1..1)
+				local x = phase*2-1
+			
+				local lo, hi = peaks[i*3], peaks[i*3+1]
+			
+				local g = (playphase - phase) % 1
+				g = 0.2 + 0.8*(1-g)*(1-g)
+			
+				gl.Color(0.2, g, 0.2)
+			
+				gl.Vertex(x, lo*0.5+y, 0)
+				gl.Vertex(x, hi*0.5+y, 0)
 			end
-		
-			local g = (playphase - phase) % 1
-			g = 0.2 + 0.8*(1-g)*(1-g)
-		
-			gl.Color(0.2, g, 0.2)
-		
-			gl.Vertex(x, lo*0.5-0.5, 0)
-			gl.Vertex(x, hi*0.5-0.5, 0)
+			gl.End()
 		end
-		gl.End()
 	
 		--[[
 		gl.Enable(gl.BLEND)
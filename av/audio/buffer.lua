@@ -6,7 +6,7 @@
 A generic audio buffer object, whose length is fixed from birth.
 Stores a sequence of frames of samples. Each frame has 1 or more channels.
 	i.e. multi-channel audio is interleaved. 
-64-bit currently.
+32-bit float by default; see buffer.types.
 
 Uses: 
 	- writing audio data to disk.
@@ -23,41 +23,77 @@ Check out ByteArray for ideas.
 --]]
 
 local min, max = math.min, math.max
+local floor = math.floor
 local format = string.format
 
 local ffi = require "ffi"
-ffi.cdef [[
-
-typedef struct audio_buffer {
-	int frames, channels;
-	double samples [?];
-} audio_buffer;
-
-]]
 
 
 local buffer = {}
 buffer.__index = buffer
 
+--- Sample element types, by name.
+-- A buffer's type field names its type: "float32" (the default), "float64" (for analysis that needs the precision), or "int16" (for compact banks of samples). 
+-- Sample values of an int16 buffer run from -32768 to 32767, but buffer:lerp and buffer:write scale them to & from -1..1. 
+-- Each type records its FFI element type (ctype), the type's id in native code (id), and the libsndfile functions that read & write it without conversion (sf, e.g. sf_readf_float).
+buffer.types = {
+	float32 = { ctype = "float", id = 0, sf = "float", encoding = "float", scale = 1 },
+	float64 = { ctype = "double", id = 1, sf = "double", encoding = "double", scale = 1 },
+	int16 = { ctype = "int16_t", id = 2, sf = "short", encoding = "pcm16", scale = 1/32768 },
+}
+local types = buffer.types
+-- type names by native id:
+local typenames = {}
+for name, t in pairs(types) do
+	t.name = name
+	t.array = ffi.typeof(t.ctype .. "[?]")
+	t.pointer = ffi.typeof(t.ctype .. " *")
+	typenames[t.id] = name
+end
+
+-- the type of an FFI pointer or array of samples, by its element type:
+local ctypenames = { float = "float32", double = "float64", short = "int16", int16_t = "int16" }
+local function typeof(samples)
+	local ctype = tostring(ffi.typeof(samples)):gsub("const ", ""):match("^ctype<(%w+)")
+	return ctypenames[ctype]
+end
+
+-- converting sample values to the element type:
+local function identity(v) return v end
+local function toint16(v)
+	v = v * 32768
+	return v >= 32767 and 32767 or v <= -32768 and -32768 or floor(v + 0.5)
+end
+types.float32.store = identity
+types.float64.store = identity
+types.int16.store = toint16
+
 function buffer.isbuffer(t)
-	--return ffi.istype(t, ffi.typeof("audio_buffer *")) 
-	--	  or ffi.istype(t, ffi.typeof("audio_buffer"))
 	return getmetatable(t) == buffer
 end
 
 --- Create a new audio_buffer filled with silence.
+-- Samples are interleaved by default. If blocksize is given, the buffer is planar: 
+-- each block of blocksize frames holds one contiguous run of samples per channel 
+-- (use blocksize = frames for a fully planar buffer).
 -- @tparam int frames The number of frames (sample length) of the buffer
 -- @tparam ?int channels The number of channels per frame
 -- @param ?samples An optional pointer to existing sample memory
--- @treturn SNDFILE
-function buffer.create(frames, channels, samples) 
+-- @tparam ?int blocksize The planar block length, in frames
+-- @tparam ?string type The sample type (see buffer.types); by default that of samples, if given, else "float32"
+-- @treturn audio_buffer
+function buffer.create(frames, channels, samples, blocksize, type) 
 	assert(frames and frames > 0, "buffer length (frames) required")
 	channels = channels and (max(channels, 1)) or 1
-	--local buf = ffi.new("audio_buffer", frames*channels, frames, channels)
+	type = type or (samples and typeof(samples)) or "float32"
+	local t = types[type]
+	assert(t, "unknown sample type")
 	local buf = setmetatable({
 		frames = frames,
 		channels = channels,
-		samples = samples or ffi.new("double[?]", frames*channels),
+		samples = samples or t.array(frames*channels),
+		blocksize = blocksize,
+		type = type,
 	}, buffer)
 	return buf
 end
@@ -66,20 +102,137 @@ end
 local new = buffer.create
 
 --- Create a new audio_buffer from an audio file on disk.
+-- Files are loaded through a cache shared by the whole process (keyed by the file's absolute path), so that loading the same file (with the same conversion) again needn't read or decode it again. 
+-- By default the buffer uses the cached samples in place, without copying them, as does every other such buffer of the same file; so it is read-only (buffer.shared is true, and buffer:write refuses it), since writing into one would be seen by all of them, and by later loads of the file while it stays cached. If private is true, the buffer instead gets its own copy of the samples, to write into (as buffer:copy gives of a shared buffer). 
+-- WAV & W64 files whose samples are already of the type asked for (32-bit float by default; 16-bit or 64-bit float only if that type is given) are mapped into memory (on little-endian machines) rather than read, unless converted to another samplerate. Other files are decoded once. 
+-- Files no buffer is sharing any more stay cached until the cache exceeds its budget (see buffer.cache), or the file changes on disk.
 -- @tparam string filename The name or full path of a soundfile to load.
--- @treturn SNDFILE
-function buffer.load(filename) 
-	local sndfile = require "audio.sndfile"
-	return sndfile.read(filename)
+-- @tparam ?number samplerate Convert to this samplerate (default: keep the file's samplerate)
+-- @tparam ?int quality The conversion quality, 1 to 3 (see buffer:resample)
+-- @tparam ?string type The sample type (see buffer.types); by default "float32"
+-- @tparam ?bool private Copy the samples into a buffer of its own, to write into, rather than share the cached samples
+-- @treturn audio_buffer
+function buffer.load(filename, samplerate, quality, type, private) 
+	require "audio.driver"
+	local lib = ffi.C
+	type = type or "float32"
+	assert(types[type], "unknown sample type")
+	-- (so that different names for the same file share its entry)
+	local path = lib.av_audio_cache_realpath(filename)
+	local key = path ~= nil and ffi.string(path) or filename
+	if samplerate then key = format("%s@%g:%d", key, samplerate, quality or 3) end
+	key = format("%s#%s", key, type)
+	local entry = lib.av_audio_cache_get(key)
+	if entry == nil and not samplerate then
+		entry = lib.av_audio_cache_map(key, filename, types[type].id)
+	end
+	if entry ~= nil then
+		entry = ffi.gc(entry, lib.av_audio_cache_release)
+	else
+		-- decode it into the cache:
+		local sndfile = require "audio.sndfile"
+		local t = types[type]
+		local sf, info = sndfile.open(filename)
+		local frames, channels = tonumber(info.frames), info.channels
+		local src, ratio
+		if samplerate and samplerate ~= info.samplerate then
+			src = new(frames, channels, nil, nil, t.name)
+			ratio = info.samplerate / samplerate
+			frames = max(1, floor(frames / ratio))
+		end
+		entry = lib.av_audio_cache_alloc(key, filename, t.id, frames, channels, samplerate or info.samplerate)
+		assert(entry ~= nil, "unable to allocate memory for sound file")
+		entry = ffi.gc(entry, lib.av_audio_cache_release)
+		local n = sndfile.lib["sf_readf_" .. t.sf](sf, src and src.samples or entry.samples, info.frames)
+		sf:close()
+		if n ~= info.frames then
+			lib.av_audio_cache_discard(ffi.gc(entry, nil))
+			error("unable to read whole file")
+		end
+		if src then
+			lib.av_audio_resample(src.samples, t.id, src.frames, channels, entry.samples, t.id, frames, ratio, quality or 3)
+		end
+	end
+	local t = types[typenames[entry.type]]
+	local buf
+	if private then
+		buf = new(entry.frames, entry.channels, nil, nil, t.name)
+		ffi.copy(buf.samples, entry.samples, ffi.sizeof(t.ctype) * entry.frames * entry.channels)
+		-- (the entry stays cached for the next load, but needn't be held)
+		lib.av_audio_cache_release(ffi.gc(entry, nil))
+	else
+		buf = new(entry.frames, entry.channels, ffi.cast(t.pointer, entry.samples), nil, t.name)
+		buf.shared = true
+		-- the buffer holds a reference to the cache entry, released when it is collected:
+		buf.cached = entry
+	end
+	buf.samplerate = entry.samplerate
+	return buf
+end
+
+--- Copy the buffer
+-- e.g. to get a buffer to write into from a shared buffer (see buffer.load).
+-- @treturn audio_buffer a new buffer, with its own samples
+function buffer:copy()
+	local t = types[self.type]
+	local buf = new(self.frames, self.channels, nil, self.blocksize, self.type)
+	ffi.copy(buf.samples, self.samples, ffi.sizeof(t.ctype) * self.frames * self.channels)
+	buf.samplerate = self.samplerate
+	return buf
+end
+
+--- Set the byte budget of the cache behind buffer.load
+-- Unused files are evicted, least recently used first, while the cache exceeds its budget (256MB by default). Files still in use are never evicted.
+-- @tparam ?number bytes The new budget (default: leave unchanged)
+-- @treturn number the bytes currently cached
+function buffer.cache(bytes)
+	require "audio.driver"
+	return ffi.C.av_audio_cache_budget(bytes or -1)
 end
 
+--- Save the buffer as a WAV file
+-- Samples are stored in the buffer's own type (16-bit integer, 32-bit or 64-bit float), so that they are written without conversion.
+-- @tparam string filename The name or full path of the file to write
+-- @treturn audio_buffer self
 function buffer:save(filename) 
 	local sndfile = require "audio.sndfile"
-	local s = sndfile.create(filename, { channels = self.channels })
-	s:write(self.samples, self.frames)
+	local t = types[self.type]
+	local s = sndfile.create(filename, { channels = self.channels, samplerate = self.samplerate, encoding = t.encoding })
+	local samples = self.samples
+	if self.blocksize then
+		-- sound files are interleaved:
+		local chans = self.channels
+		samples = t.array(self.frames * chans)
+		for i = 0, self.frames-1 do
+			for c = 0, chans-1 do
+				samples[i*chans + c] = self.samples[self:index(i, c)]
+			end
+		end
+	end
+	sndfile.lib["sf_writef_" .. t.sf](s, samples, self.frames)
+	s:close()
 	return self
 end
 
+--- Convert to a different samplerate
+-- Uses a windowed-sinc filter, which also removes frequencies above the new Nyquist limit when converting down.
+-- @tparam number samplerate The new samplerate
+-- @tparam ?int quality 1, 2 or 3 for 8, 16 or 32 filter taps (default 3)
+-- @treturn audio_buffer a new buffer, or self if no conversion is needed
+function buffer:resample(samplerate, quality)
+	local from = self.samplerate or samplerate
+	if from == samplerate then return self end
+	assert(not self.blocksize, "cannot resample a planar buffer")
+	require "audio.driver"
+	local ratio = from / samplerate
+	local frames = max(1, floor(self.frames / ratio))
+	local buf = new(frames, self.channels, nil, nil, self.type)
+	local id = types[self.type].id
+	ffi.C.av_audio_resample(self.samples, id, self.frames, self.channels, buf.samples, id, frames, ratio, quality or 3)
+	buf.samplerate = samplerate
+	return buf
+end
+
 function buffer:play()
 	local audio = require "audio"
 	audio.play(self)
@@ -90,29 +243,114 @@ end
 -- @type audio_buffer
 
 function buffer:__tostring()
-	return format("audio_buffer(%dx%d, %p)", self.frames, self.channels, self.samples)
+	return format("audio_buffer(%dx%d %s%s, %p)", self.frames, self.channels, self.type, self.blocksize and " planar" or "", self.samples)
+end
+
+--- The offset of a sample within buf.samples
+-- @tparam int i The frame index
+-- @tparam int c The channel index
+-- @treturn int offset
+function buffer:index(i, c)
+	local bs = self.blocksize
+	if bs then
+		local blk = floor(i / bs)
+		return (blk * self.channels + c) * bs + (i - blk * bs)
+	end
+	return i * self.channels + c
+end
+
+--- A planar view of one channel
+-- The samples of channel c from frame i onward are at ptr[0], ptr[stride], ptr[2*stride] etc., for count frames.
+-- For a planar buffer the stride is 1, so that DSP can run over contiguous memory.
+-- @tparam int c The channel index
+-- @tparam ?int i The first frame (default 0)
+-- @return ptr, stride, count
+function buffer:channel(c, i)
+	i = i or 0
+	local ptr = self.samples + self:index(i, c)
+	local bs = self.blocksize
+	if bs then
+		return ptr, 1, min(bs - i % bs, self.frames - i)
+	end
+	return ptr, self.channels, self.frames - i
 end
 
 --- Write values into a buffer
--- @tparam function func A function that will be called to set each frame of the buffer. For a multi-channel buffer, this function should return multiple values (one for each channel).
+-- @tparam function func A function that will be called to set each frame of the buffer. For a multi-channel buffer, this function should return multiple values (one for each channel). Values are in -1..1 for any sample type (int16 samples are scaled, rounded & clipped).
 -- @tparam ?int start The starting index to write data (default 0)
 -- @tparam ?int dur The number of frames to write (default all frames of the buffer)
 -- @treturn audio_buffer self
 function buffer:write(func, start, dur)
+	assert(not self.shared, "a shared buffer is read-only (see buffer.load); write into buffer:copy() instead")
 	local start = start or 0
 	local dur = dur or self.frames
 	local chans = self.channels
+	local samples = self.samples
+	local store = types[self.type].store
+	if chans == 1 then
+		for i = start, dur-1 do
+			samples[i] = store(func())
+		end
+		return self:touch(start, dur - start)
+	end
 	-- this is not optimized at all.
 	for i = start, dur-1 do
-		local idx = i * chans
 		local frame = { func() }
 		for c = 0, chans-1 do
-			self.samples[idx + c] = frame[(c % #frame) + 1]
+			samples[self:index(i, c)] = store(frame[(c % #frame) + 1])
 		end
 	end	
+	return self:touch(start, dur - start)
+end
+
+--- The min/max/RMS summary of the buffer, for drawing waveforms
+-- A pyramid of summaries of ever longer runs of frames, built on first use and kept with the buffer (see buffer:peaks). 
+-- buffer:write keeps it up to date; after writing samples some other way, call buffer:touch. 
+-- The summaries of audio.outbuffer and audio.inbuffer are instead kept up to date by the audio thread, block by block, from the first call on.
+-- @return the native summary
+function buffer:summary()
+	local s = self.summarized
+	if not s then
+		require "audio.driver"
+		local lib = ffi.C
+		if self.ring then
+			s = lib.av_audio_summary_ring(self.ring)
+		else
+			s = lib.av_audio_summary_new(self.samples, types[self.type].id, self.frames, self.channels, self.blocksize or 0)
+			assert(s ~= nil, "unable to allocate memory for the buffer summary")
+			s = ffi.gc(s, lib.av_audio_summary_free)
+		end
+		self.summarized = s
+	end
+	return s
+end
+
+--- Bring the summary (if any) up to date after writing samples directly
+-- @tparam ?int start The first frame written (default 0)
+-- @tparam ?int dur The number of frames written (default all frames of the buffer)
+-- @treturn audio_buffer self
+function buffer:touch(start, dur)
+	if self.summarized then
+		ffi.C.av_audio_summary_touch(self.summarized, start or 0, dur or self.frames)
+	end
 	return self
 end
 
+--- The lowest, highest and RMS sample values of equal parts of a span of frames
+-- Uses the buffer's summary (see buffer:summary), so that the cost depends on the number of parts (e.g. pixel columns) rather than of frames, at any zoom.
+-- @tparam int columns The number of parts to divide the span into
+-- @tparam ?int channel The channel (default 0)
+-- @tparam ?number start The first frame of the span (default 0)
+-- @tparam ?number dur The length of the span in frames (default to the end of the buffer)
+-- @param ?out A float array of at least columns*3 to fill (default a new one)
+-- @return out, holding the lowest, highest & RMS values of part i (from 0) at out[i*3], out[i*3+1], out[i*3+2]
+function buffer:peaks(columns, channel, start, dur, out)
+	start = start or 0
+	out = out or ffi.new("float[?]", columns * 3)
+	ffi.C.av_audio_summary_query(self:summary(), channel or 0, start, dur or self.frames - start, columns, out)
+	return out
+end
+
 --[[
 -- TODO buffer methods:
 
@@ -146,14 +384,14 @@ function buffer:lerp(idx)
 	local x1 =  self.samples[ idx1 ]
 	local x2 =  self.samples[ idx2 ]
 	local a = idx % 1
-	return x1 + a * (x2 - x1)
+	return (x1 + a * (x2 - x1)) * types[self.type].scale
 end
 
 --ffi.metatype("audio_buffer", buffer)
 
 setmetatable(buffer, {
-	__call = function(s, frames, channels)
-		return new(frames, channels)
+	__call = function(s, frames, channels, samples, blocksize, type)
+		return new(frames, channels, samples, blocksize, type)
 	end,
 })
 
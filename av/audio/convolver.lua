@@ -0,0 +1,96 @@
+--- Convolution of the output buses with an impulse response, such as a reverb or a speaker cabinet.
+-- A convolver is inserted on one or more adjacent output buses, after the voices and the ugen graph, and replaces each bus with a mix of the dry signal and the signal convolved with the response.
+-- Responses several seconds long are fine: the audio thread convolves only the first part, and a background thread the rest.
+-- The module can also be called directly as a function, e.g.: local verb = audio.convolver(audio.buffer.load("hall.wav"), { wet = 0.3 })
+-- @module audio.convolver
+
+local ffi = require "ffi"
+local lib = ffi.C
+local driver = require "audio.driver"
+local buffer = require "audio.buffer"
+
+local WET, DRY = 0, 1
+
+local convolver = {}
+convolver.__index = convolver
+
+--- Insert a convolver
+-- The options table may set bus (the first bus filtered, from 0, default 0), lanes (the number of buses filtered, up to 8; by default 2, or 1 if there is only one output bus), wet (the gain of the convolved signal, default 1), dry (the gain of the input, default 0) and partition (the frames convolved at a time on the audio thread, a power of two from 32 to 2048; see below).
+-- Bus bus+i is convolved with channel i of the response, wrapping around, so a mono response filters every bus alike.
+-- The response is resampled to the audio samplerate if need be, then copied, so the buffer may be discarded afterward. 
+-- By default the partition is the largest power of two that divides the block size, and the convolver adds no delay; otherwise the convolved signal lags the dry by a partition.
+-- Up to 8 convolvers can be inserted at once.
+-- @param response The impulse response, an interleaved audio_buffer
+-- @param options (Optional) table of options
+-- @return convolver
+function convolver.open(response, options)
+	options = options or {}
+	assert(buffer.isbuffer(response), "audio.convolver: the response should be an audio buffer")
+	assert(not response.blocksize, "audio.convolver: the response cannot be a planar buffer")
+	local samplerate = driver.samplerate
+	if response.samplerate and samplerate > 0 then
+		response = response:resample(samplerate)
+	end
+	local lanes = options.lanes or math.min(2, driver.outbuses)
+	local c = lib.av_audio_convolver_open(response.samples, buffer.types[response.type].id, response.frames, response.channels, 
+		options.bus or 0, lanes, options.partition or 0, options.wet or 1, options.dry or 0)
+	assert(c ~= nil, "audio.convolver: unable to insert a convolver (check the options, or close some)")
+	return setmetatable({
+		native = ffi.gc(c, lib.av_audio_convolver_close),
+		bus = c.bus,
+		lanes = c.lanes,
+		partition = c.partition,
+	}, convolver)
+end
+
+--- Test whether an object is a convolver
+function convolver.isconvolver(t)
+	return getmetatable(t) == convolver
+end
+
+--- Set the gain of the convolved signal
+-- Changes are ramped over one block.
+-- @tparam number gain
+function convolver:wet(gain)
+	if self.native then lib.av_audio_convolver_param(self.native, WET, gain) end
+	return self
+end
+
+--- Set the gain of the dry signal
+-- Changes are ramped over one block.
+-- @tparam number gain
+function convolver:dry(gain)
+	if self.native then lib.av_audio_convolver_param(self.native, DRY, gain) end
+	return self
+end
+
+--- The delay of the convolved signal behind the dry, in frames (0 or the partition)
+function convolver:latency()
+	return self.native and self.native.latency or 0
+end
+
+--- The number of times the background thread failed to finish the tail of the response in time
+-- Each is heard as a dropout of part of the tail, for a few thousand frames.
+function convolver:late()
+	return self.native and self.native.late or 0
+end
+
+--- Remove the convolver from the buses
+function convolver:close()
+	if self.native then
+		lib.av_audio_convolver_close(ffi.gc(self.native, nil))
+		self.native = nil
+	end
+end
+
+function convolver:__tostring()
+	return string.format("convolver(buses %d..%d, partition %d)", self.bus, self.bus + self.lanes - 1, self.partition)
+end
+
+setmetatable(convolver, {
+	__call = function(c, response, options)
+		return convolver.open(response, options)
+	end,
+})
+
+return convolver
@@ -0,0 +1,247 @@
+--- The low-level audio driver shared by the main and audio-thread Lua states
+-- Returns the FFI av_Audio object; most scripts should use the audio module instead.
+-- @module audio.driver
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+// which is 0 for the cache line size, 1 for sizeof(av_Audio), then the offsets of blockread, blockwrite 
+// and msgbuffer, then sizeof(av_msgbuffer):
+int av_audio_layout(int which);
+]]
+
+-- the pads keep fields written by different threads on separate cache lines, 
+-- so their sizes follow the C++ build:
+local CACHELINE = lib.av_audio_layout(0)
+local PAD = CACHELINE - ffi.sizeof("int")
+
+ffi.cdef((([[
+
+// a lock-free byte queue of length-prefixed messages, from the main thread to the audio thread:
+typedef struct av_msgbuffer {
+	int size;
+	char pad0[$PAD];
+	volatile int read;			// written by the audio thread only
+	char pad1[$PAD];
+	volatile int write;			// written by the main thread only
+	char pad2[$PAD];
+	unsigned char * data;
+} av_msgbuffer;
+
+typedef struct av_Audio {
+	unsigned int blocksize;
+	unsigned int frames;	
+	unsigned int indevice, outdevice;
+	unsigned int inchannels, outchannels;		// of the devices
+	unsigned int inbuses, outbuses;			// of the rings
+	
+	double time;					// in seconds
+	double samplerate;				// in samples
+	double latency_seconds;			// in seconds
+	
+	// a big buffer for main-thread audio generation
+	float * buffer;
+	float * inbuffer;
+	
+	int blocks, blockstep;
+	int block_io_latency, fill;
+	int underruns, overruns;
+	
+	// if nonzero, each block of buffer/inbuffer (and the device buffers) holds 
+	// one contiguous run of blocksize frames per channel, rather than interleaved frames:
+	int planar, dummy;
+	
+	// adaptive latency: while adaptive is nonzero, the audio thread moves block_io_latency
+	// within latency_min..latency_max (in blocks), judged by the lowest fill seen per window of callbacks:
+	int adaptive, adapt_window;
+	int latency_min, latency_max;
+	int adapt_fill_min, adapt_count;
+	int adapt_hold, adapt_stable;
+	
+	// if virtualdevice is nonzero (or there are no audio devices), av_audio_start runs a virtual
+	// device instead: a timer thread invoking the callback at the block rate, each call 
+	// delayed by up to jitter seconds, for testing & profiling on machines without hardware:
+	int virtualdevice, dummy2;
+	double jitter;
+	
+	// real-time modes for the callback thread, taking effect at the next start (see audio.realtime):
+	int realtime, lockmemory;
+	int affinity, flushdenormals;
+	// AV_AUDIO_RT_* flags (1 realtime, 2 lockmemory, 4 affinity, 8 flushdenormals) of the modes
+	// that took effect, and of those asked for that failed; complete once rt_pending is 0:
+	volatile int rt_applied, rt_failed;
+	volatile int rt_pending, rt_generation;
+	
+	// single-producer (main thread), single-consumer (audio thread) block ring:
+	char pad0[$CACHELINE];
+	volatile int blockread;		// written by the audio thread only
+	char pad1[$PAD];
+	volatile int blockwrite;	// written by the main thread only
+	char pad2[$PAD];
+	
+	// only access from audio thread:
+	float * input;
+	float * output;	
+	void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames);
+	
+	// messages for the audio-thread Lua state:
+	av_msgbuffer msgbuffer;
+	
+} av_Audio;
+
+av_Audio * av_audio_get();
+
+// callback telemetry, written only by the audio thread:
+typedef struct av_AudioStats {
+	double callback_last, callback_max;
+	double load, load_avg, load_max;
+	int callbacks;
+	int input_overflows, output_underflows;
+	int fill_min, fill_max;
+	int histogram[32];
+} av_AudioStats;
+
+av_AudioStats * av_audio_stats();
+int av_audio_stats_reset();
+
+int av_audio_latency_blocks(double seconds);
+int av_audio_writable();
+int av_audio_commit();
+// dst[i] += src[i], for mixing Lua voices into the ring:
+void av_audio_accumulate(float * dst, const float * src, int count);
+// wake this runloop callback whenever the ring drains to half the latency (-1 for none):
+void av_audio_wake_runloop(int id);
+
+// type is the element type of samples: 0 for float32, 1 for float64, 2 for int16 (see audio.buffer)
+int av_audio_voice_start(const void * samples, int type, int frames, int channels, double gain, double pan, double rate, int loop, double loopstart, double loopend, double duration);
+int av_audio_voice_stop(int handle);
+int av_audio_voice_param(int handle, int param, double value);
+int av_audio_voice_done();
+// voices started until the next call begin at this frame of this ring block (-1 for as soon as possible):
+void av_audio_voice_at(int block, int frame);
+// render native voices on up to this many threads (counting the audio thread); returns the number in use:
+int av_audio_voice_threads(int threads);
+
+// disk streams, read ahead by a background thread (see audio.stream):
+typedef long long (*av_audio_stream_read_fn)(void * file, float * dst, long long frames);
+typedef long long (*av_audio_stream_seek_fn)(void * file, long long frame, int whence);
+typedef int (*av_audio_stream_close_fn)(void * file);
+int av_audio_stream_open(void * file, av_audio_stream_read_fn read_fn, av_audio_stream_seek_fn seek_fn, av_audio_stream_close_fn close_fn, int frames, int channels, int ringframes, int loop, int loopstart, int loopend);
+int av_audio_stream_play(int id, double gain, double pan, double rate, double duration);
+void av_audio_stream_seek(int id, int frame);
+void av_audio_stream_loop(int id, int loop, int start, int end);
+int av_audio_stream_underruns(int id);
+void av_audio_stream_close(int id);
+
+// recording to disk, written by a background thread (see audio.record):
+typedef long long (*av_audio_record_write_fn)(void * file, const float * src, long long frames);
+typedef int (*av_audio_record_close_fn)(void * file);
+int av_audio_record_start(void * file, av_audio_record_write_fn write_fn, av_audio_record_close_fn close_fn, int sources, int ringframes);
+void av_audio_record_stop(int id);
+int av_audio_record_done();
+int av_audio_record_busy(int id);
+int av_audio_record_blocks(int id);
+int av_audio_record_dropped(int id, int changed);
+
+// the shared sample cache behind buffer.load (main thread only):
+typedef struct av_AudioSample {
+	void * samples;
+	int frames, channels;
+	double samplerate;
+	int refs, mapped;
+	int type, dummy;
+} av_AudioSample;
+const char * av_audio_cache_realpath(const char * path);
+av_AudioSample * av_audio_cache_get(const char * key);
+av_AudioSample * av_audio_cache_map(const char * key, const char * path, int type);
+av_AudioSample * av_audio_cache_alloc(const char * key, const char * path, int type, int frames, int channels, double samplerate);
+void av_audio_cache_release(av_AudioSample * sample);
+void av_audio_cache_discard(av_AudioSample * sample);
+double av_audio_cache_budget(double bytes);
+void av_audio_cache_purge();
+
+// min/max/rms summaries for drawing waveforms (see buffer:peaks):
+typedef struct av_AudioSummary av_AudioSummary;
+av_AudioSummary * av_audio_summary_new(const void * samples, int type, int frames, int channels, int blocksize);
+void av_audio_summary_free(av_AudioSummary * s);
+void av_audio_summary_touch(av_AudioSummary * s, int first, int count);
+// of the output (0) or input (1) ring, updated by the audio thread once asked for:
+av_AudioSummary * av_audio_summary_ring(int which);
+int av_audio_summary_query(av_AudioSummary * s, int channel, double first, double count, int columns, float * out);
+
+// short-time spectra, computed by a background thread (see audio.spectrum):
+typedef struct av_AudioSpectrum {
+	int size, hop, bins, rows;
+	float * history;
+	volatile int frames;
+	volatile int dropped;
+} av_AudioSpectrum;
+av_AudioSpectrum * av_audio_analyzer_open(int source, int bus, int size, int hop, int window, int rows, double range);
+void av_audio_analyzer_close(av_AudioSpectrum * s);
+
+// partitioned convolution of output buses through an impulse response (see audio.convolver):
+typedef struct av_AudioConvolution {
+	int frames, channels;
+	int bus, lanes;
+	int partition, tail;
+	int latency;
+	volatile int late;
+} av_AudioConvolution;
+av_AudioConvolution * av_audio_convolver_open(const void * samples, int type, int frames, int channels, int bus, int lanes, int partition, double wet, double dry);
+// param is 0 for wet, 1 for dry:
+int av_audio_convolver_param(av_AudioConvolution * c, int param, double value);
+void av_audio_convolver_close(av_AudioConvolution * c);
+
+// windowed-sinc conversion of interleaved frames, between element types as for av_audio_voice_start; 
+// ratio is source rate / destination rate, and quality is 1, 2 or 3 (8, 16 or 32 taps):
+int av_audio_resample(const void * src, int srctype, int frames, int channels, void * dst, int dsttype, int dstframes, double ratio, int quality);
+
+// native ugen graph (see audio.ugen); a node stays while its id is held (until freed) or an input reads it:
+int av_audio_ugen_new(int type);
+int av_audio_ugen_input(int id, int input, int src, int out, double value);
+int av_audio_ugen_free(int id);
+
+// routing matrices: 0 for output buses -> device outputs, 1 for device inputs -> input buses
+int av_audio_route_set(int matrix, int row, int col, double gain);
+double av_audio_route_bench(int rows, int cols, int blocksize, int blocks);
+
+// main thread -> audio-thread Lua state:
+int av_audio_msg_send(const char * msg, int len);
+int av_audio_msg_peek();
+int av_audio_msg_recv(char * dst);
+
+// only use from main thread:
+void av_audio_start(); 
+// stop the stream, ending all native voices (returned by av_audio_voice_done):
+void av_audio_stop();
+// (re)enumerate the devices listed by av_audio_start; returns the count, or -1 while reconfiguring
+int av_audio_devices_scan();
+// switch devices, samplerate or blocksize while the stream plays (see audio.reconfigure);
+// returns 1 if under way, 0 if restarted at once instead, -1 if it couldn't begin
+int av_audio_reconfigure(int indevice, int outdevice, double samplerate, int blocksize);
+// call regularly; returns 1 once the new stream has taken over, -1 if it failed, otherwise 0
+int av_audio_reconfigure_poll();
+
+// set the audio thread's floating-point modes (flush denormals) on the main thread while it renders
+// into the ring; returns the modes to restore with av_audio_fp_end:
+unsigned int av_audio_fp_begin();
+void av_audio_fp_end(unsigned int saved);
+
+// offline rendering, driven by the main thread while the device stream is stopped:
+int av_audio_offline_begin(int outchannels, int inchannels);
+void av_audio_offline_process(float * out, const float * input);
+]]):gsub("%$(%u+)", { CACHELINE = CACHELINE, PAD = PAD })))
+
+-- a cdef that drifted from the C++ struct would silently corrupt fields:
+assert(ffi.sizeof("av_Audio") == lib.av_audio_layout(1)
+	and ffi.offsetof("av_Audio", "blockread") == lib.av_audio_layout(2)
+	and ffi.offsetof("av_Audio", "blockwrite") == lib.av_audio_layout(3)
+	and ffi.offsetof("av_Audio", "msgbuffer") == lib.av_audio_layout(4)
+	and ffi.sizeof("av_msgbuffer") == lib.av_audio_layout(5), 
+	"audio driver cdef does not match av_Audio")
+
+local driver = lib.av_audio_get()
+assert(driver ~= nil, "problem acquiring audio driver")
+
+return driver
@@ -1,3 +1,7 @@
+-- Per-sample generators & filters, as Lua closures.
+-- For many simultaneous oscillators and filters, see audio.ugen, which runs 
+-- native versions of most of these on whole blocks in the audio thread.
+
 local audio = require "audio"
 local samplerate = 44100
 
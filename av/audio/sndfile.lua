@@ -594,9 +594,22 @@ local buffer = require "audio.buffer"
 
 local sndfile = {}
 
+-- file types & sample encodings, by name:
+local formats = {
+	wav = lib.SF_FORMAT_WAV,
+	w64 = lib.SF_FORMAT_W64,
+	aiff = lib.SF_FORMAT_AIFF,
+	flac = lib.SF_FORMAT_FLAC,
+}
+local encodings = {
+	pcm16 = lib.SF_FORMAT_PCM_16,
+	pcm24 = lib.SF_FORMAT_PCM_24,
+	float = lib.SF_FORMAT_FLOAT,
+	double = lib.SF_FORMAT_DOUBLE,
+}
 
 --- Create (or re-open) a soundfile for writing.
--- The config table options include "channels" (default 2), "samplerate" (default 44100).
+-- The config table options include "channels" (default 2), "samplerate" (default 44100), "format" ("wav" (the default), "w64", "aiff" or "flac") and "encoding" ("pcm16" (the default), "pcm24", "float" or "double"; flac supports neither of the last two).
 -- @tparam string path filename or full filepath of file to create
 -- @tparam ?table config configuration options
 -- @treturn SNDFILE
@@ -606,7 +619,11 @@ function sndfile.create(path, config)
 	local info = ffi.new("SF_INFO")
 	info.samplerate = config.samplerate or 44100
 	info.channels = config.channels or 1
-	info.format = bit.bor(lib.SF_FORMAT_WAV, lib.SF_FORMAT_PCM_16)
+	local format = formats[config.format or "wav"]
+	local encoding = encodings[config.encoding or "pcm16"]
+	assert(format, "unknown sound file format")
+	assert(encoding, "unknown sample encoding")
+	info.format = bit.bor(format, encoding)
 	local sf = lib.sf_open(path, lib.SFM_WRITE, info)
 	if sf == nil then
 		error(ffi.string(lib.sf_strerror(nil)))
@@ -614,25 +631,48 @@ function sndfile.create(path, config)
 	return ffi.gc(sf, lib.sf_close)
 end
 
+--- Open a sound file for reading, without reading any of it.
+-- @tparam string path filename or full filepath of file to open
+-- @treturn SNDFILE
+-- @treturn SF_INFO the file's frames, channels, samplerate and format
+function sndfile.open(path)
+	local info = ffi.new("SF_INFO")
+	local sf = lib.sf_open(path, lib.SFM_READ, info)
+	if sf == nil then
+		error(ffi.string(lib.sf_strerror(nil)))
+	end
+	return ffi.gc(sf, lib.sf_close), info
+end
+
 --- Read in a sound file and return an audio.buffer object.
+-- The buffer's samplerate field records the file's samplerate. The config table options include "type", the buffer's sample type ("float32" (the default), "float64" or "int16"; see audio.buffer.types), "samplerate", to convert to a different samplerate as the file is loaded, and "quality" (see audio.buffer:resample).
 -- @tparam string path filename or full filepath of file to read
+-- @tparam ?table config configuration options
 -- @treturn audio.buffer buffer
 -- @see audio.buffer
-function sndfile.read(path)
+function sndfile.read(path, config)
 	local info = ffi.new("SF_INFO")
 	local sf = lib.sf_open(path, lib.SFM_READ, info)
 	if sf == nil then
 		error(ffi.string(lib.sf_strerror(nil)))
 	end
 	-- allocate a buffer for it:
-	local buf = buffer(info.frames, info.channels)
+	local buf = buffer(info.frames, info.channels, nil, nil, config and config.type)
 	
-	-- read it in:
-	local n = lib.sf_read_double(sf, buf.samples, info.frames*info.channels)
-	assert(n == info.frames*info.channels, "unable to read whole file")
+	-- read it in, converting straight to the buffer's type:
+	local n = lib["sf_readf_" .. buffer.types[buf.type].sf](sf, buf.samples, info.frames)
+	lib.sf_close(sf)
+	assert(n == info.frames, "unable to read whole file")
+	buf.samplerate = info.samplerate
+	if config and config.samplerate then
+		buf = buf:resample(config.samplerate, config.quality)
+	end
 	return buf
 end
 
+-- the libsndfile namespace, for modules that call it directly (e.g. audio.stream):
+sndfile.lib = lib
+
 setmetatable(sndfile, {
 	__call = function(s, path, mode, config)
 		if mode == "w" then
@@ -659,10 +699,12 @@ function SNDFILE:write(buf, len)
 	if type(buf) == "number" then
 		local f = ffi.new("double[1]", buf)
 		lib.sf_write_double(self, f, 1)
-	elseif ffi.istype(buf, ffi.typeof("float *")) or ffi.istype(buf, ffi.typeof("float []")) then
+	elseif ffi.istype("float *", buf) or ffi.istype("float []", buf) then
 		lib.sf_write_float(self, buf, len)
-	elseif ffi.istype(buf, ffi.typeof("double *")) or ffi.istype(buf, ffi.typeof("double []")) then
+	elseif ffi.istype("double *", buf) or ffi.istype("double []", buf) then
 		lib.sf_write_double(self, buf, len)
+	elseif ffi.istype("int16_t *", buf) or ffi.istype("int16_t []", buf) then
+		lib.sf_write_short(self, buf, len)
 	end
 	return self
 end
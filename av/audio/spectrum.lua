@@ -0,0 +1,112 @@
+--- Short-time spectra of the audio buses, for audio-reactive visuals.
+-- An analyzer takes a windowed FFT of the input (or output) every hop samples, on a background thread, and keeps a history of the magnitude of each frequency bin, one row per FFT. 
+-- Draw the history as a scrolling spectrogram via spectrum:field(), or read the latest row via spectrum:latest().
+-- The module can also be called directly as a function, e.g.: local spec = audio.spectrum({ size = 2048, range = 80 })
+-- @module audio.spectrum
+
+local ffi = require "ffi"
+local lib = ffi.C
+local driver = require "audio.driver"
+
+local windows = { rect = 0, hann = 1, hamming = 2, blackman = 3 }
+local sources = { output = 0, input = 1 }
+
+local spectrum = {}
+spectrum.__index = spectrum
+
+--- Start analyzing
+-- The options table may set source ("input" (the default) or "output"), bus (the bus to analyze, from 0; by default the mix of all buses), size (the FFT size, a power of two from 64 to 32768, default 1024), hop (samples from one FFT to the next, default size/4), window ("hann" (the default), "hamming", "blackman" or "rect"), rows (the length of the history, default 256) and range (in decibels; see below).
+-- Each row holds size/2+1 magnitudes, from 0 Hz up to half the samplerate. These are linear, with 1 for a full-scale sine at the center of a bin; or if range is given, in decibels, with -range..0 dB mapped to 0..1.
+-- Up to 8 analyzers can be open at once.
+-- @param options (Optional) table of options
+-- @return spectrum
+function spectrum.open(options)
+	options = options or {}
+	local size = options.size or 1024
+	local source = sources[options.source or "input"]
+	assert(source, "audio.spectrum: source should be input or output")
+	local window = windows[options.window or "hann"]
+	assert(window, "audio.spectrum: unknown window")
+	local s = lib.av_audio_analyzer_open(source, options.bus or -1, size, options.hop or size/4, window, options.rows or 256, options.range or 0)
+	assert(s ~= nil, "audio.spectrum: unable to open an analyzer (check the size, or close some)")
+	return setmetatable({
+		native = ffi.gc(s, lib.av_audio_analyzer_close),
+		size = s.size,
+		hop = s.hop,
+		bins = s.bins,
+		rows = s.rows,
+	}, spectrum)
+end
+
+--- Test whether an object is a spectrum
+function spectrum.isspectrum(t)
+	return getmetatable(t) == spectrum
+end
+
+--- The number of rows (FFTs) written so far
+function spectrum:frames()
+	return self.native.frames
+end
+
+--- The number of blocks dropped because the analysis thread fell behind
+function spectrum:dropped()
+	return self.native.dropped
+end
+
+--- The center frequency of a bin, in Hz
+-- @tparam int bin The bin, from 0 to bins-1
+function spectrum:frequency(bin)
+	return bin * driver.samplerate / self.size
+end
+
+--- The history, as a float array usable as a texture
+-- The latest rows rows of bins magnitudes, oldest first, newest last. The pointer moves as rows are written, so call this again for each use.
+-- @return pointer to rows*bins floats
+function spectrum:history()
+	local s = self.native
+	return s.history + (s.frames % s.rows) * s.bins
+end
+
+--- The latest row of magnitudes
+-- @return pointer to bins floats (all zero until the first FFT)
+function spectrum:latest()
+	return self:history() + (self.rows - 1) * self.bins
+end
+
+--- The history as a field2D, bins wide and rows high, newest row at the top
+-- The field reads the analyzer's memory directly; call this once per frame before drawing it (e.g. spec:field():draw()), to bring it up to date.
+-- @return field2D
+function spectrum:field()
+	local f = self.fieldview
+	if not f then
+		local field2D = require "field2D"
+		f = field2D.new(self.bins, self.rows, self:history())
+		-- the field keeps the analyzer alive:
+		f.spectrum = self
+		self.fieldview = f
+	end
+	f.data = self:history()
+	return f
+end
+
+--- Stop analyzing
+-- The history is freed shortly afterward; don't use pointers or fields obtained from it any more.
+function spectrum:close()
+	if self.native then
+		lib.av_audio_analyzer_close(ffi.gc(self.native, nil))
+		self.native = nil
+		self.fieldview = nil
+	end
+end
+
+function spectrum:__tostring()
+	return string.format("spectrum(size %d, hop %d, %d rows)", self.size, self.hop, self.rows)
+end
+
+setmetatable(spectrum, {
+	__call = function(s, options)
+		return spectrum.open(options)
+	end,
+})
+
+return spectrum
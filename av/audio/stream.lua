@@ -0,0 +1,72 @@
+--- Sound files played straight from disk.
+-- A stream plays like a buffer, via audio.play, but only a little of the file is in memory at any time:
+-- a background thread reads ahead of each playing voice. Use it for files too long to load, such as ambience beds.
+-- The module can also be called directly as a function, e.g.: audio.play(audio.stream("rain.wav", { readahead = 2 }))
+-- @module audio.stream
+
+local ffi = require "ffi"
+local lib = ffi.C
+local driver = require "audio.driver"
+local sndfile = require "audio.sndfile"
+
+-- the native streams read & close files through libsndfile:
+local sf = sndfile.lib
+local read_fn = ffi.cast("av_audio_stream_read_fn", sf.sf_readf_float)
+local seek_fn = ffi.cast("av_audio_stream_seek_fn", sf.sf_seek)
+local close_fn = ffi.cast("av_audio_stream_close_fn", sf.sf_close)
+
+local stream = {}
+stream.__index = stream
+
+--- Describe a sound file to stream
+-- The file is checked now, but each time the stream is played it is opened anew, so a stream can play in several voices at once.
+-- The options table may set readahead (seconds of the file to hold in memory per voice, default 1), loop (boolean), loopstart and loopend (in frames).
+-- @param path The sound file
+-- @param options (Optional) table of options
+-- @return stream
+function stream.open(path, options)
+	options = options or {}
+	local file, info = sndfile.open(path)
+	local self = setmetatable({
+		path = path,
+		frames = tonumber(info.frames),
+		channels = info.channels,
+		samplerate = info.samplerate,
+		readahead = options.readahead or 1,
+		loop = options.loop,
+		loopstart = options.loopstart,
+		loopend = options.loopend,
+	}, stream)
+	file:close()
+	return self
+end
+
+--- Test whether an object is a stream
+function stream.isstream(t)
+	return getmetatable(t) == stream
+end
+
+-- open a native stream of the file, with the loop settings given or the stream's own
+-- returns the native stream id, or nil if none are available
+function stream:start(loop, loopstart, loopend)
+	if loop == nil then loop, loopstart, loopend = self.loop, self.loopstart, self.loopend end
+	local file, info = sndfile.open(self.path)
+	local ringframes = math.ceil(self.readahead * info.samplerate)
+	local id = lib.av_audio_stream_open(file, read_fn, seek_fn, close_fn, info.frames, info.channels, ringframes, loop and 1 or 0, loopstart or 0, loopend or 0)
+	if id < 0 then return nil end
+	-- the native stream closes the file now:
+	ffi.gc(file, nil)
+	return id
+end
+
+function stream:__tostring()
+	return string.format("stream(%q, %d frames, %d channels)", self.path, self.frames, self.channels)
+end
+
+setmetatable(stream, {
+	__call = function(s, path, options)
+		return stream.open(path, options)
+	end,
+})
+
+return stream
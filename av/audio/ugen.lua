@@ -0,0 +1,177 @@
+--- Native unit generators.
+-- Oscillators and filters that run in the audio thread, processing whole blocks at a time, so that many more of them can play at once than per-sample Lua functions (see dsp.lua).
+-- Each constructor creates a node in the graph; the inputs may be numbers (constants) or other nodes (signals), and can be changed later with node:set(). A node is heard only once it feeds an output, via node:out(). Filter coefficients follow their cutoff/frequency inputs at control rate (every 64 frames).
+-- A node stays in the graph while its handle is alive or another node reads from it; an output node plays until it is freed. Freeing an output node therefore removes the chain feeding it, as the handles of that chain are collected (or freed).
+--
+-- 	local ugen = require "audio.ugen"
+-- 	local saw = ugen.saw(110)
+-- 	local filter = ugen.svf(saw, 800, 4)
+-- 	local o = (filter * 0.2):out(0)
+-- 	o:free()		-- silence
+--
+-- @module audio.ugen
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+-- for the cdefs (and to initialize the graph):
+local driver = require "audio.driver"
+
+local ugen = {}
+
+-- types (AV_AUDIO_UGEN_*) and the names of their inputs:
+local types = {
+	phasor = { 0, "freq" },
+	sine = { 1, "freq" },
+	saw = { 2, "freq", "feedback" },
+	square = { 3, "freq", "feedback" },
+	noise = { 4 },
+	onepole = { 5, "input", "cutoff" },
+	lores = { 6, "input", "cutoff", "res" },
+	svf = { 7, "input", "freq", "q" },
+	biquad = { 8, "input", "a0", "a1", "a2", "b1", "b2" },
+	dcblock = { 9, "input" },
+	add = { 10, "a", "b" },
+	mul = { 11, "a", "b" },
+	out = { 12, "input", "bus" },
+}
+
+--- A node of the native ugen graph
+-- @type node
+local node = {}
+node.__index = node
+
+-- output nodes, which play until freed even once their handles are dropped:
+local playing = {}
+
+-- a handle's hold on its node, released when the handle is collected (or freed):
+local function release(ref)
+	lib.av_audio_ugen_free(ref[0])
+end
+
+local function isnode(v)
+	return getmetatable(v) == node
+end
+
+local function connect(self, k, v)
+	assert(self.ref[0] >= 0, "ugen has been freed")
+	if isnode(v) then
+		assert(v.ref[0] >= 0, "ugen has been freed")
+		lib.av_audio_ugen_input(self.id, k, v.id, v.output, 0)
+	else
+		lib.av_audio_ugen_input(self.id, k, -1, 0, v or 0)
+	end
+end
+
+local function create(name, ...)
+	local t = types[name]
+	local id = lib.av_audio_ugen_new(t[1])
+	if id < 0 then error("no more ugens available") end
+	local ref = ffi.gc(ffi.new("int[1]", id), release)
+	local self = setmetatable({ id = id, ref = ref, output = 0, type = name }, node)
+	-- unspecified inputs keep their defaults:
+	for k = 1, select("#", ...) do
+		local v = select(k, ...)
+		if v ~= nil then connect(self, k-1, v) end
+	end
+	return self
+end
+
+--- Set an input
+-- @param input the input name (e.g. "freq", "cutoff") or index (from 1)
+-- @param value a number, or a node to connect
+-- @return self
+function node:set(input, value)
+	local names = types[self.type]
+	local k = input
+	if type(input) == "string" then
+		for i = 2, #names do
+			if names[i] == input then k = i-1 end
+		end
+		assert(type(k) == "number", "no input named " .. input)
+	end
+	connect(self, k-1, value)
+	return self
+end
+
+--- Send this signal to an output bus
+-- @param bus the output bus (default 0)
+-- @return the output node (free it to stop sending)
+function node:out(bus)
+	local o = create("out", self, bus or 0)
+	playing[o] = true
+	return o
+end
+
+--- Release the node
+-- It leaves the graph at once, unless other nodes still read from it, in which case it leaves once they no longer do. The handle must not be used afterward.
+function node:free()
+	playing[self] = nil
+	local ref = self.ref
+	if ref[0] >= 0 then
+		ffi.gc(ref, nil)
+		release(ref)
+		ref[0] = -1
+	end
+end
+
+function node.__add(a, b) return create("add", a, b) end
+function node.__mul(a, b) return create("mul", a, b) end
+
+function node:__tostring()
+	return string.format("ugen.%s(%d)", self.type, self.id)
+end
+
+--- Phasor: a ramp from 0 to 1 at freq Hz
+function ugen.phasor(freq) return create("phasor", freq) end
+
+--- Sine oscillator
+function ugen.sine(freq) return create("sine", freq) end
+
+--- Band-limited sawtooth oscillator (as blsaw1 in dsp.lua)
+-- @param freq frequency in Hz
+-- @param feedback brightness, 0 to 1 (default 1)
+function ugen.saw(freq, feedback) return create("saw", freq, feedback) end
+
+--- Band-limited square oscillator (as blsqr in dsp.lua)
+-- @param freq frequency in Hz
+-- @param feedback brightness, 0 to 1 (default 1)
+function ugen.square(freq, feedback) return create("square", freq, feedback) end
+
+--- White noise
+function ugen.noise() return create("noise") end
+
+--- One-pole lowpass filter
+function ugen.onepole(input, cutoff) return create("onepole", input, cutoff) end
+
+--- Resonant two-pole lowpass filter
+-- @param res resonance, 0 to 1
+function ugen.lores(input, cutoff, res) return create("lores", input, cutoff, res) end
+
+--- State-variable filter
+-- The node itself is the lowpass output; node.highpass, node.bandpass and node.notch are the other outputs.
+-- @param q resonance, 0.5 to 100
+function ugen.svf(input, freq, q) 
+	local self = create("svf", input, freq, q)
+	-- (sharing the hold of the node itself)
+	self.highpass = setmetatable({ id = self.id, ref = self.ref, output = 1, type = "svf" }, node)
+	self.bandpass = setmetatable({ id = self.id, ref = self.ref, output = 2, type = "svf" }, node)
+	self.notch = setmetatable({ id = self.id, ref = self.ref, output = 3, type = "svf" }, node)
+	return self
+end
+
+--- Biquad filter with explicit coefficients
+function ugen.biquad(input, a0, a1, a2, b1, b2) return create("biquad", input, a0, a1, a2, b1, b2) end
+
+--- DC-blocking filter
+function ugen.dcblock(input) return create("dcblock", input) end
+
+--- Sum of two signals (also a + b)
+function ugen.add(a, b) return create("add", a, b) end
+
+--- Product of two signals (also a * b)
+function ugen.mul(a, b) return create("mul", a, b) end
+
+ugen.isnode = isnode
+
+return ugen
@@ -0,0 +1,70 @@
+--[[
+Runs in the audio-thread Lua state (see av_audio_get in av_audio.cpp).
+
+This state never touches the main/GL loop, so it keeps rendering while draw() 
+or other main-thread work stalls. The main state talks to it only through the
+lock-free message buffer, using audio.send(); each message is a chunk of Lua 
+code (or bytecode) that is run here, between blocks.
+
+A chunk can define a global DSP function, which is called once per audio block:
+
+	function onframes(time, input, output, frames, inchannels, outchannels)
+
+input & output are the device buffers (inchannels & outchannels, after routing), 
+interleaved unless driver.planar is set (in which case channel c starts at 
+output + c*frames); output already holds the main-thread ring and the native 
+voices, so onframes should add into it.
+
+Do not require "audio" here; that module belongs to the main thread.
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+local driver = require "audio.driver"
+
+local format = string.format
+local traceback = debug.traceback
+
+-- scratch memory for incoming messages; grows as needed
+local msgsize = 4096
+local msg = ffi.new("char[?]", msgsize)
+
+local function run_messages()
+	local len = lib.av_audio_msg_peek()
+	while len >= 0 do
+		if len > msgsize then
+			msgsize = len
+			msg = ffi.new("char[?]", msgsize)
+		end
+		lib.av_audio_msg_recv(msg)
+		local f, err = loadstring(ffi.string(msg, len), "audio thread")
+		if f then
+			local ok, res = xpcall(f, traceback)
+			if not ok then err = res end
+		end
+		if err then print(err) end
+		len = lib.av_audio_msg_peek()
+	end
+end
+
+local function onframes(self, time, input, output, frames)
+	run_messages()
+	local dsp = rawget(_G, "onframes")
+	if dsp then
+		local ok, err = pcall(dsp, time, input, output, frames, self.inchannels, self.outchannels)
+		if not ok then
+			-- don't keep failing on every block:
+			print(format("audio thread onframes disabled: %s", err))
+			_G.onframes = nil
+		end
+	end
+end
+
+local audioprocess = {
+	callback = ffi.cast("void (*)(struct av_Audio *, double, float *, float *, int)", onframes),
+}
+driver.onframes = audioprocess.callback
+
+-- returned to package.loaded, which keeps the callback alive for the lifetime of the state:
+return audioprocess
@@ -663,10 +663,14 @@ function field2D:unbind(unit)
 end
 
 
-function field2D.new(dimx, dimy)
+--- Create a field
+-- @param dimx width (optional, defaults to 64)
+-- @param dimy height (optional, defaults to dimx)
+-- @param data pointer to dimx*dimy floats to use rather than allocating (optional; the caller keeps it alive)
+function field2D.new(dimx, dimy, data)
 	dimx = dimx or 64
 	dimy = dimy or dimx
-	local data = ffi.new("float[?]", dimx*dimy)
+	data = data or ffi.new("float[?]", dimx*dimy)
 	
 	return setmetatable({
 		data = data,
@@ -676,7 +680,7 @@ function field2D.new(dimx, dimy)
 		width = dimx,
 		height = dimy,
 		-- size in bytes:
-		size = ffi.sizeof(data),
+		size = dimx*dimy*ffi.sizeof("float"),
 	}, field2D)
 end
 
@@ -5,20 +5,22 @@ local lib = ffi.C
 A low-level API to the av runtime
 
 E.g. for adding callbacks to the main loop
+
+Each callback runs once per period (default 0.005 seconds), and also at any deadline it is
+given, or as soon as it is woken (e.g. by the audio thread); in between, the main thread sleeps.
 --]]
 
 ffi.cdef [[
 	typedef void (*av_run_callback)();
 
-	typedef struct av_run_callback_node {
-		struct av_run_callback_node * next;
-		av_run_callback run;
-	} av_run_callback_node;
-
-	void av_run_insert(av_run_callback cb);
+	int av_run_insert(av_run_callback cb);
+	void av_run_period(int id, double period);
+	void av_run_deadline(int id, double t);
+	void av_run_wake(int id);
 	void av_run_once();
 
 	double av_time();
+	double av_clock();
 	void av_sleep(double s);
 ]]
 
@@ -26,9 +28,28 @@ local cache = {}
 
 local runloop = {}
 
-function runloop.insert(cb)
+-- add a callback, to run every period seconds (0 to run only at deadlines or when woken)
+-- returns its id, for the functions below
+function runloop.insert(cb, period)
 	cache[cb] = true	-- prevent garbage collection
-	lib.av_run_insert(cb)
+	local id = lib.av_run_insert(cb)
+	if period and id >= 0 then lib.av_run_period(id, period) end
+	return id
+end
+
+-- change the period of a callback, counting from now
+function runloop.period(id, period)
+	lib.av_run_period(id, period)
+end
+
+-- run a callback no later than seconds from now
+function runloop.deadline(id, seconds)
+	lib.av_run_deadline(id, lib.av_clock() + seconds)
+end
+
+-- run a callback as soon as possible
+function runloop.wake(id)
+	lib.av_run_wake(id)
 end
 
 function runloop.run_once()
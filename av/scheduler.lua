@@ -3,6 +3,22 @@ local max, min, abs = math.max, math.min, math.abs
 local traceback = debug.traceback
 local format = string.format
 
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+// a timestamped min-heap of integer ids; equal times pop in the order pushed:
+typedef struct av_EventQueue av_EventQueue;
+av_EventQueue * av_eventq_create(int capacity);
+void av_eventq_destroy(av_EventQueue * q);
+int av_eventq_push(av_EventQueue * q, double t, int id);
+double av_eventq_next(av_EventQueue * q);
+int av_eventq_next_id(av_EventQueue * q);
+int av_eventq_pop(av_EventQueue * q);
+int av_eventq_size(av_EventQueue * q);
+void av_eventq_clear(av_EventQueue * q);
+]]
+
 local eventqs = {}	
 
 -- weak map of coroutine to the scheduler/list that contains it:
@@ -20,63 +36,67 @@ function eventq_find(e)
 	return q
 end
 
+-- A scheduler keeps its timed coroutines in slots, indexed by the ids stored in its native 
+-- event queue. Released ids are recycled, so that steady-state waiting doesn't allocate.
+-- A slot holds the coroutine, false if free, or true if the coroutine was cancelled
+-- (its id stays in the queue until it comes due, and is skipped).
+-- The ids map each waiting coroutine back to its slot, so that cancelling one needn't search.
+
 local 
-function dump(q)
-	local m = q.next
-	local i = 1
-	while m and i < 10 do
-		print(i, m.C, m.t, m.C == wincoro)
-		m = m.next
-		i = i + 1
+function sched(q, C, t)
+	local slots, free = q.slots, q.free
+	local n = #free
+	local id
+	if n > 0 then
+		id = free[n]
+		free[n] = nil
+	else
+		id = #slots + 1
+	end
+	slots[id] = C
+	q.ids[C] = id
+	if lib.av_eventq_push(q.queue, t, id) == 0 then
+		error("scheduler: out of memory")
 	end
+	-- store in map:
+	Cmap[C] = q
 end
 
+-- remove the earliest id from the queue, returning its slot's content:
 local 
-function sched(q, m)
-
-	--print("before sched", m.C, m.t, m.C == wincoro, "at", q.t) dump(q)
+function unsched(q)
+	local id = lib.av_eventq_pop(q.queue)
+	local slots, free = q.slots, q.free
+	local C = slots[id]
+	slots[id] = false
+	free[#free+1] = id
+	if C ~= true then q.ids[C] = nil end
+	return C
+end
 
-	local t = m.t
-	-- insertion sort to derive prev & next:
-	local p, n = q, q.next
-	while n and n.t <= t do
-		p = n
-		n = n.next
+-- time of the earliest coroutine due, or nil if there are none
+-- (cancelled entries at the head are discarded along the way):
+local 
+function due(q)
+	local queue, slots = q.queue, q.slots
+	while true do
+		local id = lib.av_eventq_next_id(queue)
+		if id < 0 then return nil end
+		if slots[id] ~= true then 
+			return lib.av_eventq_next(queue)
+		end
+		unsched(q)
 	end
-	
-	-- note: n might be nil (if insertion at tail of list)
-	m.next = n
-	-- p is either the q itself, or a scheduled task within q
-	-- if p == q then we are inserting at the head
-	-- i.e. n == q.next
-	-- note: n might be nil; either way works
-	-- if p ~= q then there is no change to q.next	
-	--assert(p, "queue is corrupt")
-	p.next = m
-	-- print("after sched") dump(q)
 end
 
 local 
 function remove(q, C)
 	if q.t then
-		-- it is a scheduler
-		local p = q.next
-		if p then
-			if p.C == C then
-				-- remove from head:
-				q.next = p.next
-				return
-			else
-				while p do
-					local n = p.next
-					if n and n.C == C then
-						-- remove n:
-						p.next = n.next
-						return
-					end
-					p = n
-				end
-			end
+		-- it is a scheduler; mark its slot as cancelled:
+		local id = q.ids[C]
+		if id then
+			q.slots[id] = true
+			q.ids[C] = nil
 		end
 	else
 		-- it is an event list
@@ -135,7 +155,13 @@ local scheduler = {
 	panic = panic,
 	
 	create = function()
-		local self = { t=0, next=nil }
+		local self = { 
+			t = 0, 
+			queue = ffi.gc(lib.av_eventq_create(64), lib.av_eventq_destroy),
+			slots = {},
+			free = {},
+			ids = {},
+		}
 		
 --[[###Scheduler.cancel : method
 **description** stop a passed coroutine from running  
@@ -159,9 +185,7 @@ local scheduler = {
 		self.wait = function(e)
 			local C = corunning()
 			if type(e) == "number" then
-				sched(self, { C=C, t=self.t+abs(e) } )
-				-- store in map:
-				Cmap[C] = self
+				sched(self, C, self.t+abs(e))
 			elseif type(e) == "string" then
 				local q = eventq_find(e)
 				q[#q+1] = C
@@ -229,9 +253,7 @@ end)`
 			elseif type(e) == "number" then
 				-- ouch; a closure for each go() isn't ideal...
 				local C = coro(function() return func(unpack(args)) end)
-				sched(self, { C=C, t=self.t+e } )
-				-- store in map:
-				Cmap[C] = self
+				sched(self, C, self.t+e)
 				return C
 			else
 				error("bad type for go")
@@ -239,23 +261,21 @@ end)`
 		end
 		
 		self.due = function()
-			local m = self.next
-			return m and m.t or nil
+			return due(self)
 		end
 		
 		-- update the schedule up to time t, invoking only one event:
 		-- returns new self.t
 		self.run_first = function()
-			local m = self.next
-			if m then
-				local t1 = max(self.t, m.t)
-				-- remove from queue:
-				self.next = m.next
-				-- remove from map:
-				Cmap[m.C] = nil
+			local t = due(self)
+			if t then
+				local t1 = max(self.t, t)
+				-- remove from queue & map:
+				local C = unsched(self)
+				Cmap[C] = nil
 				self.t = t1
 				-- resume it:
-				resume(m.C)
+				resume(C)
 				return t1
 			end
 		end
@@ -263,19 +283,15 @@ end)`
 		self.update = function(t, maxtimercallbacks)
 			-- check for pending coros:
 			
-			-- show current stack:
-			--print("||||||||||||||||| update", t) dump(self)
-			
 			local calls = 0
-			local m = self.next
-			while m and m.t < t do
-				self.t = max(self.t, m.t)
-				-- remove from queue:
-				self.next = m.next
-				-- remove from map:
-				Cmap[m.C] = nil
+			local te = due(self)
+			while te and te < t do
+				self.t = max(self.t, te)
+				-- remove from queue & map:
+				local C = unsched(self)
+				Cmap[C] = nil
 				-- resume it:
-				resume(m.C)
+				resume(C)
 				-- continue:
 				calls = calls + 1
 				if maxtimercallbacks and calls > maxtimercallbacks then
@@ -284,7 +300,7 @@ end)`
 					return
 				end
 				-- continue to next item (which may have changed during resume)
-				m = self.next
+				te = due(self)
 			end
 			--print("no more to run", m)
 			self.t = t
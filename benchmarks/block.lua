@@ -0,0 +1,52 @@
+--[[
+Compare the per-sample and block contracts of audio.play (see audio.run),
+by rendering the same sine voices offline in each form.
+
+Run from the repository root, e.g. ./av_linux benchmarks/block.lua
+--]]
+
+local audio = require "audio"
+
+local sin, pi = math.sin, math.pi
+local samplerate = audio.driver.samplerate
+local voices = 32
+local dur = 10
+
+-- one sample per call:
+local function persample(freq)
+	local phase, step = 0, 2 * pi * freq / samplerate
+	return function()
+		phase = phase + step
+		return 0.01 * sin(phase)
+	end
+end
+
+-- a whole (interleaved stereo) block per call:
+local function perblock(freq)
+	local phase, step = 0, 2 * pi * freq / samplerate
+	return function(out, input, frames, channels)
+		for i = 0, frames-1 do
+			phase = phase + step
+			local x = 0.01 * sin(phase)
+			out[i*channels] = x
+			out[i*channels+1] = x
+		end
+	end
+end
+
+local results = {}
+for _, mode in ipairs{ "sample", "block" } do
+	for v = 1, voices do
+		local freq = 100 + 10 * v
+		if mode == "sample" then
+			audio.play(persample(freq), dur)
+		else
+			audio.play(perblock(freq), dur, { block = true })
+		end
+	end
+	results[mode] = audio.render("block.wav", dur, { channels = 2 })
+end
+
+print(string.format("%d voices: per-sample %.1fx realtime, per-block %.1fx realtime (%.1fx faster)", 
+	voices, results.sample, results.block, results.block / results.sample))
+os.remove("block.wav")
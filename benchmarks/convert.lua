@@ -0,0 +1,52 @@
+--[[
+Measure RtAudio's sample conversion between the float32 buffers the audio thread
+works in and the integer formats many devices run natively, comparing the scalar 
+loops with the SSE2 & AVX2 kernels (where this machine supports them).
+
+Run from the repository root, e.g. ./av_linux benchmarks/convert.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_convert_bench(int format, int channels, int planar, int input, int frames, int blocks, int kernels);
+]]
+
+-- RtAudioFormat values:
+local formats = {
+	{ "int16", 0x2 },
+	{ "int24", 0x4 },
+	{ "int32", 0x8 },
+	{ "float32", 0x10 },
+}
+local kernels = { [0] = "scalar loops", "SSE2", "AVX2" }
+
+local blocksize = 256
+local blocks = 20000
+
+print(string.format("%d blocks of %d frames", blocks, blocksize))
+for _, channels in ipairs{ 2, 8 } do
+	for _, planar in ipairs{ 0, 1 } do
+		for _, input in ipairs{ 0, 1 } do
+			for _, format in ipairs(formats) do
+				local name, code = format[1], format[2]
+				-- float32 to float32 only converts if the interleaving changes:
+				if code ~= 0x10 or planar == 1 then
+					local user = (planar == 1 and "planar" or "interleaved") .. " float32"
+					local device = "interleaved " .. name
+					if input == 1 then user, device = device, user end
+					print(string.format("%d channels, %s -> %s:", channels, user, device))
+					local base
+					for k = 0, 2 do
+						local elapsed = lib.av_audio_convert_bench(code, channels, planar, input, blocksize, blocks, k)
+						if elapsed >= 0 then
+							base = base or elapsed
+							print(string.format("\t%-15s %.3f seconds, %.2f ns per sample, %.1fx", kernels[k], elapsed, 1e9 * elapsed / (blocks * blocksize * channels), base / elapsed))
+						end
+					end
+				end
+			end
+		end
+	end
+end
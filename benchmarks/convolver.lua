@@ -0,0 +1,28 @@
+--[[
+Measure the partitioned convolver behind audio.convolver: the cost per partition
+of 256 frames on the audio thread and on the convolution thread, for impulse responses
+from a quarter second to 16 seconds. The audio thread's cost should stay flat.
+
+Run from the repository root, e.g. ./av_linux benchmarks/convolver.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_convolver_bench(int frames, int partition, int blocks, int thread);
+]]
+
+local samplerate = 44100
+local partition = 256
+local blocks = 20000
+
+for _, seconds in ipairs{ 0.25, 0.5, 1, 2, 4, 8, 16 } do
+	local frames = math.floor(seconds * samplerate)
+	local head = lib.av_audio_convolver_bench(frames, partition, blocks, 0)
+	local tail = lib.av_audio_convolver_bench(frames, partition, blocks, 1)
+	-- the share of one core per channel, at samplerate:
+	local rate = samplerate / partition / blocks * 100
+	print(string.format("%5.2f s: audio thread %6.2f us (%.2f%%), convolution thread %7.2f us (%.2f%%)", 
+		seconds, 1e6 * head / blocks, head * rate, 1e6 * tail / blocks, tail * rate))
+end
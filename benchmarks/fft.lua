@@ -0,0 +1,29 @@
+--[[
+Measure the FFT behind audio.spectrum: magnitudes of a real frame, 
+with the scalar passes and with the SSE passes (where this machine supports them).
+
+Run from the repository root, e.g. ./av_linux benchmarks/fft.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_fft_bench(int size, int transforms, int simd);
+]]
+
+local samplerate = 44100
+
+for _, size in ipairs{ 256, 512, 1024, 2048, 4096, 8192, 16384 } do
+	-- about the same amount of signal for each size:
+	local transforms = math.floor(50000000 / size)
+	local scalar = lib.av_audio_fft_bench(size, transforms, 0)
+	local simd = lib.av_audio_fft_bench(size, transforms, 1)
+	local line = string.format("%5d: scalar %7.2f us", size, 1e6 * scalar / transforms)
+	if simd >= 0 then
+		line = line .. string.format(", SSE %7.2f us, %.1fx", 1e6 * simd / transforms, scalar / simd)
+	end
+	-- the share of one core taken by analyzing a channel with a hop of size/4:
+	local best = simd >= 0 and math.min(scalar, simd) or scalar
+	print(line .. string.format(", %.3f%% of a core at hop size/4", 100 * best / transforms * samplerate * 4 / size))
+end
@@ -0,0 +1,47 @@
+--[[
+Measure the throughput of the whole audio stack, by rendering a scripted piece
+(scheduler, Lua voices and native voices) offline with audio.render().
+Running it twice should produce identical files.
+
+Run from the repository root, e.g. ./av_linux benchmarks/render.lua
+--]]
+
+local audio = require "audio"
+local buffer = require "audio.buffer"
+
+local sin, pi = math.sin, math.pi
+local samplerate = audio.driver.samplerate
+
+-- a short decaying tone, for the native voices:
+local ping = buffer(samplerate / 4, 1)
+local i = 0
+ping:write(function()
+	i = i + 1
+	return sin(i * 2 * pi * 880 / samplerate) * (1 - i / ping.frames)
+end)
+
+-- a Lua voice playing a sine for dur seconds:
+local function tone(freq, dur)
+	local phase, step = 0, 2 * pi * freq / samplerate
+	audio.play(function()
+		phase = phase + step
+		return 0.1 * sin(phase)
+	end, dur)
+end
+
+-- a scheduled pattern of both:
+audio.go(function()
+	local n = 0
+	while true do
+		tone(220 * (1 + n % 4), 0.5)
+		for k = 1, 8 do
+			audio.play(ping, nil, { gain = 0.2, pan = (k % 3) - 1, rate = 1 + k / 8 })
+		end
+		n = n + 1
+		audio.wait(0.25)
+	end
+end)
+
+local dur = 60
+local factor = audio.render("render.wav", dur)
+print(string.format("%d seconds rendered at %.1fx realtime", dur, factor))
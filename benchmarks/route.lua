@@ -0,0 +1,26 @@
+--[[
+Measure the cost of the bus/device routing matrix (see audio.route), 
+for the sizes with dedicated kernels and a few without.
+
+Run from the repository root, e.g. ./av_linux benchmarks/route.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_route_bench(int rows, int cols, int blocksize, int blocks);
+]]
+
+local samplerate = 44100
+local blocksize = 256
+local blocks = 20000
+-- duration of the routed audio, in seconds:
+local dur = blocks * blocksize / samplerate
+
+print(string.format("%d blocks of %d frames (%.1f seconds at %d Hz)", blocks, blocksize, dur, samplerate))
+for _, size in ipairs{ {2,2}, {2,8}, {8,2}, {16,16}, {4,4}, {6,2}, {32,32} } do
+	local rows, cols = size[1], size[2]
+	local elapsed = lib.av_audio_route_bench(rows, cols, blocksize, blocks)
+	print(string.format("%2d outputs x %2d inputs: %.3f seconds, %.2f ns per frame, %.0fx realtime", rows, cols, elapsed, 1e9 * elapsed / (blocks * blocksize), dur / elapsed))
+end
@@ -0,0 +1,56 @@
+--[[
+Measure the main loop's timing (see runloop.lua).
+Reports how late a periodic callback runs after it falls due, how soon a callback
+runs after a deadline is set, and how much CPU the main thread uses meanwhile
+(which should be close to none, as it sleeps between callbacks).
+
+Run from the repository root, e.g. ./av_linux benchmarks/runloop.lua [seconds]
+--]]
+
+local runloop = require "runloop"
+local ffi = require "ffi"
+local lib = ffi.C
+
+local period = 0.01
+local seconds = tonumber(arg and arg[1]) or 5
+
+local runs, late_sum, late_max = 0, 0, 0
+local deadlines, deadline_sum, deadline_max = 0, 0, 0
+local deadline_due
+local start_clock, start_cpu, due
+
+-- runs only at the deadlines set below:
+local deadline_id = runloop.insert(function()
+	if not deadline_due then return end
+	local late = lib.av_clock() - deadline_due
+	deadlines = deadlines + 1
+	deadline_sum = deadline_sum + late
+	deadline_max = math.max(deadline_max, late)
+	deadline_due = nil
+end, 0)
+
+runloop.insert(function()
+	local now = lib.av_clock()
+	if not start_clock then
+		start_clock, start_cpu, due = now, os.clock(), now
+	else
+		local late = now - due
+		runs = runs + 1
+		late_sum = late_sum + late
+		late_max = math.max(late_max, late)
+	end
+	due = due + period
+	-- every tenth run, ask for the other callback in 3ms:
+	if runs % 10 == 5 then
+		deadline_due = now + 0.003
+		runloop.deadline(deadline_id, 0.003)
+	end
+	if now - start_clock >= seconds then
+		local elapsed = now - start_clock
+		local cpu = os.clock() - start_cpu
+		print(string.format("%d runs every %.0fms: %.3fms late on average, %.3fms at most", runs, period * 1e3, late_sum * 1e3 / runs, late_max * 1e3))
+		print(string.format("%d deadlines: %.3fms late on average, %.3fms at most", deadlines, deadline_sum * 1e3 / math.max(deadlines, 1), deadline_max * 1e3))
+		print(string.format("main thread CPU: %.2f%% over %.1f seconds", cpu * 100 / elapsed, elapsed))
+		os.exit()
+	end
+end, period)
@@ -0,0 +1,25 @@
+--[[
+Measure drawing a waveform through a buffer's min/max/RMS summary (see buffer:peaks),
+against scanning every sample of each pixel column, for sounds of a few lengths.
+
+Run from the repository root, e.g. ./av_linux benchmarks/summary.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_summary_bench(int frames, int columns, int draws, int scan);
+]]
+
+local samplerate = 44100
+local columns = 800
+local draws = 200
+
+print(string.format("%d draws of %d columns", draws, columns))
+for _, seconds in ipairs{ 1, 10, 60, 600 } do
+	local frames = seconds * samplerate
+	local query = lib.av_audio_summary_bench(frames, columns, draws, 0)
+	local scan = lib.av_audio_summary_bench(frames, columns, draws, 1)
+	print(string.format("%4d seconds: summary %.1f us per draw, scan %.1f us per draw, %.1fx", seconds, 1e6 * query / draws, 1e6 * scan / draws, scan / query))
+end
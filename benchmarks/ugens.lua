@@ -0,0 +1,57 @@
+--[[
+Compare the native ugen graph (see audio.ugen) with the per-sample Lua 
+closures of dsp.lua, reporting how many nodes of each kind one core could 
+run in real time.
+
+Run from the repository root, e.g. ./av_linux benchmarks/ugens.lua
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_ugens_bench(int type, int count, int blocksize, int blocks);
+double av_time();
+]]
+
+require "audio.dsp"
+
+local samplerate = 44100
+local blocksize = 256
+local blocks = 1000
+local count = 64
+-- duration of the rendered audio, in seconds:
+local dur = blocks * blocksize / samplerate
+
+-- native type, and a per-sample Lua equivalent fed by a sawtooth:
+local kinds = {
+	{ "phasor", 0, function() local p = phasor() return function() return p(440) end end },
+	{ "sine", 1, function() local p = phasor() return function() return math.sin(p(440) * 2 * math.pi) end end },
+	{ "saw", 2, function() local o = blsaw1() return function() return o(440) end end },
+	{ "square", 3, function() local o = blsqr() return function() return o(440) end end },
+	{ "onepole", 5, function() local f = onepole() return function(x) return f(x, 1000) end end },
+	{ "lores", 6, function() local f = lores() return function(x) return f(x, 1000, 0.5) end end },
+	{ "svf", 7, function() local f = svf() return function(x) return f(x, 1000, 1) end end },
+	{ "biquad", 8, function() local f = biquad() return function(x) return f(x) end end },
+}
+
+print(string.format("%d nodes for %d blocks of %d frames (%.1f seconds at %d Hz)", count, blocks, blocksize, dur, samplerate))
+for _, kind in ipairs(kinds) do
+	local name, id, make = unpack(kind)
+	
+	local native = lib.av_audio_ugens_bench(id, count, blocksize, blocks)
+	
+	-- the Lua version is slow enough to measure over fewer frames:
+	local frames = blocks * blocksize / 16
+	local src = blsaw1()
+	local fs = {}
+	for i = 1, count do fs[i] = make() end
+	local t0 = lib.av_time()
+	for i = 1, frames do
+		local x = src(110)
+		for j = 1, count do fs[j](x) end
+	end
+	local lua = (lib.av_time() - t0) * 16
+	
+	print(string.format("%-8s native %8.0f per core, Lua %6.0f per core (%.1fx)", name, count * dur / native, count * dur / lua, lua / native))
+end
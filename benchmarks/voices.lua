@@ -0,0 +1,42 @@
+--[[
+Measure the throughput of the native sample-playback voices (see audio.play).
+Reports how many simultaneous voices a single core could mix in real time,
+for each interpolation quality (see player:quality), and then how 256 voices
+scale across threads (see audio.voicethreads).
+
+Run from the repository root, e.g. ./av_linux benchmarks/voices.lua [maxthreads]
+--]]
+
+local ffi = require "ffi"
+local lib = ffi.C
+
+ffi.cdef [[
+double av_audio_voices_bench(int voices, int blocksize, int blocks, int quality, int threads);
+]]
+
+local samplerate = 44100
+local blocksize = 256
+local blocks = 2000
+-- duration of the rendered audio, in seconds:
+local dur = blocks * blocksize / samplerate
+
+print(string.format("%d blocks of %d frames (%.1f seconds at %d Hz)", blocks, blocksize, dur, samplerate))
+for quality = 0, 3 do
+	print(string.format("quality %d:", quality))
+	for _, voices in ipairs{ 1, 8, 32, 64, 128, 256 } do
+		local elapsed = lib.av_audio_voices_bench(voices, blocksize, blocks, quality, 0)
+		print(string.format("%4d voices: %.3f seconds, %.1fx realtime, %.0f voices per core", voices, elapsed, dur / elapsed, voices * dur / elapsed))
+	end
+end
+
+-- scaling, relative to the serial mixer:
+local maxthreads = tonumber(arg and arg[1]) or 8
+for quality = 0, 3 do
+	local serial = lib.av_audio_voices_bench(256, blocksize, blocks, quality, 0)
+	local line = string.format("quality %d, 256 voices, serial %.3f seconds;", quality, serial)
+	for threads = 1, maxthreads do
+		local elapsed = lib.av_audio_voices_bench(256, blocksize, blocks, quality, threads)
+		line = line .. string.format(" %d: %.2fx", threads, serial / elapsed)
+	end
+	print(line)
+end
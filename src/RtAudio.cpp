@@ -7999,6 +7999,468 @@ void RtApi :: setConvertInfo( StreamMode mode, unsigned int firstChannel )
   }
 }
 
+// *************************************************** //
+//
+// Sample conversion kernels.
+//
+// convertBuffer hands the common cases -- float32 user data to or
+// from 16, 24 or 32-bit integer (or float32) device data, with both
+// sides densely interleaved or planar -- to these kernels, which run
+// over whole buffers (or tiles of them, when the interleaving
+// changes) rather than sample by sample through the offset vectors.
+// SSE2 and AVX2 versions are picked at run time; without either,
+// the scalar loops are used throughout.  For samples within -1..1
+// the kernels give the same results as the scalar loops; samples
+// outside that range are clipped rather than wrapped.
+//
+// *************************************************** //
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+  #define RTAUDIO_SSE2 1
+  #include <emmintrin.h>
+  #if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    #define RTAUDIO_AVX2 1
+    #define RTAUDIO_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+    #include <immintrin.h>
+  #elif defined(_MSC_VER)
+    #define RTAUDIO_AVX2 1
+    #define RTAUDIO_TARGET_AVX2
+    #include <intrin.h>
+    #include <immintrin.h>
+  #endif
+#endif
+
+enum { RT_CONVERT_SCALAR, RT_CONVERT_SSE2, RT_CONVERT_AVX2 };
+
+// float32 samples per tile when (de)interleaving:
+#define RT_CONVERT_TILE 1024
+
+struct RtConvertKernels {
+  void (*floatToInt16)( const float *in, signed short *out, unsigned int n );
+  void (*floatToInt32)( const float *in, signed int *out, unsigned int n, double scale );
+  void (*int16ToFloat)( const signed short *in, float *out, unsigned int n );
+  void (*int32ToFloat)( const signed int *in, float *out, unsigned int n, float scale );
+};
+
+static void rtFloatToInt16Scalar( const float *in, signed short *out, unsigned int n )
+{
+  for ( unsigned int i=0; i<n; i++ ) {
+    double x = in[i] > 1.0f ? 1.0 : in[i] < -1.0f ? -1.0 : in[i];
+    out[i] = (signed short) (int) ( x * 32767.5 - 0.5 );
+  }
+}
+
+static void rtFloatToInt32Scalar( const float *in, signed int *out, unsigned int n, double scale )
+{
+  for ( unsigned int i=0; i<n; i++ ) {
+    double x = in[i] > 1.0f ? 1.0 : in[i] < -1.0f ? -1.0 : in[i];
+    out[i] = (signed int) ( x * scale - 0.5 );
+  }
+}
+
+static void rtInt16ToFloatScalar( const signed short *in, float *out, unsigned int n )
+{
+  const float scale = (float) ( 1.0 / 32767.5 );
+  for ( unsigned int i=0; i<n; i++ ) out[i] = ( (float) in[i] + 0.5f ) * scale;
+}
+
+static void rtInt32ToFloatScalar( const signed int *in, float *out, unsigned int n, float scale )
+{
+  for ( unsigned int i=0; i<n; i++ ) out[i] = ( (float) in[i] + 0.5f ) * scale;
+}
+
+#if defined(RTAUDIO_SSE2)
+
+// four float32 samples, clipped, scaled and truncated to int32 in double precision:
+static inline __m128i rtFloatToInt32x4( const float *in, __m128d scale )
+{
+  const __m128d one = _mm_set1_pd( 1.0 ), minusOne = _mm_set1_pd( -1.0 ), half = _mm_set1_pd( 0.5 );
+  __m128 x = _mm_loadu_ps( in );
+  __m128d lo = _mm_min_pd( _mm_max_pd( _mm_cvtps_pd( x ), minusOne ), one );
+  __m128d hi = _mm_min_pd( _mm_max_pd( _mm_cvtps_pd( _mm_movehl_ps( x, x ) ), minusOne ), one );
+  __m128i a = _mm_cvttpd_epi32( _mm_sub_pd( _mm_mul_pd( lo, scale ), half ) );
+  __m128i b = _mm_cvttpd_epi32( _mm_sub_pd( _mm_mul_pd( hi, scale ), half ) );
+  return _mm_unpacklo_epi64( a, b );
+}
+
+static void rtFloatToInt16SSE2( const float *in, signed short *out, unsigned int n )
+{
+  const __m128d scale = _mm_set1_pd( 32767.5 );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m128i a = rtFloatToInt32x4( in + i, scale );
+    __m128i b = rtFloatToInt32x4( in + i + 4, scale );
+    _mm_storeu_si128( (__m128i *) ( out + i ), _mm_packs_epi32( a, b ) );
+  }
+  rtFloatToInt16Scalar( in + i, out + i, n - i );
+}
+
+static void rtFloatToInt32SSE2( const float *in, signed int *out, unsigned int n, double scale )
+{
+  const __m128d vscale = _mm_set1_pd( scale );
+  unsigned int i = 0;
+  for ( ; i+4<=n; i+=4 )
+    _mm_storeu_si128( (__m128i *) ( out + i ), rtFloatToInt32x4( in + i, vscale ) );
+  rtFloatToInt32Scalar( in + i, out + i, n - i, scale );
+}
+
+static void rtInt16ToFloatSSE2( const signed short *in, float *out, unsigned int n )
+{
+  const __m128 scale = _mm_set1_ps( (float) ( 1.0 / 32767.5 ) ), half = _mm_set1_ps( 0.5f );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m128i x = _mm_loadu_si128( (const __m128i *) ( in + i ) );
+    // sign-extend to int32:
+    __m128i lo = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+    __m128i hi = _mm_srai_epi32( _mm_unpackhi_epi16( x, x ), 16 );
+    _mm_storeu_ps( out + i, _mm_mul_ps( _mm_add_ps( _mm_cvtepi32_ps( lo ), half ), scale ) );
+    _mm_storeu_ps( out + i + 4, _mm_mul_ps( _mm_add_ps( _mm_cvtepi32_ps( hi ), half ), scale ) );
+  }
+  rtInt16ToFloatScalar( in + i, out + i, n - i );
+}
+
+static void rtInt32ToFloatSSE2( const signed int *in, float *out, unsigned int n, float scale )
+{
+  const __m128 vscale = _mm_set1_ps( scale ), half = _mm_set1_ps( 0.5f );
+  unsigned int i = 0;
+  for ( ; i+4<=n; i+=4 ) {
+    __m128 x = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i *) ( in + i ) ) );
+    _mm_storeu_ps( out + i, _mm_mul_ps( _mm_add_ps( x, half ), vscale ) );
+  }
+  rtInt32ToFloatScalar( in + i, out + i, n - i, scale );
+}
+
+#endif // RTAUDIO_SSE2
+
+#if defined(RTAUDIO_AVX2)
+
+RTAUDIO_TARGET_AVX2 static inline __m128i rtFloatToInt32x4AVX2( const float *in, __m256d scale )
+{
+  __m256d x = _mm256_cvtps_pd( _mm_loadu_ps( in ) );
+  x = _mm256_min_pd( _mm256_max_pd( x, _mm256_set1_pd( -1.0 ) ), _mm256_set1_pd( 1.0 ) );
+  return _mm256_cvttpd_epi32( _mm256_sub_pd( _mm256_mul_pd( x, scale ), _mm256_set1_pd( 0.5 ) ) );
+}
+
+RTAUDIO_TARGET_AVX2 static void rtFloatToInt16AVX2( const float *in, signed short *out, unsigned int n )
+{
+  const __m256d scale = _mm256_set1_pd( 32767.5 );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m128i a = rtFloatToInt32x4AVX2( in + i, scale );
+    __m128i b = rtFloatToInt32x4AVX2( in + i + 4, scale );
+    _mm_storeu_si128( (__m128i *) ( out + i ), _mm_packs_epi32( a, b ) );
+  }
+  rtFloatToInt16Scalar( in + i, out + i, n - i );
+}
+
+RTAUDIO_TARGET_AVX2 static void rtFloatToInt32AVX2( const float *in, signed int *out, unsigned int n, double scale )
+{
+  const __m256d vscale = _mm256_set1_pd( scale );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m128i a = rtFloatToInt32x4AVX2( in + i, vscale );
+    __m128i b = rtFloatToInt32x4AVX2( in + i + 4, vscale );
+    _mm256_storeu_si256( (__m256i *) ( out + i ), _mm256_inserti128_si256( _mm256_castsi128_si256( a ), b, 1 ) );
+  }
+  rtFloatToInt32Scalar( in + i, out + i, n - i, scale );
+}
+
+RTAUDIO_TARGET_AVX2 static void rtInt16ToFloatAVX2( const signed short *in, float *out, unsigned int n )
+{
+  const __m256 scale = _mm256_set1_ps( (float) ( 1.0 / 32767.5 ) ), half = _mm256_set1_ps( 0.5f );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m256i x = _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i *) ( in + i ) ) );
+    _mm256_storeu_ps( out + i, _mm256_mul_ps( _mm256_add_ps( _mm256_cvtepi32_ps( x ), half ), scale ) );
+  }
+  rtInt16ToFloatScalar( in + i, out + i, n - i );
+}
+
+RTAUDIO_TARGET_AVX2 static void rtInt32ToFloatAVX2( const signed int *in, float *out, unsigned int n, float scale )
+{
+  const __m256 vscale = _mm256_set1_ps( scale ), half = _mm256_set1_ps( 0.5f );
+  unsigned int i = 0;
+  for ( ; i+8<=n; i+=8 ) {
+    __m256 x = _mm256_cvtepi32_ps( _mm256_loadu_si256( (const __m256i *) ( in + i ) ) );
+    _mm256_storeu_ps( out + i, _mm256_mul_ps( _mm256_add_ps( x, half ), vscale ) );
+  }
+  rtInt32ToFloatScalar( in + i, out + i, n - i, scale );
+}
+
+static bool rtHasAVX2( void )
+{
+#if defined(_MSC_VER)
+  int r[4];
+  __cpuid( r, 0 );
+  if ( r[0] < 7 ) return false;
+  __cpuid( r, 1 );
+  // the OS must also save the AVX registers:
+  if ( !( r[2] & ( 1 << 27 ) ) || ( _xgetbv( 0 ) & 6 ) != 6 ) return false;
+  __cpuidex( r, 7, 0 );
+  return ( r[1] & ( 1 << 5 ) ) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "avx2" ) != 0;
+#endif
+}
+
+#endif // RTAUDIO_AVX2
+
+// the best kernels this machine supports:
+static int rtConvertBest( void )
+{
+#if defined(RTAUDIO_AVX2)
+  if ( rtHasAVX2() ) return RT_CONVERT_AVX2;
+#endif
+#if defined(RTAUDIO_SSE2)
+  return RT_CONVERT_SSE2;
+#else
+  return RT_CONVERT_SCALAR;
+#endif
+}
+
+// the kernels in use; -1 until first needed (rtaudioConvertBench may also select them):
+static int rtConvertLevel = -1;
+
+static RtConvertKernels rtConvertKernels( int level )
+{
+  RtConvertKernels k = { rtFloatToInt16Scalar, rtFloatToInt32Scalar, rtInt16ToFloatScalar, rtInt32ToFloatScalar };
+#if defined(RTAUDIO_SSE2)
+  if ( level == RT_CONVERT_SSE2 ) {
+    RtConvertKernels sse2 = { rtFloatToInt16SSE2, rtFloatToInt32SSE2, rtInt16ToFloatSSE2, rtInt32ToFloatSSE2 };
+    k = sse2;
+  }
+#endif
+#if defined(RTAUDIO_AVX2)
+  if ( level == RT_CONVERT_AVX2 ) {
+    RtConvertKernels avx2 = { rtFloatToInt16AVX2, rtFloatToInt32AVX2, rtInt16ToFloatAVX2, rtInt32ToFloatAVX2 };
+    k = avx2;
+  }
+#endif
+  return k;
+}
+
+static RtConvertKernels rtKernels = { rtFloatToInt16Scalar, rtFloatToInt32Scalar, rtInt16ToFloatScalar, rtInt32ToFloatScalar };
+
+static void rtConvertSelect( int level )
+{
+  rtConvertLevel = level;
+  rtKernels = rtConvertKernels( level );
+}
+
+// convert n samples between float32 and another format, densely packed
+static void rtConvertSamples( char *out, RtAudioFormat outFormat, const char *in, RtAudioFormat inFormat, unsigned int n )
+{
+  if ( inFormat == outFormat ) {
+    memcpy( out, in, n * sizeof( float ) );
+  }
+  else if ( inFormat == RTAUDIO_FLOAT32 ) {
+    const float *x = (const float *) in;
+    if ( outFormat == RTAUDIO_SINT16 ) {
+      rtKernels.floatToInt16( x, (signed short *) out, n );
+    }
+    else if ( outFormat == RTAUDIO_SINT32 ) {
+      rtKernels.floatToInt32( x, (signed int *) out, n, 2147483647.5 );
+    }
+    else { // RTAUDIO_SINT24, packed in three bytes
+      signed int tmp[RT_CONVERT_TILE];
+      unsigned char *o = (unsigned char *) out;
+      for ( unsigned int i=0; i<n; i+=RT_CONVERT_TILE ) {
+        unsigned int m = n - i < RT_CONVERT_TILE ? n - i : RT_CONVERT_TILE;
+        rtKernels.floatToInt32( x + i, tmp, m, 8388607.5 );
+        unsigned int j = 0;
+#if defined(RTAUDIO_SSE2)
+        // x86 is little-endian: store four bytes per sample (but not the last), each overlapping the next
+        unsigned int safe = i + m == n ? m - 1 : m;
+        for ( ; j<safe; j++, o+=3 ) memcpy( o, tmp + j, 4 );
+#endif
+        for ( ; j<m; j++, o+=3 ) {
+          o[0] = tmp[j] & 0xff;
+          o[1] = ( tmp[j] >> 8 ) & 0xff;
+          o[2] = ( tmp[j] >> 16 ) & 0xff;
+        }
+      }
+    }
+  }
+  else {
+    float *y = (float *) out;
+    if ( inFormat == RTAUDIO_SINT16 ) {
+      rtKernels.int16ToFloat( (const signed short *) in, y, n );
+    }
+    else if ( inFormat == RTAUDIO_SINT32 ) {
+      rtKernels.int32ToFloat( (const signed int *) in, y, n, (float) ( 1.0 / 2147483647.5 ) );
+    }
+    else { // RTAUDIO_SINT24
+      signed int tmp[RT_CONVERT_TILE];
+      const unsigned char *p = (const unsigned char *) in;
+      for ( unsigned int i=0; i<n; i+=RT_CONVERT_TILE ) {
+        unsigned int m = n - i < RT_CONVERT_TILE ? n - i : RT_CONVERT_TILE;
+        unsigned int j = 0;
+#if defined(RTAUDIO_SSE2)
+        // load four bytes per sample (but not past the last), sign-extending from the top of the three
+        unsigned int safe = i + m == n ? m - 1 : m;
+        for ( ; j<safe; j++, p+=3 ) {
+          signed int v;
+          memcpy( &v, p, 4 );
+          tmp[j] = (signed int) ( (unsigned int) v << 8 ) >> 8;
+        }
+#endif
+        for ( ; j<m; j++, p+=3 ) {
+          signed int v = p[0] | ( p[1] << 8 ) | ( p[2] << 16 );
+          tmp[j] = ( v & 0x800000 ) ? v | ~0xffffff : v;
+        }
+        rtKernels.int32ToFloat( tmp, y + i, m, (float) ( 1.0 / 8388607.5 ) );
+      }
+    }
+  }
+}
+
+// gather m frames of channels planar float32 channels (channel k at in + k*stride) into interleaved frames
+static void rtInterleave( const float *in, unsigned int stride, float *out, int channels, unsigned int m )
+{
+  unsigned int i = 0;
+#if defined(RTAUDIO_SSE2)
+  if ( channels == 2 ) {
+    const float *l = in, *r = in + stride;
+    for ( ; i+4<=m; i+=4 ) {
+      __m128 a = _mm_loadu_ps( l + i ), b = _mm_loadu_ps( r + i );
+      _mm_storeu_ps( out + 2*i, _mm_unpacklo_ps( a, b ) );
+      _mm_storeu_ps( out + 2*i + 4, _mm_unpackhi_ps( a, b ) );
+    }
+  }
+  else if ( channels % 4 == 0 ) {
+    // transpose 4 channels x 4 frames at a time:
+    for ( ; i+4<=m; i+=4 ) {
+      for ( int k=0; k<channels; k+=4 ) {
+        const float *src = in + k * stride + i;
+        __m128 a = _mm_loadu_ps( src ), b = _mm_loadu_ps( src + stride );
+        __m128 c = _mm_loadu_ps( src + 2*stride ), d = _mm_loadu_ps( src + 3*stride );
+        _MM_TRANSPOSE4_PS( a, b, c, d );
+        float *dst = out + i * channels + k;
+        _mm_storeu_ps( dst, a );
+        _mm_storeu_ps( dst + channels, b );
+        _mm_storeu_ps( dst + 2*channels, c );
+        _mm_storeu_ps( dst + 3*channels, d );
+      }
+    }
+  }
+#endif
+  for ( ; i<m; i++ )
+    for ( int k=0; k<channels; k++ ) out[i * channels + k] = in[k * stride + i];
+}
+
+// scatter m interleaved frames of channels float32 channels into planar channels (channel k at out + k*stride)
+static void rtDeinterleave( const float *in, float *out, unsigned int stride, int channels, unsigned int m )
+{
+  unsigned int i = 0;
+#if defined(RTAUDIO_SSE2)
+  if ( channels == 2 ) {
+    float *l = out, *r = out + stride;
+    for ( ; i+4<=m; i+=4 ) {
+      __m128 a = _mm_loadu_ps( in + 2*i ), b = _mm_loadu_ps( in + 2*i + 4 );
+      _mm_storeu_ps( l + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+      _mm_storeu_ps( r + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+    }
+  }
+  else if ( channels % 4 == 0 ) {
+    for ( ; i+4<=m; i+=4 ) {
+      for ( int k=0; k<channels; k+=4 ) {
+        const float *src = in + i * channels + k;
+        __m128 a = _mm_loadu_ps( src ), b = _mm_loadu_ps( src + channels );
+        __m128 c = _mm_loadu_ps( src + 2*channels ), d = _mm_loadu_ps( src + 3*channels );
+        _MM_TRANSPOSE4_PS( a, b, c, d );
+        float *dst = out + k * stride + i;
+        _mm_storeu_ps( dst, a );
+        _mm_storeu_ps( dst + stride, b );
+        _mm_storeu_ps( dst + 2*stride, c );
+        _mm_storeu_ps( dst + 3*stride, d );
+      }
+    }
+  }
+#endif
+  for ( ; i<m; i++ )
+    for ( int k=0; k<channels; k++ ) out[k * stride + i] = in[i * channels + k];
+}
+
+// 1 if the offsets & jump describe densely interleaved channels, 2 if densely planar, else 0
+static int rtConvertLayout( const std::vector<int> &offset, int jump, int channels, unsigned int bufferSize )
+{
+  bool interleaved = ( jump == channels ), planar = ( jump == 1 );
+  for ( int k=0; k<channels; k++ ) {
+    if ( offset[k] != k ) interleaved = false;
+    if ( offset[k] != (int) ( k * bufferSize ) ) planar = false;
+  }
+  return interleaved ? 1 : planar ? 2 : 0;
+}
+
+bool RtApi :: convertBufferFast( char *outBuffer, char *inBuffer, ConvertInfo &info )
+{
+  const RtAudioFormat in = info.inFormat, out = info.outFormat;
+  const RtAudioFormat ints = RTAUDIO_SINT16 | RTAUDIO_SINT24 | RTAUDIO_SINT32;
+  if ( !( ( in == RTAUDIO_FLOAT32 && ( out & ( ints | RTAUDIO_FLOAT32 ) ) ) ||
+          ( out == RTAUDIO_FLOAT32 && ( in & ints ) ) ) ) return false;
+
+  const int channels = info.channels;
+  const unsigned int frames = stream_.bufferSize;
+  const int inLayout = rtConvertLayout( info.inOffset, info.inJump, channels, frames );
+  const int outLayout = rtConvertLayout( info.outOffset, info.outJump, channels, frames );
+  if ( !inLayout || !outLayout || channels < 1 || channels > RT_CONVERT_TILE ) return false;
+
+  if ( rtConvertLevel < 0 ) rtConvertSelect( rtConvertBest() );
+  // without SIMD, the scalar loops below are as quick:
+  if ( rtConvertLevel == RT_CONVERT_SCALAR ) return false;
+
+  if ( inLayout == outLayout ) {
+    rtConvertSamples( outBuffer, out, inBuffer, in, frames * channels );
+    return true;
+  }
+
+  // change the interleaving a tile of frames at a time, in float32:
+  const unsigned int inBytes = formatBytes( in ), outBytes = formatBytes( out );
+  float tile[RT_CONVERT_TILE], planes[RT_CONVERT_TILE];
+  const unsigned int step = RT_CONVERT_TILE / channels;
+  for ( unsigned int f0=0; f0<frames; f0+=step ) {
+    const unsigned int m = frames - f0 < step ? frames - f0 : step;
+    if ( inLayout == 1 ) {
+      // interleaved -> planar:
+      const char *src = inBuffer + f0 * channels * inBytes;
+      const float *x = (const float *) src;
+      if ( in != RTAUDIO_FLOAT32 ) {
+        rtConvertSamples( (char *) tile, RTAUDIO_FLOAT32, src, in, m * channels );
+        x = tile;
+      }
+      if ( out == RTAUDIO_FLOAT32 ) {
+        rtDeinterleave( x, (float *) outBuffer + f0, frames, channels, m );
+      }
+      else {
+        rtDeinterleave( x, planes, m, channels, m );
+        for ( int k=0; k<channels; k++ )
+          rtConvertSamples( outBuffer + ( k * frames + f0 ) * outBytes, out, (const char *) ( planes + k * m ), RTAUDIO_FLOAT32, m );
+      }
+    }
+    else {
+      // planar -> interleaved:
+      const float *x = (const float *) inBuffer + f0;
+      unsigned int stride = frames;
+      if ( in != RTAUDIO_FLOAT32 ) {
+        for ( int k=0; k<channels; k++ )
+          rtConvertSamples( (char *) ( planes + k * m ), RTAUDIO_FLOAT32, inBuffer + ( k * frames + f0 ) * inBytes, in, m );
+        x = planes;
+        stride = m;
+      }
+      char *dst = outBuffer + f0 * channels * outBytes;
+      if ( out == RTAUDIO_FLOAT32 ) {
+        rtInterleave( x, stride, (float *) dst, channels, m );
+      }
+      else {
+        rtInterleave( x, stride, tile, channels, m );
+        rtConvertSamples( dst, out, (const char *) tile, RTAUDIO_FLOAT32, m * channels );
+      }
+    }
+  }
+  return true;
+}
+
 void RtApi :: convertBuffer( char *outBuffer, char *inBuffer, ConvertInfo &info )
 {
   // This function does format conversion, input/output channel compensation, and
@@ -8010,6 +8472,8 @@ void RtApi :: convertBuffer( char *outBuffer, char *inBuffer, ConvertInfo &info
        ( stream_.nDeviceChannels[0] < stream_.nDeviceChannels[1] ) )
     memset( outBuffer, 0, stream_.bufferSize * info.outJump * formatBytes( info.outFormat ) );
 
+  if ( convertBufferFast( outBuffer, inBuffer, info ) ) return;
+
   int j;
   if (info.outFormat == RTAUDIO_FLOAT64) {
     Float64 scale;
@@ -8432,6 +8896,61 @@ void RtApi :: convertBuffer( char *outBuffer, char *inBuffer, ConvertInfo &info
   }
 }
 
+// A stream-less RtApi, for timing convertBuffer.
+class RtApiConvertBench: public RtApi
+{
+public:
+
+  RtAudio::Api getCurrentApi( void ) { return RtAudio::RTAUDIO_DUMMY; }
+  unsigned int getDeviceCount( void ) { return 0; }
+  RtAudio::DeviceInfo getDeviceInfo( unsigned int /*device*/ ) { RtAudio::DeviceInfo info; return info; }
+  void startStream( void ) {}
+  void stopStream( void ) {}
+  void abortStream( void ) {}
+
+  double run( RtAudioFormat deviceFormat, unsigned int channels, bool userPlanar, bool input,
+              unsigned int frames, unsigned int blocks, double (*clock)( void ) )
+  {
+    StreamMode mode = input ? INPUT : OUTPUT;
+    stream_.mode = mode;
+    stream_.bufferSize = frames;
+    stream_.userFormat = RTAUDIO_FLOAT32;
+    stream_.deviceFormat[mode] = deviceFormat;
+    stream_.nUserChannels[mode] = channels;
+    stream_.nDeviceChannels[mode] = channels;
+    stream_.userInterleaved = !userPlanar;
+    stream_.deviceInterleaved[mode] = true;
+    setConvertInfo( mode, 0 );
+
+    std::vector<float> user( frames * channels );
+    std::vector<char> device( frames * channels * formatBytes( deviceFormat ) );
+    for ( unsigned int i=0; i<user.size(); i++ )
+      user[i] = ( ( i * 7919 ) % 2000 ) / 1000.0f - 1.0f;
+    for ( unsigned int i=0; i<device.size(); i++ )
+      device[i] = (char) ( i * 31 );
+
+    char *in = input ? &device[0] : (char *) &user[0];
+    char *out = input ? (char *) &user[0] : &device[0];
+    double t0 = clock();
+    for ( unsigned int b=0; b<blocks; b++ )
+      convertBuffer( out, in, stream_.convertInfo[mode] );
+    return clock() - t0;
+  }
+};
+
+double rtaudioConvertBench( RtAudioFormat deviceFormat, unsigned int channels, bool userPlanar, bool input,
+                            unsigned int frames, unsigned int blocks, int kernels, double (*clock)( void ) )
+{
+  if ( kernels < 0 || kernels > rtConvertBest() || channels < 1 || frames < 1 ) return -1.0;
+  int level = rtConvertLevel;
+  rtConvertSelect( kernels );
+  RtApiConvertBench api;
+  double elapsed = api.run( deviceFormat, channels, userPlanar, input, frames, blocks, clock );
+  if ( level >= 0 ) rtConvertSelect( level );
+  else rtConvertLevel = -1;
+  return elapsed;
+}
+
 //static inline uint16_t bswap_16(uint16_t x) { return (x>>8) | (x<<8); }
 //static inline uint32_t bswap_32(uint32_t x) { return (bswap_16(x&0xffff)<<16) | (bswap_16(x>>16)); }
 //static inline uint64_t bswap_64(uint64_t x) { return (((unsigned long long)bswap_32(x&0xffffffffull))<<32) | (bswap_32(x>>32)); }
@@ -743,6 +743,13 @@ protected:
   */
   void convertBuffer( char *outBuffer, char *inBuffer, ConvertInfo &info );
 
+  /*!
+    Protected method that hands the common conversions (float32 user data to or
+    from dense integer or float32 device data) to SIMD kernels.  Returns false if
+    convertBuffer must do the conversion itself.
+  */
+  bool convertBufferFast( char *outBuffer, char *inBuffer, ConvertInfo &info );
+
   //! Protected common method used to perform byte-swapping on buffers.
   void byteSwapBuffer( char *buffer, unsigned int samples, RtAudioFormat format );
 
@@ -753,6 +760,17 @@ protected:
   void setConvertInfo( StreamMode mode, unsigned int firstChannel );
 };
 
+/*!
+  Times RtApi::convertBuffer over blocks buffers of frames frames, between float32 user
+  data (interleaved, or planar if userPlanar) and interleaved device data of the given
+  format, in the input direction if input (device to user), else the output direction.
+  kernels selects the conversion code: 0 for the scalar loops, 1 for the SSE2
+  kernels or 2 for the AVX2 kernels.  Returns the elapsed time according to clock()
+  (in its units), or -1 if the kernels are not available on this machine.
+*/
+double rtaudioConvertBench( RtAudioFormat deviceFormat, unsigned int channels, bool userPlanar, bool input,
+                            unsigned int frames, unsigned int blocks, int kernels, double (*clock)( void ) );
+
 // **************************************************************** //
 //
 // Inline RtAudio definitions.
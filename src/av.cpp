@@ -2,10 +2,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "av.hpp"
 #include "RtAudio.h"
 
+#ifdef AV_OSX
+	#include <mach/mach_time.h>
+#endif
+#ifdef AV_LINUX
+	#include <stdint.h>
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <sys/timerfd.h>
+#endif
+
 // whether we are using GLUT mainloop:
 int using_glut_mainloop = 0;
 
@@ -186,27 +197,21 @@ HMODULE dll(const char * name) {
 }
 #endif
 
-int initlua(int argc, char * argv[]) {
-	L = lua_open();
-	DEBUG_PRINTF("L %p\n", L);
-	if (!L) return -1;
-	luaL_openlibs(L);
+// create a Lua state with the standard libraries, and the av modules on the search path
+// (used for the main state, and for the audio-thread state)
+lua_State * av_init_lua() {
+	lua_State * state = lua_open();
+	DEBUG_PRINTF("state %p\n", state);
+	if (!state) return 0;
+	luaL_openlibs(state);
 	
-	lua_getglobal(L, "package");
-    lua_getfield(L, -1, "preload");
-    //lua_pushcfunction(L, luaopen_pack); lua_setfield(L, -2, "pack");
-    lua_pop(L, 2);
+	lua_getglobal(state, "package");
+    lua_getfield(state, -1, "preload");
+    //lua_pushcfunction(state, luaopen_pack); lua_setfield(state, -2, "pack");
+    lua_pop(state, 2);
 	
 	DEBUG_PRINTF("opened libs\n");
 	
-	lua_createtable(L, argc, 0);
-	for (int i=0; i<argc; i++) {
-		lua_pushstring(L, argv[i]); lua_rawseti(L, -2, i);
-	}
-	lua_setglobal(L, "arg");
-	
-	DEBUG_PRINTF("set arg\n");
-	
 	#define initscriptsize 100000
 	char initscript[initscriptsize];
 	#ifdef AV_WINDOWS 
@@ -215,7 +220,27 @@ int initlua(int argc, char * argv[]) {
 		AV_SNPRINTF(initscript, initscriptsize, "package.path = [[%sav/?.lua;%sav/?/init.lua;]] .. package.path; package.cpath = [[%sav/?.so;]] .. package.cpath", apppath, apppath, apppath);
 	#endif
 	DEBUG_PRINTF("initscript %s\n", initscript);
-	return dostring(initscript);
+	if (luaL_dostring(state, initscript)) {
+		fprintf(stderr, "initscript: %s\n", lua_tostring(state, -1));
+		lua_close(state);
+		return 0;
+	}
+	return state;
+}
+
+int initlua(int argc, char * argv[]) {
+	L = av_init_lua();
+	DEBUG_PRINTF("L %p\n", L);
+	if (!L) return -1;
+	
+	lua_createtable(L, argc, 0);
+	for (int i=0; i<argc; i++) {
+		lua_pushstring(L, argv[i]); lua_rawseti(L, -2, i);
+	}
+	lua_setglobal(L, "arg");
+	
+	DEBUG_PRINTF("set arg\n");
+	return 0;
 }
 
 
@@ -275,6 +300,33 @@ AV_EXPORT double av_time() {
 		return (double)t.tv_sec + (((double)t.tv_usec) * 1.0e-6);
 }	
 
+// monotonic, high-resolution seconds from an arbitrary origin; for measuring intervals:
+AV_EXPORT double av_clock() {
+	#ifdef AV_WINDOWS
+		static double period = 0.;
+		LARGE_INTEGER t;
+		if (period == 0.) {
+			LARGE_INTEGER f;
+			QueryPerformanceFrequency(&f);
+			period = 1. / (double)f.QuadPart;
+		}
+		QueryPerformanceCounter(&t);
+		return (double)t.QuadPart * period;
+	#elif defined(AV_OSX)
+		static double period = 0.;
+		if (period == 0.) {
+			mach_timebase_info_data_t info;
+			mach_timebase_info(&info);
+			period = 1.0e-9 * (double)info.numer / (double)info.denom;
+		}
+		return (double)mach_absolute_time() * period;
+	#else
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (double)t.tv_sec + (((double)t.tv_nsec) * 1.0e-9);
+	#endif
+}
+
 AV_EXPORT void av_sleep(double seconds) {
 	#ifdef AV_WINDOWS
 		Sleep((DWORD)(seconds * 1.0e3));
@@ -288,29 +340,303 @@ AV_EXPORT void av_sleep(double seconds) {
 	#endif
 }
 
+/*
+	Timestamped event queue: a binary min-heap of (time, id) pairs for the schedulers.
+	Events due at the same time pop in the order they were pushed.
+	Storage only grows (by doubling), so a queue that has reached its working size
+	never allocates again.
+*/
+
+typedef struct av_Event {
+	double t;
+	unsigned int seq;
+	int id;
+} av_Event;
+
+typedef struct av_EventQueue {
+	av_Event * heap;
+	int size, capacity;
+	unsigned int seq;
+} av_EventQueue;
+
+static inline bool av_event_before(const av_Event& a, const av_Event& b) {
+	// seq comparison is wraparound-safe:
+	return a.t < b.t || (a.t == b.t && (int)(a.seq - b.seq) < 0);
+}
+
+AV_EXPORT av_EventQueue * av_eventq_create(int capacity) {
+	av_EventQueue * q = (av_EventQueue *)calloc(1, sizeof(av_EventQueue));
+	if (!q) return 0;
+	q->capacity = capacity > 0 ? capacity : 64;
+	q->heap = (av_Event *)malloc(sizeof(av_Event) * q->capacity);
+	if (!q->heap) { free(q); return 0; }
+	return q;
+}
+
+AV_EXPORT void av_eventq_destroy(av_EventQueue * q) {
+	if (!q) return;
+	free(q->heap);
+	free(q);
+}
+
+// returns 0 if the queue could not grow
+AV_EXPORT int av_eventq_push(av_EventQueue * q, double t, int id) {
+	if (q->size == q->capacity) {
+		av_Event * heap = (av_Event *)realloc(q->heap, sizeof(av_Event) * q->capacity * 2);
+		if (!heap) return 0;
+		q->heap = heap;
+		q->capacity *= 2;
+	}
+	av_Event e;
+	e.t = t;
+	e.seq = q->seq++;
+	e.id = id;
+	// sift up:
+	int i = q->size++;
+	while (i > 0) {
+		int p = (i - 1) / 2;
+		if (!av_event_before(e, q->heap[p])) break;
+		q->heap[i] = q->heap[p];
+		i = p;
+	}
+	q->heap[i] = e;
+	return 1;
+}
+
+// time of the earliest event, or HUGE_VAL if the queue is empty
+AV_EXPORT double av_eventq_next(av_EventQueue * q) {
+	return q->size ? q->heap[0].t : HUGE_VAL;
+}
+
+// id of the earliest event, or -1 if the queue is empty
+AV_EXPORT int av_eventq_next_id(av_EventQueue * q) {
+	return q->size ? q->heap[0].id : -1;
+}
+
+// removes the earliest event and returns its id, or -1 if the queue is empty
+AV_EXPORT int av_eventq_pop(av_EventQueue * q) {
+	if (!q->size) return -1;
+	int id = q->heap[0].id;
+	av_Event e = q->heap[--q->size];
+	int n = q->size;
+	// sift down:
+	int i = 0;
+	while (true) {
+		int c = 2*i + 1;
+		if (c >= n) break;
+		if (c + 1 < n && av_event_before(q->heap[c + 1], q->heap[c])) c++;
+		if (!av_event_before(q->heap[c], e)) break;
+		q->heap[i] = q->heap[c];
+		i = c;
+	}
+	q->heap[i] = e;
+	return id;
+}
+
+AV_EXPORT int av_eventq_size(av_EventQueue * q) {
+	return q->size;
+}
+
+AV_EXPORT void av_eventq_clear(av_EventQueue * q) {
+	q->size = 0;
+}
+
+/*
+	Runloop.
+	
+	Each callback registered with the runloop has a period, and a time at which it is next due;
+	an event queue of the due times picks whichever callback is due next, and the main thread 
+	sleeps until then, rather than polling every callback at one fixed rate. Any thread can 
+	also wake a callback early with av_run_wake, as the audio thread does when its ring runs low. 
+	On Linux the main thread sleeps in epoll, on a timerfd armed for the next due time and an 
+	eventfd for the wakeups; elsewhere, in a timed wait on a semaphore.
+	Times are in seconds of av_clock().
+*/
+
 typedef void (*av_run_callback)();
 
-typedef struct av_run_callback_node {
-	struct av_run_callback_node * next;
+typedef struct av_RunCallback {
 	av_run_callback run;
-} av_run_callback_node;
+	double period;			// seconds between runs; 0 to run only at deadlines or when woken
+	double due;				// when it next runs, or HUGE_VAL for never
+	volatile int woken;
+} av_RunCallback;
+
+#define AV_RUN_MAX_CALLBACKS 64
 
-static av_run_callback_node * av_runloop_first = 0;
+// the period of callbacks that don't set their own, as the runloop used to poll:
+#define AV_RUN_PERIOD_DEFAULT 0.005
 
-AV_EXPORT void av_run_insert(av_run_callback cb) {
-	av_run_callback_node * node = (av_run_callback_node *)malloc(sizeof(av_run_callback_node));
-	node->run = cb;
-	node->next = av_runloop_first;
-	av_runloop_first = node;
+// (a fixed array, so that other threads can wake callbacks while more are added)
+static av_RunCallback runloop[AV_RUN_MAX_CALLBACKS];
+static volatile int runloop_count = 0;
+// due times of the callbacks, by id; entries for times since changed are stale, and skipped:
+static av_EventQueue * runloop_queue = 0;
+
+#ifdef AV_LINUX
+	static int runloop_epoll = -1;
+	static int runloop_timer = -1;
+	static int runloop_event = -1;
+#else
+	static av_semaphore runloop_signal;
+#endif
+
+static void av_run_init() {
+	runloop_queue = av_eventq_create(AV_RUN_MAX_CALLBACKS);
+	#ifdef AV_LINUX
+		runloop_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		runloop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		runloop_epoll = epoll_create(2);
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = runloop_timer;
+		int ok = runloop_timer >= 0 && runloop_event >= 0 && runloop_epoll >= 0
+			&& epoll_ctl(runloop_epoll, EPOLL_CTL_ADD, runloop_timer, &ev) == 0;
+		ev.data.fd = runloop_event;
+		ok = ok && epoll_ctl(runloop_epoll, EPOLL_CTL_ADD, runloop_event, &ev) == 0;
+		if (!ok) {
+			// fall back to sleeping in short steps:
+			fprintf(stderr, "unable to create the runloop timer; polling instead\n");
+			if (runloop_epoll >= 0) close(runloop_epoll);
+			if (runloop_timer >= 0) close(runloop_timer);
+			if (runloop_event >= 0) close(runloop_event);
+			runloop_epoll = runloop_timer = runloop_event = -1;
+		}
+	#else
+		av_semaphore_init(&runloop_signal);
+	#endif
 }
 
-// mainloop:
+// add a callback, first due at once; returns its id, or -1 if there are too many
+AV_EXPORT int av_run_insert(av_run_callback cb) {
+	int id = runloop_count;
+	if (id >= AV_RUN_MAX_CALLBACKS) {
+		fprintf(stderr, "too many runloop callbacks\n");
+		return -1;
+	}
+	if (!runloop_queue) av_run_init();
+	av_RunCallback& c = runloop[id];
+	c.run = cb;
+	c.period = AV_RUN_PERIOD_DEFAULT;
+	c.due = av_clock();
+	c.woken = 0;
+	av_eventq_push(runloop_queue, c.due, id);
+	// (publishes it to av_run_wake)
+	av_atomic_store(&runloop_count, id + 1);
+	return id;
+}
+
+// set the seconds between runs of a callback (0 for none), counting from now
+AV_EXPORT void av_run_period(int id, double period) {
+	if (id < 0 || id >= runloop_count) return;
+	av_RunCallback& c = runloop[id];
+	c.period = period > 0. ? period : 0.;
+	c.due = period > 0. ? av_clock() + period : HUGE_VAL;
+	if (c.due != HUGE_VAL) av_eventq_push(runloop_queue, c.due, id);
+}
+
+// run a callback no later than time t (of av_clock)
+AV_EXPORT void av_run_deadline(int id, double t) {
+	if (id < 0 || id >= runloop_count) return;
+	av_RunCallback& c = runloop[id];
+	if (t < c.due) {
+		c.due = t;
+		av_eventq_push(runloop_queue, t, id);
+	}
+}
+
+AV_EXPORT void av_run_wake(int id) {
+	if (id < 0 || id >= av_atomic_load(&runloop_count)) return;
+	av_atomic_store(&runloop[id].woken, 1);
+	#ifdef AV_LINUX
+		if (runloop_event >= 0) {
+			uint64_t one = 1;
+			if (write(runloop_event, &one, sizeof(one)) < 0) {}
+		}
+	#else
+		av_semaphore_post(&runloop_signal);
+	#endif
+}
+
+// run a callback, having scheduled its next run at base + period
+// (first, so that the callback can move it)
+static void av_run_call(int id, double base, double now) {
+	av_RunCallback& c = runloop[id];
+	if (c.period > 0.) {
+		double next = base + c.period;
+		// if it fell behind, skip the runs it missed rather than bunching them:
+		if (next <= now) next = now + c.period;
+		c.due = next;
+		av_eventq_push(runloop_queue, next, id);
+	} else {
+		c.due = HUGE_VAL;
+	}
+	c.run();
+}
+
+// run the callbacks that are due, or have been woken, each at most once
+// returns the time the next is due, or HUGE_VAL if none is
+AV_EXPORT double av_run_due() {
+	if (!runloop_queue) return HUGE_VAL;
+	double now = av_clock();
+	for (int id=0; id<runloop_count; id++) {
+		if (runloop[id].woken && av_atomic_cas(&runloop[id].woken, 1, 0)) {
+			// a wakeup postpones the next periodic run:
+			av_run_call(id, now, now);
+		}
+	}
+	while (av_eventq_next(runloop_queue) <= now) {
+		double t = av_eventq_next(runloop_queue);
+		int id = av_eventq_pop(runloop_queue);
+		if (t == runloop[id].due) av_run_call(id, t, now);
+	}
+	// drop stale entries, so that the next due time is a real one:
+	while (av_eventq_size(runloop_queue)) {
+		int id = av_eventq_next_id(runloop_queue);
+		if (av_eventq_next(runloop_queue) == runloop[id].due) break;
+		av_eventq_pop(runloop_queue);
+	}
+	return av_eventq_next(runloop_queue);
+}
+
+// sleep until time t (of av_clock), or until a callback is woken
+static void av_run_wait(double t) {
+	double now = av_clock();
+	for (int id=0; id<runloop_count; id++) {
+		if (runloop[id].woken) return;
+	}
+	if (t <= now) return;
+	#ifdef AV_LINUX
+		if (runloop_epoll < 0) {
+			av_sleep(t - now < AV_RUN_PERIOD_DEFAULT ? t - now : AV_RUN_PERIOD_DEFAULT);
+			return;
+		}
+		// an absolute deadline on the same clock as av_clock (or disarmed, if nothing is due):
+		itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		if (t != HUGE_VAL) {
+			spec.it_value.tv_sec = (time_t)t;
+			spec.it_value.tv_nsec = (long)((t - (double)spec.it_value.tv_sec) * 1.0e9);
+			if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+		}
+		timerfd_settime(runloop_timer, TFD_TIMER_ABSTIME, &spec, NULL);
+		epoll_event events[2];
+		int n = epoll_wait(runloop_epoll, events, 2, -1);
+		for (int i=0; i<n; i++) {
+			uint64_t count;
+			if (read(events[i].data.fd, &count, sizeof(count)) < 0) {}
+		}
+	#else
+		// (at most a second at a time, since a timed wait can't wait forever)
+		av_semaphore_timedwait(&runloop_signal, t - now < 1. ? t - now : 1.);
+	#endif
+}
+
+// run every callback once, whether due or not:
 AV_EXPORT void av_run_once() {
-	// visit all registered watchers:
-	av_run_callback_node * cb = av_runloop_first;
-	while (cb) {
-		cb->run();
-		cb = cb->next;
+	for (int id=0; id<runloop_count; id++) {
+		runloop[id].run();
 	}
 }
 
@@ -320,8 +646,10 @@ AV_EXPORT void av_use_glut() {
 
 AV_EXPORT void av_glut_timerfunc(int id) {
 	// call back into mainloop
-	av_run_once();
-	glutTimerFunc(1000/60., av_glut_timerfunc, id);
+	double wait = av_run_due() - av_clock();
+	// (GLUT can't be woken early, so come back at least once per frame)
+	unsigned int ms = wait < 0. ? 0 : wait > 1./60. ? 1000/60 : (unsigned int)(wait * 1.0e3);
+	glutTimerFunc(ms, av_glut_timerfunc, id);
 }
 						
 int main(int argc, char * argv[]) {
@@ -352,11 +680,9 @@ int main(int argc, char * argv[]) {
 	if (using_glut_mainloop) {
 		glutMainLoop();
 	} else { 
-		while (av_runloop_first) {
-			av_run_once();
-			
-			// sleep a little:
-			av_sleep(0.005);
+		// run each callback as it comes due, sleeping in between:
+		while (runloop_count) {
+			av_run_wait(av_run_due());
 		}
 	}
 	
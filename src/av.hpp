@@ -44,6 +44,156 @@
 	#define AV_SNPRINTF snprintf
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
+// typical cache line size; used to keep data shared between threads apart:
+#define AV_CACHELINE 64
+
+// alignment of sample buffers, wide enough for AVX loads & stores:
+#define AV_SIMD_ALIGN 32
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define AV_SSE 1
+	#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define AV_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+// zeroed memory aligned to AV_SIMD_ALIGN; release with av_aligned_free()
+inline void * av_aligned_calloc(size_t count, size_t size) {
+	size_t bytes = count * size;
+	void * p = 0;
+	#ifdef AV_WINDOWS
+		p = _aligned_malloc(bytes, AV_SIMD_ALIGN);
+	#else
+		if (posix_memalign(&p, AV_SIMD_ALIGN, bytes)) p = 0;
+	#endif
+	if (p) memset(p, 0, bytes);
+	return p;
+}
+
+inline void av_aligned_free(void * p) {
+	#ifdef AV_WINDOWS
+		_aligned_free(p);
+	#else
+		free(p);
+	#endif
+}
+
+// minimal atomics for lock-free exchange between the main & audio threads
+// (kept as plain ints so that the same fields remain visible via the FFI)
+#ifdef AV_WINDOWS
+	#include <intrin.h>
+	// on x86 MSVC, volatile accesses already have acquire/release semantics:
+	inline int av_atomic_load(volatile int * p) { int v = *p; _ReadWriteBarrier(); return v; }
+	inline void av_atomic_store(volatile int * p, int v) { _ReadWriteBarrier(); *p = v; }
+	inline int av_atomic_add(volatile int * p, int v) { return _InterlockedExchangeAdd((volatile long *)p, v); }
+	inline bool av_atomic_cas(volatile int * p, int expected, int v) { return _InterlockedCompareExchange((volatile long *)p, v, expected) == expected; }
+#else
+	inline int av_atomic_load(volatile int * p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+	inline void av_atomic_store(volatile int * p, int v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+	inline int av_atomic_add(volatile int * p, int v) { return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL); }
+	inline bool av_atomic_cas(volatile int * p, int expected, int v) { return __atomic_compare_exchange_n(p, &expected, v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+#endif
+
+
+// minimal portable threads:
+typedef void * (*av_thread_func)(void * arg);
+
+#ifdef AV_WINDOWS
+	typedef HANDLE av_thread;
+	
+	struct av_thread_start { av_thread_func func; void * arg; };
+	
+	inline DWORD WINAPI av_thread_proc(LPVOID p) {
+		av_thread_start start = *(av_thread_start *)p;
+		delete (av_thread_start *)p;
+		start.func(start.arg);
+		return 0;
+	}
+	
+	// returns 0 on success
+	inline int av_thread_create(av_thread * t, av_thread_func func, void * arg) {
+		av_thread_start * start = new av_thread_start;
+		start->func = func;
+		start->arg = arg;
+		*t = CreateThread(NULL, 0, av_thread_proc, start, 0, NULL);
+		if (*t == NULL) { delete start; return -1; }
+		return 0;
+	}
+	
+	inline void av_thread_join(av_thread t) {
+		WaitForSingleObject(t, INFINITE);
+		CloseHandle(t);
+	}
+	
+	inline void av_thread_yield() { SwitchToThread(); }
+#else
+	#include <pthread.h>
+	#include <sched.h>
+	typedef pthread_t av_thread;
+	
+	// returns 0 on success
+	inline int av_thread_create(av_thread * t, av_thread_func func, void * arg) {
+		return pthread_create(t, NULL, func, arg);
+	}
+	
+	inline void av_thread_join(av_thread t) {
+		pthread_join(t, NULL);
+	}
+	
+	inline void av_thread_yield() { sched_yield(); }
+#endif
+
+// counting semaphores, for waking worker threads (post is safe to call from the audio thread):
+// (timedwait returns after at most seconds, whether posted or not)
+#if defined(AV_WINDOWS)
+	typedef HANDLE av_semaphore;
+	
+	// returns 0 on success
+	inline int av_semaphore_init(av_semaphore * s) {
+		*s = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+		return *s == NULL ? -1 : 0;
+	}
+	inline void av_semaphore_post(av_semaphore * s) { ReleaseSemaphore(*s, 1, NULL); }
+	inline void av_semaphore_wait(av_semaphore * s) { WaitForSingleObject(*s, INFINITE); }
+	inline void av_semaphore_timedwait(av_semaphore * s, double seconds) { WaitForSingleObject(*s, (DWORD)(seconds * 1.0e3)); }
+	inline void av_semaphore_destroy(av_semaphore * s) { CloseHandle(*s); }
+#elif defined(AV_OSX)
+	// (OS X doesn't implement unnamed POSIX semaphores)
+	#include <dispatch/dispatch.h>
+	typedef dispatch_semaphore_t av_semaphore;
+	
+	inline int av_semaphore_init(av_semaphore * s) {
+		*s = dispatch_semaphore_create(0);
+		return *s == NULL ? -1 : 0;
+	}
+	inline void av_semaphore_post(av_semaphore * s) { dispatch_semaphore_signal(*s); }
+	inline void av_semaphore_wait(av_semaphore * s) { dispatch_semaphore_wait(*s, DISPATCH_TIME_FOREVER); }
+	inline void av_semaphore_timedwait(av_semaphore * s, double seconds) { dispatch_semaphore_wait(*s, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(seconds * 1.0e9))); }
+	inline void av_semaphore_destroy(av_semaphore * s) { dispatch_release(*s); }
+#else
+	#include <semaphore.h>
+	#include <errno.h>
+	typedef sem_t av_semaphore;
+	
+	inline int av_semaphore_init(av_semaphore * s) { return sem_init(s, 0, 0); }
+	inline void av_semaphore_post(av_semaphore * s) { sem_post(s); }
+	inline void av_semaphore_wait(av_semaphore * s) { while (sem_wait(s) && errno == EINTR) {} }
+	inline void av_semaphore_timedwait(av_semaphore * s, double seconds) {
+		// (sem_timedwait takes an absolute time of the realtime clock)
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		long long nsec = t.tv_nsec + (long long)(seconds * 1.0e9);
+		t.tv_sec += (time_t)(nsec / 1000000000LL);
+		t.tv_nsec = (long)(nsec % 1000000000LL);
+		while (sem_timedwait(s, &t) && errno == EINTR) {}
+	}
+	inline void av_semaphore_destroy(av_semaphore * s) { sem_destroy(s); }
+#endif
 
 extern "C" {
 	#include "lua.h"
@@ -52,4 +202,12 @@ extern "C" {
 	#include "luajit.h"
 }
 
+// implemented in av.cpp:
+AV_EXPORT double av_time();
+AV_EXPORT double av_clock();
+AV_EXPORT void av_sleep(double seconds);
+// run a runloop callback as soon as possible; safe to call from any thread:
+AV_EXPORT void av_run_wake(int id);
+lua_State * av_init_lua();
+
 #endif // AV_HPP
\ No newline at end of file
@@ -3,41 +3,4879 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <cstddef>
+
+#ifndef AV_WINDOWS
+	#include <sys/mman.h>
+	#include <fcntl.h>
+#endif
+
+// a lock-free byte queue of length-prefixed messages, from the main thread to the audio thread:
+typedef struct av_msgbuffer {
+	int size;
+	char pad0[AV_CACHELINE - sizeof(int)];
+	volatile int read;			// written by the audio thread only
+	char pad1[AV_CACHELINE - sizeof(int)];
+	volatile int write;			// written by the main thread only
+	char pad2[AV_CACHELINE - sizeof(int)];
+	unsigned char * data;
+} av_msgbuffer;
 
 typedef struct av_Audio {
 	unsigned int blocksize;
 	unsigned int frames;	
 	unsigned int indevice, outdevice;
-	unsigned int inchannels, outchannels;		
+	unsigned int inchannels, outchannels;		// of the devices
+	unsigned int inbuses, outbuses;			// of the rings
 	
 	double time;					// in seconds
 	double samplerate;				// in samples
 	double latency_seconds;			// in seconds
 	
-	// a big buffer for main-thread audio generation
-	float * buffer;
-	float * inbuffer;
+	// a big buffer for main-thread audio generation
+	float * buffer;
+	float * inbuffer;
+	
+	int blocks, blockstep;
+	int block_io_latency, fill;
+	int underruns, overruns;
+	
+	// if nonzero, each block of buffer/inbuffer (and the device buffers) holds 
+	// one contiguous run of blocksize frames per channel, rather than interleaved frames:
+	int planar, dummy;
+	
+	// adaptive latency: while adaptive is nonzero, the audio thread moves block_io_latency
+	// within latency_min..latency_max (in blocks), judged by the lowest fill seen per window of callbacks:
+	int adaptive, adapt_window;
+	int latency_min, latency_max;
+	int adapt_fill_min, adapt_count;
+	int adapt_hold, adapt_stable;
+	
+	// if virtualdevice is nonzero (or there are no audio devices), av_audio_start runs a virtual
+	// device instead: a timer thread invoking the callback at the block rate, each call 
+	// delayed by up to jitter seconds, for testing & profiling on machines without hardware:
+	int virtualdevice, dummy2;
+	double jitter;
+	
+	// real-time modes for the callback thread, taking effect at av_audio_start: realtime is a 
+	// scheduling priority (1..99), or 0 to leave the thread's scheduling as it is; lockmemory locks
+	// the process's pages into RAM; affinity is a CPU to pin the thread to, or -1 for any; and 
+	// flushdenormals sets flush-to-zero & denormals-are-zero, so that decaying filters don't slow 
+	// to a crawl near silence:
+	int realtime, lockmemory;
+	int affinity, flushdenormals;
+	// which of these took effect (AV_AUDIO_RT_* flags), and which were asked for but failed;
+	// only complete once the first callback after av_audio_start has cleared rt_pending:
+	volatile int rt_applied, rt_failed;
+	volatile int rt_pending, rt_generation;
+	
+	// single-producer (main thread), single-consumer (audio thread) block ring.
+	// each index has exactly one writer, and sits on its own cache line:
+	char pad0[AV_CACHELINE];
+	volatile int blockread;		// written by the audio thread only
+	char pad1[AV_CACHELINE - sizeof(int)];
+	volatile int blockwrite;	// written by the main thread only
+	char pad2[AV_CACHELINE - sizeof(int)];
+	
+	// only access from audio thread:
+	float * input;
+	float * output;	
+	void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames);
+	
+	// messages for the audio-thread Lua state:
+	av_msgbuffer msgbuffer;
+	
+} av_Audio;
+
+#define AV_AUDIO_MSGBUFFER_SIZE_DEFAULT (1024 * 1024)
+
+// the layout of av_Audio, so that audio/driver.lua can size its pads & check its cdef against it:
+enum {
+	AV_AUDIO_LAYOUT_CACHELINE = 0,
+	AV_AUDIO_LAYOUT_SIZE,
+	AV_AUDIO_LAYOUT_BLOCKREAD,
+	AV_AUDIO_LAYOUT_BLOCKWRITE,
+	AV_AUDIO_LAYOUT_MSGBUFFER,
+	AV_AUDIO_LAYOUT_MSGBUFFER_SIZE
+};
+
+// the FFI exposed object:
+static av_Audio audio;
+
+// the internal objects: the stream in use belongs to rtas[rta_current]; the other is for
+// opening a new stream alongside it (see av_audio_reconfigure), and is created when first needed:
+static RtAudio rta;
+static RtAudio * rtas[2] = { &rta, 0 };
+static int rta_current = 0;
+
+// the audio-thread Lua state:
+static lua_State * AL = 0;
+
+static void av_msgbuffer_copy_in(av_msgbuffer& b, int at, const void * src, int len) {
+	int first = b.size - at;
+	if (first >= len) {
+		memcpy(b.data + at, src, len);
+	} else {
+		memcpy(b.data + at, src, first);
+		memcpy(b.data, (const unsigned char *)src + first, len - first);
+	}
+}
+
+static void av_msgbuffer_copy_out(av_msgbuffer& b, int at, void * dst, int len) {
+	int first = b.size - at;
+	if (first >= len) {
+		memcpy(dst, b.data + at, len);
+	} else {
+		memcpy(dst, b.data + at, first);
+		memcpy((unsigned char *)dst + first, b.data, len - first);
+	}
+}
+
+// main thread: queue a message for the audio-thread Lua state
+// returns 0 if there is not enough room
+AV_EXPORT int av_audio_msg_send(const char * msg, int len) {
+	av_msgbuffer& b = audio.msgbuffer;
+	int w = b.write;
+	int used = (w - av_atomic_load(&b.read) + b.size) % b.size;
+	int total = sizeof(int) + len;
+	// keep one byte free, so that a full buffer cannot look empty:
+	if (len < 0 || used + total > b.size - 1) return 0;
+	av_msgbuffer_copy_in(b, w, &len, sizeof(int));
+	av_msgbuffer_copy_in(b, (w + sizeof(int)) % b.size, msg, len);
+	av_atomic_store(&b.write, (w + total) % b.size);
+	return 1;
+}
+
+// audio thread: the length of the next message, or -1 if there is none
+AV_EXPORT int av_audio_msg_peek() {
+	av_msgbuffer& b = audio.msgbuffer;
+	int r = b.read;
+	if (r == av_atomic_load(&b.write)) return -1;
+	int len;
+	av_msgbuffer_copy_out(b, r, &len, sizeof(int));
+	return len;
+}
+
+// audio thread: copy the next message into dst (which must hold av_audio_msg_peek() bytes)
+// returns its length, or -1 if there is none
+AV_EXPORT int av_audio_msg_recv(char * dst) {
+	av_msgbuffer& b = audio.msgbuffer;
+	int len = av_audio_msg_peek();
+	if (len < 0) return -1;
+	int r = b.read;
+	av_msgbuffer_copy_out(b, (r + sizeof(int)) % b.size, dst, len);
+	av_atomic_store(&b.read, (r + sizeof(int) + len) % b.size);
+	return len;
+}
+
+/*
+	Windowed-sinc resampling.
+	
+	Each quality preset has a Kaiser-windowed sinc kernel of a fixed number of
+	taps, tabulated at AV_AUDIO_SINC_PHASES fractional positions (interpolated 
+	between them). The tables are built once, before the stream starts, and are 
+	read-only afterward, so the audio thread can use them freely.
+	
+	To play faster than the original rate, the kernel is stretched to lower its 
+	cutoff (up to AV_AUDIO_SINC_MAX_STRETCH times), which costs more taps.
+*/
+
+enum {
+	AV_AUDIO_QUALITY_LINEAR = 0,
+	AV_AUDIO_QUALITY_FAST,			// 8 taps
+	AV_AUDIO_QUALITY_MEDIUM,		// 16 taps
+	AV_AUDIO_QUALITY_BEST,			// 32 taps
+	AV_AUDIO_QUALITY_COUNT
+};
+
+#define AV_AUDIO_SINC_PHASES 256
+#define AV_AUDIO_SINC_MAX_TAPS 32
+#define AV_AUDIO_SINC_MAX_STRETCH 4
+
+typedef struct av_AudioKernel {
+	int taps;
+	// (AV_AUDIO_SINC_PHASES + 1) rows of taps coefficients: row p, tap k weighs
+	// the sample at distance (k - taps/2 + 1 - p/AV_AUDIO_SINC_PHASES) from the read position:
+	double * table;
+} av_AudioKernel;
+
+static av_AudioKernel kernels[AV_AUDIO_QUALITY_COUNT];
+
+// element types of sample memory (see audio.buffer):
+enum {
+	AV_AUDIO_FLOAT32 = 0,
+	AV_AUDIO_FLOAT64,
+	AV_AUDIO_INT16,
+	AV_AUDIO_TYPE_COUNT
+};
+
+static const int av_audio_type_size[AV_AUDIO_TYPE_COUNT] = { 4, 8, 2 };
+
+// int16 samples are read unscaled, so that sums stay exact; the scale is applied to the result:
+static inline double av_audio_sample_scale(const float *) { return 1.; }
+static inline double av_audio_sample_scale(const double *) { return 1.; }
+static inline double av_audio_sample_scale(const short *) { return 1. / 32768.; }
+
+static inline void av_audio_sample_store(float * d, double x) { *d = (float)x; }
+static inline void av_audio_sample_store(double * d, double x) { *d = x; }
+static inline void av_audio_sample_store(short * d, double x) {
+	x *= 32768.;
+	*d = (short)(x >= 32767. ? 32767 : x <= -32768. ? -32768 : floor(x + 0.5));
+}
+
+#ifdef AV_SSE2
+	// two consecutive samples, as doubles (no alignment needed):
+	static inline __m128d av_audio_sample2(const double * s) { return _mm_loadu_pd(s); }
+	static inline __m128d av_audio_sample2(const float * s) { 
+		return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)s))); 
+	}
+	static inline __m128d av_audio_sample2(const short * s) { return _mm_set_pd(s[1], s[0]); }
+#endif
+
+// zeroth-order modified Bessel function of the first kind, for the Kaiser window:
+static double av_audio_bessel_i0(double x) {
+	double sum = 1., term = 1.;
+	for (int k=1; k<32; k++) {
+		term *= (x / (2. * k)) * (x / (2. * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void av_audio_kernel_init(av_AudioKernel& K, int taps, double cutoff, double beta) {
+	const double pi = 3.14159265358979323846;
+	const int half = taps / 2;
+	K.taps = taps;
+	K.table = (double *)av_aligned_calloc((AV_AUDIO_SINC_PHASES + 1) * taps, sizeof(double));
+	for (int p=0; p<=AV_AUDIO_SINC_PHASES; p++) {
+		double * row = K.table + p * taps;
+		double f = p / (double)AV_AUDIO_SINC_PHASES;
+		double sum = 0.;
+		for (int k=0; k<taps; k++) {
+			double x = k - half + 1 - f;
+			double w = x / half;
+			double window = (w <= -1. || w >= 1.) ? 0. : av_audio_bessel_i0(beta * sqrt(1. - w*w)) / av_audio_bessel_i0(beta);
+			double sinc = x == 0. ? 1. : sin(pi * cutoff * x) / (pi * cutoff * x);
+			row[k] = cutoff * sinc * window;
+			sum += row[k];
+		}
+		// unity gain at DC:
+		for (int k=0; k<taps; k++) row[k] /= sum;
+	}
+}
+
+static void av_audio_kernels_init() {
+	static bool initialized = false;
+	if (initialized) return;
+	initialized = true;
+	kernels[AV_AUDIO_QUALITY_LINEAR].taps = 0;
+	kernels[AV_AUDIO_QUALITY_LINEAR].table = 0;
+	av_audio_kernel_init(kernels[AV_AUDIO_QUALITY_FAST], 8, 0.85, 6.);
+	av_audio_kernel_init(kernels[AV_AUDIO_QUALITY_MEDIUM], 16, 0.92, 8.);
+	av_audio_kernel_init(kernels[AV_AUDIO_QUALITY_BEST], 32, 0.96, 10.);
+}
+
+// the interpolated kernel coefficients for a fractional read position a (0 <= a < 1):
+static inline void av_audio_kernel_coefs(const av_AudioKernel& K, double a, double * coefs) {
+	const int taps = K.taps;
+	double fp = a * AV_AUDIO_SINC_PHASES;
+	int p = (int)fp;
+	double b = fp - p;
+	if (p >= AV_AUDIO_SINC_PHASES) { p = AV_AUDIO_SINC_PHASES - 1; b = 1.; }
+	const double * r0 = K.table + p * taps;
+	const double * r1 = r0 + taps;
+	#ifdef AV_SSE2
+		__m128d vb = _mm_set1_pd(b);
+		for (int k=0; k<taps; k+=2) {
+			__m128d c0 = _mm_load_pd(r0 + k);
+			__m128d c1 = _mm_load_pd(r1 + k);
+			_mm_storeu_pd(coefs + k, _mm_add_pd(c0, _mm_mul_pd(vb, _mm_sub_pd(c1, c0))));
+		}
+	#else
+		for (int k=0; k<taps; k++) coefs[k] = r0[k] + b * (r1[k] - r0[k]);
+	#endif
+}
+
+// the kernel at a continuous distance x from the read position (0 outside its support):
+static inline double av_audio_kernel_eval(const av_AudioKernel& K, double x) {
+	double cx = ceil(x);
+	int k = (int)cx + K.taps/2 - 1;
+	if (k < 0 || k >= K.taps) return 0.;
+	double fp = (cx - x) * AV_AUDIO_SINC_PHASES;
+	int p = (int)fp;
+	double b = fp - p;
+	if (p >= AV_AUDIO_SINC_PHASES) { p = AV_AUDIO_SINC_PHASES - 1; b = 1.; }
+	const double * r = K.table + p * K.taps + k;
+	return r[0] + b * (r[K.taps] - r[0]);
+}
+
+// the frame index to read for index j of a source played within [lo, hi)
+// returns -1 for silence outside the source (or wraps, if looping):
+static inline int av_audio_sinc_index(int j, int lo, int hi, int wrap) {
+	if (j >= lo && j < hi) return j;
+	int len = hi - lo;
+	if (!wrap || len < 1) return -1;
+	j = (j - lo) % len;
+	if (j < 0) j += len;
+	return lo + j;
+}
+
+// resample outchans channels of a source of chans interleaved channels at position pos,
+// reading only frames within [lo, hi); a stretch above 1 lowers the cutoff by that factor:
+template<typename T>
+static inline void av_audio_sinc_frame(const av_AudioKernel& K, const T * s, int chans, int outchans, int lo, int hi, int wrap, double pos, double stretch, double * out) {
+	const int taps = K.taps;
+	const int half = taps / 2;
+	for (int c=0; c<outchans; c++) out[c] = 0.;
+	
+	if (stretch > 1.) {
+		// wider kernel, evaluated per tap, normalized to unity gain:
+		const double scale = 1. / stretch;
+		double reach = half * stretch;
+		int j0 = (int)ceil(pos - reach);
+		int j1 = (int)floor(pos + reach);
+		double sum = 0.;
+		for (int j=j0; j<=j1; j++) {
+			double h = av_audio_kernel_eval(K, (j - pos) * scale);
+			sum += h;
+			int idx = av_audio_sinc_index(j, lo, hi, wrap);
+			if (idx < 0 || h == 0.) continue;
+			const T * f = s + idx * chans;
+			for (int c=0; c<outchans; c++) out[c] += h * f[c];
+		}
+		if (sum != 0.) for (int c=0; c<outchans; c++) out[c] /= sum;
+		return;
+	}
+	
+	int i0 = (int)pos;
+	if (i0 > pos) i0--;
+	int first = i0 - half + 1;
+	
+	if (first < lo || first + taps > hi) {
+		// near the edges:
+		double coefs[AV_AUDIO_SINC_MAX_TAPS];
+		av_audio_kernel_coefs(K, pos - i0, coefs);
+		for (int k=0; k<taps; k++) {
+			int idx = av_audio_sinc_index(first + k, lo, hi, wrap);
+			if (idx < 0) continue;
+			const T * f = s + idx * chans;
+			for (int c=0; c<outchans; c++) out[c] += coefs[k] * f[c];
+		}
+		return;
+	}
+	
+	const T * f = s + first * chans;
+	#ifdef AV_SSE2
+		if (chans <= 2) {
+			// interpolate between kernel phases while accumulating:
+			double fp = (pos - i0) * AV_AUDIO_SINC_PHASES;
+			int p = (int)fp;
+			double b = fp - p;
+			if (p >= AV_AUDIO_SINC_PHASES) { p = AV_AUDIO_SINC_PHASES - 1; b = 1.; }
+			const double * r0 = K.table + p * taps;
+			const double * r1 = r0 + taps;
+			const __m128d vb = _mm_set1_pd(b);
+			__m128d acc = _mm_setzero_pd();
+			if (chans == 1) {
+				for (int k=0; k<taps; k+=2) {
+					__m128d c0 = _mm_load_pd(r0 + k);
+					__m128d c = _mm_add_pd(c0, _mm_mul_pd(vb, _mm_sub_pd(_mm_load_pd(r1 + k), c0)));
+					acc = _mm_add_pd(acc, _mm_mul_pd(c, av_audio_sample2(f + k)));
+				}
+				acc = _mm_add_sd(acc, _mm_unpackhi_pd(acc, acc));
+				out[0] = _mm_cvtsd_f64(acc);
+			} else {
+				// both channels of a frame at once:
+				for (int k=0; k<taps; k+=2) {
+					__m128d c0 = _mm_load_pd(r0 + k);
+					__m128d c = _mm_add_pd(c0, _mm_mul_pd(vb, _mm_sub_pd(_mm_load_pd(r1 + k), c0)));
+					acc = _mm_add_pd(acc, _mm_mul_pd(_mm_unpacklo_pd(c, c), av_audio_sample2(f + 2*k)));
+					acc = _mm_add_pd(acc, _mm_mul_pd(_mm_unpackhi_pd(c, c), av_audio_sample2(f + 2*k + 2)));
+				}
+				double tmp[2];
+				_mm_storeu_pd(tmp, acc);
+				out[0] = tmp[0];
+				if (outchans > 1) out[1] = tmp[1];
+			}
+			return;
+		}
+	#endif
+	double coefs[AV_AUDIO_SINC_MAX_TAPS];
+	av_audio_kernel_coefs(K, pos - i0, coefs);
+	for (int k=0; k<taps; k++) {
+		const T * fk = f + k * chans;
+		for (int c=0; c<outchans; c++) out[c] += coefs[k] * fk[c];
+	}
+}
+
+template<typename S, typename D>
+static int av_audio_resample_typed(const av_AudioKernel& K, const S * src, int frames, int channels, D * dst, int dstframes, double ratio) {
+	double * f = (double *)malloc(sizeof(double) * channels);
+	if (!f) return 0;
+	const double scale = av_audio_sample_scale(src);
+	// offline, there is no limit on how far the kernel may stretch:
+	double stretch = ratio > 1. ? ratio : 1.;
+	for (int i=0; i<dstframes; i++) {
+		av_audio_sinc_frame(K, src, channels, channels, 0, frames, 0, i * ratio, stretch, f);
+		D * d = dst + i * channels;
+		for (int c=0; c<channels; c++) av_audio_sample_store(d + c, f[c] * scale);
+	}
+	free(f);
+	return dstframes;
+}
+
+template<typename S>
+static int av_audio_resample_from(const av_AudioKernel& K, const S * src, int frames, int channels, void * dst, int dsttype, int dstframes, double ratio) {
+	switch (dsttype) {
+		case AV_AUDIO_FLOAT32: return av_audio_resample_typed(K, src, frames, channels, (float *)dst, dstframes, ratio);
+		case AV_AUDIO_FLOAT64: return av_audio_resample_typed(K, src, frames, channels, (double *)dst, dstframes, ratio);
+		case AV_AUDIO_INT16: return av_audio_resample_typed(K, src, frames, channels, (short *)dst, dstframes, ratio);
+		default: return 0;
+	}
+}
+
+// convert frames of chans interleaved channels, reading the source every ratio frames
+// (ratio = source rate / destination rate) into dstframes frames of dst
+// srctype and dsttype are AV_AUDIO_FLOAT32, AV_AUDIO_FLOAT64 or AV_AUDIO_INT16
+// returns the number of frames written
+AV_EXPORT int av_audio_resample(const void * src, int srctype, int frames, int channels, void * dst, int dsttype, int dstframes, double ratio, int quality) {
+	if (!src || !dst || frames < 1 || channels < 1 || ratio <= 0.) return 0;
+	av_audio_kernels_init();
+	if (quality < AV_AUDIO_QUALITY_FAST) quality = AV_AUDIO_QUALITY_FAST;
+	if (quality >= AV_AUDIO_QUALITY_COUNT) quality = AV_AUDIO_QUALITY_BEST;
+	const av_AudioKernel& K = kernels[quality];
+	switch (srctype) {
+		case AV_AUDIO_FLOAT32: return av_audio_resample_from(K, (const float *)src, frames, channels, dst, dsttype, dstframes, ratio);
+		case AV_AUDIO_FLOAT64: return av_audio_resample_from(K, (const double *)src, frames, channels, dst, dsttype, dstframes, ratio);
+		case AV_AUDIO_INT16: return av_audio_resample_from(K, (const short *)src, frames, channels, dst, dsttype, dstframes, ratio);
+		default: return 0;
+	}
+}
+
+/*
+	Real-time thread configuration.
+	
+	av_audio_start asks RtAudio for real-time scheduling where the host API supports it, and 
+	locks memory if asked; the first callback after that then configures its own thread, since 
+	that is the only thread it can be sure of: it takes SCHED_FIFO itself if the host API didn't,
+	pins itself to a CPU, and sets the SSE flush-to-zero & denormals-are-zero modes (which are 
+	per thread). The voice threads take the same priority & modes, but aren't pinned. The main 
+	thread takes the same modes only while it renders into the ring (av_audio_fp_begin/end), 
+	so that the rest of the process keeps IEEE arithmetic.
+	Whatever was asked for but failed (usually for lack of permission) is reported in rt_failed.
+*/
+
+enum {
+	AV_AUDIO_RT_REALTIME = 1,
+	AV_AUDIO_RT_LOCKMEMORY = 2,
+	AV_AUDIO_RT_AFFINITY = 4,
+	AV_AUDIO_RT_DENORMALS = 8
+};
+
+// the MXCSR flush-to-zero bit, and the denormals-are-zero bit where the CPU is sure to have it:
+#ifdef AV_SSE2
+	#define AV_AUDIO_MXCSR_FLUSH 0x8040
+#else
+	#define AV_AUDIO_MXCSR_FLUSH 0x8000
+#endif
+
+static int memory_locked = 0;
+
+static int av_audio_rt_requested() {
+	int flags = 0;
+	if (audio.realtime > 0) flags |= AV_AUDIO_RT_REALTIME;
+	if (audio.lockmemory) flags |= AV_AUDIO_RT_LOCKMEMORY;
+	if (audio.affinity >= 0) flags |= AV_AUDIO_RT_AFFINITY;
+	if (audio.flushdenormals) flags |= AV_AUDIO_RT_DENORMALS;
+	return flags;
+}
+
+// give the calling thread the real-time priority & floating-point modes asked for, 
+// and if pin is nonzero, the CPU affinity; returns the AV_AUDIO_RT_* flags that took effect
+static int av_audio_rt_thread(int pin) {
+	int applied = 0;
+	if (audio.realtime > 0) {
+		#ifdef AV_WINDOWS
+		if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) applied |= AV_AUDIO_RT_REALTIME;
+		#else
+		int policy;
+		struct sched_param param;
+		if (pthread_getschedparam(pthread_self(), &policy, &param) == 0 && (policy == SCHED_FIFO || policy == SCHED_RR)) {
+			// the host API has already done it:
+			applied |= AV_AUDIO_RT_REALTIME;
+		} else {
+			int lo = sched_get_priority_min(SCHED_FIFO);
+			int hi = sched_get_priority_max(SCHED_FIFO);
+			param.sched_priority = audio.realtime < lo ? lo : audio.realtime > hi ? hi : audio.realtime;
+			if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) applied |= AV_AUDIO_RT_REALTIME;
+		}
+		#endif
+	}
+	if (pin && audio.affinity >= 0) {
+		#if defined(AV_WINDOWS)
+		if (audio.affinity < (int)(8 * sizeof(DWORD_PTR)) && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << audio.affinity)) {
+			applied |= AV_AUDIO_RT_AFFINITY;
+		}
+		#elif defined(AV_LINUX)
+		if (audio.affinity < CPU_SETSIZE) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(audio.affinity, &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) applied |= AV_AUDIO_RT_AFFINITY;
+		}
+		#endif
+		// (OS X only has affinity hints between threads, so it can't pin)
+	}
+	// (cleared again if no longer asked for, as the thread outlives the stream that set them)
+	#ifdef AV_SSE
+	if (audio.flushdenormals) {
+		_mm_setcsr(_mm_getcsr() | AV_AUDIO_MXCSR_FLUSH);
+		if ((_mm_getcsr() & AV_AUDIO_MXCSR_FLUSH) == AV_AUDIO_MXCSR_FLUSH) applied |= AV_AUDIO_RT_DENORMALS;
+	} else {
+		_mm_setcsr(_mm_getcsr() & ~AV_AUDIO_MXCSR_FLUSH);
+	}
+	#endif
+	return applied;
+}
+
+// main thread, as a stream starts: lock (or unlock) memory, and have the first callback 
+// configure its thread
+static void av_audio_rt_begin() {
+	int applied = 0;
+	#ifndef AV_WINDOWS
+	if (audio.lockmemory) {
+		memory_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+		if (memory_locked) applied |= AV_AUDIO_RT_LOCKMEMORY;
+	} else if (memory_locked) {
+		munlockall();
+		memory_locked = 0;
+	}
+	#endif
+	audio.rt_applied = applied;
+	audio.rt_failed = 0;
+	audio.rt_generation++;
+	av_atomic_store(&audio.rt_pending, 1);
+}
+
+// audio thread, at the first callback after av_audio_rt_begin:
+static void av_audio_rt_callback() {
+	int applied = av_audio_rt_thread(1) | (audio.rt_applied & AV_AUDIO_RT_LOCKMEMORY);
+	audio.rt_failed = av_audio_rt_requested() & ~applied;
+	audio.rt_applied = applied;
+	av_atomic_store(&audio.rt_pending, 0);
+}
+
+// main thread: take the audio thread's floating-point modes while rendering into the ring
+// (the Lua voices, and so dsp.lua's filters); returns the modes to restore with av_audio_fp_end
+AV_EXPORT unsigned int av_audio_fp_begin() {
+	#ifdef AV_SSE
+	const unsigned int csr = _mm_getcsr();
+	if (audio.flushdenormals) _mm_setcsr(csr | AV_AUDIO_MXCSR_FLUSH);
+	return csr;
+	#else
+	return 0;
+	#endif
+}
+
+AV_EXPORT void av_audio_fp_end(unsigned int saved) {
+	#ifdef AV_SSE
+	_mm_setcsr(saved);
+	#endif
+}
+
+/*
+	Native sample-playback voices.
+	
+	Voices are rendered directly in the audio callback. The main thread never
+	touches a playing voice; it only sends start/stop/param commands through a
+	lock-free queue, and the audio thread reports finished voices back through
+	a second queue so that the main thread can release the sample memory.
+*/
+
+#define AV_AUDIO_MAX_VOICES 256
+#define AV_AUDIO_QUEUE_SIZE 1024	// must be a power of two
+
+enum {
+	AV_AUDIO_CMD_START = 0,
+	AV_AUDIO_CMD_STOP,
+	AV_AUDIO_CMD_PARAM,
+	AV_AUDIO_CMD_ROUTE,
+	AV_AUDIO_CMD_STATS_RESET,
+	AV_AUDIO_CMD_UGEN_NEW,
+	AV_AUDIO_CMD_UGEN_INPUT,
+	AV_AUDIO_CMD_UGEN_FREE,
+	AV_AUDIO_CMD_CONVOLVER
+};
+
+enum {
+	AV_AUDIO_VOICE_GAIN = 0,
+	AV_AUDIO_VOICE_PAN,
+	AV_AUDIO_VOICE_RATE,
+	AV_AUDIO_VOICE_LOOP,
+	AV_AUDIO_VOICE_LOOPSTART,
+	AV_AUDIO_VOICE_LOOPEND,
+	AV_AUDIO_VOICE_POSITION,
+	AV_AUDIO_VOICE_QUALITY
+};
+
+typedef struct av_AudioVoice {
+	const void * samples;
+	int frames, channels;
+	int handle, loop;
+	int quality;					// AV_AUDIO_QUALITY_*
+	int type;						// of samples: AV_AUDIO_FLOAT32 etc.
+	// if at_block >= 0, the voice waits for the audio thread to play that ring block,
+	// and starts at frame at_frame within it:
+	int at_block, at_frame;
+	// if stream >= 0, frames come from that disk stream (see av_audio_stream_play)
+	// rather than from samples, and pos is relative to the stream's read head:
+	int stream, seekgen;
+	double pos, rate;				// in frames of the source
+	double gain, pan;
+	double loopstart, loopend;		// in frames of the source
+	double remain;					// in frames of output
+	// derived from gain & pan:
+	float gl, gr;
+} av_AudioVoice;
+
+typedef struct av_AudioCommand {
+	int type, handle;
+	int param, loop;
+	int row, col;
+	double value;
+	av_AudioVoice voice;
+} av_AudioCommand;
+
+typedef struct av_AudioMixer {
+	av_AudioVoice voices[AV_AUDIO_MAX_VOICES];
+	// slots currently playing, in no particular order:
+	int active[AV_AUDIO_MAX_VOICES];
+	int nactive;
+} av_AudioMixer;
+
+// main -> audio thread:
+typedef struct av_AudioCommandQueue {
+	char pad0[AV_CACHELINE];
+	volatile int read;
+	char pad1[AV_CACHELINE - sizeof(int)];
+	volatile int write;
+	char pad2[AV_CACHELINE - sizeof(int)];
+	av_AudioCommand cmds[AV_AUDIO_QUEUE_SIZE];
+} av_AudioCommandQueue;
+
+// audio -> main thread; a slot is only reused after it has been reported, 
+// so this can never hold more than AV_AUDIO_MAX_VOICES entries:
+typedef struct av_AudioDoneQueue {
+	char pad0[AV_CACHELINE];
+	volatile int read;
+	char pad1[AV_CACHELINE - sizeof(int)];
+	volatile int write;
+	char pad2[AV_CACHELINE - sizeof(int)];
+	int handles[AV_AUDIO_MAX_VOICES + 1];
+} av_AudioDoneQueue;
+
+static av_AudioMixer mixer;
+// planar stereo scratch for mixing voices into an interleaved stream:
+static float * mixbus = 0;
+static av_AudioCommandQueue cmdq;
+static av_AudioDoneQueue doneq;
+
+// main-thread only: free voice slots, and a generation count per slot so that
+// a stale handle can never address a voice that has since been reused:
+static int voice_free[AV_AUDIO_MAX_VOICES];
+static int voice_nfree = 0;
+static int voice_generation[AV_AUDIO_MAX_VOICES];
+// the ring position given to voices as they start; see av_audio_voice_at():
+static int voice_at_block = -1, voice_at_frame = 0;
+
+static void av_audio_voice_update_gains(av_AudioVoice& v) {
+	double pan = v.pan < -1. ? -1. : v.pan > 1. ? 1. : v.pan;
+	if (v.channels == 1) {
+		// equal-power pan of a mono source:
+		double a = (pan + 1.) * 0.785398163397448309616;	// pi/4
+		v.gl = (float)(v.gain * cos(a));
+		v.gr = (float)(v.gain * sin(a));
+	} else {
+		// balance of a stereo source:
+		v.gl = (float)(v.gain * (pan > 0. ? 1. - pan : 1.));
+		v.gr = (float)(v.gain * (pan < 0. ? 1. + pan : 1.));
+	}
+}
+
+static void av_audio_voice_set(av_AudioVoice& v, int param, double value) {
+	// the I/O thread handles looping & seeking of streams:
+	if (v.stream >= 0 && param > AV_AUDIO_VOICE_RATE) return;
+	switch (param) {
+		case AV_AUDIO_VOICE_GAIN: v.gain = value; break;
+		case AV_AUDIO_VOICE_PAN: v.pan = value; break;
+		case AV_AUDIO_VOICE_RATE: v.rate = value; break;
+		case AV_AUDIO_VOICE_LOOP: v.loop = value != 0.; break;
+		case AV_AUDIO_VOICE_LOOPSTART: v.loopstart = value < 0. ? 0. : value; break;
+		case AV_AUDIO_VOICE_LOOPEND: v.loopend = value > v.frames ? v.frames : value; break;
+		case AV_AUDIO_VOICE_POSITION: v.pos = value; break;
+		case AV_AUDIO_VOICE_QUALITY: {
+			int q = (int)value;
+			v.quality = q < 0 ? 0 : q >= AV_AUDIO_QUALITY_COUNT ? AV_AUDIO_QUALITY_COUNT - 1 : q;
+		} break;
+		default: break;
+	}
+	av_audio_voice_update_gains(v);
+}
+
+static void av_audio_mixer_start(av_AudioMixer * m, int slot, const av_AudioVoice& v) {
+	av_AudioVoice& dst = m->voices[slot];
+	dst = v;
+	av_audio_voice_update_gains(dst);
+	m->active[m->nactive++] = slot;
+}
+
+static int av_audio_stream_render(av_AudioVoice& v, float * outl, float * outr, int frames);
+
+template<typename T>
+static int av_audio_voice_render_samples(av_AudioVoice& v, const T * s, float * outl, float * outr, int frames) {
+	const int chans = v.channels;
+	const float scale = (float)av_audio_sample_scale(s);
+	const float gl = v.gl * scale, gr = v.gr * scale;
+	// play region:
+	const double start = v.loop ? v.loopstart : 0.;
+	const double end = v.loop ? v.loopend : (double)v.frames;
+	const double len = end - start;
+	if (len <= 0.) return 0;
+	
+	double pos = v.pos;
+	const double rate = v.rate;
+	int n = frames;
+	if (v.remain < n) n = (int)v.remain;
+	
+	// windowed-sinc interpolation, reading only frames within the play region:
+	const av_AudioKernel& K = kernels[v.quality];
+	const int lo = (int)ceil(start);
+	const int hi = (int)end;
+	const int outchans = chans > 1 ? 2 : 1;
+	double stretch = fabs(rate);
+	if (stretch < 1.) stretch = 1.;
+	if (stretch > AV_AUDIO_SINC_MAX_STRETCH) stretch = AV_AUDIO_SINC_MAX_STRETCH;
+	
+	for (int i=0; i<n; i++) {
+		if (pos >= end || pos < start) {
+			if (!v.loop) return i;
+			pos = start + fmod(pos - start, len);
+			if (pos < start) pos += len;
+		}
+		if (v.quality) {
+			double f[2];
+			av_audio_sinc_frame(K, s, chans, outchans, lo, hi, v.loop, pos, stretch, f);
+			outl[i] += (float)f[0] * gl;
+			outr[i] += (float)f[outchans - 1] * gr;
+			pos += rate;
+			continue;
+		}
+		int i0 = (int)pos;
+		double a = pos - i0;
+		int i1 = i0 + 1;
+		if (i1 >= (int)end) i1 = v.loop ? (int)start : i0;
+		if (chans == 1) {
+			double x0 = s[i0];
+			float x = (float)(x0 + a * (s[i1] - x0));
+			outl[i] += x * gl;
+			outr[i] += x * gr;
+		} else {
+			const T * f0 = s + i0 * chans;
+			const T * f1 = s + i1 * chans;
+			outl[i] += (float)(f0[0] + a * (f1[0] - f0[0])) * gl;
+			outr[i] += (float)(f0[1] + a * (f1[1] - f0[1])) * gr;
+		}
+		pos += rate;
+	}
+	v.pos = pos;
+	v.remain -= n;
+	return v.remain > 0. ? frames : n;
+}
+
+// adds into separate (planar) left & right outputs, which may be the same pointer for mono
+// returns the number of frames rendered before the voice ended 
+// (frames if it is still playing)
+static int av_audio_voice_render(av_AudioVoice& v, float * outl, float * outr, int frames) {
+	if (v.stream >= 0) return av_audio_stream_render(v, outl, outr, frames);
+	switch (v.type) {
+		case AV_AUDIO_FLOAT64: return av_audio_voice_render_samples(v, (const double *)v.samples, outl, outr, frames);
+		case AV_AUDIO_INT16: return av_audio_voice_render_samples(v, (const short *)v.samples, outl, outr, frames);
+		default: return av_audio_voice_render_samples(v, (const float *)v.samples, outl, outr, frames);
+	}
+}
+
+// render & mix all active voices into planar left & right outputs
+// block is the ring block being played (or -1 for none), for voices waiting to start
+// calls done(handle) for each voice that finishes in this block
+template<typename F>
+static void av_audio_mixer_render(av_AudioMixer * m, float * outl, float * outr, int frames, int block, F done) {
+	int i = 0;
+	while (i < m->nactive) {
+		int slot = m->active[i];
+		av_AudioVoice& v = m->voices[slot];
+		int offset = 0;
+		if (v.at_block >= 0) {
+			if (v.at_block != block) {
+				i++;
+				continue;
+			}
+			offset = v.at_frame < frames ? v.at_frame : frames;
+			v.at_block = -1;
+		}
+		if (av_audio_voice_render(v, outl + offset, outr + offset, frames - offset) < frames - offset) {
+			done(v.handle);
+			// swap-remove:
+			m->active[i] = m->active[--m->nactive];
+		} else {
+			i++;
+		}
+	}
+}
+
+static int av_audio_mixer_find(av_AudioMixer * m, int handle) {
+	int slot = handle % AV_AUDIO_MAX_VOICES;
+	if (m->voices[slot].handle != handle) return -1;
+	for (int i=0; i<m->nactive; i++) {
+		if (m->active[i] == slot) return i;
+	}
+	return -1;
+}
+
+static void av_audio_done_push(int handle) {
+	int w = doneq.write;
+	doneq.handles[w] = handle;
+	w++;
+	if (w > AV_AUDIO_MAX_VOICES) w = 0;
+	av_atomic_store(&doneq.write, w);
+}
+
+static void av_audio_route_apply(const av_AudioCommand& cmd);
+static void av_audio_stats_clear();
+static void av_audio_ugen_apply(const av_AudioCommand& cmd);
+static void av_audio_convolver_apply(const av_AudioCommand& cmd);
+
+// audio thread: apply all pending commands
+static void av_audio_commands_apply() {
+	int r = cmdq.read;
+	int w = av_atomic_load(&cmdq.write);
+	while (r != w) {
+		av_AudioCommand& cmd = cmdq.cmds[r];
+		switch (cmd.type) {
+			case AV_AUDIO_CMD_START:
+				av_audio_mixer_start(&mixer, cmd.handle % AV_AUDIO_MAX_VOICES, cmd.voice);
+				break;
+			case AV_AUDIO_CMD_STOP: {
+				int i = av_audio_mixer_find(&mixer, cmd.handle);
+				if (i >= 0) {
+					av_audio_done_push(cmd.handle);
+					mixer.active[i] = mixer.active[--mixer.nactive];
+				}
+			} break;
+			case AV_AUDIO_CMD_PARAM: {
+				int i = av_audio_mixer_find(&mixer, cmd.handle);
+				if (i >= 0) av_audio_voice_set(mixer.voices[mixer.active[i]], cmd.param, cmd.value);
+			} break;
+			case AV_AUDIO_CMD_ROUTE:
+				av_audio_route_apply(cmd);
+				break;
+			case AV_AUDIO_CMD_STATS_RESET:
+				av_audio_stats_clear();
+				break;
+			case AV_AUDIO_CMD_UGEN_NEW:
+			case AV_AUDIO_CMD_UGEN_INPUT:
+			case AV_AUDIO_CMD_UGEN_FREE:
+				av_audio_ugen_apply(cmd);
+				break;
+			case AV_AUDIO_CMD_CONVOLVER:
+				av_audio_convolver_apply(cmd);
+				break;
+			default:
+				break;
+		}
+		r = (r + 1) & (AV_AUDIO_QUEUE_SIZE - 1);
+	}
+	av_atomic_store(&cmdq.read, r);
+}
+
+// main thread: claim the next command slot, or 0 if the queue is full
+static av_AudioCommand * av_audio_command_next() {
+	int w = cmdq.write;
+	if (((w + 1) & (AV_AUDIO_QUEUE_SIZE - 1)) == av_atomic_load(&cmdq.read)) return 0;
+	return &cmdq.cmds[w];
+}
+
+static void av_audio_command_send() {
+	av_atomic_store(&cmdq.write, (cmdq.write + 1) & (AV_AUDIO_QUEUE_SIZE - 1));
+}
+
+static void av_audio_voices_init() {
+	av_audio_kernels_init();
+	for (int i=0; i<AV_AUDIO_MAX_VOICES; i++) {
+		// hand out low slots first:
+		voice_free[i] = AV_AUDIO_MAX_VOICES - 1 - i;
+		voice_generation[i] = 0;
+		mixer.voices[i].handle = -1;
+	}
+	voice_nfree = AV_AUDIO_MAX_VOICES;
+	mixer.nactive = 0;
+}
+
+// main thread: claim a free voice slot and the command to start it
+// returns the new handle, or -1 if there is no voice or command available
+static int av_audio_voice_claim(av_AudioCommand ** cmd) {
+	if (voice_nfree < 1) return -1;
+	*cmd = av_audio_command_next();
+	if (!*cmd) return -1;
+	
+	int slot = voice_free[--voice_nfree];
+	int handle = slot + AV_AUDIO_MAX_VOICES * voice_generation[slot];
+	voice_generation[slot] = (voice_generation[slot] + 1) % (1 << 20);
+	return handle;
+}
+
+// start playing a buffer; returns a voice handle, or -1 if no voice is available
+// the samples must stay valid until the handle is returned by av_audio_voice_done()
+AV_EXPORT int av_audio_voice_start(const void * samples, int type, int frames, int channels, double gain, double pan, double rate, int loop, double loopstart, double loopend, double duration) {
+	if (!samples || type < 0 || type >= AV_AUDIO_TYPE_COUNT || frames < 1 || channels < 1) return -1;
+	av_AudioCommand * cmd;
+	int handle = av_audio_voice_claim(&cmd);
+	if (handle < 0) return -1;
+	
+	av_AudioVoice& v = cmd->voice;
+	v.samples = samples;
+	v.type = type;
+	v.frames = frames;
+	v.channels = channels;
+	v.handle = handle;
+	v.loop = loop;
+	v.quality = AV_AUDIO_QUALITY_LINEAR;
+	v.pos = rate < 0. ? frames - 1 : 0.;
+	v.rate = rate;
+	v.gain = gain;
+	v.pan = pan;
+	v.loopstart = loopstart < 0. ? 0. : loopstart;
+	v.loopend = (loopend <= v.loopstart || loopend > frames) ? frames : loopend;
+	// (in whole frames, so that it counts down to zero rather than stalling below one frame)
+	v.remain = duration > 0. ? floor(duration + 0.5) : HUGE_VAL;
+	v.at_block = voice_at_block;
+	v.at_frame = voice_at_frame;
+	v.stream = -1;
+	v.seekgen = 0;
+	
+	cmd->type = AV_AUDIO_CMD_START;
+	cmd->handle = handle;
+	av_audio_command_send();
+	return handle;
+}
+
+// voices started until the next call begin at this frame of this ring block,
+// rather than as soon as the audio thread sees them; a block of -1 restores that
+// (the scheduler uses it to start voices at the sample of the event that started them)
+AV_EXPORT void av_audio_voice_at(int block, int frame) {
+	voice_at_block = block;
+	voice_at_frame = frame;
+}
+
+AV_EXPORT int av_audio_voice_stop(int handle) {
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_STOP;
+	cmd->handle = handle;
+	av_audio_command_send();
+	return 1;
+}
+
+AV_EXPORT int av_audio_voice_param(int handle, int param, double value) {
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_PARAM;
+	cmd->handle = handle;
+	cmd->param = param;
+	cmd->value = value;
+	av_audio_command_send();
+	return 1;
+}
+
+// returns the handle of a voice that has finished playing, or -1 if there are none
+// (its slot is recycled, and its sample memory may now be released)
+AV_EXPORT int av_audio_voice_done() {
+	int r = doneq.read;
+	if (r == av_atomic_load(&doneq.write)) return -1;
+	int handle = doneq.handles[r];
+	r++;
+	if (r > AV_AUDIO_MAX_VOICES) r = 0;
+	av_atomic_store(&doneq.read, r);
+	voice_free[voice_nfree++] = handle % AV_AUDIO_MAX_VOICES;
+	return handle;
+}
+
+// main thread, once no stream runs the pipeline: end every playing voice, 
+// so that av_audio_voice_done returns them
+static void av_audio_voices_end() {
+	for (int i=0; i<mixer.nactive; i++) {
+		av_audio_done_push(mixer.voices[mixer.active[i]].handle);
+	}
+	mixer.nactive = 0;
+}
+
+// as av_audio_voices_end, but first applying the commands the audio thread never got to
+static void av_audio_voices_release() {
+	av_audio_commands_apply();
+	av_audio_voices_end();
+}
+
+/*
+	Parallel voice rendering.
+	
+	The active voices are split into fixed groups of AV_AUDIO_VOICE_GRAIN, in the order of the
+	mixer's active list, and each group is rendered into its own scratch bus. The audio thread 
+	shares the groups out between itself and up to AV_AUDIO_VOICE_THREADS-1 worker threads, 
+	woken by semaphores: each starts on a contiguous run of groups, taking from the front of its
+	own run, and then steals from the back of the others', so that a few expensive voices (high 
+	quality, high rates, streams) don't hold up the rest of the block. The audio thread then waits 
+	for the last groups in flight, and sums the group buses in group order; so the mix is the same 
+	bit for bit however many threads render it (one included, which renders every group itself), 
+	and whichever thread renders each group. A block longer than the group buses is rendered in 
+	slices of their length.
+*/
+
+#define AV_AUDIO_VOICE_GRAIN 4
+#define AV_AUDIO_VOICE_GROUPS (AV_AUDIO_MAX_VOICES / AV_AUDIO_VOICE_GRAIN)
+#define AV_AUDIO_VOICE_THREADS 16
+
+struct av_AudioVoicePool;
+
+typedef struct av_AudioVoiceWorker {
+	av_AudioVoicePool * pool;
+	int index;
+	int rt_generation;			// of the real-time modes last taken from the audio thread
+	av_thread thread;
+	av_semaphore wake;
+	// the groups left in this thread's run, as (back << 16) | front:
+	char pad0[AV_CACHELINE];
+	volatile int run;
+	char pad1[AV_CACHELINE - sizeof(int)];
+} av_AudioVoiceWorker;
+
+typedef struct av_AudioVoicePool {
+	// main thread:
+	int threads;				// started, counting the audio thread (worker 0), so at least 1
+	int capacity;				// frames of each group bus
+	volatile int quit;
+	// the number of threads the audio thread may use:
+	volatile int use;
+	
+	// set by the audio thread for each block, before waking the workers:
+	av_AudioMixer * mixer;
+	float * buses;				// AV_AUDIO_VOICE_GROUPS planar stereo buses of capacity frames
+	int frames, block;
+	int from;					// the frame of the block this slice starts at
+	int nvoices, participants;
+	int slots[AV_AUDIO_MAX_VOICES];		// the voices to render this block, in order
+	// by slot, whether the voice ended in this block:
+	int finished[AV_AUDIO_MAX_VOICES];
+	
+	av_AudioVoiceWorker workers[AV_AUDIO_VOICE_THREADS];
+	
+	char pad0[AV_CACHELINE];
+	volatile int pending;		// groups not yet rendered
+	char pad1[AV_CACHELINE - sizeof(int)];
+} av_AudioVoicePool;
+
+static av_AudioVoicePool voicepool;
+
+static void av_audio_voice_group(av_AudioVoicePool * p, int g) {
+	av_AudioMixer * m = p->mixer;
+	const int frames = p->frames;
+	float * outl = p->buses + g * 2 * frames;
+	float * outr = outl + frames;
+	memset(outl, 0, sizeof(float) * 2 * frames);
+	const int end = (g + 1) * AV_AUDIO_VOICE_GRAIN < p->nvoices ? (g + 1) * AV_AUDIO_VOICE_GRAIN : p->nvoices;
+	for (int i=g*AV_AUDIO_VOICE_GRAIN; i<end; i++) {
+		const int slot = p->slots[i];
+		av_AudioVoice& v = m->voices[slot];
+		int offset = 0;
+		if (v.at_block >= 0) {
+			offset = v.at_frame - p->from < frames ? v.at_frame - p->from : frames;
+			v.at_block = -1;
+		}
+		p->finished[slot] = av_audio_voice_render(v, outl + offset, outr + offset, frames - offset) < frames - offset;
+	}
+}
+
+// render groups until there are none left to take or steal
+static void av_audio_voice_work(av_AudioVoicePool * p, int self) {
+	for (;;) {
+		int g = -1;
+		// from the front of this thread's own run:
+		volatile int * run = &p->workers[self].run;
+		for (;;) {
+			int r = av_atomic_load(run);
+			int front = r & 0xffff, back = r >> 16;
+			if (front >= back) break;
+			if (av_atomic_cas(run, r, r + 1)) {
+				g = front;
+				break;
+			}
+		}
+		// or from the back of another's:
+		const int participants = p->participants;
+		for (int k=1; g < 0 && k<participants; k++) {
+			volatile int * other = &p->workers[(self + k) % participants].run;
+			for (;;) {
+				int r = av_atomic_load(other);
+				int front = r & 0xffff, back = r >> 16;
+				if (front >= back) break;
+				if (av_atomic_cas(other, r, ((back - 1) << 16) | front)) {
+					g = back - 1;
+					break;
+				}
+			}
+		}
+		if (g < 0) return;
+		av_audio_voice_group(p, g);
+		av_atomic_add(&p->pending, -1);
+	}
+}
+
+static void * av_audio_voice_worker_main(void * arg) {
+	av_AudioVoiceWorker * w = (av_AudioVoiceWorker *)arg;
+	av_AudioVoicePool * p = w->pool;
+	for (;;) {
+		av_semaphore_wait(&w->wake);
+		if (av_atomic_load(&p->quit)) break;
+		if (w->rt_generation != audio.rt_generation) {
+			w->rt_generation = audio.rt_generation;
+			av_audio_rt_thread(0);
+		}
+		av_audio_voice_work(p, w->index);
+	}
+	return 0;
+}
+
+// render & mix frames from..from+frames-1 of the block, of the voices that have started by
+// then (more is nonzero if slices follow), on up to p->use threads
+template<typename F>
+static void av_audio_mixer_render_slice(av_AudioVoicePool * p, av_AudioMixer * m, float * outl, float * outr, int frames, int block, int from, int more, double deadline, F done) {
+	int n = 0;
+	for (int i=0; i<m->nactive; i++) {
+		const int slot = m->active[i];
+		const av_AudioVoice& v = m->voices[slot];
+		if (v.at_block >= 0 && (v.at_block != block || (more && v.at_frame >= from + frames))) continue;
+		p->slots[n++] = slot;
+	}
+	if (!n) return;
+	const int groups = (n + AV_AUDIO_VOICE_GRAIN - 1) / AV_AUDIO_VOICE_GRAIN;
+	int use = av_atomic_load(&p->use);
+	if (use < 1) use = 1;
+	const int participants = use < groups ? use : groups;
+	p->mixer = m;
+	p->frames = frames;
+	p->block = block;
+	p->from = from;
+	p->nvoices = n;
+	p->participants = participants;
+	av_atomic_store(&p->pending, groups);
+	// (a worker still waking from an earlier block finds its run empty)
+	for (int t=0; t<AV_AUDIO_VOICE_THREADS; t++) {
+		int front = 0, back = 0;
+		if (t < participants) {
+			front = t * groups / participants;
+			back = (t + 1) * groups / participants;
+		}
+		av_atomic_store(&p->workers[t].run, (back << 16) | front);
+	}
+	for (int t=1; t<participants; t++) av_semaphore_post(&p->workers[t].wake);
+	// this takes back every group no worker has started (including the whole run of a worker 
+	// that has not woken yet), so what remains is at most one group in flight per worker:
+	av_audio_voice_work(p, 0);
+	// spin for those until the block is due; past that, sleep between checks, since a worker 
+	// sharing this core would never get it back from a real-time audio thread by yielding
+	// (the wait itself has no bound: a group in flight is still writing its bus and its voices,
+	// so the block can't be mixed without it):
+	while (av_atomic_load(&p->pending)) {
+		if (av_clock() < deadline) {
+			#ifdef AV_SSE2
+			_mm_pause();
+			#endif
+		} else {
+			av_sleep(0.0001);
+		}
+	}
+	
+	for (int g=0; g<groups; g++) {
+		const float * l = p->buses + g * 2 * frames;
+		const float * r = l + frames;
+		for (int i=0; i<frames; i++) {
+			outl[i] += l[i];
+			outr[i] += r[i];
+		}
+	}
+	
+	// retire the voices that ended, in the same order as av_audio_mixer_render:
+	int i = 0;
+	while (i < m->nactive) {
+		const int slot = m->active[i];
+		if (p->finished[slot]) {
+			p->finished[slot] = 0;
+			done(m->voices[slot].handle);
+			m->active[i] = m->active[--m->nactive];
+		} else {
+			i++;
+		}
+	}
+}
+
+// render & mix all active voices, as av_audio_mixer_render does but summed by group, on up to 
+// p->use threads; deadline is the av_clock() time the block is due by
+template<typename F>
+static void av_audio_mixer_render_parallel(av_AudioVoicePool * p, av_AudioMixer * m, float * outl, float * outr, int frames, int block, double deadline, F done) {
+	if (p->capacity < 1) {
+		// (the group buses couldn't be allocated)
+		av_audio_mixer_render(m, outl, outr, frames, block, done);
+		return;
+	}
+	for (int from=0; from<frames; from+=p->capacity) {
+		const int n = frames - from < p->capacity ? frames - from : p->capacity;
+		av_audio_mixer_render_slice(p, m, outl + from, outr + from, n, block, from, from + n < frames, deadline, done);
+	}
+}
+
+// (re)allocate the group buses; only while the pool is idle
+static int av_audio_voice_pool_alloc(av_AudioVoicePool * p, int frames) {
+	av_aligned_free(p->buses);
+	p->buses = (float *)av_aligned_calloc((size_t)AV_AUDIO_VOICE_GROUPS * 2 * frames, sizeof(float));
+	p->capacity = p->buses ? frames : 0;
+	return p->buses != 0;
+}
+
+// start workers so that threads threads can render voices (counting the audio thread), 
+// and let the audio thread use that many; returns the number it may now use
+static int av_audio_voice_pool_start(av_AudioVoicePool * p, int threads) {
+	if (threads < 1) threads = 1;
+	if (threads > AV_AUDIO_VOICE_THREADS) threads = AV_AUDIO_VOICE_THREADS;
+	if (p->threads < 1) p->threads = 1;
+	while (p->threads < threads) {
+		av_AudioVoiceWorker * w = &p->workers[p->threads];
+		w->pool = p;
+		w->index = p->threads;
+		w->rt_generation = 0;
+		w->run = 0;
+		if (av_semaphore_init(&w->wake)) break;
+		if (av_thread_create(&w->thread, av_audio_voice_worker_main, w)) {
+			av_semaphore_destroy(&w->wake);
+			fprintf(stderr, "unable to start an audio voice thread\n");
+			break;
+		}
+		p->threads++;
+	}
+	int use = threads < p->threads ? threads : p->threads;
+	av_atomic_store(&p->use, use);
+	return use;
+}
+
+// stop & join the workers; only while the pool is idle
+static void av_audio_voice_pool_stop(av_AudioVoicePool * p) {
+	av_atomic_store(&p->use, 1);
+	av_atomic_store(&p->quit, 1);
+	for (int t=1; t<p->threads; t++) {
+		av_semaphore_post(&p->workers[t].wake);
+		av_thread_join(p->workers[t].thread);
+		av_semaphore_destroy(&p->workers[t].wake);
+	}
+	p->threads = 1;
+	av_atomic_store(&p->quit, 0);
+}
+
+// render the native voices on up to threads threads: the audio thread and threads-1 workers 
+// (at most 16 in all); the mix is identical whatever the number
+// returns the number of threads now in use
+AV_EXPORT int av_audio_voice_threads(int threads) {
+	return av_audio_voice_pool_start(&voicepool, threads);
+}
+
+static void av_audio_bench_done(int) {}
+
+// render a number of voices of a looping mono buffer into a private mixer
+// with the given interpolation quality, serially (if threads is 0) or on a private pool of threads
+// returns the elapsed wall-clock time in seconds
+AV_EXPORT double av_audio_voices_bench(int voices, int blocksize, int blocks, int quality, int threads) {
+	av_audio_kernels_init();
+	const int frames = 44100;
+	if (voices > AV_AUDIO_MAX_VOICES) voices = AV_AUDIO_MAX_VOICES;
+	
+	double * samples = (double *)malloc(sizeof(double) * frames);
+	float * out = (float *)av_aligned_calloc(blocksize * 2, sizeof(float));
+	av_AudioMixer * m = (av_AudioMixer *)calloc(1, sizeof(av_AudioMixer));
+	for (int i=0; i<frames; i++) samples[i] = sin(i * 0.05);
+	for (int i=0; i<voices; i++) {
+		av_AudioVoice v;
+		memset(&v, 0, sizeof(v));
+		v.samples = samples;
+		v.type = AV_AUDIO_FLOAT64;
+		v.frames = frames;
+		v.channels = 1;
+		v.handle = i;
+		v.loop = 1;
+		v.loopend = frames;
+		// a spread of playback rates, so that most voices interpolate:
+		v.rate = 0.5 + i / (double)AV_AUDIO_MAX_VOICES;
+		v.gain = 1. / voices;
+		v.pan = (i % 3) - 1.;
+		v.remain = HUGE_VAL;
+		v.at_block = -1;
+		v.stream = -1;
+		av_audio_mixer_start(m, i, v);
+		av_audio_voice_set(m->voices[i], AV_AUDIO_VOICE_QUALITY, quality);
+	}
+	
+	av_AudioVoicePool * pool = 0;
+	if (threads > 0) {
+		pool = (av_AudioVoicePool *)calloc(1, sizeof(av_AudioVoicePool));
+		av_audio_voice_pool_alloc(pool, blocksize);
+		av_audio_voice_pool_start(pool, threads);
+	}
+	
+	double t0 = av_time();
+	for (int b=0; b<blocks; b++) {
+		memset(out, 0, sizeof(float) * blocksize * 2);
+		if (pool) {
+			av_audio_mixer_render_parallel(pool, m, out, out + blocksize, blocksize, -1, HUGE_VAL, av_audio_bench_done);
+		} else {
+			av_audio_mixer_render(m, out, out + blocksize, blocksize, -1, av_audio_bench_done);
+		}
+	}
+	double elapsed = av_time() - t0;
+	
+	if (pool) {
+		av_audio_voice_pool_stop(pool);
+		av_aligned_free(pool->buses);
+		free(pool);
+	}
+	free(m);
+	av_aligned_free(out);
+	free(samples);
+	return elapsed;
+}
+
+/*
+	Disk-streaming voices.
+	
+	A stream plays a sound file without loading all of it: a background I/O thread reads
+	chunks into a per-stream ring, which the audio thread consumes as a voice plays it.
+	
+	The file is read through function pointers (libsndfile's sf_readf_float, sf_seek and
+	sf_close, as supplied by audio.stream), so that this file needn't link to any codec.
+	
+	Each ring has a single producer (the I/O thread) and a single consumer (the voice).
+	A seek requested by the main thread is carried out by the I/O thread, which then publishes
+	the ring frame where the new data begins; the voice jumps its read head there when it
+	sees a new seek generation, discarding whatever was read ahead before the seek.
+	
+	The I/O thread sleeps on a semaphore until there is work: the audio thread posts it as 
+	voices consume their rings, and the main thread as it seeks, loops or closes a stream.
+*/
+
+#define AV_AUDIO_MAX_STREAMS 64
+// most frames read per call of the read function:
+#define AV_AUDIO_STREAM_CHUNK 4096
+// largest ring, in frames:
+#define AV_AUDIO_STREAM_MAX_RING (1 << 22)
+
+// (signatures compatible with sf_readf_float, sf_seek & sf_close)
+typedef long long (*av_audio_stream_read_fn)(void * file, float * dst, long long frames);
+typedef long long (*av_audio_stream_seek_fn)(void * file, long long frame, int whence);
+typedef int (*av_audio_stream_close_fn)(void * file);
+
+enum {
+	AV_AUDIO_STREAM_FREE = 0,
+	AV_AUDIO_STREAM_OPEN,
+	AV_AUDIO_STREAM_CLOSING
+};
+
+typedef struct av_AudioStream {
+	// set by the main thread before the stream is opened:
+	void * file;
+	av_audio_stream_read_fn read_fn;
+	av_audio_stream_seek_fn seek_fn;
+	av_audio_stream_close_fn close_fn;
+	float * ring;
+	int ringframes, channels;
+	int frames, dummy;
+	
+	// main thread -> I/O thread:
+	volatile int state;
+	volatile int loop, loopstart, loopend;
+	volatile int seek_request, seek_frame;
+	
+	// I/O thread only:
+	int pos, seek_handled;
+	
+	// written by the I/O thread:
+	char pad0[AV_CACHELINE];
+	volatile int write;
+	volatile int eof;
+	// the number of seeks carried out, and the ring frame where each begins, in the slot of 
+	// its generation's parity (so a slot is rewritten only two seeks later; see av_audio_stream_render):
+	volatile int seekgen;
+	volatile int seekframe[2];
+	
+	// written by the audio thread:
+	char pad1[AV_CACHELINE];
+	volatile int read;
+	volatile int underruns;
+	char pad2[AV_CACHELINE];
+} av_AudioStream;
+
+static av_AudioStream streams[AV_AUDIO_MAX_STREAMS];
+static av_thread stream_thread;
+static volatile int stream_running = 0;
+// posted to wake the I/O thread; stream_signalled is set until it wakes, so that it is
+// posted at most once between its passes:
+static av_semaphore stream_wake;
+static volatile int stream_signalled = 0;
+
+// any thread: have the I/O thread make a pass over the streams
+static void av_audio_stream_signal() {
+	if (av_atomic_load(&stream_running) && av_atomic_cas(&stream_signalled, 0, 1)) {
+		av_semaphore_post(&stream_wake);
+	}
+}
+
+// I/O thread (or the main thread, before the stream is published):
+// carry out any seek, then read ahead until the ring is full or the file ends
+static void av_audio_stream_fill(av_AudioStream& s) {
+	const int R = s.ringframes;
+	const int chans = s.channels;
+	int w = s.write;
+	
+	int req = av_atomic_load(&s.seek_request);
+	if (req != s.seek_handled) {
+		s.seek_handled = req;
+		int frame = av_atomic_load(&s.seek_frame);
+		if (frame < 0) frame = 0;
+		if (frame > s.frames) frame = s.frames;
+		s.seek_fn(s.file, frame, SEEK_SET);
+		s.pos = frame;
+		av_atomic_store(&s.eof, 0);
+		int gen = (av_atomic_load(&s.seekgen) + 1) & 0x7fffffff;
+		av_atomic_store(&s.seekframe[gen & 1], w);
+		av_atomic_store(&s.seekgen, gen);
+	}
+	
+	int loop = av_atomic_load(&s.loop);
+	int loopstart = av_atomic_load(&s.loopstart);
+	int loopend = av_atomic_load(&s.loopend);
+	if (loopend > s.frames || loopend <= 0) loopend = s.frames;
+	if (loopstart < 0) loopstart = 0;
+	if (loopstart >= loopend) loop = 0;
+	if (av_atomic_load(&s.eof) && !loop) return;
+	
+	int space = av_atomic_load(&s.read) - w - 1;
+	if (space < 0) space += R;
+	while (space > 0) {
+		int end = loop ? loopend : s.frames;
+		int n = end - s.pos;
+		if (n <= 0) {
+			if (!loop) {
+				av_atomic_store(&s.eof, 1);
+				return;
+			}
+			s.seek_fn(s.file, loopstart, SEEK_SET);
+			s.pos = loopstart;
+			av_atomic_store(&s.eof, 0);
+			continue;
+		}
+		if (n > space) n = space;
+		if (n > R - w) n = R - w;
+		if (n > AV_AUDIO_STREAM_CHUNK) n = AV_AUDIO_STREAM_CHUNK;
+		int got = (int)s.read_fn(s.file, s.ring + w * chans, n);
+		if (got <= 0) {
+			// the file is shorter than it claimed; end (or loop) here:
+			s.frames = s.pos;
+			if (loopend > s.frames) loopend = s.frames;
+			if (loopstart >= loopend) loop = 0;
+			continue;
+		}
+		s.pos += got;
+		space -= got;
+		w += got;
+		if (w >= R) w = 0;
+		av_atomic_store(&s.write, w);
+	}
+}
+
+AV_EXPORT void av_audio_stream_loop(int id, int loop, int start, int end);
+
+static void * av_audio_stream_main(void * arg) {
+	for (;;) {
+		// (cleared first, so that requests made during the pass post again)
+		av_atomic_store(&stream_signalled, 0);
+		int running = av_atomic_load(&stream_running);
+		for (int i=0; i<AV_AUDIO_MAX_STREAMS; i++) {
+			av_AudioStream& s = streams[i];
+			int state = av_atomic_load(&s.state);
+			if (state == AV_AUDIO_STREAM_OPEN) {
+				av_audio_stream_fill(s);
+			} else if (state == AV_AUDIO_STREAM_CLOSING) {
+				if (s.close_fn) s.close_fn(s.file);
+				av_aligned_free(s.ring);
+				s.ring = 0;
+				av_atomic_store(&s.state, AV_AUDIO_STREAM_FREE);
+			}
+		}
+		// (a last pass closes whatever was left to close)
+		if (!running) break;
+		av_semaphore_wait(&stream_wake);
+	}
+	return 0;
+}
+
+// at exit: stop the I/O thread
+// (the semaphore is left as it is, since the audio thread may still be running)
+static void av_audio_streams_exit() {
+	if (!av_atomic_load(&stream_running)) return;
+	av_atomic_store(&stream_running, 0);
+	av_semaphore_post(&stream_wake);
+	av_thread_join(stream_thread);
+}
+
+// audio thread: play from the ring, with linear interpolation & no backward playback
+// a stream that runs dry counts an underrun and stays silent until its data arrives
+static int av_audio_stream_render(av_AudioVoice& v, float * outl, float * outr, int frames) {
+	av_AudioStream& s = streams[v.stream];
+	const int R = s.ringframes;
+	const int chans = s.channels;
+	const float gl = v.gl, gr = v.gr;
+	
+	// (loaded in the reverse of the order they are stored, so each is at least as new as the last)
+	// (a looping stream will be refilled, even if it has just reached the end)
+	int eof = av_atomic_load(&s.eof) && !av_atomic_load(&s.loop);
+	int w = av_atomic_load(&s.write);
+	int gen = av_atomic_load(&s.seekgen);
+	int r = s.read;
+	if (gen != v.seekgen) {
+		// the I/O thread has seeked; skip to the new data
+		// (if it seeks again while the slot is read, take the newer seek instead):
+		int start = av_atomic_load(&s.seekframe[gen & 1]);
+		for (int again = av_atomic_load(&s.seekgen); again != gen; again = av_atomic_load(&s.seekgen)) {
+			gen = again;
+			start = av_atomic_load(&s.seekframe[gen & 1]);
+		}
+		v.seekgen = gen;
+		v.pos = 0.;
+		r = start;
+		av_atomic_store(&s.read, r);
+		eof = av_atomic_load(&s.eof) && !av_atomic_load(&s.loop);
+		w = av_atomic_load(&s.write);
+	}
+	int avail = w - r;
+	if (avail < 0) avail += R;
+	
+	const double rate = v.rate > 0. ? v.rate : 0.;
+	double pos = v.pos;
+	int n = frames;
+	if (v.remain < n) n = (int)v.remain;
+	int i = 0;
+	for (; i<n; i++) {
+		int i0 = (int)pos;
+		int i1 = i0 + 1;
+		if (i1 >= avail) {
+			if (!eof) break;
+			if (i0 >= avail) return i;
+			i1 = i0;
+		}
+		int j0 = r + i0; if (j0 >= R) j0 -= R;
+		int j1 = r + i1; if (j1 >= R) j1 -= R;
+		const float * f0 = s.ring + j0 * chans;
+		const float * f1 = s.ring + j1 * chans;
+		float a = (float)(pos - i0);
+		if (chans == 1) {
+			float x = f0[0] + a * (f1[0] - f0[0]);
+			outl[i] += x * gl;
+			outr[i] += x * gr;
+		} else {
+			outl[i] += (f0[0] + a * (f1[0] - f0[0])) * gl;
+			outr[i] += (f0[1] + a * (f1[1] - f0[1])) * gr;
+		}
+		pos += rate;
+	}
+	if (i < n) s.underruns++;
+	
+	// hand the frames passed over back to the I/O thread:
+	int k = (int)pos;
+	if (k > avail) k = avail;
+	pos -= k;
+	r += k;
+	if (r >= R) r -= R;
+	av_atomic_store(&s.read, r);
+	v.pos = pos;
+	av_audio_stream_signal();
+	
+	// (only the frames played count against the duration, so an underrun doesn't cut it short)
+	v.remain -= i;
+	return v.remain > 0. ? frames : n;
+}
+
+// offline rendering: give the I/O thread time to keep ahead of the stream voices
+static void av_audio_streams_wait(int frames) {
+	for (int i=0; i<mixer.nactive; i++) {
+		const av_AudioVoice& v = mixer.voices[mixer.active[i]];
+		if (v.stream < 0) continue;
+		av_AudioStream& s = streams[v.stream];
+		int need = (int)(v.pos + v.rate * frames) + 2;
+		if (need > s.ringframes - 1) need = s.ringframes - 1;
+		for (int tries = 0; tries < 2000; tries++) {
+			if (av_atomic_load(&s.eof) && !av_atomic_load(&s.loop)) break;
+			if (av_atomic_load(&s.seekgen) != v.seekgen) break;
+			int avail = av_atomic_load(&s.write) - s.read;
+			if (avail < 0) avail += s.ringframes;
+			if (avail >= need) break;
+			av_sleep(0.0005);
+		}
+	}
+}
+
+// open a stream of a file with the given number of frames & channels, reading up to
+// ringframes ahead, and looping as for av_audio_stream_loop()
+// the stream takes ownership of the file, and closes it when released
+// returns a stream id, or -1 if none is available
+AV_EXPORT int av_audio_stream_open(void * file, av_audio_stream_read_fn read_fn, av_audio_stream_seek_fn seek_fn, av_audio_stream_close_fn close_fn, int frames, int channels, int ringframes, int loop, int loopstart, int loopend) {
+	if (!file || !read_fn || !seek_fn || frames < 1 || channels < 1) return -1;
+	int id = -1;
+	for (int i=0; i<AV_AUDIO_MAX_STREAMS; i++) {
+		if (av_atomic_load(&streams[i].state) == AV_AUDIO_STREAM_FREE) {
+			id = i;
+			break;
+		}
+	}
+	if (id < 0) return -1;
+	
+	if (ringframes < 2 * AV_AUDIO_STREAM_CHUNK) ringframes = 2 * AV_AUDIO_STREAM_CHUNK;
+	if (ringframes > AV_AUDIO_STREAM_MAX_RING) ringframes = AV_AUDIO_STREAM_MAX_RING;
+	av_AudioStream& s = streams[id];
+	s.ring = (float *)av_aligned_calloc(ringframes * channels, sizeof(float));
+	if (!s.ring) return -1;
+	s.file = file;
+	s.read_fn = read_fn;
+	s.seek_fn = seek_fn;
+	s.close_fn = close_fn;
+	s.ringframes = ringframes;
+	s.channels = channels;
+	s.frames = frames;
+	s.seek_request = s.seek_handled = 0;
+	s.seek_frame = 0;
+	s.pos = 0;
+	s.write = s.read = 0;
+	s.eof = 0;
+	s.seekgen = 0;
+	s.seekframe[0] = s.seekframe[1] = 0;
+	s.underruns = 0;
+	av_audio_stream_loop(id, loop, loopstart, loopend);
+	
+	// read ahead now, so that playback can begin at once:
+	av_audio_stream_fill(s);
+	av_atomic_store(&s.state, AV_AUDIO_STREAM_OPEN);
+	
+	if (!av_atomic_load(&stream_running)) {
+		static int exit_registered = 0;
+		if (av_semaphore_init(&stream_wake)) {
+			fprintf(stderr, "unable to start the audio streaming thread\n");
+			return id;
+		}
+		stream_running = 1;
+		if (av_thread_create(&stream_thread, av_audio_stream_main, 0)) {
+			fprintf(stderr, "unable to start the audio streaming thread\n");
+			stream_running = 0;
+			av_semaphore_destroy(&stream_wake);
+		} else if (!exit_registered) {
+			atexit(av_audio_streams_exit);
+			exit_registered = 1;
+		}
+	}
+	return id;
+}
+
+// play an open stream in a native voice; returns a voice handle, or -1 if no voice is available
+// a stream can only be played by one voice, once
+AV_EXPORT int av_audio_stream_play(int id, double gain, double pan, double rate, double duration) {
+	if (id < 0 || id >= AV_AUDIO_MAX_STREAMS || streams[id].state != AV_AUDIO_STREAM_OPEN) return -1;
+	av_AudioCommand * cmd;
+	int handle = av_audio_voice_claim(&cmd);
+	if (handle < 0) return -1;
+	
+	av_AudioVoice& v = cmd->voice;
+	memset(&v, 0, sizeof(v));
+	v.frames = streams[id].frames;
+	v.channels = streams[id].channels;
+	v.handle = handle;
+	v.rate = rate;
+	v.gain = gain;
+	v.pan = pan;
+	// (in whole frames, as for av_audio_voice_start)
+	v.remain = duration > 0. ? floor(duration + 0.5) : HUGE_VAL;
+	v.at_block = voice_at_block;
+	v.at_frame = voice_at_frame;
+	v.stream = id;
+	v.seekgen = 0;
+	
+	cmd->type = AV_AUDIO_CMD_START;
+	cmd->handle = handle;
+	av_audio_command_send();
+	return handle;
+}
+
+// continue reading from the given frame of the file
+AV_EXPORT void av_audio_stream_seek(int id, int frame) {
+	if (id < 0 || id >= AV_AUDIO_MAX_STREAMS) return;
+	av_AudioStream& s = streams[id];
+	av_atomic_store(&s.seek_frame, frame);
+	av_atomic_add(&s.seek_request, 1);
+	av_audio_stream_signal();
+}
+
+// loop (or stop looping) a region of the file, in frames; an end of 0 means the end of the file
+AV_EXPORT void av_audio_stream_loop(int id, int loop, int start, int end) {
+	if (id < 0 || id >= AV_AUDIO_MAX_STREAMS) return;
+	av_AudioStream& s = streams[id];
+	if (end <= 0 || end > s.frames) end = s.frames;
+	if (start < 0) start = 0;
+	if (start >= end) loop = 0;
+	av_atomic_store(&s.loopstart, start);
+	av_atomic_store(&s.loopend, end);
+	av_atomic_store(&s.loop, loop);
+	av_audio_stream_signal();
+}
+
+// how many blocks a voice playing this stream has found its ring empty
+AV_EXPORT int av_audio_stream_underruns(int id) {
+	if (id < 0 || id >= AV_AUDIO_MAX_STREAMS) return 0;
+	return av_atomic_load(&streams[id].underruns);
+}
+
+// release a stream (and close its file); it must no longer be playing
+AV_EXPORT void av_audio_stream_close(int id) {
+	if (id < 0 || id >= AV_AUDIO_MAX_STREAMS) return;
+	av_atomic_store(&streams[id].state, AV_AUDIO_STREAM_CLOSING);
+	av_audio_stream_signal();
+}
+
+/*
+	Shared sample cache.
+	
+	buffer.load goes through a process-wide cache of sample data keyed by absolute path (plus 
+	the conversion settings, if any), so a script that loads the same file repeatedly reads or
+	decodes it only once. A buffer loaded as shared uses the entry's samples in place, and holds
+	a reference to it; other buffers copy the samples out. Released entries stay cached, and 
+	the least recently used of them are freed whenever the cache grows past its byte budget. 
+	An entry whose file has since changed on disk is no longer found.
+	
+	Files whose data is already stored as a buffer can hold it (16-bit, 32-bit float or 64-bit 
+	float WAV or W64) are memory-mapped rather than read, on a little-endian machine (these 
+	formats are little-endian): the pages are copy-on-write, so writing into a shared buffer 
+	never touches the file, though other shared buffers of the entry see it. Anything else is 
+	decoded (by audio.buffer, through libsndfile) into memory allocated by the entry.
+	
+	Only use from the main thread.
+*/
+
+// the part of an entry visible to Lua:
+typedef struct av_AudioSample {
+	void * samples;
+	int frames, channels;
+	double samplerate;
+	int refs, mapped;
+	int type, dummy;			// AV_AUDIO_FLOAT32 etc.
+} av_AudioSample;
+
+typedef struct av_AudioCacheEntry {
+	av_AudioSample sample;		// must be first
+	struct av_AudioCacheEntry * next;
+	char * key;
+	char * path;
+	// identity of the file when it was cached:
+	long long mtime, filesize;
+	size_t bytes;
+	unsigned long long used;	// LRU stamp
+	int stale;
+	// the mapping, if any:
+	void * map;
+	size_t maplen;
+	#ifdef AV_WINDOWS
+	HANDLE file, mapping;
+	#endif
+} av_AudioCacheEntry;
+
+static av_AudioCacheEntry * cache_entries = 0;
+static size_t cache_bytes = 0;
+static size_t cache_budget = 256 * 1024 * 1024;
+static unsigned long long cache_clock = 0;
+
+static char * av_audio_cache_strdup(const char * s) {
+	size_t len = strlen(s) + 1;
+	char * d = (char *)malloc(len);
+	if (d) memcpy(d, s, len);
+	return d;
+}
+
+// the modification time & size of a file; returns 0 if it can't be found
+static int av_audio_cache_stat(const char * path, long long * mtime, long long * filesize) {
+	#ifdef AV_WINDOWS
+		struct _stat64 st;
+		if (_stat64(path, &st)) return 0;
+	#else
+		struct stat st;
+		if (stat(path, &st)) return 0;
+	#endif
+	*mtime = (long long)st.st_mtime;
+	*filesize = (long long)st.st_size;
+	return 1;
+}
+
+// the absolute path of a file, with links resolved, or NULL if it can't be found
+// (valid until the next call)
+AV_EXPORT const char * av_audio_cache_realpath(const char * path) {
+	static char resolved[AV_PATH_MAX];
+	#ifdef AV_WINDOWS
+		if (!_fullpath(resolved, path, AV_PATH_MAX)) return 0;
+	#else
+		if (!realpath(path, resolved)) return 0;
+	#endif
+	return resolved;
+}
+
+// whether samples stored little-endian (as in WAV & W64 files) can be used in place
+static int av_audio_cache_little_endian() {
+	const unsigned short one = 1;
+	return *(const unsigned char *)&one;
+}
+
+static void av_audio_cache_free(av_AudioCacheEntry * e) {
+	if (e->map) {
+		#ifdef AV_WINDOWS
+			UnmapViewOfFile(e->map);
+			CloseHandle(e->mapping);
+			CloseHandle(e->file);
+		#else
+			munmap(e->map, e->maplen);
+		#endif
+	} else {
+		av_aligned_free(e->sample.samples);
+	}
+	cache_bytes -= e->bytes;
+	free(e->key);
+	free(e->path);
+	free(e);
+}
+
+// unlink & free an entry
+static void av_audio_cache_remove(av_AudioCacheEntry * e) {
+	av_AudioCacheEntry ** p = &cache_entries;
+	while (*p && *p != e) p = &(*p)->next;
+	if (*p) *p = e->next;
+	av_audio_cache_free(e);
+}
+
+// free unreferenced entries, least recently used first, until the cache fits its budget
+static void av_audio_cache_trim(size_t budget) {
+	while (cache_bytes > budget) {
+		av_AudioCacheEntry * lru = 0;
+		for (av_AudioCacheEntry * e = cache_entries; e; e = e->next) {
+			if (e->sample.refs == 0 && (!lru || e->used < lru->used)) lru = e;
+		}
+		if (!lru) return;	// everything left is in use
+		av_audio_cache_remove(lru);
+	}
+}
+
+static av_AudioCacheEntry * av_audio_cache_add(const char * key, const char * path, long long mtime, long long filesize) {
+	av_AudioCacheEntry * e = (av_AudioCacheEntry *)calloc(1, sizeof(av_AudioCacheEntry));
+	if (!e) return 0;
+	e->key = av_audio_cache_strdup(key);
+	e->path = av_audio_cache_strdup(path);
+	if (!e->key || !e->path) {
+		free(e->key);
+		free(e->path);
+		free(e);
+		return 0;
+	}
+	e->mtime = mtime;
+	e->filesize = filesize;
+	e->sample.refs = 1;
+	e->used = ++cache_clock;
+	e->next = cache_entries;
+	cache_entries = e;
+	return e;
+}
+
+static unsigned av_audio_cache_u16(const unsigned char * p) { return p[0] | (p[1] << 8); }
+static unsigned av_audio_cache_u32(const unsigned char * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24); }
+static unsigned long long av_audio_cache_u64(const unsigned char * p) { 
+	return av_audio_cache_u32(p) | ((unsigned long long)av_audio_cache_u32(p + 4) << 32); 
+}
+
+// check a WAVE format chunk for samples of a buffer type, & read the type, channels & samplerate:
+static int av_audio_cache_fmt(const unsigned char * p, size_t len, int * type, int * channels, double * samplerate) {
+	if (len < 16) return 0;
+	unsigned tag = av_audio_cache_u16(p);
+	unsigned bits = av_audio_cache_u16(p + 14);
+	// WAVE_FORMAT_EXTENSIBLE carries the real tag at the start of its subformat GUID:
+	if (tag == 0xFFFE && len >= 26) tag = av_audio_cache_u16(p + 24);
+	if (tag == 1 && bits == 16) {
+		*type = AV_AUDIO_INT16;
+	} else if (tag == 3 && bits == 32) {
+		*type = AV_AUDIO_FLOAT32;
+	} else if (tag == 3 && bits == 64) {
+		*type = AV_AUDIO_FLOAT64;
+	} else {
+		return 0;
+	}
+	*channels = av_audio_cache_u16(p + 2);
+	*samplerate = av_audio_cache_u32(p + 4);
+	return *channels > 0 && *samplerate > 0;
+}
+
+// find the data chunk of a WAV or W64 file of a buffer type; returns 0 if there isn't one
+static int av_audio_cache_parse(const unsigned char * p, size_t len, int * type, int * channels, double * samplerate, size_t * offset, size_t * bytes) {
+	static const unsigned char w64_riff[16] = { 'r','i','f','f', 0x2E,0x91,0xCF,0x11, 0xA5,0xD6,0x28,0xDB, 0x04,0xC1,0x00,0x00 };
+	// the W64 'wave', 'fmt ' & 'data' GUIDs share this suffix:
+	static const unsigned char w64_suffix[12] = { 0xF3,0xAC,0xD3,0x11, 0x8C,0xD1,0x00,0xC0, 0x4F,0x8E,0xDB,0x8A };
+	int hasfmt = 0;
+	if (len >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WAVE", 4)) {
+		size_t pos = 12;
+		while (pos + 8 <= len) {
+			size_t size = av_audio_cache_u32(p + pos + 4);
+			const unsigned char * body = p + pos + 8;
+			if (!memcmp(p + pos, "fmt ", 4)) {
+				if (size > len - pos - 8 || !av_audio_cache_fmt(body, size, type, channels, samplerate)) return 0;
+				hasfmt = 1;
+			} else if (!memcmp(p + pos, "data", 4)) {
+				if (!hasfmt) return 0;
+				*offset = pos + 8;
+				*bytes = size < len - *offset ? size : len - *offset;
+				return 1;
+			}
+			pos += 8 + size + (size & 1);
+		}
+	} else if (len >= 40 && !memcmp(p, w64_riff, 16) && !memcmp(p + 24, "wave", 4) && !memcmp(p + 28, w64_suffix, 12)) {
+		size_t pos = 40;
+		while (pos + 24 <= len) {
+			unsigned long long size = av_audio_cache_u64(p + pos + 16);
+			if (size < 24 || size > len - pos) {
+				// tolerate a data chunk truncated by an unfinished write:
+				if (size < 24 || memcmp(p + pos, "data", 4)) return 0;
+				size = len - pos;
+			}
+			const unsigned char * body = p + pos + 24;
+			if (memcmp(p + pos + 4, w64_suffix, 12)) {
+				// not a chunk we know
+			} else if (!memcmp(p + pos, "fmt ", 4)) {
+				if (!av_audio_cache_fmt(body, (size_t)size - 24, type, channels, samplerate)) return 0;
+				hasfmt = 1;
+			} else if (!memcmp(p + pos, "data", 4)) {
+				if (!hasfmt) return 0;
+				*offset = pos + 24;
+				*bytes = (size_t)size - 24;
+				return 1;
+			}
+			pos += (size_t)((size + 7) & ~7ULL);
+		}
+	}
+	return 0;
+}
+
+// look up a cached entry, adding a reference to it; returns NULL if it is not cached
+// (or its file has changed since)
+AV_EXPORT av_AudioSample * av_audio_cache_get(const char * key) {
+	for (av_AudioCacheEntry * e = cache_entries; e; e = e->next) {
+		if (e->stale || strcmp(e->key, key)) continue;
+		long long mtime, filesize;
+		if (!av_audio_cache_stat(e->path, &mtime, &filesize) || mtime != e->mtime || filesize != e->filesize) {
+			// buffers still using it keep it alive, but it won't be found again:
+			if (e->sample.refs) {
+				e->stale = 1;
+			} else {
+				av_audio_cache_remove(e);
+			}
+			return 0;
+		}
+		e->sample.refs++;
+		e->used = ++cache_clock;
+		return &e->sample;
+	}
+	return 0;
+}
+
+// cache a file by mapping it into memory, if its data can be used in place as the given type
+// (or as any type, if type < 0); returns the entry, with one reference, or NULL
+AV_EXPORT av_AudioSample * av_audio_cache_map(const char * key, const char * path, int type) {
+	long long mtime, filesize;
+	if (!av_audio_cache_little_endian()) return 0;
+	if (!av_audio_cache_stat(path, &mtime, &filesize) || filesize <= 0) return 0;
+	size_t len = (size_t)filesize;
+	void * map = 0;
+	#ifdef AV_WINDOWS
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return 0;
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (mapping) map = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		if (!map) {
+			if (mapping) CloseHandle(mapping);
+			CloseHandle(file);
+			return 0;
+		}
+	#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return 0;
+		map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		// the mapping keeps the file open:
+		close(fd);
+		if (map == MAP_FAILED) return 0;
+	#endif
+	
+	int filetype = -1, channels = 0;
+	double samplerate = 0;
+	size_t offset = 0, bytes = 0;
+	av_AudioCacheEntry * e = 0;
+	// the data must be aligned for its type (always so in W64):
+	if (av_audio_cache_parse((const unsigned char *)map, len, &filetype, &channels, &samplerate, &offset, &bytes) 
+		&& (type < 0 || type == filetype)
+		&& (offset % av_audio_type_size[filetype]) == 0
+		&& bytes >= (size_t)channels * av_audio_type_size[filetype]) {
+		e = av_audio_cache_add(key, path, mtime, filesize);
+	}
+	if (!e) {
+		#ifdef AV_WINDOWS
+			UnmapViewOfFile(map);
+			CloseHandle(mapping);
+			CloseHandle(file);
+		#else
+			munmap(map, len);
+		#endif
+		return 0;
+	}
+	#ifdef AV_WINDOWS
+		e->file = file;
+		e->mapping = mapping;
+	#else
+		// the whole file will be read:
+		madvise(map, len, MADV_WILLNEED);
+	#endif
+	e->map = map;
+	e->maplen = len;
+	e->bytes = len;
+	e->sample.samples = (char *)map + offset;
+	e->sample.frames = (int)(bytes / ((size_t)channels * av_audio_type_size[filetype]));
+	e->sample.channels = channels;
+	e->sample.type = filetype;
+	e->sample.samplerate = samplerate;
+	e->sample.mapped = 1;
+	cache_bytes += len;
+	av_audio_cache_trim(cache_budget);
+	return &e->sample;
+}
+
+// cache zeroed memory for frames * channels samples of a type, which the caller decodes a file into;
+// returns the entry, with one reference, or NULL
+AV_EXPORT av_AudioSample * av_audio_cache_alloc(const char * key, const char * path, int type, int frames, int channels, double samplerate) {
+	long long mtime = 0, filesize = 0;
+	if (type < 0 || type >= AV_AUDIO_TYPE_COUNT || frames <= 0 || channels <= 0) return 0;
+	av_audio_cache_stat(path, &mtime, &filesize);
+	void * samples = av_aligned_calloc((size_t)frames * channels, av_audio_type_size[type]);
+	if (!samples) return 0;
+	av_AudioCacheEntry * e = av_audio_cache_add(key, path, mtime, filesize);
+	if (!e) {
+		av_aligned_free(samples);
+		return 0;
+	}
+	e->bytes = (size_t)frames * channels * av_audio_type_size[type];
+	e->sample.samples = samples;
+	e->sample.frames = frames;
+	e->sample.channels = channels;
+	e->sample.type = type;
+	e->sample.samplerate = samplerate;
+	cache_bytes += e->bytes;
+	av_audio_cache_trim(cache_budget);
+	return &e->sample;
+}
+
+// drop a reference to an entry; unreferenced entries may be evicted from now on
+AV_EXPORT void av_audio_cache_release(av_AudioSample * sample) {
+	av_AudioCacheEntry * e = (av_AudioCacheEntry *)sample;
+	if (!e || e->sample.refs <= 0) return;
+	if (--e->sample.refs == 0) {
+		if (e->stale) {
+			av_audio_cache_remove(e);
+		} else {
+			av_audio_cache_trim(cache_budget);
+		}
+	}
+}
+
+// drop a reference to an entry that should not be found again (e.g. one that failed to decode)
+AV_EXPORT void av_audio_cache_discard(av_AudioSample * sample) {
+	av_AudioCacheEntry * e = (av_AudioCacheEntry *)sample;
+	if (!e) return;
+	e->stale = 1;
+	av_audio_cache_release(sample);
+}
+
+// set the byte budget (if bytes >= 0), evicting as needed; returns the bytes now cached
+AV_EXPORT double av_audio_cache_budget(double bytes) {
+	if (bytes >= 0) {
+		cache_budget = (size_t)bytes;
+		av_audio_cache_trim(cache_budget);
+	}
+	return (double)cache_bytes;
+}
+
+// free every unreferenced entry
+AV_EXPORT void av_audio_cache_purge() {
+	av_audio_cache_trim(0);
+}
+
+/*
+	Native unit-generator graph.
+	
+	Nodes process the signal in chunks of AV_AUDIO_UGEN_BLOCK frames into aligned 
+	float buffers, in the order they were created (so a node normally reads the
+	current chunk of its inputs; an input created later is read one chunk late). 
+	Filter coefficients are derived at control rate, i.e. once per chunk, and only 
+	when their control inputs change. 
+	
+	As with voices, the graph belongs to the audio thread; the main thread builds 
+	and patches it through the command queue, and only manages the free slots.
+	
+	The main thread also counts the holds on each node: one for its handle, and one
+	for each input reading from it. A node nothing holds any more leaves the graph,
+	and lets go of its own inputs, so that freeing an output node (or dropping the 
+	handles of the nodes feeding it) removes the whole chain. (Nodes in a feedback loop 
+	hold each other, until one of the loop's inputs is set elsewhere.) Ids carry a generation, 
+	as voice handles do, so that a stale id never addresses the node that reuses its slot.
+*/
+
+#define AV_AUDIO_MAX_UGENS 1024
+#define AV_AUDIO_UGEN_INPUTS 6
+#define AV_AUDIO_UGEN_OUTPUTS 4
+#define AV_AUDIO_UGEN_BLOCK 64
+#define AV_AUDIO_SINE_TABLE 4096	// must be a power of two
+
+enum {
+	AV_AUDIO_UGEN_PHASOR = 0,	// (freq)
+	AV_AUDIO_UGEN_SINE,			// (freq)
+	AV_AUDIO_UGEN_SAW,			// (freq, feedback), as blsaw1 in dsp.lua
+	AV_AUDIO_UGEN_SQUARE,		// (freq, feedback), as blsqr in dsp.lua
+	AV_AUDIO_UGEN_NOISE,		// ()
+	AV_AUDIO_UGEN_ONEPOLE,		// (input, cutoff)
+	AV_AUDIO_UGEN_LORES,		// (input, cutoff, res)
+	AV_AUDIO_UGEN_SVF,			// (input, freq, q) -> lowpass, highpass, bandpass, notch
+	AV_AUDIO_UGEN_BIQUAD,		// (input, a0, a1, a2, b1, b2)
+	AV_AUDIO_UGEN_DCBLOCK,		// (input)
+	AV_AUDIO_UGEN_ADD,			// (a, b)
+	AV_AUDIO_UGEN_MUL,			// (a, b)
+	AV_AUDIO_UGEN_OUT,			// (input, bus): adds into an output bus
+	AV_AUDIO_UGEN_COUNT
+};
+
+// the initial (constant) value of each input, per type:
+static const float av_audio_ugen_defaults[AV_AUDIO_UGEN_COUNT][AV_AUDIO_UGEN_INPUTS] = {
+	{ 440 }, { 440 }, { 440, 1 }, { 440, 1 }, { 0 },
+	{ 0, 1000 }, { 0, 1000, 0.5f }, { 0, 1000, 1 }, 
+	{ 0, 0.095f, 0, -0.095f, -1.8f, 0.81f },
+	{ 0 }, { 0, 0 }, { 0, 1 }, { 0, 0 }
+};
+
+typedef struct av_AudioUgenInput {
+	int src, out;		// the source node & its output, or src < 0 for a constant
+	float value;		// the constant
+	float dummy;
+} av_AudioUgenInput;
+
+typedef struct av_AudioUgen {
+	int type;
+	int dummy;
+	av_AudioUgenInput inputs[AV_AUDIO_UGEN_INPUTS];
+	// control values the coefficients were last derived from:
+	float control[AV_AUDIO_UGEN_INPUTS];
+	double coefs[AV_AUDIO_UGEN_INPUTS];
+	double state[AV_AUDIO_UGEN_INPUTS];
+} av_AudioUgen;
+
+typedef struct av_AudioGraph {
+	av_AudioUgen ugens[AV_AUDIO_MAX_UGENS];
+	// the nodes in processing order:
+	int order[AV_AUDIO_MAX_UGENS];
+	int count;
+	// AV_AUDIO_UGEN_OUTPUTS buffers of AV_AUDIO_UGEN_BLOCK frames per node:
+	float * outputs;
+	// where OUT nodes write the current chunk: frame i of bus c is at bus[i*framestride + c*busstride]
+	float * bus;
+	int buses, framestride, busstride;
+	unsigned int seed;
+} av_AudioGraph;
+
+static av_AudioGraph * graph = 0;
+static float sinetable[AV_AUDIO_SINE_TABLE + 1];
+
+// main-thread only: free slots, the id of the node in each slot (or -1), 
+// the slot each input reads from (or -1), and the holds on each node:
+static int ugen_free[AV_AUDIO_MAX_UGENS];
+static int ugen_nfree = 0;
+static int ugen_ids[AV_AUDIO_MAX_UGENS];
+static int ugen_generation[AV_AUDIO_MAX_UGENS];
+static int ugen_srcs[AV_AUDIO_MAX_UGENS][AV_AUDIO_UGEN_INPUTS];
+static int ugen_refs[AV_AUDIO_MAX_UGENS];
+static bool ugen_held[AV_AUDIO_MAX_UGENS];		// whether the handle still holds it
+// nodes to remove, once the command queue has room:
+static int ugen_dying[AV_AUDIO_MAX_UGENS];
+static int ugen_ndying = 0;
+
+static av_AudioGraph * av_audio_graph_create() {
+	av_AudioGraph * g = (av_AudioGraph *)calloc(1, sizeof(av_AudioGraph));
+	g->outputs = (float *)av_aligned_calloc(AV_AUDIO_MAX_UGENS * AV_AUDIO_UGEN_OUTPUTS * AV_AUDIO_UGEN_BLOCK, sizeof(float));
+	g->seed = 1;
+	return g;
+}
+
+static void av_audio_graph_destroy(av_AudioGraph * g) {
+	av_aligned_free(g->outputs);
+	free(g);
+}
+
+static void av_audio_ugens_init() {
+	static bool initialized = false;
+	if (initialized) return;
+	initialized = true;
+	for (int i=0; i<=AV_AUDIO_SINE_TABLE; i++) {
+		sinetable[i] = (float)sin(2. * 3.14159265358979323846 * i / AV_AUDIO_SINE_TABLE);
+	}
+	graph = av_audio_graph_create();
+	for (int i=0; i<AV_AUDIO_MAX_UGENS; i++) {
+		ugen_free[i] = AV_AUDIO_MAX_UGENS - 1 - i;
+		ugen_ids[i] = -1;
+		ugen_generation[i] = 0;
+	}
+	ugen_nfree = AV_AUDIO_MAX_UGENS;
+}
+
+static inline float * av_audio_ugen_output(av_AudioGraph * g, int id, int out) {
+	return g->outputs + (id * AV_AUDIO_UGEN_OUTPUTS + out) * AV_AUDIO_UGEN_BLOCK;
+}
+
+// the buffer feeding an input, or 0 if it is a constant:
+static inline const float * av_audio_ugen_signal(av_AudioGraph * g, const av_AudioUgenInput& in) {
+	return in.src >= 0 ? av_audio_ugen_output(g, in.src, in.out) : 0;
+}
+
+// the control-rate value of an input (its first frame in this chunk):
+static inline float av_audio_ugen_control(av_AudioGraph * g, const av_AudioUgenInput& in) {
+	return in.src >= 0 ? av_audio_ugen_output(g, in.src, in.out)[0] : in.value;
+}
+
+// returns true (and remembers the new values) if any of the first n control inputs changed:
+static inline bool av_audio_ugen_changed(av_AudioGraph * g, av_AudioUgen& u, int first, int n) {
+	bool changed = false;
+	for (int k=first; k<first+n; k++) {
+		float v = av_audio_ugen_control(g, u.inputs[k]);
+		if (v != u.control[k]) {
+			u.control[k] = v;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// sin(2 pi phase), for 0 <= phase < 1:
+static inline float av_audio_sine(double phase) {
+	double x = phase * AV_AUDIO_SINE_TABLE;
+	int i = (int)x;
+	float a = (float)(x - i);
+	return sinetable[i] + a * (sinetable[i+1] - sinetable[i]);
+}
+
+// wrap into 0 <= phase < 1:
+static inline double av_audio_wrap(double phase) {
+	if (phase >= 1. || phase < 0.) {
+		phase -= (double)(int)phase;
+		if (phase < 0.) phase += 1.;
+		if (phase >= 1.) phase = 0.;
+	}
+	return phase;
+}
+
+static inline double av_audio_clip(double x, double lo, double hi) {
+	return x < lo ? lo : x > hi ? hi : x;
+}
+
+// blsaw1 & blsqr: feedback-FM oscillators (see http://scp.web.elte.hu/papers/synthesis1.pdf)
+template<int SQUARE>
+static void av_audio_ugen_blosc(av_AudioGraph * g, av_AudioUgen& u, float * out, int n, double isr) {
+	const float * freq = av_audio_ugen_signal(g, u.inputs[0]);
+	const double feedback = av_audio_clip(av_audio_ugen_control(g, u.inputs[1]), 0., 1.);
+	double phase = u.state[0], avg = u.state[1], x1 = u.state[2], y1 = u.state[3];
+	for (int i=0; i<n; i++) {
+		double fn = (freq ? freq[i] : u.inputs[0].value) * isr;
+		phase = av_audio_wrap(phase + fn);
+		double t = 0.5 - fn;
+		double t2 = t*t;
+		double fb = 54. * t2*t2*t2 * feedback * (SQUARE ? -avg*avg : avg);
+		// sin(pi * (2*phase - 1 + fb)), where |fb| < 1; offset to keep the wrap branch-free:
+		double p = phase + 1.5 + 0.5*fb;
+		double x = av_audio_sine(p - (int)p);
+		double avg1, y;
+		if (SQUARE) {
+			avg1 = x + 0.55 * (avg - x);
+			x = avg1*1.9 - avg*0.9;
+		} else {
+			avg1 = x + 0.5 * (avg - x);
+			x = avg1*2.5 - avg*1.5;
+		}
+		avg = avg1;
+		x *= 1. - fn*2.;
+		// dc block:
+		y = x - x1 + y1*0.9997;
+		x1 = x;
+		y1 = y;
+		out[i] = (float)y;
+	}
+	u.state[0] = phase; u.state[1] = avg; u.state[2] = x1; u.state[3] = y1;
+}
+
+static void av_audio_ugen_process(av_AudioGraph * g, int id, int n, double samplerate) {
+	av_AudioUgen& u = g->ugens[id];
+	const double isr = 1. / samplerate;
+	const double twopi = 2. * 3.14159265358979323846;
+	float * out = av_audio_ugen_output(g, id, 0);
+	const float * in = av_audio_ugen_signal(g, u.inputs[0]);
+	const float in0 = u.inputs[0].value;
+	
+	switch (u.type) {
+		case AV_AUDIO_UGEN_PHASOR:
+		case AV_AUDIO_UGEN_SINE: {
+			double phase = u.state[0];
+			for (int i=0; i<n; i++) {
+				phase = av_audio_wrap(phase + (in ? in[i] : in0) * isr);
+				out[i] = u.type == AV_AUDIO_UGEN_SINE ? av_audio_sine(phase) : (float)phase;
+			}
+			u.state[0] = phase;
+		} break;
+		case AV_AUDIO_UGEN_SAW:
+			av_audio_ugen_blosc<0>(g, u, out, n, isr);
+			break;
+		case AV_AUDIO_UGEN_SQUARE:
+			av_audio_ugen_blosc<1>(g, u, out, n, isr);
+			break;
+		case AV_AUDIO_UGEN_NOISE: {
+			unsigned int seed = g->seed;
+			for (int i=0; i<n; i++) {
+				seed = seed * 1664525u + 1013904223u;
+				out[i] = (float)((seed >> 8) * (2. / (1 << 24)) - 1.);
+			}
+			g->seed = seed;
+		} break;
+		case AV_AUDIO_UGEN_ONEPOLE: {
+			if (av_audio_ugen_changed(g, u, 1, 1)) {
+				u.coefs[0] = av_audio_clip(sin(u.control[1] * twopi * isr), 0.0000001, 0.99999);
+			}
+			const double a = u.coefs[0];
+			double y = u.state[0];
+			for (int i=0; i<n; i++) {
+				y += a * ((in ? in[i] : in0) - y);
+				out[i] = (float)y;
+			}
+			u.state[0] = y;
+		} break;
+		case AV_AUDIO_UGEN_LORES: {
+			if (av_audio_ugen_changed(g, u, 1, 2)) {
+				double a = cos(u.control[1] * twopi * isr);
+				double r = 0.882497 * exp(0.125 * av_audio_clip(u.control[2], 0., 0.99999));
+				u.coefs[1] = -2. * a * r;
+				u.coefs[2] = r * r;
+				u.coefs[0] = 1. + u.coefs[1] + u.coefs[2];
+			}
+			const double gain = u.coefs[0], a1 = u.coefs[1], a2 = u.coefs[2];
+			double y1 = u.state[0], y2 = u.state[1];
+			for (int i=0; i<n; i++) {
+				double y = (in ? in[i] : in0) * gain - (a1 * y1 + a2 * y2);
+				y2 = y1;
+				y1 = y;
+				out[i] = (float)y;
+			}
+			u.state[0] = y1; u.state[1] = y2;
+		} break;
+		case AV_AUDIO_UGEN_SVF: {
+			if (av_audio_ugen_changed(g, u, 1, 2)) {
+				double freq = av_audio_clip(u.control[1], 1., 20000.);
+				u.coefs[0] = 2. * sin(0.5 * twopi * freq * isr);
+				u.coefs[1] = 1. / av_audio_clip(u.control[2], 0.5, 100.);
+			}
+			const double f1 = u.coefs[0], q1 = u.coefs[1];
+			float * hp = av_audio_ugen_output(g, id, 1);
+			float * bp = av_audio_ugen_output(g, id, 2);
+			float * np = av_audio_ugen_output(g, id, 3);
+			double d1 = u.state[0], d2 = u.state[1];
+			for (int i=0; i<n; i++) {
+				double L = d2 + f1*d1;
+				double H = (in ? in[i] : in0) - L - q1*d1;
+				double B = f1*H + d1;
+				d1 = B;
+				d2 = L;
+				out[i] = (float)L;
+				hp[i] = (float)H;
+				bp[i] = (float)B;
+				np[i] = (float)(H + L);
+			}
+			u.state[0] = d1; u.state[1] = d2;
+		} break;
+		case AV_AUDIO_UGEN_BIQUAD: {
+			if (av_audio_ugen_changed(g, u, 1, 5)) {
+				for (int k=0; k<5; k++) u.coefs[k] = u.control[k+1];
+			}
+			const double a0 = u.coefs[0], a1 = u.coefs[1], a2 = u.coefs[2], b1 = u.coefs[3], b2 = u.coefs[4];
+			double x1 = u.state[0], x2 = u.state[1], y1 = u.state[2], y2 = u.state[3];
+			for (int i=0; i<n; i++) {
+				double x = in ? in[i] : in0;
+				double y = (x2 * a2 + x1 * a1 + x * a0) - (y1 * b1 + y2 * b2);
+				x2 = x1; x1 = x;
+				y2 = y1; y1 = y;
+				out[i] = (float)y;
+			}
+			u.state[0] = x1; u.state[1] = x2; u.state[2] = y1; u.state[3] = y2;
+		} break;
+		case AV_AUDIO_UGEN_DCBLOCK: {
+			double x1 = u.state[0], y1 = u.state[1];
+			for (int i=0; i<n; i++) {
+				double x = in ? in[i] : in0;
+				double y = x - x1 + y1*0.9997;
+				x1 = x;
+				y1 = y;
+				out[i] = (float)y;
+			}
+			u.state[0] = x1; u.state[1] = y1;
+		} break;
+		case AV_AUDIO_UGEN_ADD:
+		case AV_AUDIO_UGEN_MUL: {
+			const float * b = av_audio_ugen_signal(g, u.inputs[1]);
+			const float b0 = u.inputs[1].value;
+			const bool mul = u.type == AV_AUDIO_UGEN_MUL;
+			if (in && b) {
+				if (mul) for (int i=0; i<n; i++) out[i] = in[i] * b[i];
+				else for (int i=0; i<n; i++) out[i] = in[i] + b[i];
+			} else if (in || b) {
+				const float * x = in ? in : b;
+				const float k = in ? b0 : in0;
+				if (mul) for (int i=0; i<n; i++) out[i] = x[i] * k;
+				else for (int i=0; i<n; i++) out[i] = x[i] + k;
+			} else {
+				const float k = mul ? in0 * b0 : in0 + b0;
+				for (int i=0; i<n; i++) out[i] = k;
+			}
+		} break;
+		case AV_AUDIO_UGEN_OUT: {
+			int c = (int)av_audio_ugen_control(g, u.inputs[1]);
+			if (!g->bus || c < 0 || c >= g->buses) break;
+			float * dst = g->bus + c * g->busstride;
+			const int fs = g->framestride;
+			if (in) {
+				for (int i=0; i<n; i++) dst[i * fs] += in[i];
+			} else if (in0 != 0.f) {
+				for (int i=0; i<n; i++) dst[i * fs] += in0;
+			}
+		} break;
+		default:
+			break;
+	}
+}
+
+// audio thread: run the whole graph, adding the OUT nodes into frames of buses
+// (planar: one run of frames per bus; otherwise interleaved)
+static void av_audio_graph_render(av_AudioGraph * g, float * bus, int buses, int frames, int planar, double samplerate) {
+	g->buses = buses;
+	g->framestride = planar ? 1 : buses;
+	g->busstride = planar ? frames : 1;
+	for (int offset=0; offset<frames; offset += AV_AUDIO_UGEN_BLOCK) {
+		int n = frames - offset;
+		if (n > AV_AUDIO_UGEN_BLOCK) n = AV_AUDIO_UGEN_BLOCK;
+		g->bus = bus ? bus + offset * g->framestride : 0;
+		for (int k=0; k<g->count; k++) {
+			av_audio_ugen_process(g, g->order[k], n, samplerate);
+		}
+	}
+}
+
+// audio thread: command handlers
+static void av_audio_graph_add(av_AudioGraph * g, int id, int type) {
+	av_AudioUgen& u = g->ugens[id];
+	memset(&u, 0, sizeof(u));
+	u.type = type;
+	for (int k=0; k<AV_AUDIO_UGEN_INPUTS; k++) {
+		u.inputs[k].src = -1;
+		u.inputs[k].value = av_audio_ugen_defaults[type][k];
+		// force the coefficients to be derived at the first chunk:
+		u.control[k] = (float)HUGE_VAL;
+	}
+	memset(av_audio_ugen_output(g, id, 0), 0, sizeof(float) * AV_AUDIO_UGEN_OUTPUTS * AV_AUDIO_UGEN_BLOCK);
+	g->order[g->count++] = id;
+}
+
+static void av_audio_graph_remove(av_AudioGraph * g, int id) {
+	int j = 0;
+	for (int k=0; k<g->count; k++) {
+		int other = g->order[k];
+		if (other == id) continue;
+		g->order[j++] = other;
+		// disconnect anything it fed:
+		av_AudioUgen& u = g->ugens[other];
+		for (int i=0; i<AV_AUDIO_UGEN_INPUTS; i++) {
+			if (u.inputs[i].src == id) {
+				u.inputs[i].src = -1;
+				u.inputs[i].value = 0.f;
+			}
+		}
+	}
+	g->count = j;
+}
+
+// return every node to its state when created, keeping the connections:
+static void av_audio_graph_reset(av_AudioGraph * g) {
+	for (int k=0; k<g->count; k++) {
+		int id = g->order[k];
+		av_AudioUgen& u = g->ugens[id];
+		for (int i=0; i<AV_AUDIO_UGEN_INPUTS; i++) {
+			u.control[i] = (float)HUGE_VAL;
+			u.coefs[i] = 0.;
+			u.state[i] = 0.;
+		}
+		memset(av_audio_ugen_output(g, id, 0), 0, sizeof(float) * AV_AUDIO_UGEN_OUTPUTS * AV_AUDIO_UGEN_BLOCK);
+	}
+	g->seed = 1;
+}
+
+static void av_audio_graph_input(av_AudioGraph * g, int id, int input, int src, int out, float value) {
+	av_AudioUgenInput& in = g->ugens[id].inputs[input];
+	in.src = src;
+	in.out = out;
+	in.value = value;
+}
+
+static void av_audio_ugen_apply(const av_AudioCommand& cmd) {
+	switch (cmd.type) {
+		case AV_AUDIO_CMD_UGEN_NEW:
+			av_audio_graph_add(graph, cmd.handle, cmd.param);
+			break;
+		case AV_AUDIO_CMD_UGEN_INPUT:
+			av_audio_graph_input(graph, cmd.handle, cmd.param, cmd.row, cmd.col, (float)cmd.value);
+			break;
+		case AV_AUDIO_CMD_UGEN_FREE:
+			av_audio_graph_remove(graph, cmd.handle);
+			break;
+		default:
+			break;
+	}
+}
+
+// main thread: the slot of a node id, or -1 if there is no such node (any more)
+static int av_audio_ugen_slot(int id) {
+	if (id < 0) return -1;
+	int slot = id % AV_AUDIO_MAX_UGENS;
+	return ugen_ids[slot] == id ? slot : -1;
+}
+
+// send the removal of nodes nothing holds, as far as the command queue allows
+// (a slot is only reused once its removal is queued, since commands apply in order)
+static void av_audio_ugen_flush() {
+	while (ugen_ndying > 0) {
+		av_AudioCommand * cmd = av_audio_command_next();
+		if (!cmd) return;
+		int slot = ugen_dying[--ugen_ndying];
+		cmd->type = AV_AUDIO_CMD_UGEN_FREE;
+		cmd->handle = slot;
+		av_audio_command_send();
+		ugen_free[ugen_nfree++] = slot;
+	}
+}
+
+// drop a hold on a node; with none left, it goes, and lets go of its inputs in turn
+static void av_audio_ugen_release(int slot) {
+	if (--ugen_refs[slot] > 0) return;
+	ugen_ids[slot] = -1;
+	ugen_dying[ugen_ndying++] = slot;
+	for (int k=0; k<AV_AUDIO_UGEN_INPUTS; k++) {
+		int src = ugen_srcs[slot][k];
+		ugen_srcs[slot][k] = -1;
+		if (src >= 0) av_audio_ugen_release(src);
+	}
+}
+
+// create a node of the given type (AV_AUDIO_UGEN_*), held by the returned id until av_audio_ugen_free
+// returns its id, or -1 if none are available
+AV_EXPORT int av_audio_ugen_new(int type) {
+	av_audio_ugen_flush();
+	if (type < 0 || type >= AV_AUDIO_UGEN_COUNT || ugen_nfree < 1) return -1;
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return -1;
+	int slot = ugen_free[--ugen_nfree];
+	int id = slot + AV_AUDIO_MAX_UGENS * ugen_generation[slot];
+	ugen_generation[slot] = (ugen_generation[slot] + 1) % (1 << 20);
+	ugen_ids[slot] = id;
+	ugen_refs[slot] = 1;
+	ugen_held[slot] = true;
+	for (int k=0; k<AV_AUDIO_UGEN_INPUTS; k++) ugen_srcs[slot][k] = -1;
+	cmd->type = AV_AUDIO_CMD_UGEN_NEW;
+	cmd->handle = slot;
+	cmd->param = type;
+	av_audio_command_send();
+	return id;
+}
+
+// connect output out of node src to an input of node id, or if src < 0, set the input to a constant value
+// returns 0 if either node is gone, or the command queue is full
+AV_EXPORT int av_audio_ugen_input(int id, int input, int src, int out, double value) {
+	av_audio_ugen_flush();
+	int slot = av_audio_ugen_slot(id);
+	if (slot < 0 || input < 0 || input >= AV_AUDIO_UGEN_INPUTS) return 0;
+	int srcslot = src < 0 ? -1 : av_audio_ugen_slot(src);
+	if ((src >= 0 && srcslot < 0) || out < 0 || out >= AV_AUDIO_UGEN_OUTPUTS) return 0;
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_UGEN_INPUT;
+	cmd->handle = slot;
+	cmd->param = input;
+	cmd->row = srcslot;
+	cmd->col = out;
+	cmd->value = value;
+	av_audio_command_send();
+	
+	// the input holds its new source, and lets go of the old:
+	if (srcslot >= 0) ugen_refs[srcslot]++;
+	int old = ugen_srcs[slot][input];
+	ugen_srcs[slot][input] = srcslot;
+	if (old >= 0) av_audio_ugen_release(old);
+	av_audio_ugen_flush();
+	return 1;
+}
+
+// release the hold of a node's id: the node leaves the graph once no input reads from it either
+// (an output node at once), and so in turn do the nodes it read from
+// returns 0 if the id was already released
+AV_EXPORT int av_audio_ugen_free(int id) {
+	int slot = av_audio_ugen_slot(id);
+	if (slot < 0 || !ugen_held[slot]) return 0;
+	ugen_held[slot] = false;
+	av_audio_ugen_release(slot);
+	av_audio_ugen_flush();
+	return 1;
+}
+
+// process count nodes of one type, each fed by a shared sawtooth, in a private graph
+// returns the elapsed wall-clock time in seconds
+AV_EXPORT double av_audio_ugens_bench(int type, int count, int blocksize, int blocks) {
+	av_audio_ugens_init();
+	if (type < 0 || type >= AV_AUDIO_UGEN_COUNT) return 0.;
+	if (count > AV_AUDIO_MAX_UGENS - 1) count = AV_AUDIO_MAX_UGENS - 1;
+	av_AudioGraph * g = av_audio_graph_create();
+	av_audio_graph_add(g, 0, AV_AUDIO_UGEN_SAW);
+	for (int i=1; i<=count; i++) {
+		av_audio_graph_add(g, i, type);
+		if (type >= AV_AUDIO_UGEN_ONEPOLE) {
+			av_audio_graph_input(g, i, 0, 0, 0, 0.f);
+		} else {
+			// a spread of frequencies:
+			av_audio_graph_input(g, i, 0, -1, 0, 100.f + i);
+		}
+	}
+	double t0 = av_clock();
+	for (int b=0; b<blocks; b++) {
+		av_audio_graph_render(g, 0, 0, blocksize, 0, 44100.);
+	}
+	double elapsed = av_clock() - t0;
+	av_audio_graph_destroy(g);
+	return elapsed;
+}
+
+/*
+	Routing between device channels and ring (bus) channels.
+	
+	The rings carry outbuses/inbuses channels, independent of the device. 
+	Each callback, a gain matrix maps device inputs to input buses, and output 
+	buses to device outputs. The matrices belong to the audio thread, and are 
+	edited through the command queue, so they can change while the stream runs.
+*/
+
+#define AV_AUDIO_MAX_CHANNELS 32
+
+typedef struct av_AudioMatrix {
+	// gains[row * AV_AUDIO_MAX_CHANNELS + col] is the gain from source channel col to destination channel row:
+	float gains[AV_AUDIO_MAX_CHANNELS * AV_AUDIO_MAX_CHANNELS];
+	// cached test for a plain copy, valid for rows x cols (recomputed when these change):
+	int identity, rows, cols;
+} av_AudioMatrix;
+
+static av_AudioMatrix outmatrix;	// output buses -> device outputs
+static av_AudioMatrix inmatrix;		// device inputs -> input buses
+
+// planar scratch for deinterleaving, and a silent bus for underruns:
+static float * routein = 0;
+static float * routeout = 0;
+static float * silence = 0;
+
+static void av_audio_matrix_reset(av_AudioMatrix& mat) {
+	memset(mat.gains, 0, sizeof(mat.gains));
+	for (int i=0; i<AV_AUDIO_MAX_CHANNELS; i++) {
+		mat.gains[i * AV_AUDIO_MAX_CHANNELS + i] = 1.f;
+	}
+	mat.rows = mat.cols = -1;
+}
+
+static int av_audio_matrix_identity(av_AudioMatrix& mat, int rows, int cols) {
+	if (rows != mat.rows || cols != mat.cols) {
+		mat.rows = rows;
+		mat.cols = cols;
+		mat.identity = (rows == cols);
+		for (int m=0; m<rows && mat.identity; m++) {
+			for (int n=0; n<cols; n++) {
+				if (mat.gains[m * AV_AUDIO_MAX_CHANNELS + n] != (m == n ? 1.f : 0.f)) {
+					mat.identity = 0;
+					break;
+				}
+			}
+		}
+	}
+	return mat.identity;
+}
+
+// out[m][i] = sum over n of g[m][n] * in[n][i], for M outputs and N inputs
+// fixed sizes let the compiler keep the inputs in registers; SSE works across 4 frames at a time
+template<int M, int N>
+static void av_audio_matrix_kernel(const float * g, const float * const * in, float * const * out, int frames) {
+	int i = 0;
+	#ifdef AV_SSE
+	for (; i + 4 <= frames; i += 4) {
+		__m128 x[N];
+		for (int n=0; n<N; n++) x[n] = _mm_loadu_ps(in[n] + i);
+		for (int m=0; m<M; m++) {
+			const float * gm = g + m * AV_AUDIO_MAX_CHANNELS;
+			__m128 acc = _mm_mul_ps(_mm_load1_ps(gm), x[0]);
+			for (int n=1; n<N; n++) {
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load1_ps(gm + n), x[n]));
+			}
+			_mm_storeu_ps(out[m] + i, acc);
+		}
+	}
+	#endif
+	for (; i < frames; i++) {
+		for (int m=0; m<M; m++) {
+			const float * gm = g + m * AV_AUDIO_MAX_CHANNELS;
+			float acc = 0.f;
+			for (int n=0; n<N; n++) acc += gm[n] * in[n][i];
+			out[m][i] = acc;
+		}
+	}
+}
+
+// any other size; the inner loop runs over contiguous frames, so it still vectorizes:
+static void av_audio_matrix_generic(const float * g, const float * const * in, float * const * out, int rows, int cols, int frames) {
+	for (int m=0; m<rows; m++) {
+		const float * gm = g + m * AV_AUDIO_MAX_CHANNELS;
+		float * o = out[m];
+		memset(o, 0, sizeof(float) * frames);
+		for (int n=0; n<cols; n++) {
+			const float gain = gm[n];
+			if (gain == 0.f) continue;
+			const float * x = in[n];
+			for (int i=0; i<frames; i++) o[i] += gain * x[i];
+		}
+	}
+}
+
+static void av_audio_matrix_process(const av_AudioMatrix& mat, const float * const * in, float * const * out, int rows, int cols, int frames) {
+	const float * g = mat.gains;
+	if (rows == 2 && cols == 2) av_audio_matrix_kernel<2, 2>(g, in, out, frames);
+	else if (rows == 2 && cols == 8) av_audio_matrix_kernel<2, 8>(g, in, out, frames);
+	else if (rows == 8 && cols == 2) av_audio_matrix_kernel<8, 2>(g, in, out, frames);
+	else if (rows == 16 && cols == 16) av_audio_matrix_kernel<16, 16>(g, in, out, frames);
+	else av_audio_matrix_generic(g, in, out, rows, cols, frames);
+}
+
+// route one block from src (srcchans) to dst (dstchans), in the stream's layout
+// a null src is treated as silence
+static void av_audio_route(av_AudioMatrix& mat, const float * src, int srcchans, float * dst, int dstchans, int frames, int planar) {
+	if (!src || srcchans < 1) {
+		memset(dst, 0, sizeof(float) * frames * dstchans);
+		return;
+	}
+	if (av_audio_matrix_identity(mat, dstchans, srcchans)) {
+		memcpy(dst, src, sizeof(float) * frames * dstchans);
+		return;
+	}
+	const float * in[AV_AUDIO_MAX_CHANNELS];
+	float * out[AV_AUDIO_MAX_CHANNELS];
+	for (int c=0; c<srcchans; c++) {
+		if (planar) {
+			in[c] = src + c * frames;
+		} else {
+			// deinterleave:
+			float * x = routein + c * frames;
+			for (int i=0; i<frames; i++) x[i] = src[i * srcchans + c];
+			in[c] = x;
+		}
+	}
+	for (int c=0; c<dstchans; c++) {
+		out[c] = planar ? dst + c * frames : routeout + c * frames;
+	}
+	av_audio_matrix_process(mat, in, out, dstchans, srcchans, frames);
+	if (!planar) {
+		// interleave:
+		for (int c=0; c<dstchans; c++) {
+			const float * x = out[c];
+			for (int i=0; i<frames; i++) dst[i * dstchans + c] = x[i];
+		}
+	}
+}
+
+// set one gain of the output (matrix 0) or input (matrix 1) routing
+// a negative row or col resets that matrix to one-to-one routing
+AV_EXPORT int av_audio_route_set(int matrix, int row, int col, double gain) {
+	if (row >= AV_AUDIO_MAX_CHANNELS || col >= AV_AUDIO_MAX_CHANNELS) return 0;
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_ROUTE;
+	cmd->param = matrix;
+	cmd->row = row;
+	cmd->col = col;
+	cmd->value = gain;
+	av_audio_command_send();
+	return 1;
+}
+
+static void av_audio_route_apply(const av_AudioCommand& cmd) {
+	av_AudioMatrix& mat = cmd.param ? inmatrix : outmatrix;
+	if (cmd.row < 0 || cmd.col < 0) {
+		av_audio_matrix_reset(mat);
+	} else {
+		mat.gains[cmd.row * AV_AUDIO_MAX_CHANNELS + cmd.col] = (float)cmd.value;
+		mat.rows = mat.cols = -1;
+	}
+}
+
+// time the routing of one matrix size, with planar buffers
+// returns the elapsed wall-clock time in seconds
+AV_EXPORT double av_audio_route_bench(int rows, int cols, int blocksize, int blocks) {
+	if (rows > AV_AUDIO_MAX_CHANNELS) rows = AV_AUDIO_MAX_CHANNELS;
+	if (cols > AV_AUDIO_MAX_CHANNELS) cols = AV_AUDIO_MAX_CHANNELS;
+	av_AudioMatrix * mat = (av_AudioMatrix *)calloc(1, sizeof(av_AudioMatrix));
+	float * src = (float *)av_aligned_calloc(blocksize * cols, sizeof(float));
+	float * dst = (float *)av_aligned_calloc(blocksize * rows, sizeof(float));
+	for (int i=0; i<AV_AUDIO_MAX_CHANNELS * AV_AUDIO_MAX_CHANNELS; i++) mat->gains[i] = 1.f / (1 + i % 7);
+	for (int i=0; i<blocksize * cols; i++) src[i] = sin(i * 0.01);
+	mat->rows = rows;
+	mat->cols = cols;
+	mat->identity = 0;
+	
+	double t0 = av_time();
+	for (int b=0; b<blocks; b++) {
+		av_audio_route(*mat, src, cols, dst, rows, blocksize, 1);
+	}
+	double elapsed = av_time() - t0;
+	
+	av_aligned_free(dst);
+	av_aligned_free(src);
+	free(mat);
+	return elapsed;
+}
+
+// time RtAudio's conversion between float32 buffers (interleaved, or planar if planar is nonzero)
+// and interleaved device buffers of format (an RtAudioFormat), device to user if input is nonzero;
+// kernels is 0 for the scalar loops, 1 for the SSE2 kernels or 2 for the AVX2 kernels
+// returns the elapsed wall-clock time in seconds, or -1 if the kernels are unavailable here
+AV_EXPORT double av_audio_convert_bench(int format, int channels, int planar, int input, int frames, int blocks, int kernels) {
+	return rtaudioConvertBench((RtAudioFormat)format, channels, planar != 0, input != 0, frames, blocks, kernels, av_time);
+}
+
+
+// callback telemetry. only the audio thread writes it; other threads may read it at any time
+// (values are plain ints & doubles, so a reader may see one callback's update half-applied)
+#define AV_AUDIO_STATS_BINS 32
+
+typedef struct av_AudioStats {
+	// wall-clock duration of the last callback, and the longest since reset, in seconds:
+	double callback_last, callback_max;
+	// callback duration as a fraction of the block period: last, smoothed, and worst since reset:
+	double load, load_avg, load_max;
+	int callbacks;
+	// reported by the driver through RtAudioStreamStatus:
+	int input_overflows, output_underflows;
+	// the fewest & most blocks the ring has held at a callback since reset:
+	int fill_min, fill_max;
+	// callbacks counted by load, in steps of 1/16 of the block period
+	// (the last bin also counts everything slower):
+	int histogram[AV_AUDIO_STATS_BINS];
+} av_AudioStats;
+
+static av_AudioStats stats;
+
+static void av_audio_stats_clear() {
+	memset(&stats, 0, sizeof(stats));
+	stats.fill_min = 1 << 30;
+}
+
+// audio thread: account for one callback
+static void av_audio_stats_update(double elapsed, int frames, int ready, RtAudioStreamStatus status) {
+	double load = elapsed * audio.samplerate / frames;
+	stats.callback_last = elapsed;
+	if (elapsed > stats.callback_max) stats.callback_max = elapsed;
+	stats.load = load;
+	stats.load_avg += 0.01 * (load - stats.load_avg);
+	if (load > stats.load_max) stats.load_max = load;
+	
+	int bin = (int)(load * 16.);
+	if (bin > AV_AUDIO_STATS_BINS - 1) bin = AV_AUDIO_STATS_BINS - 1;
+	stats.histogram[bin]++;
+	stats.callbacks++;
+	
+	if (status & RTAUDIO_INPUT_OVERFLOW) stats.input_overflows++;
+	if (status & RTAUDIO_OUTPUT_UNDERFLOW) stats.output_underflows++;
+	if (ready < stats.fill_min) stats.fill_min = ready;
+	if (ready > stats.fill_max) stats.fill_max = ready;
+}
+
+AV_EXPORT av_AudioStats * av_audio_stats() {
+	return &stats;
+}
+
+// clear the telemetry; applied by the audio thread at its next callback
+AV_EXPORT int av_audio_stats_reset() {
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_STATS_RESET;
+	av_audio_command_send();
+	return 1;
+}
+
+/*
+	Recording to disk.
+	
+	After each callback, the audio thread copies the block it played (the output buses) 
+	and/or the block it received (the input buses) into the current recording's ring, as 
+	interleaved frames, outputs first; a writer thread drains the ring into a sound file. 
+	The audio thread never waits: if the ring is full, or the buses have changed since the 
+	recording began, the block is dropped and counted.
+	
+	Only one recording is current at a time, but a stopped recording's writer may still be 
+	finishing its file as the next begins, so each recording has its own slot, ring and 
+	thread. The writer sleeps on its slot's semaphore, which the audio thread posts after 
+	copying a block. Once the writer has closed the file, it marks the slot done; the main 
+	thread collects it with av_audio_record_done (as it collects finished voices), which joins 
+	the thread and frees the slot for reuse. At exit, any recording still going is stopped, 
+	and its writer drains the ring & closes the file (so that the header is complete) before 
+	the process ends.
+	
+	The file is written & closed through function pointers (libsndfile's sf_writef_float and
+	sf_close, as supplied by audio.record), as for streams.
+*/
+
+#define AV_AUDIO_MAX_RECORDINGS 4
+
+enum {
+	AV_AUDIO_RECORD_OUTPUT = 1,
+	AV_AUDIO_RECORD_INPUT = 2
+};
+
+enum {
+	AV_AUDIO_RECORDING_FREE = 0,
+	// from the start of a recording until the writer thread has closed the file:
+	AV_AUDIO_RECORDING_BUSY,
+	// finished, until collected by av_audio_record_done:
+	AV_AUDIO_RECORDING_DONE
+};
+
+// (signatures compatible with sf_writef_float & sf_close)
+typedef long long (*av_audio_record_write_fn)(void * file, const float * src, long long frames);
+typedef int (*av_audio_record_close_fn)(void * file);
+
+typedef struct av_AudioRecorder {
+	// set by the main thread before recording starts:
+	void * file;
+	av_audio_record_write_fn write_fn;
+	av_audio_record_close_fn close_fn;
+	float * ring;
+	int ringframes, channels;
+	int sources, dummy;
+	unsigned int outbuses, inbuses;		// of the rings when recording began
+	av_thread thread;
+	// posted when there is something for the writer to do (see av_audio_record_signal):
+	av_semaphore wake;
+	int wake_init;
+	
+	// main thread -> writer thread:
+	volatile int state, stopping;
+	
+	// written by the audio thread:
+	char pad0[AV_CACHELINE];
+	volatile int write;
+	// whether the audio thread may still copy into the ring:
+	volatile int tapping;
+	volatile int signalled;
+	// blocks recorded, blocks dropped for lack of room in the ring, 
+	// and blocks dropped because the buses no longer match the file:
+	volatile int blocks, dropped, changed;
+	
+	// written by the writer thread:
+	char pad1[AV_CACHELINE];
+	volatile int read;
+	char pad2[AV_CACHELINE];
+} av_AudioRecorder;
+
+static av_AudioRecorder recorders[AV_AUDIO_MAX_RECORDINGS];
+// the recording the audio thread copies into, or -1 for none:
+static volatile int record_current = -1;
+// audio thread only: the recording it copied into at the last callback:
+static int record_tapped = -1;
+
+static void av_audio_record_signal(av_AudioRecorder& rec) {
+	if (av_atomic_cas(&rec.signalled, 0, 1)) av_semaphore_post(&rec.wake);
+}
+
+// copy one block of buses (in the stream layout) into channels co.. of ring frames from w:
+static void av_audio_record_copy(av_AudioRecorder& rec, const float * src, int buses, int frames, int co, int w) {
+	const int R = rec.ringframes;
+	const int chans = rec.channels;
+	const int fs = audio.planar ? 1 : buses;
+	const int cs = audio.planar ? frames : 1;
+	for (int i=0; i<frames; i++) {
+		float * dst = rec.ring + w * chans + co;
+		const float * x = src + i * fs;
+		for (int c=0; c<buses; c++) dst[c] = x[c * cs];
+		if (++w == R) w = 0;
+	}
+}
+
+// audio thread: record the block just played and/or received
+static void av_audio_record_tap(const float * bus, const float * inblock, int frames) {
+	int cur = av_atomic_load(&record_current);
+	if (cur != record_tapped) {
+		// let the writer of the last recording finish:
+		if (record_tapped >= 0) {
+			av_atomic_store(&recorders[record_tapped].tapping, 0);
+			av_audio_record_signal(recorders[record_tapped]);
+		}
+		record_tapped = cur;
+	}
+	if (cur < 0) return;
+	
+	av_AudioRecorder& rec = recorders[cur];
+	if (audio.outbuses != rec.outbuses || audio.inbuses != rec.inbuses) {
+		// the buses have changed since recording began:
+		av_atomic_store(&rec.changed, rec.changed + 1);
+		return;
+	}
+	int w = rec.write;
+	int space = av_atomic_load(&rec.read) - w - 1;
+	if (space < 0) space += rec.ringframes;
+	if (space < frames) {
+		av_atomic_store(&rec.dropped, rec.dropped + 1);
+		return;
+	}
+	int co = 0;
+	if (rec.sources & AV_AUDIO_RECORD_OUTPUT) {
+		av_audio_record_copy(rec, bus, audio.outbuses, frames, co, w);
+		co += audio.outbuses;
+	}
+	if (rec.sources & AV_AUDIO_RECORD_INPUT) {
+		av_audio_record_copy(rec, inblock, audio.inbuses, frames, co, w);
+	}
+	w += frames;
+	if (w >= rec.ringframes) w -= rec.ringframes;
+	av_atomic_store(&rec.write, w);
+	av_atomic_store(&rec.blocks, rec.blocks + 1);
+	av_audio_record_signal(rec);
+}
+
+// writer thread: write out everything in the ring
+static void av_audio_record_drain(av_AudioRecorder& rec) {
+	const int R = rec.ringframes;
+	int r = rec.read;
+	int w = av_atomic_load(&rec.write);
+	while (r != w) {
+		int n = (w > r ? w : R) - r;
+		rec.write_fn(rec.file, rec.ring + r * rec.channels, n);
+		r += n;
+		if (r >= R) r = 0;
+		av_atomic_store(&rec.read, r);
+	}
+}
+
+static void * av_audio_record_main(void * arg) {
+	av_AudioRecorder& rec = *(av_AudioRecorder *)arg;
+	double stopped = 0.;
+	while (true) {
+		av_atomic_store(&rec.signalled, 0);
+		av_audio_record_drain(rec);
+		if (av_atomic_load(&rec.stopping)) {
+			// finish once the audio thread has moved on from this recording
+			// (or has plainly stopped calling back):
+			if (stopped == 0.) stopped = av_clock();
+			if (!av_atomic_load(&rec.tapping) || av_clock() - stopped > 0.5) {
+				av_audio_record_drain(rec);
+				break;
+			}
+			av_semaphore_timedwait(&rec.wake, 0.1);
+		} else {
+			av_semaphore_wait(&rec.wake);
+		}
+	}
+	if (rec.close_fn) rec.close_fn(rec.file);
+	rec.file = 0;
+	av_atomic_store(&rec.state, AV_AUDIO_RECORDING_DONE);
+	return 0;
+}
+
+// offline rendering: give the writer thread time to make room
+static void av_audio_record_wait(int frames) {
+	int cur = av_atomic_load(&record_current);
+	if (cur < 0) return;
+	av_AudioRecorder& rec = recorders[cur];
+	for (int tries = 0; tries < 2000; tries++) {
+		int space = av_atomic_load(&rec.read) - rec.write - 1;
+		if (space < 0) space += rec.ringframes;
+		if (space >= frames) break;
+		av_sleep(0.0005);
+	}
+}
+
+// at exit: stop the current recording, and let every writer finish its file
+static void av_audio_record_exit() {
+	av_atomic_store(&record_current, -1);
+	for (int i=0; i<AV_AUDIO_MAX_RECORDINGS; i++) {
+		av_AudioRecorder& rec = recorders[i];
+		int state = av_atomic_load(&rec.state);
+		if (state == AV_AUDIO_RECORDING_BUSY) {
+			// (not waiting for the audio thread to move on, as it may have stopped already;
+			// a block it copies from here on is not written)
+			av_atomic_store(&rec.stopping, 1);
+			av_atomic_store(&rec.tapping, 0);
+			av_audio_record_signal(rec);
+		}
+		if (state != AV_AUDIO_RECORDING_FREE) {
+			av_thread_join(rec.thread);
+			av_atomic_store(&rec.state, AV_AUDIO_RECORDING_FREE);
+		}
+	}
+	// (the semaphores are left, as the audio thread may still post them)
+}
+
+// start recording the output buses and/or input buses (sources is a combination of
+// AV_AUDIO_RECORD_OUTPUT and AV_AUDIO_RECORD_INPUT) into a file with as many channels,
+// buffering up to ringframes; the recorder takes ownership of the file, and closes it when done
+// only one recording can be current: stop the last first (it need not have finished its file)
+// returns a recording id, or -1 on failure
+AV_EXPORT int av_audio_record_start(void * file, av_audio_record_write_fn write_fn, av_audio_record_close_fn close_fn, int sources, int ringframes) {
+	if (!file || !write_fn || !(sources & (AV_AUDIO_RECORD_OUTPUT | AV_AUDIO_RECORD_INPUT))) return -1;
+	if (av_atomic_load(&record_current) >= 0) return -1;
+	int id = -1;
+	for (int i=0; i<AV_AUDIO_MAX_RECORDINGS; i++) {
+		if (av_atomic_load(&recorders[i].state) == AV_AUDIO_RECORDING_FREE) {
+			id = i;
+			break;
+		}
+	}
+	if (id < 0) return -1;
+	av_AudioRecorder& rec = recorders[id];
+	
+	int channels = 0;
+	if (sources & AV_AUDIO_RECORD_OUTPUT) channels += audio.outbuses;
+	if (sources & AV_AUDIO_RECORD_INPUT) channels += audio.inbuses;
+	if (ringframes < 4 * (int)audio.blocksize) ringframes = 4 * audio.blocksize;
+	if (rec.ring) av_aligned_free(rec.ring);
+	rec.ring = (float *)av_aligned_calloc(ringframes * channels, sizeof(float));
+	if (!rec.ring) return -1;
+	if (!rec.wake_init) {
+		if (av_semaphore_init(&rec.wake)) return -1;
+		rec.wake_init = 1;
+	}
+	static int exit_registered = 0;
+	if (!exit_registered) {
+		atexit(av_audio_record_exit);
+		exit_registered = 1;
+	}
+	
+	rec.file = file;
+	rec.write_fn = write_fn;
+	rec.close_fn = close_fn;
+	rec.ringframes = ringframes;
+	rec.channels = channels;
+	rec.sources = sources;
+	rec.outbuses = audio.outbuses;
+	rec.inbuses = audio.inbuses;
+	rec.stopping = 0;
+	rec.tapping = 1;
+	rec.signalled = 0;
+	rec.write = rec.read = 0;
+	rec.blocks = rec.dropped = rec.changed = 0;
+	rec.state = AV_AUDIO_RECORDING_BUSY;
+	
+	if (av_thread_create(&rec.thread, av_audio_record_main, &rec)) {
+		fprintf(stderr, "unable to start the audio recording thread\n");
+		rec.state = AV_AUDIO_RECORDING_FREE;
+		return -1;
+	}
+	av_atomic_store(&record_current, id);
+	return id;
+}
+
+// stop recording; the writer thread finishes the file shortly afterward (see av_audio_record_done)
+AV_EXPORT void av_audio_record_stop(int id) {
+	if (id < 0 || id >= AV_AUDIO_MAX_RECORDINGS || av_atomic_load(&record_current) != id) return;
+	av_atomic_store(&record_current, -1);
+	av_atomic_store(&recorders[id].stopping, 1);
+	av_audio_record_signal(recorders[id]);
+}
+
+// returns the id of a recording whose file has been finished, or -1 if there are none
+// (its counts stay as they are until another recording takes its slot)
+AV_EXPORT int av_audio_record_done() {
+	for (int i=0; i<AV_AUDIO_MAX_RECORDINGS; i++) {
+		av_AudioRecorder& rec = recorders[i];
+		if (av_atomic_load(&rec.state) == AV_AUDIO_RECORDING_DONE) {
+			av_thread_join(rec.thread);
+			av_atomic_store(&rec.state, AV_AUDIO_RECORDING_FREE);
+			return i;
+		}
+	}
+	return -1;
+}
+
+// whether a recording is still being written
+AV_EXPORT int av_audio_record_busy(int id) {
+	if (id < 0 || id >= AV_AUDIO_MAX_RECORDINGS) return 0;
+	return av_atomic_load(&recorders[id].state) == AV_AUDIO_RECORDING_BUSY;
+}
+
+// blocks recorded so far, in this recording
+AV_EXPORT int av_audio_record_blocks(int id) {
+	if (id < 0 || id >= AV_AUDIO_MAX_RECORDINGS) return 0;
+	return av_atomic_load(&recorders[id].blocks);
+}
+
+// blocks dropped so far, in this recording: for lack of room in the ring, or 
+// (if changed is nonzero) because the buses have changed since it began
+AV_EXPORT int av_audio_record_dropped(int id, int changed) {
+	if (id < 0 || id >= AV_AUDIO_MAX_RECORDINGS) return 0;
+	return av_atomic_load(changed ? &recorders[id].changed : &recorders[id].dropped);
+}
+
+/*
+	Waveform summaries.
+	
+	A summary is a pyramid of min/max/sum-of-squares bins over the samples of a buffer, 
+	for drawing waveforms: level 0 has one bin per AV_AUDIO_SUMMARY_BIN frames of each 
+	channel, and each level above has one bin per two bins of the level below, up to a 
+	single bin for the whole buffer. A query picks, for each column of the display, the 
+	fewest bins that cover it exactly (at most two per level, plus fewer than two level-0 
+	bins of samples at its edges), so that the cost of drawing grows with the number of 
+	columns and levels rather than of frames.
+	
+	Summaries of buffers are rebuilt on request (after writing into them); the audio 
+	thread updates the summaries of the output & input rings once per block, as it plays
+	the one and fills the other. The main thread reads these while they change: a bin 
+	may mix two laps of the ring, which is harmless for display.
+*/
+
+#define AV_AUDIO_SUMMARY_BIN 16
+#define AV_AUDIO_SUMMARY_LEVELS 32
+
+typedef struct av_AudioSummary {
+	const void * samples;	// not owned
+	int type;				// element type, as for av_audio_voice_start
+	int frames, channels;
+	int blocksize;			// nonzero for planar blocks of this many frames
+	int levels;
+	// bins of each level, at bins[level]; each bin is (min, max, sum of squares) per channel:
+	int nbins[AV_AUDIO_SUMMARY_LEVELS];
+	float * bins[AV_AUDIO_SUMMARY_LEVELS];
+	float * data;
+	// for the ring summaries, nonzero once the audio thread should keep them up to date:
+	volatile int live;
+} av_AudioSummary;
+
+static av_AudioSummary outsummary;
+static av_AudioSummary insummary;
+
+static void av_audio_summary_clear(av_AudioSummary * s) {
+	if (s->data) free(s->data);
+	s->data = 0;
+	s->levels = 0;
+}
+
+// (re)initialize the summary of a source; returns 0 if out of memory
+static int av_audio_summary_init(av_AudioSummary * s, const void * samples, int type, int frames, int channels, int blocksize) {
+	av_audio_summary_clear(s);
+	s->samples = samples;
+	s->type = type;
+	s->frames = frames;
+	s->channels = channels;
+	s->blocksize = blocksize;
+	
+	int total = 0;
+	int n = (frames + AV_AUDIO_SUMMARY_BIN - 1) / AV_AUDIO_SUMMARY_BIN;
+	int levels = 0;
+	while (levels < AV_AUDIO_SUMMARY_LEVELS) {
+		s->nbins[levels++] = n;
+		total += n;
+		if (n <= 1) break;
+		n = (n + 1) / 2;
+	}
+	s->data = (float *)calloc((size_t)total * channels * 3, sizeof(float));
+	if (!s->data) return 0;
+	float * p = s->data;
+	for (int l=0; l<levels; l++) {
+		s->bins[l] = p;
+		p += s->nbins[l] * channels * 3;
+	}
+	s->levels = levels;
+	return 1;
+}
+
+// a running (min, max, sum of squares) over parts of one channel:
+struct av_AudioSummaryAcc {
+	double lo, hi, sum;
+	
+	void bin(const float * b) {
+		if (b[0] < lo) lo = b[0];
+		if (b[1] > hi) hi = b[1];
+		sum += b[2];
+	}
+};
+
+// accumulate frames i0..i1-1 of one channel of the source, a contiguous run (or interleaved stride) at a time:
+template<typename T>
+static void av_audio_summary_raw(const av_AudioSummary * s, const T * src, int channel, int i0, int i1, av_AudioSummaryAcc& acc) {
+	const double scale = av_audio_sample_scale(src);
+	double lo = acc.lo, hi = acc.hi, sum = acc.sum;
+	while (i0 < i1) {
+		const T * p;
+		int n, step;
+		if (s->blocksize) {
+			int blk = i0 / s->blocksize;
+			int off = i0 - blk * s->blocksize;
+			p = src + (blk * s->channels + channel) * s->blocksize + off;
+			n = s->blocksize - off;
+			if (n > i1 - i0) n = i1 - i0;
+			step = 1;
+		} else {
+			p = src + i0 * s->channels + channel;
+			n = i1 - i0;
+			step = s->channels;
+		}
+		for (int i=0; i<n; i++, p += step) {
+			double x = *p * scale;
+			if (x < lo) lo = x;
+			if (x > hi) hi = x;
+			sum += x * x;
+		}
+		i0 += n;
+	}
+	acc.lo = lo;
+	acc.hi = hi;
+	acc.sum = sum;
+}
+
+template<typename T>
+static void av_audio_summary_scan(const av_AudioSummary * s, const T * src, int b0, int b1) {
+	const int channels = s->channels;
+	for (int b=b0; b<b1; b++) {
+		int i0 = b * AV_AUDIO_SUMMARY_BIN;
+		int i1 = i0 + AV_AUDIO_SUMMARY_BIN;
+		if (i1 > s->frames) i1 = s->frames;
+		float * bin = s->bins[0] + b * channels * 3;
+		for (int c=0; c<channels; c++) {
+			av_AudioSummaryAcc acc = { HUGE_VAL, -HUGE_VAL, 0. };
+			av_audio_summary_raw(s, src, c, i0, i1, acc);
+			bin[c*3] = (float)acc.lo;
+			bin[c*3 + 1] = (float)acc.hi;
+			bin[c*3 + 2] = (float)acc.sum;
+		}
+	}
+}
+
+// recompute the bins covering frames first..first+count-1, at every level
+static void av_audio_summary_update(av_AudioSummary * s, int first, int count) {
+	if (!s->levels || count <= 0) return;
+	if (first < 0) { count += first; first = 0; }
+	if (first + count > s->frames) count = s->frames - first;
+	if (count <= 0) return;
+	int b0 = first / AV_AUDIO_SUMMARY_BIN;
+	int b1 = (first + count - 1) / AV_AUDIO_SUMMARY_BIN + 1;
+	switch (s->type) {
+		case AV_AUDIO_FLOAT64: av_audio_summary_scan(s, (const double *)s->samples, b0, b1); break;
+		case AV_AUDIO_INT16: av_audio_summary_scan(s, (const short *)s->samples, b0, b1); break;
+		default: av_audio_summary_scan(s, (const float *)s->samples, b0, b1); break;
+	}
+	const int stride = s->channels * 3;
+	for (int l=1; l<s->levels; l++) {
+		b0 /= 2;
+		b1 = (b1 + 1) / 2;
+		const float * below = s->bins[l-1];
+		const int nbelow = s->nbins[l-1];
+		for (int b=b0; b<b1; b++) {
+			float * bin = s->bins[l] + b * stride;
+			const float * x = below + 2 * b * stride;
+			if (2*b + 1 < nbelow) {
+				const float * y = x + stride;
+				for (int k=0; k<stride; k+=3) {
+					bin[k] = x[k] < y[k] ? x[k] : y[k];
+					bin[k+1] = x[k+1] > y[k+1] ? x[k+1] : y[k+1];
+					bin[k+2] = x[k+2] + y[k+2];
+				}
+			} else {
+				memcpy(bin, x, sizeof(float) * stride);
+			}
+		}
+	}
+}
+
+template<typename T>
+static void av_audio_summary_columns(const av_AudioSummary * s, const T * src, int channel, double first, double count, int columns, float * out) {
+	const int stride = s->channels * 3;
+	const double step = count / columns;
+	for (int col=0; col<columns; col++, out += 3) {
+		int a = (int)(first + col * step);
+		int e = (int)(first + (col + 1) * step);
+		if (e > s->frames) e = s->frames;
+		// zoomed in past one frame per column, repeat frames:
+		if (a >= e) a = e - 1;
+		if (a < 0) {
+			out[0] = out[1] = out[2] = 0.f;
+			continue;
+		}
+		av_AudioSummaryAcc acc = { HUGE_VAL, -HUGE_VAL, 0. };
+		// the whole level-0 bins within a..e-1, and the samples either side of them:
+		int lo = (a + AV_AUDIO_SUMMARY_BIN - 1) / AV_AUDIO_SUMMARY_BIN;
+		int hi = e / AV_AUDIO_SUMMARY_BIN;
+		if (lo >= hi) {
+			av_audio_summary_raw(s, src, channel, a, e, acc);
+		} else {
+			av_audio_summary_raw(s, src, channel, a, lo * AV_AUDIO_SUMMARY_BIN, acc);
+			av_audio_summary_raw(s, src, channel, hi * AV_AUDIO_SUMMARY_BIN, e, acc);
+			// cover the bins with at most two per level, climbing while the ends are aligned:
+			for (int l=0; lo < hi; l++) {
+				const float * bins = s->bins[l] + channel * 3;
+				if (lo & 1) acc.bin(bins + (lo++) * stride);
+				if (hi & 1) acc.bin(bins + (--hi) * stride);
+				lo /= 2;
+				hi /= 2;
+			}
+		}
+		out[0] = (float)acc.lo;
+		out[1] = (float)acc.hi;
+		out[2] = (float)sqrt(acc.sum / (e - a));
+	}
+}
+
+// main thread: create the summary of samples (of the given element type, interleaved, 
+// or if blocksize is nonzero, in planar blocks of blocksize frames), computed at once
+// returns NULL if out of memory
+AV_EXPORT av_AudioSummary * av_audio_summary_new(const void * samples, int type, int frames, int channels, int blocksize) {
+	if (!samples || frames < 1 || channels < 1 || type < 0 || type >= AV_AUDIO_TYPE_COUNT) return 0;
+	av_AudioSummary * s = (av_AudioSummary *)calloc(1, sizeof(av_AudioSummary));
+	if (!s) return 0;
+	if (!av_audio_summary_init(s, samples, type, frames, channels, blocksize)) {
+		free(s);
+		return 0;
+	}
+	av_audio_summary_update(s, 0, frames);
+	return s;
+}
+
+AV_EXPORT void av_audio_summary_free(av_AudioSummary * s) {
+	if (!s || s == &outsummary || s == &insummary) return;
+	av_audio_summary_clear(s);
+	free(s);
+}
+
+// main thread: recompute the summary of frames first..first+count-1, after writing to them
+AV_EXPORT void av_audio_summary_touch(av_AudioSummary * s, int first, int count) {
+	if (s && s != &outsummary && s != &insummary) av_audio_summary_update(s, first, count);
+}
+
+// the summary of the output (0) or input (1) ring, which the audio thread keeps up to date from now on
+// (its source and size change whenever the rings are reallocated, by av_audio_start etc.)
+AV_EXPORT av_AudioSummary * av_audio_summary_ring(int which) {
+	av_AudioSummary * s = which ? &insummary : &outsummary;
+	av_atomic_store(&s->live, 1);
+	return s;
+}
+
+// fill out with columns (min, max, rms) triples of one channel, 
+// each summarizing an equal part of the frames first..first+count-1
+// returns the number of columns filled (0 if the range is outside the source)
+AV_EXPORT int av_audio_summary_query(av_AudioSummary * s, int channel, double first, double count, int columns, float * out) {
+	if (!s || !s->levels || columns < 1 || count <= 0. || channel < 0 || channel >= s->channels) return 0;
+	if (first < 0. || first >= s->frames) return 0;
+	switch (s->type) {
+		case AV_AUDIO_FLOAT64: av_audio_summary_columns(s, (const double *)s->samples, channel, first, count, columns, out); break;
+		case AV_AUDIO_INT16: av_audio_summary_columns(s, (const short *)s->samples, channel, first, count, columns, out); break;
+		default: av_audio_summary_columns(s, (const float *)s->samples, channel, first, count, columns, out); break;
+	}
+	return columns;
+}
+
+// time drawing columns columns over a mono float32 source of frames frames, draws times over:
+// via av_audio_summary_query, or if scan is nonzero, by scanning the samples for each column
+// returns the elapsed wall-clock time in seconds
+AV_EXPORT double av_audio_summary_bench(int frames, int columns, int draws, int scan) {
+	float * samples = (float *)malloc(sizeof(float) * frames);
+	float * result = (float *)malloc(sizeof(float) * columns * 3);
+	unsigned int seed = 1;
+	for (int i=0; i<frames; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		samples[i] = (seed >> 8) / (float)(1 << 23) - 1.f;
+	}
+	av_AudioSummary * s = av_audio_summary_new(samples, AV_AUDIO_FLOAT32, frames, 1, 0);
+	
+	double t0 = av_time();
+	for (int d=0; d<draws; d++) {
+		if (!scan) {
+			av_audio_summary_query(s, 0, 0, frames, columns, result);
+			continue;
+		}
+		for (int col=0; col<columns; col++) {
+			int a = (int)((double)frames * col / columns);
+			int e = (int)((double)frames * (col + 1) / columns);
+			float lo = 1.f, hi = -1.f;
+			for (int i=a; i<e; i++) {
+				if (samples[i] < lo) lo = samples[i];
+				if (samples[i] > hi) hi = samples[i];
+			}
+			result[col*3] = lo;
+			result[col*3 + 1] = hi;
+		}
+	}
+	double elapsed = av_time() - t0;
+	
+	av_audio_summary_free(s);
+	free(result);
+	free(samples);
+	return elapsed;
+}
+
+/*
+	Spectrum analysis.
+	
+	An analyzer takes a short-time Fourier transform of one bus (or the mix of all buses)
+	of the output or the input, for audio-reactive visuals. After each callback the audio 
+	thread copies the block into the analyzer's ring of mono samples (dropping the block if
+	the ring is full); the analysis thread takes a windowed FFT of the latest size samples 
+	every hop samples, and writes the magnitude of each bin as one row of the history, 
+	which the main thread reads as a scrolling spectrogram (see audio.spectrum).
+	
+	The history holds each row twice, rows apart, so that the latest rows are always 
+	contiguous, oldest first, from history + (frames % rows) * bins.
+	
+	A real frame of N samples is transformed as a complex frame of N/2 points, by a 
+	radix-4 Stockham FFT (with a final radix-2 pass for odd powers of two), which needs no
+	bit reversal, and which runs each pass over four butterflies at a time with SSE.
+*/
+
+#define AV_AUDIO_ANALYZERS 8
+#define AV_AUDIO_FFT_MIN 64
+#define AV_AUDIO_FFT_MAX 32768
+
+enum {
+	AV_AUDIO_WINDOW_RECT = 0,
+	AV_AUDIO_WINDOW_HANN,
+	AV_AUDIO_WINDOW_HAMMING,
+	AV_AUDIO_WINDOW_BLACKMAN,
+	AV_AUDIO_WINDOW_COUNT
+};
+
+typedef struct av_AudioFFT {
+	int n;					// complex points
+	// for each radix-4 pass over m points, the real & imaginary parts of w, w^2 & w^3
+	// (w = e^-2pi.i.p/m) for p in 0..m/4-1, as six runs of m/4:
+	float * twiddles;
+	// cos & sin of pi.k/n for k in 0..n, for splitting the transform of a real frame:
+	float * split;
+	float * re[2];
+	float * im[2];
+	int simd;				// 1 to use the SSE passes where available (cleared for its own plan by av_audio_fft_bench)
+} av_AudioFFT;
+
+static void av_audio_fft_free(av_AudioFFT * f) {
+	av_aligned_free(f->twiddles);
+	av_aligned_free(f->split);
+	for (int i=0; i<2; i++) {
+		av_aligned_free(f->re[i]);
+		av_aligned_free(f->im[i]);
+	}
+	memset(f, 0, sizeof(av_AudioFFT));
+}
+
+// plan a complex FFT of n points (a power of 2, at least 32); returns 0 if out of memory
+static int av_audio_fft_init(av_AudioFFT * f, int n) {
+	memset(f, 0, sizeof(av_AudioFFT));
+	f->n = n;
+	f->simd = 1;
+	int count = 0;
+	for (int m=n; m>=4; m/=4) count += 6 * (m/4);
+	f->twiddles = (float *)av_aligned_calloc(count, sizeof(float));
+	f->split = (float *)av_aligned_calloc(2 * (n + 1), sizeof(float));
+	for (int i=0; i<2; i++) {
+		f->re[i] = (float *)av_aligned_calloc(n, sizeof(float));
+		f->im[i] = (float *)av_aligned_calloc(n, sizeof(float));
+	}
+	if (!f->twiddles || !f->split || !f->re[0] || !f->re[1] || !f->im[0] || !f->im[1]) {
+		av_audio_fft_free(f);
+		return 0;
+	}
+	const double pi = 3.14159265358979323846;
+	float * tw = f->twiddles;
+	for (int m=n; m>=4; m/=4) {
+		const int q = m/4;
+		for (int p=0; p<q; p++) {
+			for (int k=1; k<=3; k++) {
+				double a = -2. * pi * k * p / m;
+				tw[(2*k-2)*q + p] = (float)cos(a);
+				tw[(2*k-1)*q + p] = (float)sin(a);
+			}
+		}
+		tw += 6 * q;
+	}
+	for (int k=0; k<=n; k++) {
+		f->split[2*k] = (float)cos(pi * k / n);
+		f->split[2*k + 1] = (float)sin(pi * k / n);
+	}
+	return 1;
+}
+
+// one radix-4 pass over m points at stride s, from x to y:
+static void av_audio_fft_pass4(int simd, int m, int s, const float * tw, const float * xr, const float * xi, float * yr, float * yi) {
+	const int q = m/4;
+	const int sq = s * q;
+	#ifdef AV_SSE
+	if (simd && s == 1 && q >= 4) {
+		// the first pass: four values of p at a time, transposed on the way out
+		for (int p=0; p<q; p+=4) {
+			__m128 ar = _mm_loadu_ps(xr + p), ai = _mm_loadu_ps(xi + p);
+			__m128 br = _mm_loadu_ps(xr + p + q), bi = _mm_loadu_ps(xi + p + q);
+			__m128 cr = _mm_loadu_ps(xr + p + 2*q), ci = _mm_loadu_ps(xi + p + 2*q);
+			__m128 dr = _mm_loadu_ps(xr + p + 3*q), di = _mm_loadu_ps(xi + p + 3*q);
+			__m128 apcr = _mm_add_ps(ar, cr), apci = _mm_add_ps(ai, ci);
+			__m128 amcr = _mm_sub_ps(ar, cr), amci = _mm_sub_ps(ai, ci);
+			__m128 bpdr = _mm_add_ps(br, dr), bpdi = _mm_add_ps(bi, di);
+			__m128 bmdr = _mm_sub_ps(br, dr), bmdi = _mm_sub_ps(bi, di);
+			__m128 w1r = _mm_loadu_ps(tw + p), w1i = _mm_loadu_ps(tw + q + p);
+			__m128 w2r = _mm_loadu_ps(tw + 2*q + p), w2i = _mm_loadu_ps(tw + 3*q + p);
+			__m128 w3r = _mm_loadu_ps(tw + 4*q + p), w3i = _mm_loadu_ps(tw + 5*q + p);
+			__m128 y0r = _mm_add_ps(apcr, bpdr), y0i = _mm_add_ps(apci, bpdi);
+			__m128 t1r = _mm_add_ps(amcr, bmdi), t1i = _mm_sub_ps(amci, bmdr);
+			__m128 t2r = _mm_sub_ps(apcr, bpdr), t2i = _mm_sub_ps(apci, bpdi);
+			__m128 t3r = _mm_sub_ps(amcr, bmdi), t3i = _mm_add_ps(amci, bmdr);
+			__m128 y1r = _mm_sub_ps(_mm_mul_ps(w1r, t1r), _mm_mul_ps(w1i, t1i));
+			__m128 y1i = _mm_add_ps(_mm_mul_ps(w1r, t1i), _mm_mul_ps(w1i, t1r));
+			__m128 y2r = _mm_sub_ps(_mm_mul_ps(w2r, t2r), _mm_mul_ps(w2i, t2i));
+			__m128 y2i = _mm_add_ps(_mm_mul_ps(w2r, t2i), _mm_mul_ps(w2i, t2r));
+			__m128 y3r = _mm_sub_ps(_mm_mul_ps(w3r, t3r), _mm_mul_ps(w3i, t3i));
+			__m128 y3i = _mm_add_ps(_mm_mul_ps(w3r, t3i), _mm_mul_ps(w3i, t3r));
+			_MM_TRANSPOSE4_PS(y0r, y1r, y2r, y3r);
+			_MM_TRANSPOSE4_PS(y0i, y1i, y2i, y3i);
+			_mm_storeu_ps(yr + 4*p, y0r); _mm_storeu_ps(yi + 4*p, y0i);
+			_mm_storeu_ps(yr + 4*p + 4, y1r); _mm_storeu_ps(yi + 4*p + 4, y1i);
+			_mm_storeu_ps(yr + 4*p + 8, y2r); _mm_storeu_ps(yi + 4*p + 8, y2i);
+			_mm_storeu_ps(yr + 4*p + 12, y3r); _mm_storeu_ps(yi + 4*p + 12, y3i);
+		}
+		return;
+	}
+	if (simd && s >= 4) {
+		// later passes: four values of k at a time, for each p
+		for (int p=0; p<q; p++) {
+			const __m128 w1r = _mm_set1_ps(tw[p]), w1i = _mm_set1_ps(tw[q + p]);
+			const __m128 w2r = _mm_set1_ps(tw[2*q + p]), w2i = _mm_set1_ps(tw[3*q + p]);
+			const __m128 w3r = _mm_set1_ps(tw[4*q + p]), w3i = _mm_set1_ps(tw[5*q + p]);
+			const float * ar_ = xr + s*p, * ai_ = xi + s*p;
+			float * or_ = yr + 4*s*p, * oi_ = yi + 4*s*p;
+			for (int k=0; k<s; k+=4) {
+				__m128 ar = _mm_loadu_ps(ar_ + k), ai = _mm_loadu_ps(ai_ + k);
+				__m128 br = _mm_loadu_ps(ar_ + k + sq), bi = _mm_loadu_ps(ai_ + k + sq);
+				__m128 cr = _mm_loadu_ps(ar_ + k + 2*sq), ci = _mm_loadu_ps(ai_ + k + 2*sq);
+				__m128 dr = _mm_loadu_ps(ar_ + k + 3*sq), di = _mm_loadu_ps(ai_ + k + 3*sq);
+				__m128 apcr = _mm_add_ps(ar, cr), apci = _mm_add_ps(ai, ci);
+				__m128 amcr = _mm_sub_ps(ar, cr), amci = _mm_sub_ps(ai, ci);
+				__m128 bpdr = _mm_add_ps(br, dr), bpdi = _mm_add_ps(bi, di);
+				__m128 bmdr = _mm_sub_ps(br, dr), bmdi = _mm_sub_ps(bi, di);
+				__m128 t1r = _mm_add_ps(amcr, bmdi), t1i = _mm_sub_ps(amci, bmdr);
+				__m128 t2r = _mm_sub_ps(apcr, bpdr), t2i = _mm_sub_ps(apci, bpdi);
+				__m128 t3r = _mm_sub_ps(amcr, bmdi), t3i = _mm_add_ps(amci, bmdr);
+				_mm_storeu_ps(or_ + k, _mm_add_ps(apcr, bpdr));
+				_mm_storeu_ps(oi_ + k, _mm_add_ps(apci, bpdi));
+				_mm_storeu_ps(or_ + k + s, _mm_sub_ps(_mm_mul_ps(w1r, t1r), _mm_mul_ps(w1i, t1i)));
+				_mm_storeu_ps(oi_ + k + s, _mm_add_ps(_mm_mul_ps(w1r, t1i), _mm_mul_ps(w1i, t1r)));
+				_mm_storeu_ps(or_ + k + 2*s, _mm_sub_ps(_mm_mul_ps(w2r, t2r), _mm_mul_ps(w2i, t2i)));
+				_mm_storeu_ps(oi_ + k + 2*s, _mm_add_ps(_mm_mul_ps(w2r, t2i), _mm_mul_ps(w2i, t2r)));
+				_mm_storeu_ps(or_ + k + 3*s, _mm_sub_ps(_mm_mul_ps(w3r, t3r), _mm_mul_ps(w3i, t3i)));
+				_mm_storeu_ps(oi_ + k + 3*s, _mm_add_ps(_mm_mul_ps(w3r, t3i), _mm_mul_ps(w3i, t3r)));
+			}
+		}
+		return;
+	}
+	#endif
+	for (int p=0; p<q; p++) {
+		const float w1r = tw[p], w1i = tw[q + p];
+		const float w2r = tw[2*q + p], w2i = tw[3*q + p];
+		const float w3r = tw[4*q + p], w3i = tw[5*q + p];
+		for (int k=0; k<s; k++) {
+			const int i = k + s*p;
+			const int o = k + 4*s*p;
+			float apcr = xr[i] + xr[i + 2*sq], apci = xi[i] + xi[i + 2*sq];
+			float amcr = xr[i] - xr[i + 2*sq], amci = xi[i] - xi[i + 2*sq];
+			float bpdr = xr[i + sq] + xr[i + 3*sq], bpdi = xi[i + sq] + xi[i + 3*sq];
+			float bmdr = xr[i + sq] - xr[i + 3*sq], bmdi = xi[i + sq] - xi[i + 3*sq];
+			// (a - c) -/+ j(b - d):
+			float t1r = amcr + bmdi, t1i = amci - bmdr;
+			float t2r = apcr - bpdr, t2i = apci - bpdi;
+			float t3r = amcr - bmdi, t3i = amci + bmdr;
+			yr[o] = apcr + bpdr;
+			yi[o] = apci + bpdi;
+			yr[o + s] = w1r*t1r - w1i*t1i;
+			yi[o + s] = w1r*t1i + w1i*t1r;
+			yr[o + 2*s] = w2r*t2r - w2i*t2i;
+			yi[o + 2*s] = w2r*t2i + w2i*t2r;
+			yr[o + 3*s] = w3r*t3r - w3i*t3i;
+			yi[o + 3*s] = w3r*t3i + w3i*t3r;
+		}
+	}
+}
+
+// the final radix-2 pass (over 2 points at stride s), for odd powers of two:
+static void av_audio_fft_pass2(int simd, int s, const float * xr, const float * xi, float * yr, float * yi) {
+	int k = 0;
+	#ifdef AV_SSE
+	if (simd) {
+		for (; k+4<=s; k+=4) {
+			__m128 ar = _mm_loadu_ps(xr + k), ai = _mm_loadu_ps(xi + k);
+			__m128 br = _mm_loadu_ps(xr + k + s), bi = _mm_loadu_ps(xi + k + s);
+			_mm_storeu_ps(yr + k, _mm_add_ps(ar, br));
+			_mm_storeu_ps(yi + k, _mm_add_ps(ai, bi));
+			_mm_storeu_ps(yr + k + s, _mm_sub_ps(ar, br));
+			_mm_storeu_ps(yi + k + s, _mm_sub_ps(ai, bi));
+		}
+	}
+	#endif
+	for (; k<s; k++) {
+		float ar = xr[k], ai = xi[k], br = xr[k + s], bi = xi[k + s];
+		yr[k] = ar + br;
+		yi[k] = ai + bi;
+		yr[k + s] = ar - br;
+		yi[k + s] = ai - bi;
+	}
+}
+
+// transform f->re[0], f->im[0] in place (forward, unscaled); returns the index (0 or 1) of the result
+static int av_audio_fft_forward(av_AudioFFT * f) {
+	const float * tw = f->twiddles;
+	int src = 0;
+	int s = 1;
+	int m = f->n;
+	for (; m>=4; m/=4, s*=4) {
+		av_audio_fft_pass4(f->simd, m, s, tw, f->re[src], f->im[src], f->re[1-src], f->im[1-src]);
+		tw += 6 * (m/4);
+		src = 1 - src;
+	}
+	if (m == 2) {
+		av_audio_fft_pass2(f->simd, s, f->re[src], f->im[src], f->re[1-src], f->im[1-src]);
+		src = 1 - src;
+	}
+	return src;
+}
+
+// magnitudes of bins 0..n of the real frame x of 2n samples, scaled by gain:
+static void av_audio_fft_magnitudes(av_AudioFFT * f, const float * x, const float * window, float gain, float * out) {
+	const int n = f->n;
+	float * zr = f->re[0];
+	float * zi = f->im[0];
+	for (int i=0; i<n; i++) {
+		zr[i] = x[2*i] * window[2*i];
+		zi[i] = x[2*i + 1] * window[2*i + 1];
+	}
+	int r = av_audio_fft_forward(f);
+	zr = f->re[r];
+	zi = f->im[r];
+	// the transforms of the even & odd samples are the conjugate-symmetric & -antisymmetric 
+	// parts of Z; the bins of the whole frame are E[k] + e^-pi.i.k/n O[k]:
+	const float g = 0.5f * gain;
+	for (int k=0; k<=n; k++) {
+		const int a = k < n ? k : 0;
+		const int b = k > 0 ? n - k : 0;
+		float er = zr[a] + zr[b], ei = zi[a] - zi[b];
+		float or_ = zi[a] + zi[b], oi = zr[b] - zr[a];
+		float c = f->split[2*k], s = f->split[2*k + 1];
+		float xr = er + c*or_ + s*oi;
+		float xi = ei + c*oi - s*or_;
+		out[k] = g * sqrtf(xr*xr + xi*xi);
+	}
+}
+
+// bins 0..n of the real frame x of 2n samples, into xr & xi:
+static void av_audio_fft_real(av_AudioFFT * f, const float * x, float * xr, float * xi) {
+	const int n = f->n;
+	float * zr = f->re[0];
+	float * zi = f->im[0];
+	for (int i=0; i<n; i++) {
+		zr[i] = x[2*i];
+		zi[i] = x[2*i + 1];
+	}
+	int r = av_audio_fft_forward(f);
+	zr = f->re[r];
+	zi = f->im[r];
+	// as for av_audio_fft_magnitudes:
+	for (int k=0; k<=n; k++) {
+		const int a = k < n ? k : 0;
+		const int b = k > 0 ? n - k : 0;
+		float er = zr[a] + zr[b], ei = zi[a] - zi[b];
+		float or_ = zi[a] + zi[b], oi = zr[b] - zr[a];
+		float c = f->split[2*k], s = f->split[2*k + 1];
+		xr[k] = 0.5f * (er + c*or_ + s*oi);
+		xi[k] = 0.5f * (ei + c*oi - s*or_);
+	}
+}
+
+// the real frame x of 2n samples from its bins 0..n, scaled by 2n (the inverse of av_audio_fft_real)
+static void av_audio_fft_real_inverse(av_AudioFFT * f, const float * xr, const float * xi, float * x) {
+	const int n = f->n;
+	float * zr = f->re[0];
+	float * zi = f->im[0];
+	// rebuild Z = E + iO from E[k] = X[k] + X*[n-k] and O[k] = (X[k] - X*[n-k]).e^pi.i.k/n,
+	// conjugated, so that the forward transform inverts it:
+	for (int k=0; k<n; k++) {
+		float er = xr[k] + xr[n-k], ei = xi[k] - xi[n-k];
+		float dr = xr[k] - xr[n-k], di = xi[k] + xi[n-k];
+		float c = f->split[2*k], s = f->split[2*k + 1];
+		float or_ = c*dr - s*di, oi = s*dr + c*di;
+		zr[k] = er - oi;
+		zi[k] = -(ei + or_);
+	}
+	int r = av_audio_fft_forward(f);
+	zr = f->re[r];
+	zi = f->im[r];
+	for (int i=0; i<n; i++) {
+		x[2*i] = zr[i];
+		x[2*i + 1] = -zi[i];
+	}
+}
+
+// the part of an analyzer visible to Lua:
+typedef struct av_AudioSpectrum {
+	int size, hop, bins, rows;
+	float * history;			// 2 * rows * bins
+	volatile int frames;		// rows written so far
+	volatile int dropped;		// blocks dropped for lack of room in the ring
+} av_AudioSpectrum;
+
+typedef struct av_AudioAnalyzer {
+	av_AudioSpectrum spectrum;	// must be first
+	
+	// set by the main thread while the analyzer is claimed:
+	int source, bus;
+	int window, ringframes;
+	double range;
+	float gain, dummy;
+	float * ring;
+	float * windowed;
+	float * frame;
+	av_AudioFFT fft;
+	
+	// 0 free, 1 being opened or closed by the main thread, 2 open, 3 closing
+	// (the analysis thread frees a closing analyzer, once the audio thread has let go):
+	volatile int state;
+	double closed;
+	
+	// written by the audio thread:
+	char pad0[AV_CACHELINE];
+	volatile int write;
+	// whether the analyzer was open at the last callback:
+	volatile int tapping;
+	
+	// written by the analysis thread:
+	char pad1[AV_CACHELINE];
+	volatile int read;
+	char pad2[AV_CACHELINE];
+} av_AudioAnalyzer;
+
+static av_AudioAnalyzer analyzers[AV_AUDIO_ANALYZERS];
+static av_thread analysis_thread;
+static volatile int analysis_running = 0;
+// the analysis thread sleeps on analysis_wake until the audio thread has filled the rings,
+// or the main thread has closed an analyzer; set until it wakes, to post once per pass:
+static av_semaphore analysis_wake;
+static volatile int analysis_signalled = 0;
+
+static void av_audio_analysis_signal() {
+	if (av_atomic_load(&analysis_running) && av_atomic_cas(&analysis_signalled, 0, 1)) {
+		av_semaphore_post(&analysis_wake);
+	}
+}
+
+static void av_audio_analyzer_free(av_AudioAnalyzer * a) {
+	av_aligned_free(a->ring);
+	av_aligned_free(a->windowed);
+	av_aligned_free(a->frame);
+	av_aligned_free(a->spectrum.history);
+	av_audio_fft_free(&a->fft);
+	a->ring = a->windowed = a->frame = a->spectrum.history = 0;
+}
+
+// audio thread: copy the block just played or received into each open analyzer's ring
+static void av_audio_analyzers_tap(const float * bus, const float * inblock, int frames) {
+	int wake = 0;
+	for (int i=0; i<AV_AUDIO_ANALYZERS; i++) {
+		av_AudioAnalyzer& a = analyzers[i];
+		int active = av_atomic_load(&a.state) == 2;
+		if (active) {
+			const int R = a.ringframes;
+			int w = a.write;
+			int space = av_atomic_load(&a.read) - w - 1;
+			if (space < 0) space += R;
+			if (space < frames) {
+				av_atomic_store(&a.spectrum.dropped, a.spectrum.dropped + 1);
+			} else {
+				const float * src = a.source ? inblock : bus;
+				const int buses = a.source ? audio.inbuses : audio.outbuses;
+				const int fs = audio.planar ? 1 : buses;
+				const int cs = audio.planar ? frames : 1;
+				if (a.bus >= 0) {
+					const float * x = src + (a.bus % buses) * cs;
+					for (int j=0; j<frames; j++) {
+						a.ring[w] = x[j * fs];
+						if (++w == R) w = 0;
+					}
+				} else {
+					const float scale = 1.f / buses;
+					for (int j=0; j<frames; j++) {
+						const float * x = src + j * fs;
+						float sum = 0.f;
+						for (int c=0; c<buses; c++) sum += x[c * cs];
+						a.ring[w] = sum * scale;
+						if (++w == R) w = 0;
+					}
+				}
+				av_atomic_store(&a.write, w);
+			}
+			wake = 1;
+		}
+		if (a.tapping != active) {
+			av_atomic_store(&a.tapping, active);
+			wake = 1;
+		}
+	}
+	if (wake) av_audio_analysis_signal();
+}
+
+// analysis thread: write a row for every hop of samples in the ring
+// returns the number of rows written
+static int av_audio_analyzer_run(av_AudioAnalyzer& a) {
+	av_AudioSpectrum& s = a.spectrum;
+	const int R = a.ringframes;
+	const int need = s.size > s.hop ? s.size : s.hop;
+	int r = a.read;
+	int avail = av_atomic_load(&a.write) - r;
+	if (avail < 0) avail += R;
+	int rows = 0;
+	while (avail >= need) {
+		// unwrap the frame:
+		int first = R - r < s.size ? R - r : s.size;
+		memcpy(a.frame, a.ring + r, sizeof(float) * first);
+		memcpy(a.frame + first, a.ring, sizeof(float) * (s.size - first));
+		
+		int k = s.frames % s.rows;
+		float * row = s.history + k * s.bins;
+		av_audio_fft_magnitudes(&a.fft, a.frame, a.windowed, a.gain, row);
+		if (a.range > 0.) {
+			// decibels, from -range .. 0 to 0..1:
+			const float scale = (float)(20. / a.range);
+			for (int b=0; b<s.bins; b++) {
+				float v = row[b] > 1e-20f ? 1.f + scale * log10f(row[b]) : 0.f;
+				row[b] = v < 0.f ? 0.f : v > 1.f ? 1.f : v;
+			}
+		}
+		memcpy(row + s.rows * s.bins, row, sizeof(float) * s.bins);
+		av_atomic_store(&s.frames, s.frames + 1);
+		
+		r += s.hop;
+		if (r >= R) r -= R;
+		avail -= s.hop;
+		av_atomic_store(&a.read, r);
+		rows++;
+	}
+	return rows;
+}
+
+static void * av_audio_analysis_main(void * arg) {
+	for (;;) {
+		// (cleared first, so that blocks arriving during the pass post again)
+		av_atomic_store(&analysis_signalled, 0);
+		int running = av_atomic_load(&analysis_running);
+		int closing = 0;
+		for (int i=0; i<AV_AUDIO_ANALYZERS; i++) {
+			av_AudioAnalyzer& a = analyzers[i];
+			int state = av_atomic_load(&a.state);
+			if (state == 2) {
+				av_audio_analyzer_run(a);
+			} else if (state == 3) {
+				// free it once the audio thread has seen the close
+				// (or has plainly stopped calling back):
+				if (!av_atomic_load(&a.tapping) || av_clock() - a.closed > 0.5) {
+					av_audio_analyzer_free(&a);
+					av_atomic_store(&a.state, 0);
+				} else {
+					closing++;
+				}
+			}
+		}
+		if (!running) break;
+		// (with no callbacks to post it, look again for the timeout of a close)
+		if (closing) {
+			av_semaphore_timedwait(&analysis_wake, 0.1);
+		} else {
+			av_semaphore_wait(&analysis_wake);
+		}
+	}
+	return 0;
+}
+
+// at exit: stop the analysis thread
+// (the semaphore is left as it is, since the audio thread may still be running)
+static void av_audio_analysis_exit() {
+	if (!av_atomic_load(&analysis_running)) return;
+	av_atomic_store(&analysis_running, 0);
+	av_semaphore_post(&analysis_wake);
+	av_thread_join(analysis_thread);
+}
+
+// open an analyzer of the output (source 0) or input (source 1) buses: of one bus, or 
+// if bus is negative, of the mix of all of them; taking an FFT of size samples (a power
+// of 2, 64 to 32768) every hop samples, with window AV_AUDIO_WINDOW_HANN etc., into a
+// history of rows rows of size/2+1 magnitudes (1 for a full-scale sine at a bin's center
+// frequency; or if range is positive, decibels from -range..0 mapped to 0..1)
+// returns NULL if the arguments are out of range, all analyzers are open, or out of memory
+AV_EXPORT av_AudioSpectrum * av_audio_analyzer_open(int source, int bus, int size, int hop, int window, int rows, double range) {
+	if (size < AV_AUDIO_FFT_MIN || size > AV_AUDIO_FFT_MAX || (size & (size - 1))) return 0;
+	if (hop < 1 || rows < 1 || window < 0 || window >= AV_AUDIO_WINDOW_COUNT) return 0;
+	av_AudioAnalyzer * a = 0;
+	for (int i=0; i<AV_AUDIO_ANALYZERS && !a; i++) {
+		if (av_atomic_cas(&analyzers[i].state, 0, 1)) a = &analyzers[i];
+	}
+	if (!a) return 0;
+	
+	av_AudioSpectrum& s = a->spectrum;
+	s.size = size;
+	s.hop = hop;
+	s.bins = size/2 + 1;
+	s.rows = rows;
+	s.frames = 0;
+	s.dropped = 0;
+	a->source = source ? 1 : 0;
+	a->bus = bus;
+	a->window = window;
+	a->range = range;
+	// room for a frame and a hop, plus plenty of blocks for the analysis thread to fall behind by:
+	a->ringframes = size + hop + 8 * (audio.blocksize > 1024 ? audio.blocksize : 1024);
+	a->ring = (float *)av_aligned_calloc(a->ringframes, sizeof(float));
+	a->windowed = (float *)av_aligned_calloc(size, sizeof(float));
+	a->frame = (float *)av_aligned_calloc(size, sizeof(float));
+	s.history = (float *)av_aligned_calloc((size_t)2 * rows * s.bins, sizeof(float));
+	if (!a->ring || !a->windowed || !a->frame || !s.history || !av_audio_fft_init(&a->fft, size/2)) {
+		av_audio_analyzer_free(a);
+		av_atomic_store(&a->state, 0);
+		return 0;
+	}
+	
+	// periodic windows, and the gain that brings a sine at a bin's center to 1:
+	const double twopi = 2. * 3.14159265358979323846;
+	double sum = 0.;
+	for (int i=0; i<size; i++) {
+		double t = twopi * i / size;
+		double w = 1.;
+		switch (window) {
+			case AV_AUDIO_WINDOW_HANN: w = 0.5 - 0.5 * cos(t); break;
+			case AV_AUDIO_WINDOW_HAMMING: w = 0.54 - 0.46 * cos(t); break;
+			case AV_AUDIO_WINDOW_BLACKMAN: w = 0.42 - 0.5 * cos(t) + 0.08 * cos(2. * t); break;
+		}
+		a->windowed[i] = (float)w;
+		sum += w;
+	}
+	a->gain = (float)(2. / sum);
+	
+	a->read = a->write = 0;
+	a->tapping = 0;
+	if (!analysis_running) {
+		static int exit_registered = 0;
+		if (av_semaphore_init(&analysis_wake)) {
+			fprintf(stderr, "unable to start the audio analysis thread\n");
+			av_audio_analyzer_free(a);
+			av_atomic_store(&a->state, 0);
+			return 0;
+		}
+		av_atomic_store(&analysis_running, 1);
+		if (av_thread_create(&analysis_thread, av_audio_analysis_main, 0)) {
+			av_atomic_store(&analysis_running, 0);
+			av_semaphore_destroy(&analysis_wake);
+			fprintf(stderr, "unable to start the audio analysis thread\n");
+			av_audio_analyzer_free(a);
+			av_atomic_store(&a->state, 0);
+			return 0;
+		}
+		if (!exit_registered) {
+			atexit(av_audio_analysis_exit);
+			exit_registered = 1;
+		}
+	}
+	av_atomic_store(&a->state, 2);
+	return &a->spectrum;
+}
+
+// close an analyzer; its history is freed shortly afterward, so stop reading it now
+AV_EXPORT void av_audio_analyzer_close(av_AudioSpectrum * s) {
+	if (!s) return;
+	av_AudioAnalyzer * a = (av_AudioAnalyzer *)s;
+	if (!av_atomic_cas(&a->state, 2, 1)) return;
+	a->closed = av_clock();
+	av_atomic_store(&a->state, 3);
+	av_audio_analysis_signal();
+}
+
+// time transforms FFTs of size real samples, with the SSE passes if simd is nonzero, else the scalar passes
+// returns the elapsed wall-clock time in seconds, or -1 if SSE is unavailable or the size is out of range
+AV_EXPORT double av_audio_fft_bench(int size, int transforms, int simd) {
+	#ifndef AV_SSE
+	if (simd) return -1.;
+	#endif
+	if (size < AV_AUDIO_FFT_MIN || size > AV_AUDIO_FFT_MAX || (size & (size - 1))) return -1.;
+	av_AudioFFT fft;
+	if (!av_audio_fft_init(&fft, size/2)) return -1.;
+	float * x = (float *)av_aligned_calloc(size, sizeof(float));
+	float * window = (float *)av_aligned_calloc(size, sizeof(float));
+	float * out = (float *)av_aligned_calloc(size/2 + 1, sizeof(float));
+	for (int i=0; i<size; i++) {
+		x[i] = (float)sin(i * 0.1) + 0.25f * (float)sin(i * 1.3);
+		window[i] = 1.f;
+	}
+	fft.simd = simd;
+	double t0 = av_clock();
+	for (int t=0; t<transforms; t++) {
+		av_audio_fft_magnitudes(&fft, x, window, 1.f, out);
+	}
+	double elapsed = av_clock() - t0;
+	av_aligned_free(x);
+	av_aligned_free(window);
+	av_aligned_free(out);
+	av_audio_fft_free(&fft);
+	return elapsed;
+}
+
+/*
+	Partitioned convolution.
+	
+	A convolver filters a few adjacent output buses in place through a long impulse response,
+	such as a reverb or a speaker cabinet, mixing y = dry.x + wet.(x * h) for each.
+	
+	The response is split in two stages. The head (its first 2Q frames) is convolved on the
+	audio thread, by uniformly-partitioned overlap-save: each partition of P frames of input
+	is transformed once into a ring of past spectra (the frequency-domain delay line), and
+	the output is one inverse transform of their sum of products with the spectra of the
+	response's partitions. The tail (the rest) is convolved the same way in partitions of
+	Q = 8P frames or more, by the convolution thread: every Q frames the audio thread posts
+	a block of input to it, and since the tail starts 2Q frames into the response, the
+	thread has Q frames' worth of time to return its part of the output before it is due.
+	So the cost to the audio thread depends on P and Q but not the length of the response.
+	
+	P is normally the largest power of two dividing the block size, and then the convolver
+	adds no latency; otherwise the wet signal lags the dry by P frames.
+*/
+
+#define AV_AUDIO_CONVOLVERS 8
+#define AV_AUDIO_CONVOLVER_LANES 8
+#define AV_AUDIO_PARTITION_MIN 32
+#define AV_AUDIO_PARTITION_MAX 2048
+
+enum {
+	AV_AUDIO_CONVOLVER_WET = 0,
+	AV_AUDIO_CONVOLVER_DRY
+};
+
+// y += x.h over bins (a multiple of 4) of complex spectra, each stored as bins real parts then bins imaginary parts:
+static void av_audio_spectra_mac(int simd, int bins, const float * x, const float * h, float * y) {
+	const float * xr = x, * xi = x + bins;
+	const float * hr = h, * hi = h + bins;
+	float * yr = y, * yi = y + bins;
+	#ifdef AV_SSE
+	if (simd) {
+		for (int k=0; k<bins; k+=4) {
+			__m128 ar = _mm_load_ps(xr + k), ai = _mm_load_ps(xi + k);
+			__m128 br = _mm_load_ps(hr + k), bi = _mm_load_ps(hi + k);
+			__m128 re = _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi));
+			__m128 im = _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br));
+			_mm_store_ps(yr + k, _mm_add_ps(_mm_load_ps(yr + k), re));
+			_mm_store_ps(yi + k, _mm_add_ps(_mm_load_ps(yi + k), im));
+		}
+		return;
+	}
+	#endif
+	for (int k=0; k<bins; k++) {
+		yr[k] += xr[k]*hr[k] - xi[k]*hi[k];
+		yi[k] += xr[k]*hi[k] + xi[k]*hr[k];
+	}
+}
+
+// the part of a convolver visible to Lua:
+typedef struct av_AudioConvolution {
+	int frames, channels;		// of the impulse response
+	int bus, lanes;				// the buses filtered: bus..bus+lanes-1
+	int partition, tail;		// P & Q, in frames
+	int latency;				// of the wet signal behind the dry, in frames
+	volatile int late;			// tail blocks the convolution thread did not return in time
+} av_AudioConvolution;
+
+typedef struct av_AudioConvolver {
+	av_AudioConvolution conv;	// must be first
+	
+	// set by the main thread while the convolver is claimed:
+	int generation;
+	int responses;				// channels of the response in use; lane l uses channel l % responses
+	int heads, tails;			// partitions of P & of Q frames
+	int hbins, tbins;			// P+1 & Q+1, rounded up to a multiple of 4
+	float * memory;
+	float * hspectra;			// responses * heads spectra of 2*hbins floats
+	float * tspectra;			// responses * tails spectra of 2*tbins floats
+	// audio thread, per lane:
+	float * hdelay;				// a ring of heads spectra of past input
+	float * hwindow;			// the latest 2P frames of input
+	float * in, * out;			// P frames each
+	float * tin;				// 4 blocks of Q frames of input to the convolution thread
+	// convolution thread, per lane:
+	float * tdelay;				// a ring of tails spectra of past input
+	float * twindow;			// the latest 2Q frames of input
+	float * tout;				// 4 blocks of Q frames of output to the audio thread
+	// scratch:
+	float * hacc, * hframe;		// audio thread
+	float * tacc, * tframe;		// convolution thread
+	av_AudioFFT hfft, tfft;
+	
+	// 0 free, 1 being opened or closed by the main thread, 2 open, 3 closing
+	// (the convolution thread frees a closing convolver, once the audio thread has let go):
+	volatile int state;
+	double closed;
+	
+	// audio thread only:
+	float wet, dry;
+	float wettarget, drytarget;
+	int pos, hslot;				// frame within the partition, and slot in hdelay
+	int block, phase;			// the tail block the current partition belongs to, and its frame within it
+	int lateblock;
+	
+	char pad0[AV_CACHELINE];
+	volatile int posted;		// tail blocks posted by the audio thread
+	// whether the convolver was open at the last callback:
+	volatile int tapping;
+	
+	char pad1[AV_CACHELINE];
+	volatile int done;			// tail blocks returned by the convolution thread
+	int tslot;					// slot in tdelay (convolution thread only)
+	char pad2[AV_CACHELINE];
+} av_AudioConvolver;
+
+static av_AudioConvolver convolvers[AV_AUDIO_CONVOLVERS];
+static av_thread convolution_thread;
+static volatile int convolution_running = 0;
+// the convolution thread sleeps on convolution_wake until the audio thread posts a tail block,
+// or a convolver closes; set until it wakes, to post once per pass:
+static av_semaphore convolution_wake;
+static volatile int convolution_signalled = 0;
+
+static void av_audio_convolution_signal() {
+	if (av_atomic_load(&convolution_running) && av_atomic_cas(&convolution_signalled, 0, 1)) {
+		av_semaphore_post(&convolution_wake);
+	}
+}
+
+static void av_audio_convolver_free(av_AudioConvolver * c) {
+	av_aligned_free(c->memory);
+	c->memory = 0;
+	av_audio_fft_free(&c->hfft);
+	av_audio_fft_free(&c->tfft);
+}
+
+// frames first..first+count-1 of one channel of the response into dst, followed by count zeros:
+template<typename T>
+static void av_audio_convolver_partition(const T * src, int frames, int channels, int channel, int first, int count, float * dst) {
+	const float scale = (float)av_audio_sample_scale(src);
+	int i = 0;
+	for (; i<count && first + i < frames; i++) {
+		dst[i] = scale * src[(size_t)(first + i) * channels + channel];
+	}
+	for (; i<2*count; i++) dst[i] = 0.f;
+}
+
+// the spectra of count partitions of size frames from frame first, for each channel in use
+// scaled by 1/2size, to undo the scale of av_audio_fft_real_inverse:
+static void av_audio_convolver_spectra(av_AudioConvolver * c, const void * samples, int type, av_AudioFFT * fft, int first, int size, int count, int bins, float * frame, float * dst) {
+	const av_AudioConvolution& v = c->conv;
+	const float scale = 1.f / (2 * size);
+	for (int ch=0; ch<c->responses; ch++) {
+		for (int p=0; p<count; p++) {
+			const int from = first + p * size;
+			switch (type) {
+				case AV_AUDIO_FLOAT64: av_audio_convolver_partition((const double *)samples, v.frames, v.channels, ch, from, size, frame); break;
+				case AV_AUDIO_INT16: av_audio_convolver_partition((const short *)samples, v.frames, v.channels, ch, from, size, frame); break;
+				default: av_audio_convolver_partition((const float *)samples, v.frames, v.channels, ch, from, size, frame); break;
+			}
+			float * x = dst + (size_t)(ch * count + p) * 2 * bins;
+			av_audio_fft_real(fft, frame, x, x + bins);
+			for (int k=0; k<2*bins; k++) x[k] *= scale;
+		}
+	}
+}
+
+// plan & allocate a convolver of a response, in partitions of P frames (a power of 2 within range)
+// returns 0 if out of memory
+static int av_audio_convolver_init(av_AudioConvolver * c, const void * samples, int type, int frames, int channels, int lanes, int partition) {
+	av_AudioConvolution& v = c->conv;
+	const int P = partition;
+	const int Q = 8 * P > 2048 ? 8 * P : 2048;
+	v.frames = frames;
+	v.channels = channels;
+	v.lanes = lanes;
+	v.partition = P;
+	v.tail = Q;
+	v.latency = audio.blocksize % P ? P : 0;
+	v.late = 0;
+	c->responses = channels < lanes ? channels : lanes;
+	c->heads = ((frames < 2 * Q ? frames : 2 * Q) + P - 1) / P;
+	c->tails = frames > 2 * Q ? (frames - 2 * Q + Q - 1) / Q : 0;
+	c->hbins = (P + 4) & ~3;
+	c->tbins = (Q + 4) & ~3;
+	
+	const size_t R = c->responses, L = lanes;
+	const size_t hs = 2 * c->hbins, ts = 2 * c->tbins;
+	size_t total = (R + L) * c->heads * hs + hs + L * 4 * P + 2 * P;
+	if (c->tails) total += (R + L) * c->tails * ts + ts + L * 10 * Q + 2 * Q;
+	c->memory = (float *)av_aligned_calloc(total, sizeof(float));
+	if (!c->memory || !av_audio_fft_init(&c->hfft, P) || (c->tails && !av_audio_fft_init(&c->tfft, Q))) {
+		av_audio_convolver_free(c);
+		return 0;
+	}
+	float * m = c->memory;
+	c->hspectra = m;	m += R * c->heads * hs;
+	c->hdelay = m;		m += L * c->heads * hs;
+	c->hacc = m;		m += hs;
+	c->hwindow = m;		m += L * 2 * P;
+	c->in = m;			m += L * P;
+	c->out = m;			m += L * P;
+	c->hframe = m;		m += 2 * P;
+	c->tspectra = c->tdelay = c->tacc = c->twindow = c->tin = c->tout = c->tframe = 0;
+	if (c->tails) {
+		c->tspectra = m;	m += R * c->tails * ts;
+		c->tdelay = m;		m += L * c->tails * ts;
+		c->tacc = m;		m += ts;
+		c->twindow = m;		m += L * 2 * Q;
+		c->tin = m;			m += L * 4 * Q;
+		c->tout = m;		m += L * 4 * Q;
+		c->tframe = m;		m += 2 * Q;
+	}
+	
+	av_audio_convolver_spectra(c, samples, type, &c->hfft, 0, P, c->heads, c->hbins, c->hframe, c->hspectra);
+	if (c->tails) {
+		av_audio_convolver_spectra(c, samples, type, &c->tfft, 2 * Q, Q, c->tails, c->tbins, c->tframe, c->tspectra);
+	}
+	
+	c->pos = c->hslot = 0;
+	c->block = c->phase = 0;
+	c->lateblock = -1;
+	c->posted = c->done = 0;
+	c->tslot = 0;
+	return 1;
+}
+
+// audio thread: convolve the partition of input in c.in into c.out, for every lane
+static void av_audio_convolver_chunk(av_AudioConvolver& c) {
+	av_AudioConvolution& v = c.conv;
+	const int P = v.partition, Q = v.tail;
+	const int hb = c.hbins;
+	// the tail block due now, if the convolution thread has returned it:
+	const int due = c.block - 2;
+	int tail = 0;
+	if (c.tails && due >= 0) {
+		if (av_atomic_load(&c.done) > due) {
+			tail = 1;
+		} else if (c.lateblock != due) {
+			c.lateblock = due;
+			av_atomic_store(&v.late, v.late + 1);
+		}
+	}
+	for (int l=0; l<v.lanes; l++) {
+		const float * in = c.in + l * P;
+		float * out = c.out + l * P;
+		float * window = c.hwindow + l * 2 * P;
+		float * delay = c.hdelay + (size_t)l * c.heads * 2 * hb;
+		const float * h = c.hspectra + (size_t)(l % c.responses) * c.heads * 2 * hb;
+		
+		memcpy(window + P, in, sizeof(float) * P);
+		float * x = delay + c.hslot * 2 * hb;
+		av_audio_fft_real(&c.hfft, window, x, x + hb);
+		memcpy(window, window + P, sizeof(float) * P);
+		
+		memset(c.hacc, 0, sizeof(float) * 2 * hb);
+		for (int p=0, slot=c.hslot; p<c.heads; p++) {
+			av_audio_spectra_mac(c.hfft.simd, hb, delay + slot * 2 * hb, h + p * 2 * hb, c.hacc);
+			if (--slot < 0) slot = c.heads - 1;
+		}
+		av_audio_fft_real_inverse(&c.hfft, c.hacc, c.hacc + hb, c.hframe);
+		memcpy(out, c.hframe + P, sizeof(float) * P);
+		
+		if (c.tails) {
+			if (tail) {
+				const float * y = c.tout + l * 4 * Q + (due & 3) * Q + c.phase;
+				for (int i=0; i<P; i++) out[i] += y[i];
+			}
+			memcpy(c.tin + l * 4 * Q + (c.block & 3) * Q + c.phase, in, sizeof(float) * P);
+		}
+	}
+	if (++c.hslot == c.heads) c.hslot = 0;
+	c.phase += P;
+	if (c.phase == Q) {
+		c.phase = 0;
+		c.block++;
+		if (c.tails) {
+			av_atomic_store(&c.posted, c.block);
+			av_audio_convolution_signal();
+		}
+	}
+}
+
+// audio thread: filter one convolver's buses in place
+static void av_audio_convolver_render(av_AudioConvolver& c, float * bus, int buses, int frames, int planar) {
+	av_AudioConvolution& v = c.conv;
+	const int P = v.partition;
+	// once a block isn't a whole number of partitions, the wet signal must lag by one:
+	if (frames % P && !v.latency) v.latency = P;
+	const int fs = planar ? 1 : buses;
+	const int cs = planar ? frames : 1;
+	int lanes = buses - v.bus;
+	if (lanes > v.lanes) lanes = v.lanes;
+	
+	// ramp any change of gain over the block:
+	const float w0 = c.wet, d0 = c.dry;
+	const float dw = (c.wettarget - w0) / frames, dd = (c.drytarget - d0) / frames;
+	for (int i=0; i<frames; ) {
+		const int n = frames - i < P - c.pos ? frames - i : P - c.pos;
+		for (int l=0; l<v.lanes; l++) {
+			float * in = c.in + l * P + c.pos;
+			if (l < lanes) {
+				const float * x = bus + (v.bus + l) * cs + i * fs;
+				for (int j=0; j<n; j++) in[j] = x[j * fs];
+			} else {
+				memset(in, 0, sizeof(float) * n);
+			}
+		}
+		if (!v.latency) av_audio_convolver_chunk(c);
+		for (int l=0; l<lanes; l++) {
+			float * x = bus + (v.bus + l) * cs + i * fs;
+			const float * y = c.out + l * P + c.pos;
+			for (int j=0; j<n; j++) {
+				const float t = (float)(i + j);
+				x[j * fs] = (d0 + dd * t) * x[j * fs] + (w0 + dw * t) * y[j];
+			}
+		}
+		c.pos += n;
+		i += n;
+		if (c.pos == P) {
+			if (v.latency) av_audio_convolver_chunk(c);
+			c.pos = 0;
+		}
+	}
+	c.wet = c.wettarget;
+	c.dry = c.drytarget;
+}
+
+// audio thread: filter the output buses through each open convolver
+static void av_audio_convolvers_render(float * bus, int buses, int frames, int planar) {
+	for (int i=0; i<AV_AUDIO_CONVOLVERS; i++) {
+		av_AudioConvolver& c = convolvers[i];
+		int active = av_atomic_load(&c.state) == 2;
+		if (active) av_audio_convolver_render(c, bus, buses, frames, planar);
+		if (c.tapping != active) {
+			av_atomic_store(&c.tapping, active);
+			// (so that a closed convolver is freed)
+			av_audio_convolution_signal();
+		}
+	}
+}
+
+static void av_audio_convolver_apply(const av_AudioCommand& cmd) {
+	if (cmd.handle < 0 || cmd.handle >= AV_AUDIO_CONVOLVERS) return;
+	av_AudioConvolver& c = convolvers[cmd.handle];
+	// ignore commands meant for a previous use of the slot:
+	if (cmd.row != c.generation) return;
+	switch (cmd.param) {
+		case AV_AUDIO_CONVOLVER_WET: c.wettarget = (float)cmd.value; break;
+		case AV_AUDIO_CONVOLVER_DRY: c.drytarget = (float)cmd.value; break;
+		default: break;
+	}
+}
+
+// convolution thread: return every tail block posted so far
+static void av_audio_convolver_run(av_AudioConvolver& c) {
+	const av_AudioConvolution& v = c.conv;
+	const int Q = v.tail;
+	const int tb = c.tbins;
+	const int posted = av_atomic_load(&c.posted);
+	int j = c.done;
+	if (posted - j > 3) {
+		// so far behind that the audio thread has overwritten the input; start over from the latest block:
+		j = posted - 1;
+		memset(c.tdelay, 0, sizeof(float) * v.lanes * c.tails * 2 * tb);
+		memset(c.twindow, 0, sizeof(float) * v.lanes * 2 * Q);
+	}
+	for (; j<posted; j++) {
+		for (int l=0; l<v.lanes; l++) {
+			float * window = c.twindow + l * 2 * Q;
+			float * delay = c.tdelay + (size_t)l * c.tails * 2 * tb;
+			const float * h = c.tspectra + (size_t)(l % c.responses) * c.tails * 2 * tb;
+			
+			memcpy(window + Q, c.tin + l * 4 * Q + (j & 3) * Q, sizeof(float) * Q);
+			float * x = delay + (size_t)c.tslot * 2 * tb;
+			av_audio_fft_real(&c.tfft, window, x, x + tb);
+			memcpy(window, window + Q, sizeof(float) * Q);
+			
+			memset(c.tacc, 0, sizeof(float) * 2 * tb);
+			for (int p=0, slot=c.tslot; p<c.tails; p++) {
+				av_audio_spectra_mac(c.tfft.simd, tb, delay + (size_t)slot * 2 * tb, h + (size_t)p * 2 * tb, c.tacc);
+				if (--slot < 0) slot = c.tails - 1;
+			}
+			av_audio_fft_real_inverse(&c.tfft, c.tacc, c.tacc + tb, c.tframe);
+			memcpy(c.tout + l * 4 * Q + (j & 3) * Q, c.tframe + Q, sizeof(float) * Q);
+		}
+		if (++c.tslot == c.tails) c.tslot = 0;
+		av_atomic_store(&c.done, j + 1);
+	}
+}
+
+static void * av_audio_convolution_main(void * arg) {
+	for (;;) {
+		// (cleared first, so that tail blocks posted during the pass post again)
+		av_atomic_store(&convolution_signalled, 0);
+		int running = av_atomic_load(&convolution_running);
+		int closing = 0;
+		for (int i=0; i<AV_AUDIO_CONVOLVERS; i++) {
+			av_AudioConvolver& c = convolvers[i];
+			int state = av_atomic_load(&c.state);
+			if (state == 2) {
+				if (c.tails) av_audio_convolver_run(c);
+			} else if (state == 3) {
+				// free it once the audio thread has seen the close
+				// (or has plainly stopped calling back):
+				if (!av_atomic_load(&c.tapping) || av_clock() - c.closed > 0.5) {
+					av_audio_convolver_free(&c);
+					av_atomic_store(&c.state, 0);
+				} else {
+					closing++;
+				}
+			}
+		}
+		if (!running) break;
+		// (a close the audio thread never sees times out, so look again for it meanwhile)
+		if (closing) {
+			av_semaphore_timedwait(&convolution_wake, 0.1);
+		} else {
+			av_semaphore_wait(&convolution_wake);
+		}
+	}
+	return 0;
+}
+
+// at exit: stop the convolution thread
+// (the audio thread may still post the semaphore, so it is not destroyed)
+static void av_audio_convolution_exit() {
+	if (!av_atomic_load(&convolution_running)) return;
+	av_atomic_store(&convolution_running, 0);
+	av_semaphore_post(&convolution_wake);
+	av_thread_join(convolution_thread);
+}
+
+// offline rendering runs faster than real time; let the convolution thread catch up first:
+static void av_audio_convolvers_wait() {
+	for (int i=0; i<AV_AUDIO_CONVOLVERS; i++) {
+		av_AudioConvolver& c = convolvers[i];
+		if (av_atomic_load(&c.state) != 2 || !c.tails) continue;
+		for (int tries = 0; tries < 2000; tries++) {
+			if (av_atomic_load(&c.done) >= av_atomic_load(&c.posted)) break;
+			av_sleep(0.0005);
+		}
+	}
+}
+
+// (main thread, while no callback runs the pipeline) forget every open convolver's input so far, 
+// as if just inserted, so that an offline render doesn't start with a live tail
+static void av_audio_convolvers_reset() {
+	av_audio_convolvers_wait();
+	for (int i=0; i<AV_AUDIO_CONVOLVERS; i++) {
+		av_AudioConvolver& c = convolvers[i];
+		if (av_atomic_load(&c.state) != 2) continue;
+		const av_AudioConvolution& v = c.conv;
+		const size_t L = v.lanes, P = v.partition, Q = v.tail;
+		memset(c.hdelay, 0, sizeof(float) * L * c.heads * 2 * c.hbins);
+		memset(c.hwindow, 0, sizeof(float) * L * 2 * P);
+		memset(c.in, 0, sizeof(float) * L * P);
+		memset(c.out, 0, sizeof(float) * L * P);
+		if (c.tails) {
+			memset(c.tdelay, 0, sizeof(float) * L * c.tails * 2 * c.tbins);
+			memset(c.twindow, 0, sizeof(float) * L * 2 * Q);
+			memset(c.tin, 0, sizeof(float) * L * 4 * Q);
+			memset(c.tout, 0, sizeof(float) * L * 4 * Q);
+		}
+		c.pos = c.hslot = 0;
+		c.block = c.phase = 0;
+		c.lateblock = -1;
+		c.tslot = 0;
+		// (posted first, so that the convolution thread never sees blocks to do)
+		av_atomic_store(&c.posted, 0);
+		av_atomic_store(&c.done, 0);
+	}
+}
+
+// insert a convolver on output buses bus..bus+lanes-1 (up to 8), through the impulse response
+// of frames interleaved frames of channels channels in samples, of element type AV_AUDIO_FLOAT32 etc.;
+// lane l uses channel l % channels. The response is copied, so samples may be freed afterward.
+// partition is P, a power of 2 from 32 to 2048, or 0 for the largest that divides the block size
+// returns NULL if the arguments are out of range, all convolvers are open, or out of memory
+AV_EXPORT av_AudioConvolution * av_audio_convolver_open(const void * samples, int type, int frames, int channels, int bus, int lanes, int partition, double wet, double dry) {
+	if (!samples || frames < 1 || channels < 1 || type < 0 || type >= AV_AUDIO_TYPE_COUNT) return 0;
+	if (bus < 0 || lanes < 1 || lanes > AV_AUDIO_CONVOLVER_LANES) return 0;
+	if (!partition) {
+		partition = AV_AUDIO_PARTITION_MAX;
+		while (partition > AV_AUDIO_PARTITION_MIN && audio.blocksize % partition) partition /= 2;
+	}
+	if (partition < AV_AUDIO_PARTITION_MIN || partition > AV_AUDIO_PARTITION_MAX || (partition & (partition - 1))) return 0;
+	av_AudioConvolver * c = 0;
+	for (int i=0; i<AV_AUDIO_CONVOLVERS && !c; i++) {
+		if (av_atomic_cas(&convolvers[i].state, 0, 1)) c = &convolvers[i];
+	}
+	if (!c) return 0;
+	
+	c->conv.bus = bus;
+	if (!av_audio_convolver_init(c, samples, type, frames, channels, lanes, partition)) {
+		av_atomic_store(&c->state, 0);
+		return 0;
+	}
+	c->wet = c->wettarget = (float)wet;
+	c->dry = c->drytarget = (float)dry;
+	c->generation++;
+	c->tapping = 0;
+	if (!convolution_running) {
+		static int exit_registered = 0;
+		if (av_semaphore_init(&convolution_wake)) {
+			fprintf(stderr, "unable to start the audio convolution thread\n");
+			av_audio_convolver_free(c);
+			av_atomic_store(&c->state, 0);
+			return 0;
+		}
+		av_atomic_store(&convolution_running, 1);
+		if (av_thread_create(&convolution_thread, av_audio_convolution_main, 0)) {
+			av_atomic_store(&convolution_running, 0);
+			av_semaphore_destroy(&convolution_wake);
+			fprintf(stderr, "unable to start the audio convolution thread\n");
+			av_audio_convolver_free(c);
+			av_atomic_store(&c->state, 0);
+			return 0;
+		}
+		if (!exit_registered) {
+			atexit(av_audio_convolution_exit);
+			exit_registered = 1;
+		}
+	}
+	av_atomic_store(&c->state, 2);
+	return &c->conv;
+}
+
+// set AV_AUDIO_CONVOLVER_WET or AV_AUDIO_CONVOLVER_DRY, ramped over the next block
+// returns 0 if the convolver is closed or the command queue is full
+AV_EXPORT int av_audio_convolver_param(av_AudioConvolution * v, int param, double value) {
+	if (!v) return 0;
+	av_AudioConvolver * c = (av_AudioConvolver *)v;
+	if (av_atomic_load(&c->state) != 2) return 0;
+	av_AudioCommand * cmd = av_audio_command_next();
+	if (!cmd) return 0;
+	cmd->type = AV_AUDIO_CMD_CONVOLVER;
+	cmd->handle = (int)(c - convolvers);
+	cmd->row = c->generation;
+	cmd->param = param;
+	cmd->value = value;
+	av_audio_command_send();
+	return 1;
+}
+
+// remove a convolver from the buses; it is freed shortly afterward
+AV_EXPORT void av_audio_convolver_close(av_AudioConvolution * v) {
+	if (!v) return;
+	av_AudioConvolver * c = (av_AudioConvolver *)v;
+	if (!av_atomic_cas(&c->state, 2, 1)) return;
+	c->closed = av_clock();
+	av_atomic_store(&c->state, 3);
+	av_audio_convolution_signal();
+}
+
+// convolve blocks partitions of noise through a mono response of frames frames, in partitions of
+// partition frames, running the tail in step on this thread
+// returns the wall-clock seconds spent on the audio thread's share (if thread is 0) or on the 
+// convolution thread's share (if 1), or -1 if the partition is out of range or out of memory
+AV_EXPORT double av_audio_convolver_bench(int frames, int partition, int blocks, int thread) {
+	if (frames < 1 || partition < AV_AUDIO_PARTITION_MIN || partition > AV_AUDIO_PARTITION_MAX || (partition & (partition - 1))) return -1.;
+	float * response = (float *)av_aligned_calloc(frames, sizeof(float));
+	av_AudioConvolver * c = (av_AudioConvolver *)calloc(1, sizeof(av_AudioConvolver));
+	if (!response || !c) {
+		av_aligned_free(response);
+		free(c);
+		return -1.;
+	}
+	// a decaying noise:
+	unsigned int seed = 1;
+	for (int i=0; i<frames; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		response[i] = ((int)(seed >> 9) - (1 << 22)) * (1.f / (1 << 22)) * expf(-6.f * i / frames);
+	}
+	double elapsed[2] = { -1., -1. };
+	if (av_audio_convolver_init(c, response, AV_AUDIO_FLOAT32, frames, 1, 1, partition)) {
+		elapsed[0] = elapsed[1] = 0.;
+		for (int b=0; b<blocks; b++) {
+			for (int i=0; i<partition; i++) {
+				seed = seed * 1664525u + 1013904223u;
+				c->in[i] = ((int)(seed >> 9) - (1 << 22)) * (1.f / (1 << 22));
+			}
+			double t0 = av_time();
+			av_audio_convolver_chunk(*c);
+			double t1 = av_time();
+			if (c->tails) av_audio_convolver_run(*c);
+			elapsed[0] += t1 - t0;
+			elapsed[1] += av_time() - t1;
+		}
+	}
+	av_audio_convolver_free(c);
+	av_aligned_free(response);
+	free(c);
+	return elapsed[thread ? 1 : 0];
+}
+
+// audio thread: adjust the target latency given the number of blocks ready at this callback
+// grows at once on an underrun; otherwise it moves at most one block per window, 
+// growing if the fill came within one block of running dry, and shrinking only 
+// after adapt_hold consecutive windows in which at least three blocks were always ready.
+// each underrun doubles adapt_hold, so that periodic stalls (e.g. garbage collection)
+// settle on a lead that covers them, rather than oscillating around it:
+#define AV_AUDIO_ADAPT_HOLD_MAX 64
+
+static void av_audio_adapt(int ready) {
+	if (ready < audio.adapt_fill_min) audio.adapt_fill_min = ready;
 	
-	int blocks, blockread, blockwrite, blockstep;
-	int block_io_latency, dummy;
+	int lead = audio.block_io_latency;
+	int next = lead;
+	if (ready == 0) {
+		next = lead + 1;
+		audio.adapt_count = 0;
+		audio.adapt_fill_min = audio.blocks;
+		if (audio.adapt_stable >= 0) {
+			// first empty callback of this stall:
+			audio.adapt_hold *= 2;
+			if (audio.adapt_hold > AV_AUDIO_ADAPT_HOLD_MAX) audio.adapt_hold = AV_AUDIO_ADAPT_HOLD_MAX;
+		}
+		audio.adapt_stable = -1;
+	} else if (++audio.adapt_count >= audio.adapt_window) {
+		if (audio.adapt_fill_min <= 1) {
+			next = lead + 1;
+			audio.adapt_stable = 0;
+		} else if (audio.adapt_fill_min >= 3) {
+			if (++audio.adapt_stable >= audio.adapt_hold) {
+				next = lead - 1;
+				audio.adapt_stable = 0;
+			}
+		} else {
+			audio.adapt_stable = 0;
+		}
+		audio.adapt_count = 0;
+		audio.adapt_fill_min = audio.blocks;
+	}
 	
-	// only access from audio thread:
-	float * input;
-	float * output;	
-	void (*onframes)(struct av_Audio * self, double sampletime, float * inputs, float * outputs, int frames);
+	if (next > audio.latency_max) next = audio.latency_max;
+	if (next > audio.blocks - 1) next = audio.blocks - 1;
+	if (next < audio.latency_min) next = audio.latency_min;
+	if (next < 1) next = 1;
+	if (next != lead) {
+		// fails harmlessly if the main thread has just set a fixed latency:
+		av_atomic_cas(&audio.block_io_latency, lead, next);
+	}
+}
+
+/*
+	Stream handover.
 	
-} av_Audio;
+	Only one stream at a time runs the pipeline (the rings, voices, graph and the rest): the one
+	whose token is stream_owner. Each RtAudio stream passes its token as the callback's user data
+	(1 or 2, for rtas[0] or rtas[1]); the virtual device & offline rendering pass 0. The callbacks
+	of any other stream play silence. To hand over, the main thread sets stream_retire; the owner
+	fades its outputs out over AV_AUDIO_FADE_SECONDS, then gives up the pipeline (stream_owner -1)
+	and wakes the main thread, which may then rearrange it before naming a new owner, which 
+	fades in.
+*/
 
-//#define AV_AUDIO_MSGBUFFER_SIZE_DEFAULT (1024 * 1024)
+#define AV_AUDIO_FADE_SECONDS 0.005
 
-// the FFI exposed object:
-static av_Audio audio;
+static volatile int stream_owner = 0;
+static volatile int stream_retire = 0;
+// device output channels of each RtAudio stream, for the silence of those not in use:
+static unsigned int stream_outchannels[2] = { 0, 0 };
 
-// the internal object:
-static RtAudio rta;
+// only touched by the owner (or the main thread, while there is none):
+static int fade_dir = 0;		// -1 fading out, 1 fading in
+static double fade_gain = 1.;
 
-// the audio-thread Lua state:
-//static lua_State * AL = 0;
+// (main thread, with no stream running the pipeline) give it to the stream of this token, at full gain
+static void av_audio_stream_own(int token) {
+	fade_dir = 0;
+	fade_gain = 1.;
+	av_atomic_store(&stream_retire, 0);
+	av_atomic_store(&stream_owner, token);
+}
+
+// ramp the device outputs of this block toward silence or full gain:
+static void av_audio_fade(float * out, int chans, int frames, int planar) {
+	const double step = fade_dir / (AV_AUDIO_FADE_SECONDS * audio.samplerate);
+	double g = fade_gain;
+	for (int i=0; i<frames; i++) {
+		g += step;
+		if (g < 0.) g = 0.;
+		if (g > 1.) g = 1.;
+		const float gain = (float)g;
+		if (planar) {
+			for (int c=0; c<chans; c++) out[c * frames + i] *= gain;
+		} else {
+			float * frame = out + i * chans;
+			for (int c=0; c<chans; c++) frame[c] *= gain;
+		}
+	}
+	fade_gain = g;
+	if (fade_dir > 0 && g >= 1.) fade_dir = 0;
+}
+
+// the runloop callback to wake when the ring runs low (see av_audio_wake_runloop), 
+// and whether it has been woken since the main thread last committed a block:
+static volatile int ring_wake = -1;
+static volatile int ring_woken = 0;
+
+// have the main thread run its ring callback now, rather than at its next period
+// (which also carries on a reconfiguration; see av_audio_reconfigure_poll):
+static void av_audio_wake_main() {
+	int wake = av_atomic_load(&ring_wake);
+	if (wake >= 0) av_run_wake(wake);
+}
 
 int av_rtaudio_callback(void *outputBuffer, 
 						void *inputBuffer, 
@@ -46,118 +4884,851 @@ int av_rtaudio_callback(void *outputBuffer,
 						RtAudioStreamStatus status, 
 						void *data) {
 	
+	int token = (int)(size_t)data;
+	if (token != av_atomic_load(&stream_owner)) {
+		// a stream starting up, or one that has handed over:
+		if (token > 0) memset(outputBuffer, 0, sizeof(float) * frames * stream_outchannels[token - 1]);
+		return 0;
+	}
+	
+	double t0 = av_clock();
+	
 	audio.input = (float *)inputBuffer;
 	audio.output = (float *)outputBuffer;
 	audio.frames = frames;
 	
 	double newtime = audio.time + frames / audio.samplerate;
-	size_t size = sizeof(float) * frames;
 	
-	//printf("%d %d %d %d\n", audio.blockread, audio.blocks, audio.blocksize, size);
+	if (audio.rt_pending) av_audio_rt_callback();
 	
-	// zero outbuffers:
-	//memset(outputBuffer, 0, size);
+	av_audio_commands_apply();
 	
-	// copy in the buffers:
-	float * dst = audio.output;
-	float * src = audio.buffer + audio.blockread * audio.blocksize * audio.outchannels;
-	memcpy(dst, src, size * audio.outchannels);
+	int r = audio.blockread;
+	int w = av_atomic_load(&audio.blockwrite);
+	int ready = (w - r + audio.blocks) % audio.blocks;
+	
+	if (audio.adaptive) av_audio_adapt(ready);
 	
 	/*
 		If input goes into the same location, we probably won't get it until much later.
 	*/
-	dst = audio.inbuffer + ((audio.blockread + audio.block_io_latency) % audio.blocks) * audio.blocksize * audio.outchannels;
-	src = audio.input;
-	memcpy(dst, src, size * audio.outchannels);
-	// advance the read head:
-	audio.blockread++;
-	if (audio.blockread >= audio.blocks) audio.blockread = 0;
+	int inblk = (r + audio.block_io_latency) % audio.blocks;
+	float * inblock = audio.inbuffer + inblk * audio.blocksize * audio.inbuses;
+	av_audio_route(inmatrix, audio.input, audio.inchannels, inblock, audio.inbuses, frames, audio.planar);
+	
+	// the block to play; until the read head advances, it belongs to this thread:
+	float * bus;
+	if (r != w) {
+		bus = audio.buffer + r * audio.blockstep;
+	} else {
+		// the main thread didn't keep up; play silence rather than a stale block:
+		bus = silence;
+		memset(bus, 0, sizeof(float) * frames * audio.outbuses);
+		audio.underruns++;
+	}
+	
+	// mix the native voices into the first two buses:
+	int block = r != w ? r : -1;
+	if (audio.planar) {
+		float * outl = bus;
+		float * outr = audio.outbuses > 1 ? bus + frames : outl;
+		av_audio_mixer_render_parallel(&voicepool, &mixer, outl, outr, frames, block, t0 + frames / audio.samplerate, av_audio_done_push);
+	} else if (mixer.nactive) {
+		float * outl = mixbus;
+		float * outr = mixbus + frames;
+		memset(mixbus, 0, sizeof(float) * frames * 2);
+		av_audio_mixer_render_parallel(&voicepool, &mixer, outl, outr, frames, block, t0 + frames / audio.samplerate, av_audio_done_push);
+		// interleave into the bus:
+		const int chans = audio.outbuses;
+		const int ro = chans > 1 ? 1 : 0;
+		for (unsigned int i=0; i<frames; i++) {
+			bus[i*chans] += outl[i];
+			bus[i*chans + ro] += outr[i];
+		}
+	}
+	
+	// and the native ugen graph:
+	if (graph->count) {
+		av_audio_graph_render(graph, bus, audio.outbuses, frames, audio.planar, audio.samplerate);
+	}
+	
+	// and any convolvers inserted on the buses:
+	av_audio_convolvers_render(bus, audio.outbuses, frames, audio.planar);
+	
+	// buses to device outputs:
+	av_audio_route(outmatrix, bus, audio.outbuses, audio.output, audio.outchannels, frames, audio.planar);
 	
+	av_audio_record_tap(bus, inblock, frames);
+	
+	// summarize the block played, and the block received:
+	if (r != w && av_atomic_load(&outsummary.live)) {
+		av_audio_summary_update(&outsummary, r * audio.blocksize, frames);
+	}
+	if (av_atomic_load(&insummary.live)) {
+		av_audio_summary_update(&insummary, inblk * audio.blocksize, frames);
+	}
+	av_audio_analyzers_tap(bus, inblock, frames);
+	
+	if (r != w) {
+		// advance the read head, handing the block back to the producer:
+		r++;
+		if (r >= audio.blocks) r = 0;
+		av_atomic_store(&audio.blockread, r);
+	}
+	audio.fill = (w - r + audio.blocks) % audio.blocks;
+	
+	// have the main thread refill the ring once it has drained to half the target latency:
+	int wake = av_atomic_load(&ring_wake);
+	if (wake >= 0 && audio.fill * 2 <= audio.block_io_latency && !av_atomic_load(&ring_woken)) {
+		av_atomic_store(&ring_woken, 1);
+		av_run_wake(wake);
+	}
 	
 	// this calls back into Lua via FFI:
 	if (audio.onframes) {
 		(audio.onframes)(&audio, newtime, audio.input, audio.output, frames);
 	}
 	
+	// declick a handover between streams, last, so that it covers what onframes added:
+	if (fade_dir == 0 && av_atomic_load(&stream_retire)) fade_dir = -1;
+	if (fade_dir) av_audio_fade(audio.output, audio.outchannels, frames, audio.planar);
+	
 	audio.time = newtime;
 	
+	av_audio_stats_update(av_clock() - t0, frames, ready, status);
+	
+	if (fade_dir < 0 && fade_gain <= 0.) {
+		// faded out; the pipeline is the main thread's until it names a new owner,
+		// so have it do so at once, rather than leave a gap of silence:
+		fade_dir = 0;
+		av_atomic_store(&stream_retire, 0);
+		av_atomic_store(&stream_owner, -1);
+		av_audio_wake_main();
+	}
+	
 	return 0;
 }
 
-AV_EXPORT void av_audio_start() {
-	if (rta.isStreamRunning()) {
-		rta.stopStream();
+// the ring can hold at most blocks-1 blocks, since a full ring would look empty:
+AV_EXPORT int av_audio_latency_blocks(double seconds) {
+	int latency = 1 + int(seconds * audio.samplerate / audio.blocksize);
+	if (latency > audio.blocks - 1) latency = audio.blocks - 1;
+	return latency;
+}
+
+// how many blocks the main thread should produce now to restore the target latency:
+AV_EXPORT int av_audio_writable() {
+	int r = av_atomic_load(&audio.blockread);
+	int fill = (audio.blockwrite - r + audio.blocks) % audio.blocks;
+	int lead = audio.block_io_latency;
+	if (lead > audio.blocks - 1) lead = audio.blocks - 1;
+	return lead > fill ? lead - fill : 0;
+}
+
+// publish the block at blockwrite to the audio thread
+// returns 0 (and counts an overrun) if the ring is already full
+AV_EXPORT int av_audio_commit() {
+	int w = audio.blockwrite + 1;
+	if (w >= audio.blocks) w = 0;
+	if (w == av_atomic_load(&audio.blockread)) {
+		audio.overruns++;
+		return 0;
+	}
+	av_atomic_store(&audio.blockwrite, w);
+	av_atomic_store(&ring_woken, 0);
+	// ugens released while the command queue was full leave now:
+	if (ugen_ndying) av_audio_ugen_flush();
+	return 1;
+}
+
+// dst[i] += src[i] for count samples, e.g. to mix a Lua voice's block into the ring
+AV_EXPORT void av_audio_accumulate(float * dst, const float * src, int count) {
+	int i = 0;
+	#ifdef AV_SSE
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+	}
+	#endif
+	for (; i < count; i++) dst[i] += src[i];
+}
+
+// wake runloop callback id (-1 for none) whenever the ring drains to half the target latency,
+// so that the main thread can refill it without polling
+AV_EXPORT void av_audio_wake_runloop(int id) {
+	av_atomic_store(&ring_wake, id);
+}
+
+// the buffers sized by the blocksize, samplerate & bus counts; kept together so that a new set 
+// can be allocated (see av_audio_reconfigure) while the audio thread still uses the current one
+typedef struct av_AudioRings {
+	int blocks;
+	float * buffer;
+	float * inbuffer;
+	float * mixbus;
+	float * voicebuses;
+	float * routein;
+	float * routeout;
+	float * silence;
+	av_AudioSummary outsummary, insummary;
+} av_AudioRings;
+
+static void av_audio_rings_free(av_AudioRings * g) {
+	av_aligned_free(g->buffer);
+	av_aligned_free(g->inbuffer);
+	av_aligned_free(g->mixbus);
+	av_aligned_free(g->voicebuses);
+	av_aligned_free(g->routein);
+	av_aligned_free(g->routeout);
+	av_aligned_free(g->silence);
+	av_audio_summary_clear(&g->outsummary);
+	av_audio_summary_clear(&g->insummary);
+	memset(g, 0, sizeof(av_AudioRings));
+}
+
+// allocate a set of rings (from any thread); returns 0 if out of memory
+static int av_audio_rings_alloc(av_AudioRings * g, int blocksize, double samplerate, int inbuses, int outbuses, int planar) {
+	memset(g, 0, sizeof(av_AudioRings));
+	// one second of ringbuffer:
+	int blockspersecond = samplerate / blocksize;
+	g->blocks = blockspersecond + 1;
+	
+	// blocksize is normally a multiple of 8 frames, which keeps every block 
+	// (and in planar mode, every channel of every block) 32-byte aligned:
+	g->buffer = (float *)av_aligned_calloc(blocksize * outbuses * g->blocks, sizeof(float));
+	g->inbuffer = (float *)av_aligned_calloc(blocksize * inbuses * g->blocks, sizeof(float));
+	
+	g->mixbus = (float *)av_aligned_calloc(blocksize * 2, sizeof(float));
+	g->voicebuses = (float *)av_aligned_calloc((size_t)AV_AUDIO_VOICE_GROUPS * 2 * blocksize, sizeof(float));
+	
+	g->routein = (float *)av_aligned_calloc(blocksize * AV_AUDIO_MAX_CHANNELS, sizeof(float));
+	g->routeout = (float *)av_aligned_calloc(blocksize * AV_AUDIO_MAX_CHANNELS, sizeof(float));
+	g->silence = (float *)av_aligned_calloc(blocksize * AV_AUDIO_MAX_CHANNELS, sizeof(float));
+	
+	// the ring summaries start out silent, like the rings:
+	int planarblock = planar ? blocksize : 0;
+	int ok = av_audio_summary_init(&g->outsummary, g->buffer, AV_AUDIO_FLOAT32, g->blocks * blocksize, outbuses, planarblock)
+		&& av_audio_summary_init(&g->insummary, g->inbuffer, AV_AUDIO_FLOAT32, g->blocks * blocksize, inbuses, planarblock);
+	
+	if (!ok || !g->buffer || !g->inbuffer || !g->mixbus || !g->voicebuses || !g->routein || !g->routeout || !g->silence) {
+		av_audio_rings_free(g);
+		return 0;
 	}
-	if (rta.isStreamOpen()) {
-		// close it:
-		rta.closeStream();
-	}	
+	return 1;
+}
+
+static inline void av_audio_buffer_swap(float *& a, float *& b) {
+	float * tmp = a;
+	a = b;
+	b = tmp;
+}
+
+static void av_audio_summary_swap(av_AudioSummary * s, av_AudioSummary * t) {
+	// (whether the main thread asked for it is a property of the ring, not of the buffers)
+	int live = s->live;
+	av_AudioSummary tmp = *s;
+	*s = *t;
+	*t = tmp;
+	s->live = live;
+}
+
+// swap a set of rings (allocated for the current blocksize, samplerate & bus counts) with those 
+// in use, and reset the pipeline to use them; afterward g holds the old set, to be freed
+// only while no callback runs the pipeline
+static void av_audio_rings_install(av_AudioRings * g) {
+	av_audio_buffer_swap(audio.buffer, g->buffer);
+	av_audio_buffer_swap(audio.inbuffer, g->inbuffer);
+	av_audio_buffer_swap(mixbus, g->mixbus);
+	av_audio_buffer_swap(voicepool.buses, g->voicebuses);
+	av_audio_buffer_swap(routein, g->routein);
+	av_audio_buffer_swap(routeout, g->routeout);
+	av_audio_buffer_swap(silence, g->silence);
+	voicepool.capacity = audio.blocksize;
+	av_audio_summary_swap(&outsummary, &g->outsummary);
+	av_audio_summary_swap(&insummary, &g->insummary);
 	
-	unsigned int devices = rta.getDeviceCount();
-	if (devices < 1) {
-		printf("No audio devices found\n");
+	audio.blocks = g->blocks;
+	audio.blockstep = audio.blocksize * audio.outbuses;
+	
+	audio.blockread = 0;
+	audio.blockwrite = 0;
+	audio.fill = 0;
+	audio.underruns = 0;
+	audio.overruns = 0;
+	
+	audio.block_io_latency = av_audio_latency_blocks(audio.latency_seconds);
+	audio.adapt_window = audio.blocks;
+	audio.adapt_count = 0;
+	audio.adapt_fill_min = audio.blocks;
+	audio.adapt_hold = 1;
+	audio.adapt_stable = 0;
+	av_audio_stats_clear();
+	
+	// positions in the old ring no longer mean anything:
+	for (int i=0; i<mixer.nactive; i++) {
+		mixer.voices[mixer.active[i]].at_block = -1;
+	}
+	voice_at_block = -1;
+}
+
+// (re)allocate the rings for the current blocksize & channel counts
+// only while the stream is stopped, so that the voices are safe to touch
+static void av_audio_alloc_rings() {
+	av_AudioRings g;
+	av_audio_rings_alloc(&g, audio.blocksize, audio.samplerate, audio.inbuses, audio.outbuses, audio.planar);
+	av_audio_rings_install(&g);
+	av_audio_rings_free(&g);
+}
+
+// device buffers for when no RtAudio stream drives the callback 
+// (offline rendering & the virtual device), in the layout the callback expects:
+static float * host_out = 0;
+static float * host_in = 0;
+
+static void av_audio_host_alloc() {
+	if (host_out) av_aligned_free(host_out);
+	if (host_in) av_aligned_free(host_in);
+	host_out = (float *)av_aligned_calloc(audio.blocksize * AV_AUDIO_MAX_CHANNELS, sizeof(float));
+	host_in = (float *)av_aligned_calloc(audio.blocksize * AV_AUDIO_MAX_CHANNELS, sizeof(float));
+}
+
+// the virtual device:
+static av_thread virtual_thread;
+static volatile int virtual_running = 0;
+
+static void * av_audio_virtual_main(void * arg) {
+	const double period = audio.blocksize / audio.samplerate;
+	unsigned int seed = 12345;
+	double next = av_clock() + period;
+	while (av_atomic_load(&virtual_running)) {
+		RtAudioStreamStatus status = 0;
+		double delay = 0.;
+		if (audio.jitter > 0.) {
+			seed = seed * 1664525u + 1013904223u;
+			delay = audio.jitter * (seed >> 8) / (double)(1 << 24);
+		}
+		double wait = next + delay - av_clock();
+		if (wait > 0.) {
+			av_sleep(wait);
+		} else if (wait < -period) {
+			// more than a block late; a real device would have run dry:
+			status |= RTAUDIO_OUTPUT_UNDERFLOW;
+			next = av_clock();
+		}
+		av_rtaudio_callback(host_out, host_in, audio.blocksize, audio.time, status, 0);
+		next += period;
+	}
+	return 0;
+}
+
+static void av_audio_virtual_start() {
+	audio.inchannels = audio.inbuses;
+	audio.outchannels = audio.outbuses;
+	av_audio_alloc_rings();
+	av_audio_host_alloc();
+	av_audio_stream_own(0);
+	av_atomic_store(&virtual_running, 1);
+	if (av_thread_create(&virtual_thread, av_audio_virtual_main, 0)) {
+		av_atomic_store(&virtual_running, 0);
+		fprintf(stderr, "unable to start the virtual audio device\n");
 		return;
 	}
+	printf("Audio started on a virtual device (%d in, %d out, jitter %.3fms)\n", audio.inchannels, audio.outchannels, audio.jitter * 1000.);
+}
+
+// returns 1 if the virtual device had been running
+static int av_audio_virtual_stop() {
+	if (!virtual_running) return 0;
+	av_atomic_store(&virtual_running, 0);
+	av_thread_join(virtual_thread);
+	return 1;
+}
+
+/*
+	Streams.
 	
-	RtAudio::DeviceInfo info;
-	RtAudio::StreamParameters iParams, oParams;
+	The device list is enumerated once (it can take a while, and on some host APIs disturbs 
+	running streams), and reused by each start & reconfiguration until av_audio_devices_scan 
+	is called again, e.g. after plugging in a device.
+*/
+
+static RtAudio::DeviceInfo * device_info = 0;
+static unsigned int device_count = 0;
+
+static int av_audio_reconfig_busy();
+static void av_audio_reconfig_cancel();
+
+// (re)enumerate the devices; returns the number found, or -1 (without enumerating) while a reconfiguration is under way
+AV_EXPORT int av_audio_devices_scan() {
+	if (av_audio_reconfig_busy()) return -1;
+	
+	delete [] device_info;
+	device_count = rtas[rta_current]->getDeviceCount();
+	device_info = new RtAudio::DeviceInfo[device_count > 0 ? device_count : 1];
 	
 	printf("Available audio devices:\n");
-	for (unsigned int i=0; i<devices; i++) {
-		info = rta.getDeviceInfo(i);
+	for (unsigned int i=0; i<device_count; i++) {
+		RtAudio::DeviceInfo& info = device_info[i];
+		info = rtas[rta_current]->getDeviceInfo(i);
 		printf("Device %d: %dx%d (%d) %s\n", i, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
 	}
+	return device_count;
+}
+
+// open (but don't start) a stream of rtas[slot]; blocksize may be changed by the device
+// throws RtError on failure
+static void av_audio_device_open(int slot, unsigned int indevice, unsigned int inchannels, unsigned int outdevice, unsigned int outchannels, double samplerate, unsigned int * blocksize, int planar) {
+	RtAudio::StreamParameters iParams, oParams;
+	iParams.deviceId = indevice;
+	iParams.nChannels = inchannels;
+	iParams.firstChannel = 0;
+	oParams.deviceId = outdevice;
+	oParams.nChannels = outchannels;
+	oParams.firstChannel = 0;
+	
+	RtAudio::StreamOptions options;
+	if (planar) options.flags |= RTAUDIO_NONINTERLEAVED;
+	if (audio.realtime > 0) {
+		options.flags |= RTAUDIO_SCHEDULE_REALTIME;
+		options.priority = audio.realtime;
+	}
+	options.streamName = "av";
+	
+	stream_outchannels[slot] = outchannels;
+	rtas[slot]->openStream( &oParams, &iParams, RTAUDIO_FLOAT32, samplerate, blocksize, &av_rtaudio_callback, (void *)(size_t)(slot + 1), &options );
+}
+
+static void av_audio_device_close(RtAudio * rt) {
+	if (rt->isStreamRunning()) rt->stopStream();
+	if (rt->isStreamOpen()) rt->closeStream();
+}
+
+AV_EXPORT void av_audio_start() {
+	av_audio_reconfig_cancel();
+	av_audio_virtual_stop();
+	av_audio_device_close(rtas[rta_current]);
 	
+	if (audio.inbuses < 1) audio.inbuses = 1;
+	if (audio.inbuses > AV_AUDIO_MAX_CHANNELS) audio.inbuses = AV_AUDIO_MAX_CHANNELS;
+	if (audio.outbuses < 1) audio.outbuses = 1;
+	if (audio.outbuses > AV_AUDIO_MAX_CHANNELS) audio.outbuses = AV_AUDIO_MAX_CHANNELS;
 	
-	info = rta.getDeviceInfo(audio.indevice);
-	printf("Using audio input %d: %dx%d (%d) %s\n", audio.indevice, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
+	av_audio_rt_begin();
 	
-	audio.inchannels = info.inputChannels;
+	if (audio.virtualdevice) {
+		av_audio_virtual_start();
+		return;
+	}
 	
-	iParams.deviceId = audio.indevice;
-	iParams.nChannels = audio.inchannels;
-	iParams.firstChannel = 0;
+	if (!device_info) av_audio_devices_scan();
+	if (device_count < 1) {
+		printf("No audio devices found\n");
+		av_audio_virtual_start();
+		return;
+	}
+	if (audio.indevice >= device_count || audio.outdevice >= device_count) {
+		printf("No audio device %d\n", audio.indevice >= device_count ? audio.indevice : audio.outdevice);
+		av_audio_virtual_start();
+		return;
+	}
 	
-	info = rta.getDeviceInfo(audio.outdevice);
-	printf("Using audio output %d: %dx%d (%d) %s\n", audio.outdevice, info.inputChannels, info.outputChannels, info.duplexChannels, info.name.c_str());
+	const RtAudio::DeviceInfo& ininfo = device_info[audio.indevice];
+	printf("Using audio input %d: %dx%d (%d) %s\n", audio.indevice, ininfo.inputChannels, ininfo.outputChannels, ininfo.duplexChannels, ininfo.name.c_str());
 	
-	audio.outchannels = info.outputChannels;
+	audio.inchannels = ininfo.inputChannels;
+	if (audio.inchannels > AV_AUDIO_MAX_CHANNELS) audio.inchannels = AV_AUDIO_MAX_CHANNELS;
 	
-	oParams.deviceId = audio.outdevice;
-	oParams.nChannels = audio.outchannels;
-	oParams.firstChannel = 0;
+	const RtAudio::DeviceInfo& outinfo = device_info[audio.outdevice];
+	printf("Using audio output %d: %dx%d (%d) %s\n", audio.outdevice, outinfo.inputChannels, outinfo.outputChannels, outinfo.duplexChannels, outinfo.name.c_str());
+	
+	audio.outchannels = outinfo.outputChannels;
+	if (audio.outchannels > AV_AUDIO_MAX_CHANNELS) audio.outchannels = AV_AUDIO_MAX_CHANNELS;
+	
+	printf("Using %d input and %d output buses\n", audio.inbuses, audio.outbuses);
+	
+	RtAudio& rt = *rtas[rta_current];
+	try {
+		av_audio_device_open(rta_current, audio.indevice, audio.inchannels, audio.outdevice, audio.outchannels, audio.samplerate, &audio.blocksize, audio.planar);
+		
+		// allocate after opening, since the device may have chosen a different blocksize:
+		av_audio_alloc_rings();
+		
+		av_audio_stream_own(rta_current + 1);
+		rt.startStream();
+		printf("Audio started\n");
+	}
+	catch ( RtError& e ) {
+		fprintf(stderr, "%s\n", e.getMessage().c_str());
+		if (rt.isStreamOpen()) rt.closeStream();
+		av_audio_virtual_start();
+	}
+}
 
-	RtAudio::StreamOptions options;
-	//options.flags |= RTAUDIO_NONINTERLEAVED;
-	options.streamName = "av";
+// stop the device (or virtual device), ending all voices
+AV_EXPORT void av_audio_stop() {
+	av_audio_reconfig_cancel();
+	av_audio_virtual_stop();
+	av_audio_device_close(rtas[rta_current]);
+	av_audio_stream_own(-1);
+	av_audio_voices_release();
+}
+
+/*
+	Stream reconfiguration.
 	
+	Rather than closing the stream before opening another, as av_audio_start does, 
+	av_audio_reconfigure has a helper thread open the new stream alongside the old one (on the 
+	other RtAudio object) and allocate rings for it, while the old stream plays on and the main 
+	thread keeps filling its ring. Once the new stream runs, av_audio_reconfigure_poll (called 
+	by the main thread) has the old stream fade out, installs the new settings & rings, and hands 
+	the pipeline to the new stream, which fades in; the helper thread then closes the old stream.
+	Where the host API can't open a device twice, the helper thread fades out & closes the old 
+	stream before opening the new one, so that the gap is only as long as opening takes.
+*/
+
+enum {
+	AV_AUDIO_RECONFIG_IDLE = 0,
+	AV_AUDIO_RECONFIG_OPENING,		// the helper thread is opening the new stream
+	AV_AUDIO_RECONFIG_OPENED,		// the new stream runs (silently), and its rings are ready
+	AV_AUDIO_RECONFIG_FAILED,		// the new stream could not be opened
+	AV_AUDIO_RECONFIG_CLOSING,		// the new stream has taken over; the helper thread is closing the old
+	AV_AUDIO_RECONFIG_DONE
+};
+
+// how long to wait for the old stream to fade out, before stopping it regardless:
+#define AV_AUDIO_RETIRE_TIMEOUT 0.5
+
+typedef struct av_AudioReconfig {
+	unsigned int indevice, outdevice;
+	unsigned int inchannels, outchannels;
+	unsigned int inbuses, outbuses;
+	unsigned int blocksize;		// as chosen by the device, once opened
+	double samplerate;
+	int planar;
+	int from, to;				// the RtAudio objects of the old & new streams
+	int resize;					// nonzero if the new stream needs new rings
+	av_AudioRings rings;
+	double retire_by;			// (main thread) when to stop waiting for the old stream to fade out
+	av_thread thread;
+	volatile int state;
+} av_AudioReconfig;
+
+static av_AudioReconfig reconfig;
+
+static int av_audio_reconfig_busy() {
+	return av_atomic_load(&reconfig.state) != AV_AUDIO_RECONFIG_IDLE;
+}
+
+// (helper thread) open & start the new stream, which plays silence until it owns the pipeline
+static int av_audio_reconfig_open(av_AudioReconfig * r) {
+	RtAudio& rt = *rtas[r->to];
 	try {
+		av_audio_device_open(r->to, r->indevice, r->inchannels, r->outdevice, r->outchannels, r->samplerate, &r->blocksize, r->planar);
+		rt.startStream();
+	}
+	catch ( RtError& e ) {
+		fprintf(stderr, "%s\n", e.getMessage().c_str());
+		if (rt.isStreamOpen()) rt.closeStream();
+		return 0;
+	}
+	return 1;
+}
+
+// (helper thread) have the old stream fade out, then close it
+static void av_audio_reconfig_retire(av_AudioReconfig * r) {
+	av_atomic_store(&stream_retire, 1);
+	double until = av_clock() + AV_AUDIO_RETIRE_TIMEOUT;
+	while (av_atomic_load(&stream_owner) != -1 && av_clock() < until) {
+		av_sleep(0.001);
+	}
+	av_audio_device_close(rtas[r->from]);
+	// (if it never faded out, e.g. because its device went away, it has stopped now anyway)
+	av_atomic_store(&stream_retire, 0);
+	av_atomic_store(&stream_owner, -1);
+}
+
+static void * av_audio_reconfig_main(void * arg) {
+	av_AudioReconfig * r = (av_AudioReconfig *)arg;
+	if (av_atomic_load(&r->state) == AV_AUDIO_RECONFIG_CLOSING) {
+		av_audio_device_close(rtas[r->from]);
+		av_atomic_store(&r->state, AV_AUDIO_RECONFIG_DONE);
+		return 0;
+	}
 	
-		{
-			int blockspersecond = audio.samplerate / audio.blocksize;
-			audio.blocks = blockspersecond + 1;
-			audio.blockstep = audio.blocksize * audio.outchannels;
-			
-			if (audio.buffer) free(audio.buffer);
-			int len = audio.blocksize * audio.outchannels * audio.blocks;
-			audio.buffer = (float *)calloc(len, sizeof(float));
-			
-			if (audio.inbuffer) free(audio.inbuffer);
-			len = audio.blocksize * audio.inchannels * audio.blocks;
-			audio.inbuffer = (float *)calloc(len, sizeof(float));
-			
-			audio.blockread = 0;
-			audio.blockwrite = 0;
+	int opened = av_audio_reconfig_open(r);
+	if (!opened) {
+		// perhaps the host API can't open a device twice; make way for the new stream:
+		printf("Closing the current audio stream first\n");
+		av_audio_reconfig_retire(r);
+		opened = av_audio_reconfig_open(r);
+	}
+	if (opened) {
+		// (the main thread doesn't change these while a reconfiguration is under way)
+		r->resize = r->blocksize != audio.blocksize || r->samplerate != audio.samplerate
+			|| r->inbuses != audio.inbuses || r->outbuses != audio.outbuses || r->planar != audio.planar;
+		if (r->resize && !av_audio_rings_alloc(&r->rings, r->blocksize, r->samplerate, r->inbuses, r->outbuses, r->planar)) {
+			fprintf(stderr, "unable to allocate the audio rings\n");
+			av_audio_device_close(rtas[r->to]);
+			opened = 0;
+		}
+	}
+	av_atomic_store(&r->state, opened ? AV_AUDIO_RECONFIG_OPENED : AV_AUDIO_RECONFIG_FAILED);
+	// (so that the main thread starts the handover, or reports the failure, without delay)
+	av_audio_wake_main();
+	return 0;
+}
+
+// (main thread, once the old stream has given up the pipeline) 
+// switch to the new settings & rings, and hand the pipeline to the new stream
+static void av_audio_reconfig_install(av_AudioReconfig * r) {
+	audio.indevice = r->indevice;
+	audio.outdevice = r->outdevice;
+	audio.inchannels = r->inchannels;
+	audio.outchannels = r->outchannels;
+	audio.inbuses = r->inbuses;
+	audio.outbuses = r->outbuses;
+	audio.blocksize = r->blocksize;
+	audio.samplerate = r->samplerate;
+	audio.planar = r->planar;
+	if (r->resize) {
+		av_audio_rings_install(&r->rings);
+		// (now the old rings)
+		av_audio_rings_free(&r->rings);
+	}
+	rta_current = r->to;
+	
+	// the new callback thread configures itself, as after av_audio_start:
+	av_audio_rt_begin();
+	fade_dir = 1;
+	fade_gain = 0.;
+	av_atomic_store(&stream_owner, r->to + 1);
+}
+
+// (main thread) abandon any reconfiguration under way, before restarting the pipeline: 
+// a new stream that hasn't taken over is closed, and one that has is kept
+static void av_audio_reconfig_cancel() {
+	av_AudioReconfig * r = &reconfig;
+	if (!av_audio_reconfig_busy()) return;
+	av_thread_join(r->thread);
+	if (r->state == AV_AUDIO_RECONFIG_OPENED) {
+		av_audio_device_close(rtas[r->to]);
+		av_audio_rings_free(&r->rings);
+	}
+	av_atomic_store(&r->state, AV_AUDIO_RECONFIG_IDLE);
+}
+
+// whether a device (that said which rates it supports) supports this samplerate:
+static int av_audio_device_rate(const RtAudio::DeviceInfo& info, double samplerate) {
+	if (info.sampleRates.empty()) return 1;
+	for (size_t i=0; i<info.sampleRates.size(); i++) {
+		if (info.sampleRates[i] == samplerate) return 1;
+	}
+	return 0;
+}
+
+// begin switching the stream to other devices, samplerate or blocksize, without stopping the 
+// sound for longer than a short fade (see av_audio_reconfigure_poll)
+// returns 1 if the new stream is opening in the background, 0 if the stream was restarted at 
+// once instead (as when no device stream is running), or -1 if it can't begin (because a 
+// reconfiguration is under way, or the devices don't support the samplerate)
+AV_EXPORT int av_audio_reconfigure(int indevice, int outdevice, double samplerate, int blocksize) {
+	av_AudioReconfig * r = &reconfig;
+	if (av_audio_reconfig_busy()) return -1;
+	if (!device_info) av_audio_devices_scan();
+	
+	if (audio.virtualdevice || !rtas[rta_current]->isStreamRunning() 
+		|| (unsigned int)indevice >= device_count || (unsigned int)outdevice >= device_count) {
+		// nothing to hand over from (or to); restart as usual:
+		audio.indevice = indevice;
+		audio.outdevice = outdevice;
+		audio.samplerate = samplerate;
+		audio.blocksize = blocksize;
+		av_audio_start();
+		return 0;
+	}
+	
+	if (!av_audio_device_rate(device_info[outdevice], samplerate)
+		|| (device_info[indevice].inputChannels && !av_audio_device_rate(device_info[indevice], samplerate))) {
+		fprintf(stderr, "the audio devices don't support %g Hz\n", samplerate);
+		return -1;
+	}
+	
+	r->indevice = indevice;
+	r->outdevice = outdevice;
+	r->inchannels = device_info[indevice].inputChannels;
+	if (r->inchannels > AV_AUDIO_MAX_CHANNELS) r->inchannels = AV_AUDIO_MAX_CHANNELS;
+	r->outchannels = device_info[outdevice].outputChannels;
+	if (r->outchannels > AV_AUDIO_MAX_CHANNELS) r->outchannels = AV_AUDIO_MAX_CHANNELS;
+	r->inbuses = audio.inbuses;
+	r->outbuses = audio.outbuses;
+	r->blocksize = blocksize;
+	r->samplerate = samplerate;
+	r->planar = audio.planar;
+	r->from = rta_current;
+	r->to = 1 - rta_current;
+	r->resize = 0;
+	memset(&r->rings, 0, sizeof(av_AudioRings));
+	r->retire_by = 0.;
+	
+	if (!rtas[r->to]) {
+		rtas[r->to] = new RtAudio();
+		rtas[r->to]->showWarnings( true );
+	}
+	
+	printf("Reconfiguring audio: input %d, output %d, %g Hz, %d frames\n", indevice, outdevice, samplerate, blocksize);
+	av_atomic_store(&r->state, AV_AUDIO_RECONFIG_OPENING);
+	if (av_thread_create(&r->thread, av_audio_reconfig_main, r)) {
+		av_atomic_store(&r->state, AV_AUDIO_RECONFIG_IDLE);
+		audio.indevice = indevice;
+		audio.outdevice = outdevice;
+		audio.samplerate = samplerate;
+		audio.blocksize = blocksize;
+		av_audio_start();
+		return 0;
+	}
+	return 1;
+}
+
+// (main thread) carry on a reconfiguration begun by av_audio_reconfigure; call it regularly
+// returns 1 once the new stream has taken over, -1 if it couldn't (and the old settings are 
+// back in use), and 0 otherwise; after a nonzero result, the rings may have been reallocated
+AV_EXPORT int av_audio_reconfigure_poll() {
+	av_AudioReconfig * r = &reconfig;
+	switch (av_atomic_load(&r->state)) {
+		case AV_AUDIO_RECONFIG_OPENED:
+			if (av_atomic_load(&stream_owner) != -1) {
+				if (r->retire_by == 0.) {
+					r->retire_by = av_clock() + AV_AUDIO_RETIRE_TIMEOUT;
+					av_atomic_store(&stream_retire, 1);
+				} else if (av_clock() > r->retire_by) {
+					// it never faded out; stop it regardless:
+					av_audio_device_close(rtas[r->from]);
+					av_atomic_store(&stream_retire, 0);
+					av_atomic_store(&stream_owner, -1);
+				}
+				if (av_atomic_load(&stream_owner) != -1) return 0;
+			}
+			av_thread_join(r->thread);
+			av_audio_reconfig_install(r);
+			printf("Audio reconfigured: %g Hz, %d frames, %s rings\n", audio.samplerate, audio.blocksize, r->resize ? "new" : "the same");
 			
-			audio.block_io_latency = 1 + int(audio.latency_seconds * audio.samplerate / audio.blocksize);
+			// close the old stream in the background:
+			av_atomic_store(&r->state, AV_AUDIO_RECONFIG_CLOSING);
+			if (av_thread_create(&r->thread, av_audio_reconfig_main, r)) {
+				av_audio_device_close(rtas[r->from]);
+				av_atomic_store(&r->state, AV_AUDIO_RECONFIG_IDLE);
+			}
+			return 1;
+		case AV_AUDIO_RECONFIG_FAILED:
+			av_thread_join(r->thread);
+			av_atomic_store(&r->state, AV_AUDIO_RECONFIG_IDLE);
+			fprintf(stderr, "unable to reconfigure the audio stream\n");
+			if (av_atomic_load(&stream_owner) == -1) {
+				// the old stream was closed to make way for the new one; reopen it:
+				av_audio_start();
+			}
+			return -1;
+		case AV_AUDIO_RECONFIG_DONE:
+			av_thread_join(r->thread);
+			av_atomic_store(&r->state, AV_AUDIO_RECONFIG_IDLE);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+// offline rendering: with the device stream stopped, the main thread drives the 
+// same callback itself, one block per call, as fast as it can go
+
+// stop the device stream and reset the pipeline for offline rendering
+// returns 1 if the device stream had been running (see av_audio_start)
+AV_EXPORT int av_audio_offline_begin(int outchannels, int inchannels) {
+	av_audio_reconfig_cancel();
+	int running = av_audio_virtual_stop();
+	if (rtas[rta_current]->isStreamRunning()) {
+		rtas[rta_current]->stopStream();
+		running = 1;
+	}
+	
+	if (outchannels < 1) outchannels = 1;
+	if (outchannels > AV_AUDIO_MAX_CHANNELS) outchannels = AV_AUDIO_MAX_CHANNELS;
+	if (inchannels < 0) inchannels = 0;
+	if (inchannels > AV_AUDIO_MAX_CHANNELS) inchannels = AV_AUDIO_MAX_CHANNELS;
+	audio.outchannels = outchannels;
+	audio.inchannels = inchannels;
+	
+	if (audio.inbuses < 1) audio.inbuses = 1;
+	if (audio.inbuses > AV_AUDIO_MAX_CHANNELS) audio.inbuses = AV_AUDIO_MAX_CHANNELS;
+	if (audio.outbuses < 1) audio.outbuses = 1;
+	if (audio.outbuses > AV_AUDIO_MAX_CHANNELS) audio.outbuses = AV_AUDIO_MAX_CHANNELS;
+	
+	// render from the same state whatever played before: voices still playing end, the commands 
+	// the audio thread never got to (such as voices the script has just started) apply, 
+	// and the graph's nodes and the convolvers start over from their initial state:
+	av_audio_voices_end();
+	av_audio_commands_apply();
+	av_audio_graph_reset(graph);
+	av_audio_convolvers_reset();
+	
+	av_audio_alloc_rings();
+	
+	av_audio_host_alloc();
+	
+	// the main thread runs the callback from now on, and keeps its own scheduling:
+	av_audio_stream_own(0);
+	av_atomic_store(&audio.rt_pending, 0);
+	
+	// sample time restarts from zero, so that the same script renders the same output:
+	audio.time = 0;
+	return running;
+}
+
+// render one block: writes blocksize interleaved frames of outchannels to out
+// in supplies blocksize interleaved frames of inchannels, or if NULL, silence
+AV_EXPORT void av_audio_offline_process(float * out, const float * in) {
+	const int frames = audio.blocksize;
+	const int ins = audio.inchannels;
+	const int outs = audio.outchannels;
+	if (!in) {
+		memset(host_in, 0, sizeof(float) * frames * ins);
+	} else if (audio.planar) {
+		for (int c=0; c<ins; c++) {
+			float * dst = host_in + c * frames;
+			for (int i=0; i<frames; i++) dst[i] = in[i * ins + c];
 		}
+	} else {
+		memcpy(host_in, in, sizeof(float) * frames * ins);
+	}
 	
-		rta.openStream( &oParams, &iParams, RTAUDIO_FLOAT32, audio.samplerate, &audio.blocksize, &av_rtaudio_callback, NULL, &options );
-		rta.startStream();
-		printf("Audio started\n");
+	// (apply new voices now, so that the wait covers streams that start in this block)
+	av_audio_commands_apply();
+	av_audio_streams_wait(frames);
+	av_audio_record_wait(frames);
+	av_audio_convolvers_wait();
+	// the same floating-point modes as the audio thread, so that it renders the same:
+	const unsigned int csr = av_audio_fp_begin();
+	av_rtaudio_callback(host_out, host_in, frames, audio.time, 0, 0);
+	av_audio_fp_end(csr);
+	
+	if (audio.planar) {
+		for (int c=0; c<outs; c++) {
+			const float * src = host_out + c * frames;
+			for (int i=0; i<frames; i++) out[i * outs + c] = src[i];
+		}
+	} else {
+		memcpy(out, host_out, sizeof(float) * frames * outs);
 	}
-	catch ( RtError& e ) {
-		fprintf(stderr, "%s\n", e.getMessage().c_str());
+}
+
+AV_EXPORT int av_audio_layout(int which) {
+	switch (which) {
+		case AV_AUDIO_LAYOUT_CACHELINE: return AV_CACHELINE;
+		case AV_AUDIO_LAYOUT_SIZE: return (int)sizeof(av_Audio);
+		case AV_AUDIO_LAYOUT_BLOCKREAD: return (int)offsetof(av_Audio, blockread);
+		case AV_AUDIO_LAYOUT_BLOCKWRITE: return (int)offsetof(av_Audio, blockwrite);
+		case AV_AUDIO_LAYOUT_MSGBUFFER: return (int)offsetof(av_Audio, msgbuffer);
+		case AV_AUDIO_LAYOUT_MSGBUFFER_SIZE: return (int)sizeof(av_msgbuffer);
+		default: return -1;
 	}
 }
 
@@ -173,42 +5744,49 @@ AV_EXPORT av_Audio * av_audio_get() {
 		audio.blocksize = 256;
 		audio.inchannels = 2;
 		audio.outchannels = 2;
+		audio.inbuses = 2;
+		audio.outbuses = 2;
 		audio.time = 0;
 		audio.latency_seconds = 1;
 		audio.indevice = rta.getDefaultInputDevice();
 		audio.outdevice = rta.getDefaultOutputDevice();
-		//audio.msgbuffer.size = AV_AUDIO_MSGBUFFER_SIZE_DEFAULT;
-		//audio.msgbuffer.read = 0;
-		//audio.msgbuffer.write = 0;
-		//audio.msgbuffer.data = (unsigned char *)malloc(audio.msgbuffer.size);
+		audio.msgbuffer.size = AV_AUDIO_MSGBUFFER_SIZE_DEFAULT;
+		audio.msgbuffer.read = 0;
+		audio.msgbuffer.write = 0;
+		audio.msgbuffer.data = (unsigned char *)malloc(audio.msgbuffer.size);
 		
 		audio.onframes = 0;
 		
-		audio.latency_seconds = 0.1;
-		audio.block_io_latency = 1 + int(audio.latency_seconds * audio.samplerate / audio.blocksize);
-		
-		// one second of ringbuffer:
-		int blockspersecond = audio.samplerate / audio.blocksize;
-		audio.blocks = blockspersecond + 1;
-		audio.blockstep = audio.blocksize * audio.outchannels;
+		av_audio_voices_init();
+		av_audio_ugens_init();
+		av_audio_matrix_reset(outmatrix);
+		av_audio_matrix_reset(inmatrix);
 		
-		int len = audio.blocksize * audio.outchannels * audio.blocks;
-		audio.buffer = (float *)calloc(len, sizeof(float));
-		
-		len = audio.blocksize * audio.inchannels * audio.blocks;
-		audio.inbuffer = (float *)calloc(len, sizeof(float));
+		audio.latency_seconds = 0.1;
+		audio.planar = 0;
+		audio.adaptive = 0;
+		audio.virtualdevice = 0;
+		audio.jitter = 0.;
+		audio.realtime = 0;
+		audio.lockmemory = 0;
+		audio.affinity = -1;
+		audio.flushdenormals = 1;
+		audio.latency_min = 1;
+		audio.latency_max = 1 << 30;
+		audio.buffer = 0;
+		audio.inbuffer = 0;
+		av_audio_alloc_rings();
 		
-		audio.blockread = 0;
-		audio.blockwrite = 0;
-		//AL = av_init_lua();
+		AL = av_init_lua();
 		
 		// unique to audio thread:
-		/*
-		if (luaL_dostring(AL, "require 'audioprocess'")) {
+		// (this installs audio.onframes, so from now on AL belongs to the audio thread)
+		if (AL && luaL_dostring(AL, "require 'audioprocess'")) {
 			printf("error: %s\n", lua_tostring(AL, -1));
-			initialized = false;
+			audio.onframes = 0;
+			lua_close(AL);
+			AL = 0;
 		} 
-		*/
 	}
 	return &audio;
 }